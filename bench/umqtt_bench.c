@@ -0,0 +1,527 @@
+/******************************************************************************
+ * umqtt_bench.c - Microbenchmarks for the umqtt encode and decode paths.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+/*
+ * Drives the umqtt API against an in-memory transport and reports the
+ * time, allocations and allocated bytes per operation.  The network write
+ * function only counts bytes, and incoming packets are built here and
+ * passed straight to umqtt_DecodePacket(), so only the umqtt code is
+ * measured.
+ *
+ * Usage: umqtt_bench [-q] [filter]
+ *
+ * -q runs each benchmark for a short time only, for a quick check that
+ * everything works.  If a filter is given, only benchmarks whose name
+ * contains the filter are run.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "umqtt.h"
+
+// largest payload that is benchmarked
+#define BENCH_MAX_PAYLOAD (1024 * 1024)
+
+// largest in-flight depth that is benchmarked for publish
+#define BENCH_MAX_DEPTH 4096
+
+// largest in-flight depth that is benchmarked for acks alone
+#define BENCH_MAX_ACK_DEPTH 50000
+
+/*
+ * Counters kept by the in-memory transport.
+ */
+static uint64_t allocCount;
+static uint64_t allocBytes;
+static uint64_t writeBytes;
+
+/*
+ * Time measured by a benchmark function that times only part of its work,
+ * or 0 if the whole function is timed.
+ */
+static uint64_t timedNs;
+
+/*
+ * Benchmark settings from the command line.
+ */
+static uint64_t minBenchNs = 200000000;
+static const char *pFilter = NULL;
+
+/*
+ * Shared buffers for payloads, topics and incoming packets.
+ */
+static uint8_t payload[BENCH_MAX_PAYLOAD];
+static char topic[4097];
+static uint8_t *pInPacket;
+static uint32_t inPacketLen;
+static uint16_t pendingIds[BENCH_MAX_ACK_DEPTH];
+
+/*
+ * Parameters of one benchmark.
+ */
+typedef struct
+{
+    uint32_t payloadLen;    // payload bytes of each publish
+    uint32_t topicLen;      // bytes in the topic
+    uint32_t depth;         // packets in flight before acks are decoded
+    uint32_t ringSize;      // bytes of the packet ring, or 0 for none
+} BenchParms_t;
+
+// benchmark function, runs the operation _count_ times
+typedef void (*BenchFn_t)(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count);
+
+/*
+ * In-memory transport functions.
+ */
+static void *
+benchMalloc(size_t size)
+{
+    ++allocCount;
+    allocBytes += size;
+    return malloc(size);
+}
+
+static void
+benchFree(void *ptr)
+{
+    free(ptr);
+}
+
+static int
+benchRead(void *hNet, uint8_t **ppBuf)
+{
+    (void)hNet;
+    (void)ppBuf;
+    return 0;
+}
+
+static int
+benchWrite(void *hNet, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    (void)hNet;
+    (void)pBuf;
+    (void)isMore;
+    writeBytes += len;
+    return len;
+}
+
+static void
+benchPublishCb(umqtt_Handle_t h, void *pUser, bool dup, bool retain, uint8_t qos,
+               const char *pTopic, uint16_t topicLen, const uint8_t *pMsg,
+               uint16_t msgLen)
+{
+    (void)h;
+    (void)pUser;
+    (void)dup;
+    (void)retain;
+    (void)qos;
+    (void)pTopic;
+    (void)topicLen;
+    (void)pMsg;
+    (void)msgLen;
+}
+
+static int benchNet;
+static umqtt_TransportConfig_t transport =
+{
+    &benchNet, benchMalloc, benchFree, benchRead, benchWrite, NULL, false, NULL
+};
+static umqtt_Callbacks_t callbacks =
+{
+    NULL, benchPublishCb, NULL, NULL, NULL, NULL
+};
+
+/*
+ * Read the monotonic clock in nanoseconds.
+ */
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000U) + ts.tv_nsec;
+}
+
+/*
+ * Build an incoming packet in pInPacket from a fixed header byte and
+ * the variable header and payload.
+ */
+static void
+buildPacket(uint8_t hdr, const uint8_t *pVar, uint32_t varLen,
+            const uint8_t *pPayload, uint32_t payloadLen)
+{
+    uint32_t remainingLen = varLen + payloadLen;
+    uint32_t idx = 0;
+    free(pInPacket);
+    pInPacket = malloc(remainingLen + 5);
+    pInPacket[idx++] = hdr;
+    do
+    {
+        uint8_t encByte = remainingLen & 0x7F;
+        remainingLen >>= 7;
+        pInPacket[idx++] = encByte | (remainingLen ? 0x80 : 0);
+    } while (remainingLen);
+    memcpy(&pInPacket[idx], pVar, varLen);
+    idx += varLen;
+    if (payloadLen)
+    {
+        memcpy(&pInPacket[idx], pPayload, payloadLen);
+        idx += payloadLen;
+    }
+    inPacketLen = idx;
+}
+
+/*
+ * Decode a 4 byte ack packet of the given type for a packet ID.
+ */
+static void
+decodeAck(umqtt_Handle_t h, uint8_t type, uint16_t packetId)
+{
+    uint8_t ack[4] = { type << 4, 2, packetId >> 8, packetId & 0xFF };
+    umqtt_DecodePacket(h, ack, 4);
+}
+
+/*
+ * Set the shared topic to a string of the given length.
+ */
+static const char *
+makeTopic(uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        topic[i] = ((i % 8) == 7) ? '/' : 'a' + (i % 26);
+    }
+    topic[len] = 0;
+    return topic;
+}
+
+/*
+ * Connect, receive the CONNACK and disconnect.
+ */
+static void
+benchConnect(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    static const uint8_t connack[4] = { 0x20, 2, 0, 0 };
+    (void)pParms;
+    umqtt_Disconnect(h);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        umqtt_Connect(h, true, false, 0, 60, "benchcli", NULL, NULL, 0, NULL, NULL);
+        umqtt_DecodePacket(h, connack, sizeof(connack));
+        umqtt_Disconnect(h);
+    }
+}
+
+/*
+ * Publish with QoS 0.
+ */
+static void
+benchPublish0(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    const char *pTopic = makeTopic(pParms->topicLen);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        umqtt_Publish(h, pTopic, payload, pParms->payloadLen, 0, false, NULL);
+    }
+}
+
+/*
+ * Publish with QoS 1, keeping up to _depth_ packets in flight, and decode
+ * the PUBACK for the oldest one when the limit is reached.
+ */
+static void
+benchPublish1(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    const char *pTopic = makeTopic(pParms->topicLen);
+    uint32_t head = 0;
+    uint32_t pending = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (pending == pParms->depth)
+        {
+            decodeAck(h, 4, pendingIds[head]);
+            head = (head + 1) % pParms->depth;
+            --pending;
+        }
+        uint32_t tail = (head + pending) % pParms->depth;
+        umqtt_Publish(h, pTopic, payload, pParms->payloadLen, 1, false, &pendingIds[tail]);
+        ++pending;
+    }
+    while (pending)
+    {
+        decodeAck(h, 4, pendingIds[head]);
+        head = (head + 1) % pParms->depth;
+        --pending;
+    }
+}
+
+/*
+ * Decode PUBACKs with _depth_ QoS 1 publishes in flight.  The oldest half
+ * of the packets is acked, and then as many are published again, so
+ * between _depth_ / 2 and _depth_ packets are always in flight.  Only the
+ * acks are timed, but the allocations of the publishes are counted.
+ */
+static void
+benchPuback(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    const char *pTopic = makeTopic(pParms->topicLen);
+    uint32_t batch = (pParms->depth + 1) / 2;
+    uint32_t head = 0;
+    for (uint32_t i = 0; i < pParms->depth; i++)
+    {
+        umqtt_Publish(h, pTopic, payload, pParms->payloadLen, 1, false, &pendingIds[i]);
+    }
+    uint64_t done = 0;
+    timedNs = 0;
+    while (done < count)
+    {
+        uint32_t acks = ((count - done) < batch) ? (uint32_t)(count - done) : batch;
+        uint32_t idx = head;
+        uint64_t start = nowNs();
+        for (uint32_t i = 0; i < acks; i++)
+        {
+            decodeAck(h, 4, pendingIds[idx]);
+            idx = ((idx + 1) == pParms->depth) ? 0 : (idx + 1);
+        }
+        timedNs += nowNs() - start;
+        for (uint32_t i = 0; i < acks; i++)
+        {
+            umqtt_Publish(h, pTopic, payload, pParms->payloadLen, 1, false, &pendingIds[head]);
+            head = ((head + 1) == pParms->depth) ? 0 : (head + 1);
+        }
+        done += acks;
+    }
+}
+
+/*
+ * Subscribe to one topic filter and decode the SUBACK.
+ */
+static void
+benchSubscribe(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    char *topics[1] = { (char *)makeTopic(pParms->topicLen) };
+    uint8_t qoss[1] = { 1 };
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint16_t packetId;
+        umqtt_Subscribe(h, 1, topics, qoss, &packetId);
+        uint8_t suback[5] = { 0x90, 3, packetId >> 8, packetId & 0xFF, 1 };
+        umqtt_DecodePacket(h, suback, sizeof(suback));
+    }
+}
+
+/*
+ * Unsubscribe from one topic filter and decode the UNSUBACK.
+ */
+static void
+benchUnsubscribe(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    const char *topics[1] = { makeTopic(pParms->topicLen) };
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint16_t packetId;
+        umqtt_Unsubscribe(h, 1, topics, &packetId);
+        decodeAck(h, 11, packetId);
+    }
+}
+
+/*
+ * Decode an incoming publish.  QoS 1 also encodes and writes the PUBACK.
+ */
+static void
+benchDecodePublish(umqtt_Handle_t h, const BenchParms_t *pParms, uint64_t count)
+{
+    (void)pParms;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        umqtt_DecodePacket(h, pInPacket, inPacketLen);
+    }
+}
+
+/*
+ * Build the incoming publish packet used by benchDecodePublish().
+ */
+static void
+prepareInPublish(uint8_t qos, uint32_t topicLen, uint32_t payloadLen)
+{
+    static uint8_t var[4096 + 4];
+    uint32_t idx = 0;
+    var[idx++] = topicLen >> 8;
+    var[idx++] = topicLen & 0xFF;
+    memcpy(&var[idx], makeTopic(topicLen), topicLen);
+    idx += topicLen;
+    if (qos)
+    {
+        var[idx++] = 0x12;
+        var[idx++] = 0x34;
+    }
+    buildPacket(0x30 | (qos << 1), var, idx, payload, payloadLen);
+}
+
+/*
+ * Run one benchmark with a connected instance, doubling the operation
+ * count until the run takes long enough to time, and print the results.
+ */
+static void
+runBench(const char *name, BenchFn_t fn, const BenchParms_t *pParms)
+{
+    if (pFilter && !strstr(name, pFilter))
+    {
+        return;
+    }
+
+    uint64_t count = 1;
+    uint64_t elapsed;
+    uint64_t allocs;
+    uint64_t bytes;
+    for (;;)
+    {
+        umqtt_Options_t options;
+        memset(&options, 0, sizeof(options));
+        options.ringSize = pParms->ringSize;
+        umqtt_Handle_t h = umqtt_NewWithOptions(&transport, &callbacks, NULL, &options);
+        if (h == NULL)
+        {
+            fprintf(stderr, "umqtt_New failed\n");
+            exit(1);
+        }
+        static const uint8_t connack[4] = { 0x20, 2, 0, 0 };
+        umqtt_Connect(h, true, false, 0, 60, "benchcli", NULL, NULL, 0, NULL, NULL);
+        umqtt_DecodePacket(h, connack, sizeof(connack));
+
+        allocCount = 0;
+        allocBytes = 0;
+        writeBytes = 0;
+        timedNs = 0;
+        uint64_t start = nowNs();
+        fn(h, pParms, count);
+        elapsed = timedNs ? timedNs : (nowNs() - start);
+        allocs = allocCount;
+        bytes = allocBytes;
+        umqtt_Delete(h);
+
+        if (elapsed >= minBenchNs)
+        {
+            break;
+        }
+        // aim a bit past the minimum time, but never more than 100x
+        uint64_t next = elapsed ? ((count * minBenchNs * 12) / (elapsed * 10)) : (count * 100);
+        count = (next > (count * 100)) ? (count * 100) : ((next > count) ? next : (count + 1));
+    }
+
+    char parms[64];
+    snprintf(parms, sizeof(parms), "payload=%u topic=%u depth=%u",
+             pParms->payloadLen, pParms->topicLen, pParms->depth);
+    printf("%-20s %-36s %12.1f %10.2f %12.1f\n", name, parms,
+           (double)elapsed / count, (double)allocs / count, (double)bytes / count);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const uint32_t payloadLens[] = { 0, 16, 256, 4096, 65536, BENCH_MAX_PAYLOAD };
+    static const uint32_t topicLens[] = { 8, 64, 512, 4096 };
+    static const uint32_t depths[] = { 1, 16, 256, BENCH_MAX_DEPTH };
+    const uint32_t payloadCount = sizeof(payloadLens) / sizeof(payloadLens[0]);
+    const uint32_t topicCount = sizeof(topicLens) / sizeof(topicLens[0]);
+    const uint32_t depthCount = sizeof(depths) / sizeof(depths[0]);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            minBenchNs = 10000000;
+        }
+        else
+        {
+            pFilter = argv[i];
+        }
+    }
+    for (uint32_t i = 0; i < BENCH_MAX_PAYLOAD; i++)
+    {
+        payload[i] = i & 0xFF;
+    }
+
+    printf("%-20s %-36s %12s %10s %12s\n", "benchmark", "parameters",
+           "ns/op", "allocs/op", "B/op");
+
+    BenchParms_t parms = { 0, 16, 1, 0 };
+    runBench("connect", benchConnect, &parms);
+
+    for (uint32_t i = 0; i < payloadCount; i++)
+    {
+        parms.payloadLen = payloadLens[i];
+        runBench("publish_qos0", benchPublish0, &parms);
+    }
+    parms.payloadLen = 16;
+    for (uint32_t i = 0; i < topicCount; i++)
+    {
+        parms.topicLen = topicLens[i];
+        runBench("publish_qos0", benchPublish0, &parms);
+    }
+    parms.topicLen = 16;
+    for (uint32_t i = 0; i < depthCount; i++)
+    {
+        parms.depth = depths[i];
+        runBench("publish_qos1", benchPublish1, &parms);
+    }
+    parms.ringSize = BENCH_MAX_DEPTH * 256;
+    for (uint32_t i = 0; i < depthCount; i++)
+    {
+        parms.depth = depths[i];
+        runBench("publish_qos1_ring", benchPublish1, &parms);
+    }
+    parms.ringSize = 0;
+    static const uint32_t ackDepths[] = { 10, 1000, 10000, BENCH_MAX_ACK_DEPTH };
+    for (uint32_t i = 0; i < sizeof(ackDepths) / sizeof(ackDepths[0]); i++)
+    {
+        parms.depth = ackDepths[i];
+        runBench("puback", benchPuback, &parms);
+    }
+    parms.depth = 1;
+
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        parms.topicLen = topicLens[i];
+        runBench("subscribe", benchSubscribe, &parms);
+        runBench("unsubscribe", benchUnsubscribe, &parms);
+    }
+    parms.topicLen = 16;
+
+    for (uint32_t i = 0; i < payloadCount; i++)
+    {
+        parms.payloadLen = payloadLens[i];
+        prepareInPublish(0, parms.topicLen, parms.payloadLen);
+        runBench("decode_publish_qos0", benchDecodePublish, &parms);
+    }
+    for (uint32_t i = 0; i < topicCount; i++)
+    {
+        parms.payloadLen = 16;
+        parms.topicLen = topicLens[i];
+        prepareInPublish(0, parms.topicLen, parms.payloadLen);
+        runBench("decode_publish_qos0", benchDecodePublish, &parms);
+    }
+    parms.topicLen = 16;
+    prepareInPublish(1, parms.topicLen, parms.payloadLen);
+    runBench("decode_publish_qos1", benchDecodePublish, &parms);
+
+    free(pInPacket);
+    return 0;
+}
@@ -0,0 +1,341 @@
+/******************************************************************************
+ * umqtt_loopbench.c - Many idle and active umqtt instances on one thread.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+/*
+ * Connects many umqtt instances, each over its own local socket pair, and
+ * then in each round sends one publish to a fraction of them.  The time
+ * to process a round is measured twice: once with the umqtt_Loop event
+ * loop, which only runs the instances that have data, and once by calling
+ * umqtt_RunBudget() for every instance, as an application without the
+ * loop would.  The broker side of each socket pair is written directly by
+ * the benchmark.
+ *
+ * Usage: umqtt_loopbench [-q] [-n instances]
+ *
+ * -q uses fewer instances and rounds, for a quick check that everything
+ * works.  -n sets the number of instances, each of which uses two file
+ * descriptors.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "umqtt.h"
+#include "umqtt_loop.h"
+
+/*
+ * One client instance and its socket pair.
+ */
+typedef struct
+{
+    umqtt_Handle_t h;
+    umqtt_TransportConfig_t transport;  // must live as long as the instance
+    int fd;             // client end, read by the instance
+    int brokerFd;       // broker end, written by the benchmark
+} Client_t;
+
+/*
+ * Benchmark settings from the command line.
+ */
+static uint32_t clientCount = 4000;
+static uint32_t roundCount = 200;
+
+static Client_t *pClients;
+static uint64_t connacks;
+static uint64_t delivered;
+static uint32_t rs = 1;
+
+/*
+ * Socket transport functions.  The socket is not blocking and incoming
+ * data is passed to umqtt as a byte stream, in a buffer that umqtt frees.
+ */
+static int
+sockRead(void *hNet, uint8_t **ppBuf)
+{
+    Client_t *pClient = hNet;
+    uint8_t buf[4096];
+    ssize_t len = recv(pClient->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0)
+    {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    if (len == 0)
+    {
+        return -1;
+    }
+    *ppBuf = malloc(len);
+    if (*ppBuf == NULL)
+    {
+        return -1;
+    }
+    memcpy(*ppBuf, buf, len);
+    return (int)len;
+}
+
+static int
+sockWrite(void *hNet, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    Client_t *pClient = hNet;
+    (void)isMore;
+    return (int)send(pClient->fd, pBuf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void
+connackCb(umqtt_Handle_t h, void *pUser, bool sessionPresent, uint8_t retCode)
+{
+    (void)h;
+    (void)pUser;
+    (void)sessionPresent;
+    (void)retCode;
+    ++connacks;
+}
+
+static void
+publishCb(umqtt_Handle_t h, void *pUser, bool dup, bool retain, uint8_t qos,
+          const char *pTopic, uint16_t topicLen, const uint8_t *pMsg,
+          uint16_t msgLen)
+{
+    (void)h;
+    (void)pUser;
+    (void)dup;
+    (void)retain;
+    (void)qos;
+    (void)pTopic;
+    (void)topicLen;
+    (void)pMsg;
+    (void)msgLen;
+    ++delivered;
+}
+
+static umqtt_Callbacks_t callbacks =
+{
+    connackCb, publishCb, NULL, NULL, NULL, NULL
+};
+
+static void
+loopErrorCb(umqtt_Loop_t hLoop, umqtt_Handle_t h, void *pUser, umqtt_Error_t err)
+{
+    (void)hLoop;
+    (void)h;
+    (void)pUser;
+    fprintf(stderr, "instance error: %s\n", umqtt_GetErrorString(err));
+    exit(1);
+}
+
+/*
+ * Read the monotonic clock in nanoseconds.
+ */
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000U) + ts.tv_nsec;
+}
+
+static uint32_t
+rnd(void)
+{
+    rs ^= rs << 13;
+    rs ^= rs >> 17;
+    rs ^= rs << 5;
+    return rs;
+}
+
+/*
+ * Write bytes to the broker end of a client socket pair.
+ */
+static void
+brokerSend(Client_t *pClient, const uint8_t *pBuf, uint32_t len)
+{
+    if (send(pClient->brokerFd, pBuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        perror("send");
+        exit(1);
+    }
+}
+
+/*
+ * Create the clients, add them to the loop and connect them.
+ */
+static void
+connectClients(umqtt_Loop_t hLoop)
+{
+    umqtt_Options_t options;
+    memset(&options, 0, sizeof(options));
+    options.streamInput = true;
+
+    static const uint8_t connack[4] = { 0x20, 2, 0, 0 };
+    uint8_t discard[256];
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        Client_t *pClient = &pClients[i];
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            perror("socketpair");
+            exit(1);
+        }
+        pClient->fd = fds[0];
+        pClient->brokerFd = fds[1];
+        pClient->transport.hNet = pClient;
+        pClient->transport.pfnmalloc = malloc;
+        pClient->transport.pfnfree = free;
+        pClient->transport.pfnNetReadPacket = sockRead;
+        pClient->transport.pfnNetWritePacket = sockWrite;
+        pClient->h = umqtt_NewWithOptions(&pClient->transport, &callbacks, NULL, &options);
+        if ((pClient->h == NULL)
+         || (umqtt_LoopAdd(hLoop, pClient->h, pClient->fd, pClient) != UMQTT_ERR_OK)
+         || (umqtt_Connect(pClient->h, true, false, 0, 600, "bench",
+                           NULL, NULL, 0, NULL, NULL) != UMQTT_ERR_OK))
+        {
+            fprintf(stderr, "unable to set up client %u\n", i);
+            exit(1);
+        }
+        umqtt_LoopUpdate(hLoop, pClient->h);
+
+        // throw away the CONNECT and answer it
+        if (read(pClient->brokerFd, discard, sizeof(discard)) <= 0)
+        {
+            perror("read");
+            exit(1);
+        }
+        brokerSend(pClient, connack, sizeof(connack));
+    }
+    while (connacks < clientCount)
+    {
+        umqtt_LoopRun(hLoop, 100, NULL);
+    }
+}
+
+/*
+ * Send one publish to each of _active_ random clients, then process it
+ * either with the loop or by running every instance.  Returns the time
+ * taken to process the round, and the number of instances run.
+ */
+static uint64_t
+runRound(umqtt_Loop_t hLoop, uint32_t active, bool useLoop, uint32_t *pRunCount)
+{
+    static const uint8_t publish[] = { 0x30, 9, 0, 3, 'a', '/', 'b', 1, 2, 3, 4 };
+    uint64_t expected = delivered + active;
+    for (uint32_t i = 0; i < active; i++)
+    {
+        brokerSend(&pClients[rnd() % clientCount], publish, sizeof(publish));
+    }
+
+    uint64_t start = nowNs();
+    uint32_t runCount = 0;
+    if (useLoop)
+    {
+        while (delivered < expected)
+        {
+            uint32_t count;
+            umqtt_LoopRun(hLoop, 0, &count);
+            runCount += count;
+        }
+    }
+    else
+    {
+        uint32_t msTicks = umqtt_LoopGetTicks(hLoop);
+        for (uint32_t i = 0; i < clientCount; i++)
+        {
+            if (umqtt_RunBudget(pClients[i].h, msTicks, 16, 0, NULL) != UMQTT_ERR_OK)
+            {
+                fprintf(stderr, "run error on client %u\n", i);
+                exit(1);
+            }
+        }
+        runCount = clientCount;
+    }
+    uint64_t elapsed = nowNs() - start;
+    if (delivered != expected)
+    {
+        fprintf(stderr, "delivered %llu expected %llu\n",
+                (unsigned long long)delivered, (unsigned long long)expected);
+        exit(1);
+    }
+    *pRunCount = runCount;
+    return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            clientCount = 1000;
+            roundCount = 20;
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && ((i + 1) < argc))
+        {
+            clientCount = strtoul(argv[++i], NULL, 0);
+        }
+    }
+
+    umqtt_LoopOptions_t loopOptions;
+    memset(&loopOptions, 0, sizeof(loopOptions));
+    loopOptions.errorCb = loopErrorCb;
+    umqtt_Loop_t hLoop = umqtt_LoopNew(&loopOptions);
+    pClients = calloc(clientCount, sizeof(Client_t));
+    if ((hLoop == NULL) || (pClients == NULL))
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    connectClients(hLoop);
+
+    printf("%-10s %10s %10s %14s %14s %14s\n", "instances", "active",
+           "runs/round", "loop ns/round", "all ns/round", "speedup");
+
+    // active instances per round, in parts per thousand
+    static const uint32_t activity[] = { 0, 1, 10, 100, 1000 };
+    for (uint32_t a = 0; a < sizeof(activity) / sizeof(activity[0]); a++)
+    {
+        uint32_t active = (uint32_t)(((uint64_t)clientCount * activity[a]) / 1000);
+        uint64_t loopNs = 0;
+        uint64_t allNs = 0;
+        uint64_t runs = 0;
+        for (uint32_t r = 0; r < roundCount; r++)
+        {
+            uint32_t runCount;
+            loopNs += runRound(hLoop, active, true, &runCount);
+            runs += runCount;
+            allNs += runRound(hLoop, active, false, &runCount);
+        }
+        printf("%-10u %10u %10.1f %14.0f %14.0f %13.1fx\n", clientCount, active,
+               (double)runs / roundCount, (double)loopNs / roundCount,
+               (double)allNs / roundCount, (double)allNs / (loopNs ? loopNs : 1));
+    }
+
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        umqtt_LoopRemove(hLoop, pClients[i].h);
+        umqtt_Delete(pClients[i].h);
+        close(pClients[i].fd);
+        close(pClients[i].brokerFd);
+    }
+    umqtt_LoopDelete(hLoop);
+    free(pClients);
+    return 0;
+}
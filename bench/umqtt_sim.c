@@ -0,0 +1,1077 @@
+/******************************************************************************
+ * umqtt_sim.c - Simulated MQTT broker and network link for umqtt.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+/*
+ * A minimal MQTT 3.1.1 broker core for one client, joined to the client
+ * by an in-memory transport.  Both run on a virtual millisecond clock
+ * that only moves when sim_Advance() is called, and the link losses and
+ * delays come from a seeded random generator, so a run with the same
+ * settings and seed always behaves the same way.
+ *
+ * The broker acknowledges everything the client sends, keeps track of
+ * subscriptions, and routes each accepted message back to the client if
+ * it matches a subscription.  QoS 1 and 2 messages sent to the client
+ * are retransmitted until they are acknowledged.  The connection is
+ * closed if nothing is received for 1.5 times the keep-alive time.
+ *
+ * Typical use:
+ *
+ *     hSim = sim_New(&config);
+ *     sim_GetTransport(hSim, &transport);
+ *     h = umqtt_New(&transport, &callbacks, NULL);
+ *     umqtt_Connect(h, ...);
+ *     while (...)
+ *     {
+ *         umqtt_Run(h, sim_GetTicks(hSim));
+ *         sim_Advance(hSim, 1);
+ *     }
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "umqtt.h"
+#include "umqtt_sim.h"
+
+// MQTT packet types used by the broker
+#define SIM_TYPE_CONNECT 1
+#define SIM_TYPE_CONNACK 2
+#define SIM_TYPE_PUBLISH 3
+#define SIM_TYPE_PUBACK 4
+#define SIM_TYPE_PUBREC 5
+#define SIM_TYPE_PUBREL 6
+#define SIM_TYPE_PUBCOMP 7
+#define SIM_TYPE_SUBSCRIBE 8
+#define SIM_TYPE_SUBACK 9
+#define SIM_TYPE_UNSUBSCRIBE 10
+#define SIM_TYPE_UNSUBACK 11
+#define SIM_TYPE_PINGREQ 12
+#define SIM_TYPE_PINGRESP 13
+#define SIM_TYPE_DISCONNECT 14
+
+// link directions
+#define SIM_UP 0
+#define SIM_DOWN 1
+
+// most subscriptions kept by the broker
+#define SIM_MAX_SUBS 16
+
+// longest subscription topic filter
+#define SIM_MAX_FILTER 128
+
+// most QoS 1 and 2 messages waiting for the client to acknowledge
+#define SIM_MAX_OUTBOUND 64
+
+/*
+ * One segment on the link, with its packet data after the header.
+ */
+typedef struct Segment_s
+{
+    struct Segment_s *pNext;
+    uint32_t deliverAt;     // tick when the segment arrives
+    uint32_t len;           // bytes of packet data
+    uint8_t data[];
+} Segment_t;
+
+/*
+ * One direction of the link.  Segments are kept in the order they
+ * arrive.
+ */
+typedef struct
+{
+    sim_LinkConfig_t config;
+    Segment_t *pHead;
+    uint32_t busyUntil;     // tick when the link has sent everything
+} Link_t;
+
+/*
+ * A subscription held by the broker.
+ */
+typedef struct
+{
+    bool inUse;
+    uint8_t qos;
+    char filter[SIM_MAX_FILTER];
+} Sub_t;
+
+/*
+ * A QoS 1 or 2 message sent to the client and not yet acknowledged.
+ */
+typedef struct
+{
+    uint8_t *pPkt;          // the PUBLISH, or NULL if the slot is free
+    uint32_t pktLen;
+    uint16_t packetId;
+    bool released;          // QoS 2 PUBREC received and PUBREL sent
+    uint32_t sentAt;        // tick of the last transmission
+    uint32_t retries;
+} Outbound_t;
+
+/*
+ * Simulator instance data
+ */
+typedef struct
+{
+    uint32_t ticks;
+    uint32_t random;
+    uint32_t retryTimeout;
+    uint32_t maxRetries;
+    Link_t links[2];
+    bool closed;            // the broker has closed the connection
+    bool connected;         // the broker has accepted a CONNECT
+    uint32_t keepAlive;     // keep-alive time in seconds, 0 for none
+    uint32_t lastRecv;      // tick of the last packet from the client
+    uint16_t nextPacketId;
+    uint8_t qos2Ids[65536 / 8];     // QoS 2 ids received and not released
+    Sub_t subs[SIM_MAX_SUBS];
+    Outbound_t outbound[SIM_MAX_OUTBOUND];
+    sim_Stats_t stats;
+} Sim_t;
+
+/*
+ * @internal
+ *
+ * Get the next value from the random generator (xorshift32)
+ *
+ * @param this simulator instance
+ *
+ * @return a pseudo-random number
+ */
+static uint32_t
+nextRandom(Sim_t *this)
+{
+    uint32_t x = this->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    this->random = x;
+    return x;
+}
+
+/*
+ * @internal
+ *
+ * Send a segment over one direction of the link
+ *
+ * @param this simulator instance
+ * @param dir link direction, SIM_UP or SIM_DOWN
+ * @param pSegs the buffers holding the segment data
+ * @param segCount number of buffers
+ *
+ * The segment takes up the link for as long as its bytes take to send at
+ * the link bandwidth, and then arrives after the latency and a random
+ * amount of jitter.  A lost segment still takes up the link.
+ *
+ * @return the number of bytes sent
+ */
+static uint32_t
+linkSend(Sim_t *this, uint32_t dir, const umqtt_Segment_t *pSegs, uint32_t segCount)
+{
+    Link_t *pLink = &this->links[dir];
+    uint32_t len = 0;
+    for (uint32_t idx = 0; idx < segCount; idx++)
+    {
+        len += pSegs[idx].len;
+    }
+
+    ++this->stats.segments[dir];
+    this->stats.bytes[dir] += len;
+
+    // time taken to put the bytes on the link
+    uint32_t start = ((int32_t)(pLink->busyUntil - this->ticks) > 0)
+                   ? pLink->busyUntil : this->ticks;
+    uint32_t bandwidth = pLink->config.bandwidth;
+    pLink->busyUntil = start + (bandwidth ? ((len + bandwidth - 1) / bandwidth) : 0);
+
+    if (pLink->config.lossPpm && ((nextRandom(this) % 1000000) < pLink->config.lossPpm))
+    {
+        ++this->stats.segmentsLost[dir];
+        return len;
+    }
+
+    Segment_t *pSeg = malloc(sizeof(Segment_t) + len);
+    if (pSeg == NULL)
+    {
+        ++this->stats.segmentsLost[dir];
+        return len;
+    }
+    pSeg->deliverAt = pLink->busyUntil + pLink->config.latency;
+    if (pLink->config.jitter)
+    {
+        pSeg->deliverAt += nextRandom(this) % (pLink->config.jitter + 1);
+    }
+    pSeg->len = 0;
+    for (uint32_t idx = 0; idx < segCount; idx++)
+    {
+        memcpy(&pSeg->data[pSeg->len], pSegs[idx].pData, pSegs[idx].len);
+        pSeg->len += pSegs[idx].len;
+    }
+
+    // keep the segments in arrival order.  Segments that arrive at the
+    // same tick stay in the order they were sent
+    Segment_t **ppNext = &pLink->pHead;
+    while (*ppNext && ((int32_t)((*ppNext)->deliverAt - pSeg->deliverAt) <= 0))
+    {
+        ppNext = &(*ppNext)->pNext;
+    }
+    pSeg->pNext = *ppNext;
+    *ppNext = pSeg;
+    return len;
+}
+
+/*
+ * @internal
+ *
+ * Take the next segment that has arrived from one direction of the link
+ *
+ * @param this simulator instance
+ * @param dir link direction, SIM_UP or SIM_DOWN
+ *
+ * @return the segment, to be freed by the caller, or NULL if nothing
+ * has arrived
+ */
+static Segment_t *
+linkReceive(Sim_t *this, uint32_t dir)
+{
+    Link_t *pLink = &this->links[dir];
+    Segment_t *pSeg = pLink->pHead;
+    if (pSeg && ((int32_t)(this->ticks - pSeg->deliverAt) >= 0))
+    {
+        pLink->pHead = pSeg->pNext;
+        return pSeg;
+    }
+    return NULL;
+}
+
+/*
+ * @internal
+ *
+ * Free all of the segments on both directions of the link
+ *
+ * @param this simulator instance
+ */
+static void
+linkFlush(Sim_t *this)
+{
+    for (uint32_t dir = 0; dir < 2; dir++)
+    {
+        while (this->links[dir].pHead)
+        {
+            Segment_t *pSeg = this->links[dir].pHead;
+            this->links[dir].pHead = pSeg->pNext;
+            free(pSeg);
+        }
+    }
+}
+
+/*
+ * @internal
+ *
+ * Send a packet from the broker to the client
+ *
+ * @param this simulator instance
+ * @param pPkt the encoded packet
+ * @param len length of the packet
+ */
+static void
+brokerSend(Sim_t *this, const uint8_t *pPkt, uint32_t len)
+{
+    umqtt_Segment_t seg = { pPkt, len };
+    ++this->stats.pktsSent[pPkt[0] >> 4];
+    linkSend(this, SIM_DOWN, &seg, 1);
+}
+
+/*
+ * @internal
+ *
+ * Send a 4 byte ack packet from the broker
+ *
+ * @param this simulator instance
+ * @param hdr fixed header byte of the ack
+ * @param packetId the packet ID being acknowledged
+ */
+static void
+brokerSendAck(Sim_t *this, uint8_t hdr, uint16_t packetId)
+{
+    uint8_t ack[4] = { hdr, 2, packetId >> 8, packetId & 0xFF };
+    brokerSend(this, ack, sizeof(ack));
+}
+
+/*
+ * @internal
+ *
+ * Check if a topic name matches a topic filter
+ *
+ * @param pFilter the topic filter, which can have wildcards
+ * @param pTopic the topic name
+ * @param topicLen bytes in the topic name
+ *
+ * @return true if the topic matches
+ */
+static bool
+topicMatches(const char *pFilter, const char *pTopic, uint32_t topicLen)
+{
+    uint32_t idx = 0;
+    while (*pFilter)
+    {
+        if (*pFilter == '#')
+        {
+            return true;
+        }
+        if (*pFilter == '+')
+        {
+            while ((idx < topicLen) && (pTopic[idx] != '/'))
+            {
+                ++idx;
+            }
+            ++pFilter;
+            continue;
+        }
+        if ((idx == topicLen) || (*pFilter != pTopic[idx]))
+        {
+            // "a/#" also matches "a"
+            return (idx == topicLen) && (pFilter[0] == '/')
+                && (pFilter[1] == '#') && (pFilter[2] == 0);
+        }
+        ++pFilter;
+        ++idx;
+    }
+    return idx == topicLen;
+}
+
+/*
+ * @internal
+ *
+ * Route a message accepted by the broker to the client
+ *
+ * @param this simulator instance
+ * @param qos QoS the message was published with
+ * @param pTopic the topic name
+ * @param topicLen bytes in the topic name
+ * @param pMsg the message payload
+ * @param msgLen bytes in the payload
+ *
+ * The message is sent once at the highest QoS of the matching
+ * subscriptions, but not higher than it was published with.
+ */
+static void
+routeMessage(Sim_t *this, uint8_t qos, const char *pTopic, uint32_t topicLen,
+             const uint8_t *pMsg, uint32_t msgLen)
+{
+    int32_t subQos = -1;
+    for (uint32_t idx = 0; idx < SIM_MAX_SUBS; idx++)
+    {
+        if (this->subs[idx].inUse && (this->subs[idx].qos > subQos)
+         && topicMatches(this->subs[idx].filter, pTopic, topicLen))
+        {
+            subQos = this->subs[idx].qos;
+        }
+    }
+    if (subQos < 0)
+    {
+        return;
+    }
+    qos = (qos < subQos) ? qos : subQos;
+
+    // a slot is needed to wait for the ack
+    Outbound_t *pOut = NULL;
+    if (qos)
+    {
+        for (uint32_t idx = 0; idx < SIM_MAX_OUTBOUND; idx++)
+        {
+            if (this->outbound[idx].pPkt == NULL)
+            {
+                pOut = &this->outbound[idx];
+                break;
+            }
+        }
+        if (pOut == NULL)
+        {
+            ++this->stats.dropped;
+            return;
+        }
+    }
+
+    // encode the PUBLISH
+    uint32_t remainingLen = 2 + topicLen + (qos ? 2 : 0) + msgLen;
+    uint8_t *pPkt = malloc(remainingLen + 5);
+    if (pPkt == NULL)
+    {
+        ++this->stats.dropped;
+        return;
+    }
+    uint32_t len = 0;
+    pPkt[len++] = (SIM_TYPE_PUBLISH << 4) | (qos << 1);
+    uint32_t remaining = remainingLen;
+    do
+    {
+        uint8_t encByte = remaining & 0x7F;
+        remaining >>= 7;
+        pPkt[len++] = encByte | (remaining ? 0x80 : 0);
+    } while (remaining);
+    pPkt[len++] = topicLen >> 8;
+    pPkt[len++] = topicLen & 0xFF;
+    memcpy(&pPkt[len], pTopic, topicLen);
+    len += topicLen;
+    uint16_t packetId = 0;
+    if (qos)
+    {
+        packetId = ++this->nextPacketId ? this->nextPacketId : ++this->nextPacketId;
+        pPkt[len++] = packetId >> 8;
+        pPkt[len++] = packetId & 0xFF;
+    }
+    memcpy(&pPkt[len], pMsg, msgLen);
+    len += msgLen;
+
+    ++this->stats.delivered;
+    brokerSend(this, pPkt, len);
+    if (qos)
+    {
+        pOut->pPkt = pPkt;
+        pOut->pktLen = len;
+        pOut->packetId = packetId;
+        pOut->released = false;
+        pOut->sentAt = this->ticks;
+        pOut->retries = 0;
+    }
+    else
+    {
+        free(pPkt);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Find a message waiting for the client to acknowledge it
+ *
+ * @param this simulator instance
+ * @param packetId the packet ID of the message
+ *
+ * @return the outbound slot, or NULL if there is none with that ID
+ */
+static Outbound_t *
+findOutbound(Sim_t *this, uint16_t packetId)
+{
+    for (uint32_t idx = 0; idx < SIM_MAX_OUTBOUND; idx++)
+    {
+        if (this->outbound[idx].pPkt && (this->outbound[idx].packetId == packetId))
+        {
+            return &this->outbound[idx];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * @internal
+ *
+ * Free a message that the client has acknowledged or that was given up
+ *
+ * @param pOut the outbound slot
+ */
+static void
+freeOutbound(Outbound_t *pOut)
+{
+    free(pOut->pPkt);
+    pOut->pPkt = NULL;
+}
+
+/*
+ * @internal
+ *
+ * Read a length prefixed string from a packet
+ *
+ * @param pData the packet variable header and payload
+ * @param len bytes in _pData_
+ * @param pIdx index of the string, moved past it on return
+ * @param pStrLen storage for the string length
+ *
+ * @return pointer to the string, or NULL if it does not fit in the packet
+ */
+static const char *
+readString(const uint8_t *pData, uint32_t len, uint32_t *pIdx, uint32_t *pStrLen)
+{
+    if ((*pIdx + 2) > len)
+    {
+        return NULL;
+    }
+    uint32_t strLen = ((uint32_t)pData[*pIdx] << 8) | pData[*pIdx + 1];
+    if ((*pIdx + 2 + strLen) > len)
+    {
+        return NULL;
+    }
+    const char *pStr = (const char *)&pData[*pIdx + 2];
+    *pIdx += 2 + strLen;
+    *pStrLen = strLen;
+    return pStr;
+}
+
+/*
+ * @internal
+ *
+ * Process one packet received by the broker
+ *
+ * @param this simulator instance
+ * @param hdr the fixed header byte
+ * @param pData the variable header and payload
+ * @param len bytes in _pData_
+ */
+static void
+brokerProcess(Sim_t *this, uint8_t hdr, const uint8_t *pData, uint32_t len)
+{
+    uint8_t type = hdr >> 4;
+    uint32_t idx = 0;
+    uint32_t strLen;
+    uint16_t packetId = (len >= 2) ? (((uint16_t)pData[0] << 8) | pData[1]) : 0;
+
+    ++this->stats.pktsRecv[type];
+    this->lastRecv = this->ticks;
+
+    // nothing but CONNECT is accepted until the client has connected
+    if (!this->connected && (type != SIM_TYPE_CONNECT))
+    {
+        ++this->stats.malformed;
+        return;
+    }
+
+    switch (type)
+    {
+        case SIM_TYPE_CONNECT:
+        {
+            // protocol name, level, flags, keep-alive
+            if ((readString(pData, len, &idx, &strLen) == NULL) || ((idx + 4) > len))
+            {
+                ++this->stats.malformed;
+                return;
+            }
+            bool cleanSession = pData[idx + 1] & 0x02;
+            this->keepAlive = ((uint32_t)pData[idx + 2] << 8) | pData[idx + 3];
+            if (cleanSession)
+            {
+                memset(this->qos2Ids, 0, sizeof(this->qos2Ids));
+                memset(this->subs, 0, sizeof(this->subs));
+                for (uint32_t slot = 0; slot < SIM_MAX_OUTBOUND; slot++)
+                {
+                    if (this->outbound[slot].pPkt)
+                    {
+                        freeOutbound(&this->outbound[slot]);
+                    }
+                }
+            }
+            this->connected = true;
+            uint8_t connack[4] = { SIM_TYPE_CONNACK << 4, 2, 0, 0 };
+            brokerSend(this, connack, sizeof(connack));
+            break;
+        }
+
+        case SIM_TYPE_PUBLISH:
+        {
+            uint8_t qos = (hdr >> 1) & 3;
+            const char *pTopic = readString(pData, len, &idx, &strLen);
+            if ((pTopic == NULL) || (qos == 3) || (qos && ((idx + 2) > len)))
+            {
+                ++this->stats.malformed;
+                return;
+            }
+            if (qos)
+            {
+                packetId = ((uint16_t)pData[idx] << 8) | pData[idx + 1];
+                idx += 2;
+            }
+            if (hdr & 0x08)
+            {
+                ++this->stats.dupFlagged;
+            }
+
+            // a QoS 2 message is only accepted once until it is released
+            bool accept = true;
+            if (qos == 2)
+            {
+                uint8_t mask = 1 << (packetId & 7);
+                if (this->qos2Ids[packetId >> 3] & mask)
+                {
+                    ++this->stats.duplicates;
+                    accept = false;
+                }
+                this->qos2Ids[packetId >> 3] |= mask;
+                brokerSendAck(this, SIM_TYPE_PUBREC << 4, packetId);
+            }
+            else if (qos == 1)
+            {
+                brokerSendAck(this, SIM_TYPE_PUBACK << 4, packetId);
+            }
+            if (accept)
+            {
+                ++this->stats.published;
+                routeMessage(this, qos, pTopic, strLen, &pData[idx], len - idx);
+            }
+            break;
+        }
+
+        case SIM_TYPE_PUBREL:
+            this->qos2Ids[packetId >> 3] &= ~(1 << (packetId & 7));
+            brokerSendAck(this, SIM_TYPE_PUBCOMP << 4, packetId);
+            break;
+
+        case SIM_TYPE_PUBACK:
+        case SIM_TYPE_PUBCOMP:
+        {
+            Outbound_t *pOut = findOutbound(this, packetId);
+            if (pOut)
+            {
+                freeOutbound(pOut);
+            }
+            break;
+        }
+
+        case SIM_TYPE_PUBREC:
+        {
+            Outbound_t *pOut = findOutbound(this, packetId);
+            if (pOut)
+            {
+                pOut->released = true;
+                pOut->sentAt = this->ticks;
+            }
+            brokerSendAck(this, (SIM_TYPE_PUBREL << 4) | 0x02, packetId);
+            break;
+        }
+
+        case SIM_TYPE_SUBSCRIBE:
+        {
+            uint8_t suback[4 + SIM_MAX_SUBS];
+            uint32_t count = 0;
+            idx = 2;
+            while ((idx < len) && (count < SIM_MAX_SUBS))
+            {
+                const char *pFilter = readString(pData, len, &idx, &strLen);
+                if ((pFilter == NULL) || (idx >= len))
+                {
+                    ++this->stats.malformed;
+                    return;
+                }
+                uint8_t qos = pData[idx++] & 3;
+                uint8_t retCode = 0x80;
+
+                // replace a subscription to the same filter, or use a free one
+                Sub_t *pSub = NULL;
+                for (uint32_t slot = 0; slot < SIM_MAX_SUBS; slot++)
+                {
+                    Sub_t *pSlot = &this->subs[slot];
+                    if (pSlot->inUse && (strlen(pSlot->filter) == strLen)
+                     && (memcmp(pSlot->filter, pFilter, strLen) == 0))
+                    {
+                        pSub = pSlot;
+                        break;
+                    }
+                    if (!pSlot->inUse && (pSub == NULL))
+                    {
+                        pSub = pSlot;
+                    }
+                }
+                if (pSub && (strLen < SIM_MAX_FILTER) && (qos < 3))
+                {
+                    pSub->inUse = true;
+                    pSub->qos = qos;
+                    memcpy(pSub->filter, pFilter, strLen);
+                    pSub->filter[strLen] = 0;
+                    retCode = qos;
+                }
+                suback[4 + count++] = retCode;
+            }
+            suback[0] = SIM_TYPE_SUBACK << 4;
+            suback[1] = 2 + count;
+            suback[2] = packetId >> 8;
+            suback[3] = packetId & 0xFF;
+            brokerSend(this, suback, 4 + count);
+            break;
+        }
+
+        case SIM_TYPE_UNSUBSCRIBE:
+            idx = 2;
+            while (idx < len)
+            {
+                const char *pFilter = readString(pData, len, &idx, &strLen);
+                if (pFilter == NULL)
+                {
+                    ++this->stats.malformed;
+                    return;
+                }
+                for (uint32_t slot = 0; slot < SIM_MAX_SUBS; slot++)
+                {
+                    Sub_t *pSlot = &this->subs[slot];
+                    if (pSlot->inUse && (strlen(pSlot->filter) == strLen)
+                     && (memcmp(pSlot->filter, pFilter, strLen) == 0))
+                    {
+                        pSlot->inUse = false;
+                    }
+                }
+            }
+            brokerSendAck(this, SIM_TYPE_UNSUBACK << 4, packetId);
+            break;
+
+        case SIM_TYPE_PINGREQ:
+        {
+            uint8_t pingresp[2] = { SIM_TYPE_PINGRESP << 4, 0 };
+            brokerSend(this, pingresp, sizeof(pingresp));
+            break;
+        }
+
+        case SIM_TYPE_DISCONNECT:
+            this->connected = false;
+            break;
+
+        default:
+            ++this->stats.malformed;
+            break;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Process a segment received by the broker, which holds one or more
+ * whole packets
+ *
+ * @param this simulator instance
+ * @param pSeg the segment
+ */
+static void
+brokerReceive(Sim_t *this, const Segment_t *pSeg)
+{
+    uint32_t idx = 0;
+    while (idx < pSeg->len)
+    {
+        // decode the fixed header
+        uint8_t hdr = pSeg->data[idx++];
+        uint32_t remainingLen = 0;
+        uint32_t shift = 0;
+        uint8_t encByte;
+        do
+        {
+            if ((idx == pSeg->len) || (shift > 21))
+            {
+                ++this->stats.malformed;
+                return;
+            }
+            encByte = pSeg->data[idx++];
+            remainingLen |= (uint32_t)(encByte & 0x7F) << shift;
+            shift += 7;
+        } while (encByte & 0x80);
+        if (remainingLen > (pSeg->len - idx))
+        {
+            ++this->stats.malformed;
+            return;
+        }
+        brokerProcess(this, hdr, &pSeg->data[idx], remainingLen);
+        idx += remainingLen;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Retransmit messages the client has not acknowledged in time
+ *
+ * @param this simulator instance
+ */
+static void
+brokerRetry(Sim_t *this)
+{
+    for (uint32_t idx = 0; idx < SIM_MAX_OUTBOUND; idx++)
+    {
+        Outbound_t *pOut = &this->outbound[idx];
+        if ((pOut->pPkt == NULL) || ((this->ticks - pOut->sentAt) < this->retryTimeout))
+        {
+            continue;
+        }
+        if (pOut->retries == this->maxRetries)
+        {
+            ++this->stats.dropped;
+            freeOutbound(pOut);
+            continue;
+        }
+        ++pOut->retries;
+        pOut->sentAt = this->ticks;
+        if (pOut->released)
+        {
+            brokerSendAck(this, (SIM_TYPE_PUBREL << 4) | 0x02, pOut->packetId);
+        }
+        else
+        {
+            pOut->pPkt[0] |= 0x08;
+            brokerSend(this, pOut->pPkt, pOut->pktLen);
+        }
+    }
+}
+
+/*
+ * @internal
+ *
+ * Transport functions used by the client
+ */
+static void *
+simMalloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void
+simFree(void *ptr)
+{
+    free(ptr);
+}
+
+static int
+simRead(void *hNet, uint8_t **ppBuf)
+{
+    Sim_t *this = hNet;
+    if (this->closed)
+    {
+        return -1;
+    }
+    Segment_t *pSeg = linkReceive(this, SIM_DOWN);
+    if (pSeg == NULL)
+    {
+        return 0;
+    }
+    // the client frees the buffer, so pass it only the packet data
+    uint8_t *pBuf = malloc(pSeg->len);
+    if (pBuf == NULL)
+    {
+        free(pSeg);
+        return -1;
+    }
+    memcpy(pBuf, pSeg->data, pSeg->len);
+    int len = pSeg->len;
+    free(pSeg);
+    *ppBuf = pBuf;
+    return len;
+}
+
+static int
+simWritev(void *hNet, const umqtt_Segment_t *pSegs, uint32_t segCount, bool isMore)
+{
+    Sim_t *this = hNet;
+    (void)isMore;
+    if (this->closed)
+    {
+        return -1;
+    }
+    return linkSend(this, SIM_UP, pSegs, segCount);
+}
+
+static int
+simWrite(void *hNet, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    umqtt_Segment_t seg = { pBuf, len };
+    return simWritev(hNet, &seg, 1, isMore);
+}
+
+/**
+ * Create a simulator instance
+ *
+ * @param pConfig the simulator settings
+ *
+ * The virtual clock starts at 0 and the link is open, with the broker
+ * waiting for a CONNECT.
+ *
+ * @return the simulator handle, or NULL if it could not be allocated
+ */
+sim_Handle_t
+sim_New(const sim_Config_t *pConfig)
+{
+    Sim_t *this = calloc(1, sizeof(Sim_t));
+    if (this == NULL)
+    {
+        return NULL;
+    }
+    this->random = pConfig->seed ? pConfig->seed : 1;
+    this->retryTimeout = pConfig->retryTimeout ? pConfig->retryTimeout : 1000;
+    this->maxRetries = pConfig->maxRetries ? pConfig->maxRetries : 10;
+    this->links[SIM_UP].config = pConfig->up;
+    this->links[SIM_DOWN].config = pConfig->down;
+    return this;
+}
+
+/**
+ * Free a simulator instance and everything in it
+ *
+ * @param h the simulator handle
+ */
+void
+sim_Delete(sim_Handle_t h)
+{
+    Sim_t *this = h;
+    if (this)
+    {
+        linkFlush(this);
+        for (uint32_t idx = 0; idx < SIM_MAX_OUTBOUND; idx++)
+        {
+            free(this->outbound[idx].pPkt);
+        }
+        free(this);
+    }
+}
+
+/**
+ * Get the transport to pass to umqtt_New() to connect a client to the
+ * simulated broker
+ *
+ * @param h the simulator handle
+ * @param pTransport storage for the transport functions
+ */
+void
+sim_GetTransport(sim_Handle_t h, umqtt_TransportConfig_t *pTransport)
+{
+    pTransport->hNet = h;
+    pTransport->pfnmalloc = simMalloc;
+    pTransport->pfnfree = simFree;
+    pTransport->pfnNetReadPacket = simRead;
+    pTransport->pfnNetWritePacket = simWrite;
+    pTransport->pfnNetWritevPacket = simWritev;
+}
+
+/**
+ * Get the virtual clock in milliseconds, to pass to umqtt_Run()
+ *
+ * @param h the simulator handle
+ *
+ * @return the virtual tick count
+ */
+uint32_t
+sim_GetTicks(sim_Handle_t h)
+{
+    Sim_t *this = h;
+    return this->ticks;
+}
+
+/**
+ * Move the virtual clock forward
+ *
+ * @param h the simulator handle
+ * @param ms number of milliseconds to move the clock
+ *
+ * For each millisecond, the broker processes the segments that have
+ * arrived, retransmits unacknowledged messages, and closes the
+ * connection if the keep-alive time has run out.  Segments sent to the
+ * client are read by the client in umqtt_Run().
+ */
+void
+sim_Advance(sim_Handle_t h, uint32_t ms)
+{
+    Sim_t *this = h;
+    while (ms--)
+    {
+        ++this->ticks;
+        Segment_t *pSeg;
+        while ((pSeg = linkReceive(this, SIM_UP)) != NULL)
+        {
+            if (!this->closed)
+            {
+                brokerReceive(this, pSeg);
+            }
+            free(pSeg);
+        }
+        if (!this->closed && this->connected)
+        {
+            brokerRetry(this);
+            if (this->keepAlive
+             && ((this->ticks - this->lastRecv) > (this->keepAlive * 1500)))
+            {
+                ++this->stats.keepAliveExpired;
+                this->connected = false;
+                this->closed = true;
+                linkFlush(this);
+            }
+        }
+    }
+}
+
+/**
+ * Check if the broker has a connected client
+ *
+ * @param h the simulator handle
+ *
+ * @return true if the broker has accepted a CONNECT and the connection
+ * has not been closed or disconnected since
+ */
+bool
+sim_IsConnected(sim_Handle_t h)
+{
+    Sim_t *this = h;
+    return this->connected && !this->closed;
+}
+
+/**
+ * Open a new link after the broker closed the connection
+ *
+ * @param h the simulator handle
+ *
+ * Segments still on the link are discarded.  The client must then send a
+ * new CONNECT.  Subscriptions and unacknowledged messages are kept unless
+ * it asks for a clean session.
+ */
+void
+sim_Reconnect(sim_Handle_t h)
+{
+    Sim_t *this = h;
+    linkFlush(this);
+    this->closed = false;
+    this->connected = false;
+    this->links[SIM_UP].busyUntil = this->ticks;
+    this->links[SIM_DOWN].busyUntil = this->ticks;
+}
+
+/**
+ * Get the amount of work the simulator has not finished
+ *
+ * @param h the simulator handle
+ *
+ * @return the number of segments that have not arrived yet in both
+ * directions, plus the number of messages waiting for the client to
+ * acknowledge them
+ */
+uint32_t
+sim_GetPending(sim_Handle_t h)
+{
+    Sim_t *this = h;
+    uint32_t count = 0;
+    for (uint32_t idx = 0; idx < SIM_MAX_OUTBOUND; idx++)
+    {
+        count += this->outbound[idx].pPkt ? 1 : 0;
+    }
+    for (uint32_t dir = 0; dir < 2; dir++)
+    {
+        for (Segment_t *pSeg = this->links[dir].pHead; pSeg; pSeg = pSeg->pNext)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Get a copy of the simulator counters
+ *
+ * @param h the simulator handle
+ * @param pStats storage for the counters
+ */
+void
+sim_GetStats(sim_Handle_t h, sim_Stats_t *pStats)
+{
+    Sim_t *this = h;
+    *pStats = this->stats;
+}
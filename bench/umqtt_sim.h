@@ -0,0 +1,91 @@
+/******************************************************************************
+ * umqtt_sim.h - Simulated MQTT broker and network link for umqtt.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#ifndef __UMQTT_SIM_H__
+#define __UMQTT_SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "umqtt.h"
+
+/**
+ * Simulator instance handle, obtained from sim_New().
+ */
+typedef void * sim_Handle_t;
+
+/**
+ * Settings for one direction of the simulated network link.  Each write
+ * made by the client, and each packet sent by the broker, is carried as
+ * one segment.  A lost segment loses all of the packets in it.
+ */
+typedef struct
+{
+    uint32_t latency;   ///< delay in ms from sending to receiving a segment
+    uint32_t jitter;    ///< most extra random delay in ms, which can reorder segments
+    uint32_t lossPpm;   ///< segments lost, in parts per million
+    uint32_t bandwidth; ///< link speed in bytes per ms, or 0 for unlimited
+} sim_LinkConfig_t;
+
+/**
+ * Simulator settings, passed to sim_New().
+ */
+typedef struct
+{
+    uint32_t seed;          ///< random seed, the same seed gives the same run
+    sim_LinkConfig_t up;    ///< client to broker direction
+    sim_LinkConfig_t down;  ///< broker to client direction
+    uint32_t retryTimeout;  ///< broker retransmit timeout in ms, or 0 for 1000 ms
+    uint32_t maxRetries;    ///< broker retransmits before giving up, or 0 for 10
+} sim_Config_t;
+
+/**
+ * Simulator counters, see sim_GetStats().  The arrays indexed by
+ * direction use 0 for client to broker and 1 for broker to client.  The
+ * per-type arrays are indexed by the MQTT packet type number.
+ */
+typedef struct
+{
+    uint32_t segments[2];   ///< segments sent, by direction
+    uint32_t segmentsLost[2];   ///< segments lost, by direction
+    uint64_t bytes[2];      ///< bytes sent, by direction
+    uint32_t pktsRecv[16];  ///< packets received by the broker, by type
+    uint32_t pktsSent[16];  ///< packets sent by the broker, by type
+    uint32_t published;     ///< messages accepted by the broker
+    uint32_t duplicates;    ///< QoS 2 messages received again and not accepted
+    uint32_t dupFlagged;    ///< received PUBLISH packets with the DUP flag
+    uint32_t delivered;     ///< messages routed to the client
+    uint32_t dropped;       ///< messages for the client that were given up
+    uint32_t keepAliveExpired;  ///< connections closed for keep-alive
+    uint32_t malformed;     ///< malformed packets received by the broker
+} sim_Stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern sim_Handle_t sim_New(const sim_Config_t *pConfig);
+extern void sim_Delete(sim_Handle_t h);
+extern void sim_GetTransport(sim_Handle_t h, umqtt_TransportConfig_t *pTransport);
+extern uint32_t sim_GetTicks(sim_Handle_t h);
+extern void sim_Advance(sim_Handle_t h, uint32_t ms);
+extern bool sim_IsConnected(sim_Handle_t h);
+extern void sim_Reconnect(sim_Handle_t h);
+extern uint32_t sim_GetPending(sim_Handle_t h);
+extern void sim_GetStats(sim_Handle_t h, sim_Stats_t *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,416 @@
+/******************************************************************************
+ * umqtt_simbench.c - End-to-end umqtt tests against a simulated broker.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+/*
+ * Runs a umqtt client against the simulated broker and link in
+ * umqtt_sim.c, on a virtual clock, and reports publish to ack throughput,
+ * retransmit amplification and keep-alive behavior for several link
+ * settings.  The runs are deterministic, so the numbers only change when
+ * the code or the settings change.  The wall time is also reported, as
+ * a measure of the processing cost.
+ *
+ * Usage: umqtt_simbench [-q] [-s seed] [filter]
+ *
+ * -q sends fewer messages, for a quick check that everything works.  If
+ * a filter is given, only the scenarios whose name contains the filter
+ * are run.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "umqtt.h"
+#include "umqtt_sim.h"
+
+// virtual time limit for one run, in ms
+#define SIMBENCH_TIME_LIMIT (30 * 60 * 1000)
+
+/*
+ * Settings from the command line.
+ */
+static uint32_t messageCount = 10000;
+static uint32_t seed = 1;
+static const char *pFilter = NULL;
+
+/*
+ * The simulator used by the tick function.
+ */
+static sim_Handle_t hSim;
+
+/*
+ * Client events counted by the callbacks.
+ */
+static bool connacked;
+static bool subacked;
+static uint32_t networkErrors;
+static uint32_t acked;
+static uint32_t received;
+static uint32_t receivedDup;
+
+/*
+ * Settings of one run.
+ */
+typedef struct
+{
+    sim_LinkConfig_t link;  // used for both directions
+    uint8_t qos;            // QoS of the published messages
+    uint32_t window;        // most messages in flight, 0 for no limit
+    uint32_t payloadLen;    // bytes in each message
+    bool echo;              // subscribe to the published topic
+    uint8_t subQos;         // QoS of the subscription
+} RunParms_t;
+
+static uint32_t
+simTicks(void)
+{
+    return sim_GetTicks(hSim);
+}
+
+static void
+connackCb(umqtt_Handle_t h, void *pUser, bool sessionPresent, uint8_t retCode)
+{
+    (void)h;
+    (void)pUser;
+    (void)sessionPresent;
+    connacked = (retCode == 0);
+}
+
+static void
+publishCb(umqtt_Handle_t h, void *pUser, bool dup, bool retain, uint8_t qos,
+          const char *pTopic, uint16_t topicLen, const uint8_t *pMsg, uint16_t msgLen)
+{
+    (void)h;
+    (void)pUser;
+    (void)retain;
+    (void)qos;
+    (void)pTopic;
+    (void)topicLen;
+    (void)pMsg;
+    (void)msgLen;
+    ++received;
+    receivedDup += dup ? 1 : 0;
+}
+
+static void
+pubackCb(umqtt_Handle_t h, void *pUser, uint16_t pktId)
+{
+    (void)h;
+    (void)pUser;
+    (void)pktId;
+    ++acked;
+}
+
+static void
+subackCb(umqtt_Handle_t h, void *pUser, const uint8_t *retCodes,
+         uint16_t retCount, uint16_t pktId)
+{
+    (void)h;
+    (void)pUser;
+    (void)retCodes;
+    (void)retCount;
+    (void)pktId;
+    subacked = true;
+}
+
+static umqtt_Callbacks_t callbacks =
+{
+    connackCb, publishCb, pubackCb, subackCb, NULL, NULL
+};
+
+/*
+ * Read the monotonic clock in nanoseconds.
+ */
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000U) + ts.tv_nsec;
+}
+
+/*
+ * Run the client and the simulator for one millisecond.  If the
+ * connection was closed or the CONNECT timed out, then connect again.
+ */
+static void
+step(umqtt_Handle_t h, uint16_t keepAlive)
+{
+    umqtt_Error_t err = umqtt_RunBudget(h, sim_GetTicks(hSim), 0, 0, NULL);
+    if (err == UMQTT_ERR_NETWORK)
+    {
+        ++networkErrors;
+        umqtt_Disconnect(h);
+        sim_Reconnect(hSim);
+        umqtt_Connect(h, true, false, 0, keepAlive, "simbench", NULL, NULL, 0, NULL, NULL);
+    }
+    else if ((err == UMQTT_ERR_TIMEOUT)
+          && (umqtt_GetConnectedStatus(h) == UMQTT_ERR_DISCONNECTED))
+    {
+        umqtt_Connect(h, true, false, 0, keepAlive, "simbench", NULL, NULL, 0, NULL, NULL);
+    }
+    sim_Advance(hSim, 1);
+}
+
+/*
+ * Create the simulator and a client, and connect.
+ *
+ * @return the client handle, or NULL if the connection failed
+ */
+static umqtt_Handle_t
+startClient(const RunParms_t *pParms, uint16_t keepAlive)
+{
+    sim_Config_t config;
+    memset(&config, 0, sizeof(config));
+    config.seed = seed;
+    config.up = pParms->link;
+    config.down = pParms->link;
+    hSim = sim_New(&config);
+
+    // umqtt keeps a pointer to the transport, so it must not be on the stack
+    static umqtt_TransportConfig_t transport;
+    sim_GetTransport(hSim, &transport);
+    umqtt_Options_t options;
+    memset(&options, 0, sizeof(options));
+    options.pfnGetTicks = simTicks;
+    options.maxInflight = pParms->window;
+    umqtt_Handle_t h = umqtt_NewWithOptions(&transport, &callbacks, NULL, &options);
+
+    connacked = false;
+    subacked = false;
+    networkErrors = 0;
+    acked = 0;
+    received = 0;
+    receivedDup = 0;
+    umqtt_Connect(h, true, false, 0, keepAlive, "simbench", NULL, NULL, 0, NULL, NULL);
+    while (!connacked && (sim_GetTicks(hSim) < SIMBENCH_TIME_LIMIT))
+    {
+        step(h, keepAlive);
+    }
+    return h;
+}
+
+/*
+ * Disconnect and free the client and the simulator.
+ */
+static void
+stopClient(umqtt_Handle_t h)
+{
+    umqtt_Disconnect(h);
+    umqtt_Delete(h);
+    sim_Delete(hSim);
+    hSim = NULL;
+}
+
+/*
+ * Publish messageCount messages as fast as the window allows, and wait
+ * for all of them to be acknowledged.
+ */
+static void
+runThroughput(const char *name, const RunParms_t *pParms)
+{
+    if (pFilter && !strstr(name, pFilter))
+    {
+        return;
+    }
+
+    static uint8_t payload[65536];
+    uint64_t startNs = nowNs();
+    umqtt_Handle_t h = startClient(pParms, 60);
+    uint32_t startTicks = sim_GetTicks(hSim);
+    if (pParms->echo)
+    {
+        char *topics[1] = { "sim/echo" };
+        uint8_t qoss[1] = { pParms->subQos };
+        umqtt_Subscribe(h, 1, topics, qoss, NULL);
+        while (!subacked && ((sim_GetTicks(hSim) - startTicks) < SIMBENCH_TIME_LIMIT))
+        {
+            step(h, 60);
+        }
+    }
+
+    uint32_t sent = 0;
+    uint32_t expected = pParms->qos ? messageCount : 0;
+    while ((acked < expected) || (sent < messageCount))
+    {
+        uint32_t ticks = sim_GetTicks(hSim);
+        if (ticks - startTicks > SIMBENCH_TIME_LIMIT)
+        {
+            break;
+        }
+        while (sent < messageCount)
+        {
+            umqtt_Error_t err = umqtt_Publish(h, "sim/echo", payload, pParms->payloadLen,
+                                              pParms->qos, false, NULL);
+            if (err != UMQTT_ERR_OK)
+            {
+                break;
+            }
+            ++sent;
+        }
+        step(h, 60);
+    }
+
+    // let the last messages reach the client
+    if (pParms->echo)
+    {
+        for (uint32_t idx = 0; (idx < 60000) && sim_GetPending(hSim); idx++)
+        {
+            step(h, 60);
+        }
+    }
+
+    uint32_t elapsed = sim_GetTicks(hSim) - startTicks;
+    umqtt_Stats_t stats;
+    umqtt_GetStats(h, &stats);
+    sim_Stats_t simStats;
+    sim_GetStats(hSim, &simStats);
+    stopClient(h);
+    uint64_t wallNs = nowNs() - startNs;
+
+    char parms[64];
+    snprintf(parms, sizeof(parms), "qos=%u win=%u len=%u lat=%u loss=%u%%",
+             pParms->qos, pParms->window, pParms->payloadLen,
+             pParms->link.latency, pParms->link.lossPpm / 10000);
+    printf("%-12s %-40s %8u %9.0f %6.2f %7u %7u %6u %8.0f\n", name, parms,
+           acked, elapsed ? ((double)acked * 1000 / elapsed) : 0,
+           (double)stats.pktsSent[3] / messageCount,
+           simStats.published, simStats.duplicates,
+           pParms->echo ? received : 0, (double)wallNs / messageCount);
+}
+
+/*
+ * Stay idle for ten virtual minutes and check that keep-alive pings keep
+ * the connection open.
+ */
+static void
+runKeepAlive(const char *name, const RunParms_t *pParms)
+{
+    if (pFilter && !strstr(name, pFilter))
+    {
+        return;
+    }
+
+    umqtt_Handle_t h = startClient(pParms, 10);
+    uint32_t startTicks = sim_GetTicks(hSim);
+    while ((sim_GetTicks(hSim) - startTicks) < (10 * 60 * 1000))
+    {
+        step(h, 10);
+    }
+
+    umqtt_Stats_t stats;
+    umqtt_GetStats(h, &stats);
+    sim_Stats_t simStats;
+    sim_GetStats(hSim, &simStats);
+    stopClient(h);
+
+    char parms[64];
+    snprintf(parms, sizeof(parms), "keepalive=10s lat=%u loss=%u%%",
+             pParms->link.latency, pParms->link.lossPpm / 10000);
+    printf("%-12s %-40s %8u %9u %6u %7u %7u\n", name, parms,
+           stats.pktsSent[12], stats.pktsRecv[13], simStats.keepAliveExpired,
+           networkErrors, stats.pktsSent[1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            messageCount = 1000;
+        }
+        else if ((strcmp(argv[i], "-s") == 0) && ((i + 1) < argc))
+        {
+            seed = strtoul(argv[++i], NULL, 0);
+        }
+        else
+        {
+            pFilter = argv[i];
+        }
+    }
+
+    printf("%-12s %-40s %8s %9s %6s %7s %7s %6s %8s\n", "scenario", "parameters",
+           "acked", "msg/s", "amp", "brk_pub", "brk_dup", "echo", "ns/msg");
+
+    RunParms_t parms;
+    memset(&parms, 0, sizeof(parms));
+    parms.link.latency = 5;
+    parms.payloadLen = 64;
+
+    // publish to ack throughput on a clean link, by window size
+    static const uint32_t windows[] = { 1, 16, 64, 256 };
+    for (uint32_t qos = 1; qos <= 2; qos++)
+    {
+        for (uint32_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+        {
+            parms.qos = qos;
+            parms.window = windows[i];
+            runThroughput("window", &parms);
+        }
+    }
+
+    // retransmit amplification as the link gets worse
+    static const uint32_t losses[] = { 0, 10000, 50000, 100000, 200000 };
+    parms.link.latency = 10;
+    parms.link.jitter = 5;
+    parms.window = 16;
+    for (uint32_t qos = 1; qos <= 2; qos++)
+    {
+        for (uint32_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++)
+        {
+            parms.qos = qos;
+            parms.link.lossPpm = losses[i];
+            runThroughput("loss", &parms);
+        }
+    }
+
+    // large messages on a slow link, 100 KB/s
+    parms.link.lossPpm = 0;
+    parms.link.bandwidth = 100;
+    parms.qos = 1;
+    parms.payloadLen = 1024;
+    runThroughput("bandwidth", &parms);
+    parms.payloadLen = 16384;
+    runThroughput("bandwidth", &parms);
+
+    // messages routed back to the client over a lossy link
+    parms.link.bandwidth = 0;
+    parms.link.lossPpm = 50000;
+    parms.payloadLen = 64;
+    parms.echo = true;
+    for (uint32_t qos = 0; qos <= 2; qos++)
+    {
+        parms.qos = qos;
+        parms.subQos = qos;
+        runThroughput("echo", &parms);
+    }
+
+    printf("\n%-12s %-40s %8s %9s %6s %7s %7s\n", "scenario", "parameters",
+           "pings", "pingresp", "expire", "neterr", "connect");
+    parms.echo = false;
+    parms.link.jitter = 0;
+    static const uint32_t pingLosses[] = { 0, 100000, 300000 };
+    for (uint32_t i = 0; i < sizeof(pingLosses) / sizeof(pingLosses[0]); i++)
+    {
+        parms.link.lossPpm = pingLosses[i];
+        runKeepAlive("keepalive", &parms);
+    }
+    return 0;
+}
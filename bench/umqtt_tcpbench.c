@@ -0,0 +1,376 @@
+/******************************************************************************
+ * umqtt_tcpbench.c - Publish throughput over loopback TCP.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+/*
+ * Connects one umqtt instance over a loopback TCP socket, using the
+ * reference POSIX transport from umqtt_posix.c, and measures how many
+ * publish packets per second reach the other end.  The broker end of the
+ * socket is served by the benchmark on the same thread: it answers the
+ * CONNECT, counts publish packets and acks the QoS 1 ones.
+ *
+ * Usage: umqtt_tcpbench [-q] [-n messages]
+ *
+ * -q sends fewer messages, for a quick check that everything works.  -n
+ * sets the number of messages sent for each payload size and QoS.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "umqtt.h"
+#include "umqtt_posix.h"
+
+// most QoS 1 publishes waiting for an ack at one time
+#define WINDOW 64
+
+static uint32_t msgCount = 200000;
+
+static umqtt_Handle_t h;
+static umqtt_PosixNet_t hNet;
+static int brokerFd = -1;
+static uint32_t connacks;
+static uint32_t pubacks;
+
+// broker receive state, holding at most one partial packet between reads
+static uint8_t brokerBuf[65536 + 8];
+static uint32_t brokerLen;
+static uint32_t published;
+
+static void
+connackCb(umqtt_Handle_t h, void *pUser, bool sessionPresent, uint8_t retCode)
+{
+    (void)h;
+    (void)pUser;
+    (void)sessionPresent;
+    (void)retCode;
+    ++connacks;
+}
+
+static void
+pubackCb(umqtt_Handle_t h, void *pUser, uint16_t msgId)
+{
+    (void)h;
+    (void)pUser;
+    (void)msgId;
+    ++pubacks;
+}
+
+static umqtt_Callbacks_t callbacks =
+{
+    connackCb, NULL, pubackCb, NULL, NULL, NULL
+};
+
+/*
+ * Read the monotonic clock in nanoseconds.
+ */
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000U) + ts.tv_nsec;
+}
+
+static void
+fail(const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+/*
+ * Write bytes to the broker end of the socket, waiting as needed.
+ */
+static void
+brokerSend(const uint8_t *pBuf, uint32_t len)
+{
+    while (len)
+    {
+        ssize_t sent = send(brokerFd, pBuf, len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            fail("broker send");
+        }
+        pBuf += sent;
+        len -= sent;
+    }
+}
+
+/*
+ * Read whatever the client has sent, and answer each whole packet.  All
+ * the PUBACKs for one read are sent with one write.
+ */
+static void
+brokerPoll(void)
+{
+    ssize_t len = recv(brokerFd, &brokerBuf[brokerLen], sizeof(brokerBuf) - brokerLen,
+                       MSG_DONTWAIT);
+    if (len < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        fail("broker recv");
+    }
+    if (len == 0)
+    {
+        fail("client closed connection");
+    }
+    brokerLen += len;
+
+    uint8_t acks[(sizeof(brokerBuf) / 4) * 4];
+    uint32_t ackLen = 0;
+    uint32_t idx = 0;
+    while (idx + 2 <= brokerLen)
+    {
+        // decode the remaining length, up to the bytes present so far
+        uint32_t remainingLength = 0;
+        uint32_t shift = 0;
+        uint32_t pos = idx + 1;
+        bool isComplete = false;
+        while ((pos < brokerLen) && (shift < 28))
+        {
+            uint8_t b = brokerBuf[pos++];
+            remainingLength |= (uint32_t)(b & 0x7F) << shift;
+            shift += 7;
+            if ((b & 0x80) == 0)
+            {
+                isComplete = true;
+                break;
+            }
+        }
+        if (!isComplete || ((pos + remainingLength) > brokerLen))
+        {
+            break;
+        }
+        if ((pos + remainingLength - idx) > (sizeof(brokerBuf) - 8))
+        {
+            fail("packet size");
+        }
+
+        uint8_t type = brokerBuf[idx] >> 4;
+        if (type == 1)
+        {
+            static const uint8_t connack[4] = { 0x20, 2, 0, 0 };
+            brokerSend(connack, sizeof(connack));
+        }
+        else if (type == 3)
+        {
+            ++published;
+            if (brokerBuf[idx] & 0x06)
+            {
+                // the packet ID follows the topic
+                uint32_t topicLen = (brokerBuf[pos] << 8) | brokerBuf[pos + 1];
+                uint32_t idPos = pos + 2 + topicLen;
+                acks[ackLen++] = 0x40;
+                acks[ackLen++] = 2;
+                acks[ackLen++] = brokerBuf[idPos];
+                acks[ackLen++] = brokerBuf[idPos + 1];
+            }
+        }
+        idx = pos + remainingLength;
+    }
+    memmove(brokerBuf, &brokerBuf[idx], brokerLen - idx);
+    brokerLen -= idx;
+    if (ackLen)
+    {
+        brokerSend(acks, ackLen);
+    }
+}
+
+/*
+ * Let the broker catch up until the transport has no send backlog, so
+ * the next publish can be written.
+ */
+static void
+drainBacklog(void)
+{
+    while (umqtt_PosixGetBacklog(hNet))
+    {
+        brokerPoll();
+        if (umqtt_PosixFlush(hNet) != UMQTT_ERR_OK)
+        {
+            fail("flush");
+        }
+    }
+}
+
+/*
+ * Run the client instance until it has no more incoming packets.
+ */
+static void
+runClient(void)
+{
+    uint32_t count;
+    do
+    {
+        if (umqtt_RunBudget(h, (uint32_t)(nowNs() / 1000000U), 16, 0, &count)
+            != UMQTT_ERR_OK)
+        {
+            fail("umqtt_Run");
+        }
+    } while (count != 0);
+}
+
+/*
+ * Create the listening socket, connect the transport to it and connect
+ * the umqtt instance.
+ */
+static void
+setup(void)
+{
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if ((listenFd < 0)
+     || (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+     || (listen(listenFd, 1) != 0)
+     || (getsockname(listenFd, (struct sockaddr *)&addr, &addrLen) != 0))
+    {
+        fail("listen");
+    }
+    char port[8];
+    snprintf(port, sizeof(port), "%u", ntohs(addr.sin_port));
+
+    hNet = umqtt_PosixNew(NULL);
+    if (hNet == NULL)
+    {
+        fail("umqtt_PosixNew");
+    }
+    umqtt_Error_t err = umqtt_PosixConnect(hNet, "127.0.0.1", port);
+    brokerFd = accept(listenFd, NULL, NULL);
+    close(listenFd);
+    if (brokerFd < 0)
+    {
+        fail("accept");
+    }
+    int one = 1;
+    setsockopt(brokerFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    while (err == UMQTT_ERR_CONNECT_PENDING)
+    {
+        err = umqtt_PosixCheckConnect(hNet, 1000);
+    }
+    if (err != UMQTT_ERR_OK)
+    {
+        fail("umqtt_PosixConnect");
+    }
+
+    // the transport config must live as long as the instance
+    static umqtt_TransportConfig_t transport;
+    umqtt_PosixGetTransport(hNet, &transport);
+    h = umqtt_New(&transport, &callbacks, NULL);
+    if ((h == NULL)
+     || (umqtt_Connect(h, true, false, 0, 600, "bench", NULL, NULL, 0, NULL, NULL)
+         != UMQTT_ERR_OK))
+    {
+        fail("umqtt_Connect");
+    }
+    while (connacks == 0)
+    {
+        brokerPoll();
+        runClient();
+    }
+}
+
+/*
+ * Publish _msgCount_ messages of one size and QoS, and print the rate.
+ */
+static void
+runCase(uint32_t payloadLen, uint32_t qos)
+{
+    static uint8_t payload[4096];
+    uint32_t startPublished = published;
+    uint32_t startPubacks = pubacks;
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < msgCount; i++)
+    {
+        // a retransmit can be acked twice, so the count can run ahead
+        while (qos && ((int32_t)(i - (pubacks - startPubacks)) >= WINDOW))
+        {
+            brokerPoll();
+            runClient();
+        }
+        drainBacklog();
+        if (umqtt_Publish(h, "bench/tcp", payload, payloadLen, qos, false, NULL)
+            != UMQTT_ERR_OK)
+        {
+            fail("umqtt_Publish");
+        }
+        if ((i % 32) == 31)
+        {
+            brokerPoll();
+            runClient();
+        }
+    }
+    umqtt_Stats_t stats;
+    do
+    {
+        umqtt_PosixFlush(hNet);
+        brokerPoll();
+        runClient();
+        umqtt_GetStats(h, &stats);
+    } while (((published - startPublished) < msgCount) || (stats.inflight != 0));
+    uint64_t elapsed = nowNs() - start;
+
+    double seconds = (double)elapsed / 1e9;
+    printf("%-8u %4u %10u %14.0f %10.1f\n", payloadLen, qos, msgCount,
+           msgCount / seconds, ((double)msgCount * payloadLen) / seconds / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            msgCount = 5000;
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && ((i + 1) < argc))
+        {
+            msgCount = strtoul(argv[++i], NULL, 0);
+        }
+    }
+
+    setup();
+
+    printf("%-8s %4s %10s %14s %10s\n", "payload", "qos", "messages",
+           "messages/s", "MB/s");
+    static const uint32_t sizes[] = { 16, 256, 4096 };
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        runCase(sizes[s], 0);
+        runCase(sizes[s], 1);
+    }
+
+    umqtt_Delete(h);
+    umqtt_PosixDelete(hNet);
+    close(brokerFd);
+    return 0;
+}
@@ -0,0 +1,430 @@
+/******************************************************************************
+ * umqtt_uringbench.c - Many TCP connections with the POSIX and io_uring
+ *                      transports.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+/*
+ * Connects many umqtt instances over loopback TCP and runs them from one
+ * umqtt_Loop event loop, first with the transport from umqtt_posix.c and
+ * then with the io_uring transport from umqtt_uring.c.  In each round the
+ * broker end of every connection, which is served directly by the
+ * benchmark, sends a burst of QoS 1 publish packets.  The time measured
+ * is the time taken by the loop to receive all of them and to send all of
+ * the PUBACKs.  The io_uring part is skipped if the kernel does not have
+ * io_uring.  Before the io_uring is deleted, the broker ends of half of
+ * its connections are closed, so that deleting it also covers
+ * connections that have already seen the peer go away.
+ *
+ * Usage: umqtt_uringbench [-q] [-n connections]
+ *
+ * -q uses fewer connections and rounds, for a quick check that everything
+ * works.  -n sets the number of connections, each of which uses two file
+ * descriptors.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "umqtt.h"
+#include "umqtt_loop.h"
+#include "umqtt_posix.h"
+#include "umqtt_uring.h"
+
+// most publish packets sent to one connection in a round
+#define MAX_BURST 16
+
+/*
+ * One client instance and its connection.
+ */
+typedef struct
+{
+    umqtt_Handle_t h;
+    umqtt_TransportConfig_t transport;  // must live as long as the instance
+    umqtt_PosixNet_t hNet;              // POSIX transport, or NULL
+    umqtt_UringConn_t hConn;            // io_uring connection, or NULL
+    int brokerFd;       // broker end, served by the benchmark
+} Client_t;
+
+/*
+ * Benchmark settings from the command line.
+ */
+static uint32_t clientCount = 2000;
+static uint32_t roundCount = 100;
+
+static Client_t *pClients;
+static uint64_t connacks;
+static uint64_t delivered;
+static bool peersClosed;        // network errors are expected
+static uint32_t disconnects;    // network errors seen while peersClosed
+
+static void
+connackCb(umqtt_Handle_t h, void *pUser, bool sessionPresent, uint8_t retCode)
+{
+    (void)h;
+    (void)pUser;
+    (void)sessionPresent;
+    (void)retCode;
+    ++connacks;
+}
+
+static void
+publishCb(umqtt_Handle_t h, void *pUser, bool dup, bool retain, uint8_t qos,
+          const char *pTopic, uint16_t topicLen, const uint8_t *pMsg,
+          uint16_t msgLen)
+{
+    (void)h;
+    (void)pUser;
+    (void)dup;
+    (void)retain;
+    (void)qos;
+    (void)pTopic;
+    (void)topicLen;
+    (void)pMsg;
+    (void)msgLen;
+    ++delivered;
+}
+
+static umqtt_Callbacks_t callbacks =
+{
+    connackCb, publishCb, NULL, NULL, NULL, NULL
+};
+
+static void
+loopErrorCb(umqtt_Loop_t hLoop, umqtt_Handle_t h, void *pUser, umqtt_Error_t err)
+{
+    (void)hLoop;
+    (void)h;
+    (void)pUser;
+    if (peersClosed && (err == UMQTT_ERR_NETWORK))
+    {
+        ++disconnects;
+        return;
+    }
+    fprintf(stderr, "instance error: %s\n", umqtt_GetErrorString(err));
+    exit(1);
+}
+
+/*
+ * Read the monotonic clock in nanoseconds.
+ */
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000U) + ts.tv_nsec;
+}
+
+static void
+fail(const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+/*
+ * Write bytes to the broker end of a connection.
+ */
+static void
+brokerSend(Client_t *pClient, const uint8_t *pBuf, uint32_t len)
+{
+    if (send(pClient->brokerFd, pBuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        fail("broker send");
+    }
+}
+
+/*
+ * Read exactly _len_ bytes from the broker end of a connection.
+ */
+static void
+brokerRecv(Client_t *pClient, uint8_t *pBuf, uint32_t len)
+{
+    if (recv(pClient->brokerFd, pBuf, len, MSG_WAITALL) != (ssize_t)len)
+    {
+        fail("broker recv");
+    }
+}
+
+/*
+ * Create the clients, each with its own loopback TCP connection, add them
+ * to the loop and connect them.  The clients use the io_uring if _hRing_
+ * is not NULL, and the POSIX transport otherwise.
+ */
+static void
+connectClients(umqtt_Loop_t hLoop, umqtt_Uring_t hRing)
+{
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if ((listenFd < 0)
+     || (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+     || (listen(listenFd, 128) != 0)
+     || (getsockname(listenFd, (struct sockaddr *)&addr, &addrLen) != 0))
+    {
+        fail("listen");
+    }
+
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        Client_t *pClient = &pClients[i];
+        memset(pClient, 0, sizeof(*pClient));
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if ((fd < 0) || (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0))
+        {
+            fail("connect");
+        }
+        pClient->brokerFd = accept(listenFd, NULL, NULL);
+        if (pClient->brokerFd < 0)
+        {
+            fail("accept");
+        }
+
+        umqtt_Error_t err;
+        if (hRing)
+        {
+            pClient->hConn = umqtt_UringAttach(hRing, fd);
+            if (pClient->hConn == NULL)
+            {
+                fail("umqtt_UringAttach");
+            }
+            umqtt_UringGetTransport(pClient->hConn, &pClient->transport);
+            pClient->h = umqtt_New(&pClient->transport, &callbacks, NULL);
+            err = pClient->h ? umqtt_UringAdd(pClient->hConn, pClient->h, pClient)
+                             : UMQTT_ERR_BUFSIZE;
+        }
+        else
+        {
+            pClient->hNet = umqtt_PosixNew(NULL);
+            if ((pClient->hNet == NULL)
+             || (umqtt_PosixAttach(pClient->hNet, fd) != UMQTT_ERR_OK))
+            {
+                fail("umqtt_PosixAttach");
+            }
+            umqtt_PosixGetTransport(pClient->hNet, &pClient->transport);
+            pClient->h = umqtt_New(&pClient->transport, &callbacks, NULL);
+            err = pClient->h ? umqtt_LoopAdd(hLoop, pClient->h, fd, pClient)
+                             : UMQTT_ERR_BUFSIZE;
+        }
+        // run the instance once so the CONNECT is timed from now
+        if ((err != UMQTT_ERR_OK)
+         || (umqtt_Run(pClient->h, umqtt_LoopGetTicks(hLoop)) != UMQTT_ERR_OK)
+         || (umqtt_Connect(pClient->h, true, false, 0, 600, "bench",
+                           NULL, NULL, 0, NULL, NULL) != UMQTT_ERR_OK))
+        {
+            fprintf(stderr, "unable to set up client %u\n", i);
+            exit(1);
+        }
+        umqtt_LoopUpdate(hLoop, pClient->h);
+    }
+    close(listenFd);
+    if (hRing && (umqtt_UringSubmit(hRing) != UMQTT_ERR_OK))
+    {
+        fail("umqtt_UringSubmit");
+    }
+
+    // throw away each CONNECT and answer it
+    static const uint8_t connack[4] = { 0x20, 2, 0, 0 };
+    uint8_t discard[128];
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        brokerRecv(&pClients[i], discard, 2);
+        brokerRecv(&pClients[i], discard, discard[1]);
+        brokerSend(&pClients[i], connack, sizeof(connack));
+    }
+    while (connacks < clientCount)
+    {
+        umqtt_LoopRun(hLoop, 100, NULL);
+    }
+}
+
+/*
+ * Send _burst_ QoS 1 publish packets to every client, in one write for
+ * each client, then run the loop until all of them are received and
+ * acked.  Returns the time taken by the loop.
+ */
+static uint64_t
+runRound(umqtt_Loop_t hLoop, umqtt_Uring_t hRing, uint32_t burst)
+{
+    static uint16_t msgId;
+    uint8_t publish[MAX_BURST * 15];
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < burst; i++)
+    {
+        static const uint8_t header[] = { 0x32, 13, 0, 3, 'a', '/', 'b' };
+        static const uint8_t payload[] = { 1, 2, 3, 4, 5, 6 };
+        msgId = (msgId % 0xFFFF) + 1;
+        memcpy(&publish[len], header, sizeof(header));
+        len += sizeof(header);
+        publish[len++] = msgId >> 8;
+        publish[len++] = msgId & 0xFF;
+        memcpy(&publish[len], payload, sizeof(payload));
+        len += sizeof(payload);
+    }
+    uint64_t expected = delivered + ((uint64_t)clientCount * burst);
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        brokerSend(&pClients[i], publish, len);
+    }
+
+    uint64_t start = nowNs();
+    while (delivered < expected)
+    {
+        umqtt_LoopRun(hLoop, 100, NULL);
+    }
+    if (hRing && (umqtt_UringSubmit(hRing) != UMQTT_ERR_OK))
+    {
+        fail("umqtt_UringSubmit");
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    // check the PUBACKs
+    uint8_t acks[MAX_BURST * 4];
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        brokerRecv(&pClients[i], acks, burst * 4);
+        for (uint32_t j = 0; j < burst; j++)
+        {
+            if (acks[j * 4] != 0x40)
+            {
+                fail("puback");
+            }
+        }
+    }
+    return elapsed;
+}
+
+/*
+ * Connect the clients with one transport, time the rounds for each burst
+ * size and print the rates, then close the clients.
+ */
+static void
+runCase(bool useUring)
+{
+    umqtt_LoopOptions_t loopOptions;
+    memset(&loopOptions, 0, sizeof(loopOptions));
+    loopOptions.errorCb = loopErrorCb;
+    umqtt_Loop_t hLoop = umqtt_LoopNew(&loopOptions);
+    if (hLoop == NULL)
+    {
+        fail("umqtt_LoopNew");
+    }
+    umqtt_Uring_t hRing = NULL;
+    if (useUring)
+    {
+        hRing = umqtt_UringNew(hLoop, NULL);
+        if (hRing == NULL)
+        {
+            printf("%-10s io_uring is not available\n", "io_uring");
+            umqtt_LoopDelete(hLoop);
+            return;
+        }
+    }
+    connacks = 0;
+    connectClients(hLoop, hRing);
+
+    static const uint32_t bursts[] = { 1, 4, MAX_BURST };
+    for (uint32_t b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++)
+    {
+        uint64_t ns = 0;
+        for (uint32_t r = 0; r < roundCount; r++)
+        {
+            ns += runRound(hLoop, hRing, bursts[b]);
+        }
+        double messages = (double)clientCount * bursts[b] * roundCount;
+        printf("%-10s %12u %6u %14.0f %14.0f\n", useUring ? "io_uring" : "posix",
+               clientCount, bursts[b], (double)ns / messages,
+               messages / ((double)ns / 1e9));
+    }
+
+    // close the broker end of every other connection, and wait until the
+    // loop sees them go away
+    if (hRing)
+    {
+        uint32_t closed = 0;
+        peersClosed = true;
+        disconnects = 0;
+        for (uint32_t i = 0; i < clientCount; i += 2)
+        {
+            close(pClients[i].brokerFd);
+            pClients[i].brokerFd = -1;
+            ++closed;
+        }
+        while (disconnects < closed)
+        {
+            umqtt_LoopRun(hLoop, 100, NULL);
+        }
+        peersClosed = false;
+    }
+
+    // deleting the io_uring closes all of its connections
+    umqtt_UringDelete(hRing);
+    for (uint32_t i = 0; i < clientCount; i++)
+    {
+        if (pClients[i].hNet)
+        {
+            umqtt_LoopRemove(hLoop, pClients[i].h);
+            umqtt_PosixDelete(pClients[i].hNet);
+        }
+        umqtt_Delete(pClients[i].h);
+        if (pClients[i].brokerFd >= 0)
+        {
+            close(pClients[i].brokerFd);
+        }
+    }
+    umqtt_LoopDelete(hLoop);
+}
+
+int
+main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            clientCount = 200;
+            roundCount = 10;
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && ((i + 1) < argc))
+        {
+            clientCount = strtoul(argv[++i], NULL, 0);
+        }
+    }
+
+    pClients = calloc(clientCount, sizeof(Client_t));
+    if (pClients == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%-10s %12s %6s %14s %14s\n", "transport", "connections", "burst",
+           "ns/message", "messages/s");
+    runCase(false);
+    runCase(true);
+
+    free(pClients);
+    return 0;
+}
@@ -29,15 +29,32 @@
  * Function Name              | Description
  * ---------------------------|------------
  * umqtt_New()                | Create and initialize umqtt instance
+ * umqtt_NewWithOptions()     | Create umqtt instance with optional settings
+ * umqtt_NewStatic()          | Create umqtt instance in caller supplied memory
  * umqtt_Delete()             | de-initialize umqtt instace (frees resources)
  * umqtt_Run()                | main run loop
+ * umqtt_RunBudget()          | main run loop, processing many incoming packets
+ * umqtt_GetNextDeadline()    | get the ticks when umqtt_Run() next has work
  * umqtt_Connect()            | establish protocol connection to MQTT broker
  * umqtt_Disconnect()         | protocol disconnect from MQTT broker
  * umqtt_Publish()            | publish a topic
+ * umqtt_RegisterTopic()      | prepare a topic for repeated publishing
+ * umqtt_UnregisterTopic()    | free a registered topic
+ * umqtt_PublishTopic()       | publish a registered topic
+ * umqtt_NewTemplate()        | prepare a publish packet for repeated use
+ * umqtt_DeleteTemplate()     | free a publish template
+ * umqtt_PublishTemplate()    | publish from a template
+ * umqtt_PublishBatch()       | publish many topics with one network write
  * umqtt_Subscribe()          | subscribe to topic(s)
+ * umqtt_SubscribeHandler()   | subscribe to topic(s) with a message handler
  * umqtt_Unsubscribe()        | unsubscribe from topic(s)
  * umqtt_GetErrorString()     | get string representation of error code
  * umqtt_GetConnectedStatus() | determine if connected
+ * umqtt_GetNetBacklog()      | get the bytes the transport holds for sending
+ * umqtt_GetPoolStats()       | get packet buffer pool counters
+ * umqtt_GetStats()           | get instance performance counters
+ * umqtt_ResetStats()         | clear instance performance counters
+ * umqtt_LatencyPercentile()  | get a percentile from a latency histogram
  *
  * The following are available but you don't need to call these directly,
  * they are called from umqtt_Run() when needed.
@@ -46,6 +63,8 @@
  * ---------------------------|------------
  * umqtt_PingReq()            | send ping request to MQTT broker
  * umqtt_DecodePacket()       | decode a MQTT packet and perform actions
+ * umqtt_Feed()               | split a byte stream into packets and decode them
+ * umqtt_FlushAcks()          | write collected acknowledgments to the network
  *
  * Functions you must implement
  * ----------------------------
@@ -59,6 +78,10 @@
  * netReadPacket_t()  | read a packet from the network
  * netWritePacket_t() | write a packet to the network
  *
+ * The transport can also provide netWritevPacket_t() to write a packet that
+ * is spread over several buffers.  This is optional, but lets umqtt send
+ * publish payloads without copying them.
+ *
  * Optional functions to implement
  * -------------------------------
  * These callback functions are used to notify the application when certain
@@ -69,7 +92,7 @@
  * Function Name  | Description
  * ---------------|------------
  * ConnackCb_t()  | CONNACK received from broker to acknowledge a CONNECT
- * PublishCb_t()  | PUBLISH received from broker
+ * PublishCb_t()  | PUBLISH received from broker, if no topic handler matched
  * PubackCb_t()   | PUBACK received from broker in response to PUBLISH with QoS != 0
  * SubackCb_t()   | SUBACK received in response to SUBSCRIBE
  * UnsubackCb_t() | UNSUBACK received in response to UNSUBSCRIBE
@@ -86,7 +109,9 @@
  * Not thread safe
  * ---------------
  * These functions are not thread safe.  You musn't call them from different
- * threads unless you provide your own resource lock wrapper(s).
+ * threads unless you provide your own resource lock wrapper(s).  The one
+ * exception is umqtt_GetStats(), which can be called from a monitoring
+ * thread while another thread runs the client.
  *
  */
 
@@ -97,6 +122,9 @@
 #define UMQTT_TYPE_CONNACK 2
 #define UMQTT_TYPE_PUBLISH 3
 #define UMQTT_TYPE_PUBACK 4
+#define UMQTT_TYPE_PUBREC 5
+#define UMQTT_TYPE_PUBREL 6
+#define UMQTT_TYPE_PUBCOMP 7
 #define UMQTT_TYPE_SUBSCRIBE 8
 #define UMQTT_TYPE_SUBACK 9
 #define UMQTT_TYPE_UNSUBSCRIBE 10
@@ -125,14 +153,126 @@
 #define UMQTT_CONNECT_FLAG_QOS_SHIFT 3
 
 /*
- * Defines the retry timeout and number of retries before giving up.
+ * Defines the default retry timeouts and number of retries before giving
+ * up.  The retry timeout adapts to the measured round trip time, within
+ * the minimum and maximum.  UMQTT_RETRY_TIMEOUT is used until the first
+ * round trip is measured.
  */
 #define UMQTT_RETRY_TIMEOUT 5000
+#define UMQTT_RETRY_TIMEOUT_MIN 200
+#define UMQTT_RETRY_TIMEOUT_MAX 60000
 #define UMQTT_RETRIES 10
 
+/*
+ * Initial number of slots in the pending packet index.  The index is
+ * doubled whenever it would become more than half full.  Must be a power
+ * of 2.
+ */
+#define UMQTT_PKT_INDEX_MIN 16
+
+/*
+ * Retry timer wheel.  Pending packets are kept in one of UMQTT_TIMER_SLOTS
+ * lists according to when they time out, each list covering a span of
+ * UMQTT_TIMER_RESOLUTION milliseconds, so one turn of the wheel covers
+ * UMQTT_TIMER_SPAN milliseconds.  Packets that time out on a later turn
+ * are kept on a second wheel with one slot per turn of the first, about
+ * two minutes in all, and are moved to the first wheel when their turn
+ * starts.  A timeout is detected at most one resolution period late.  The
+ * resolution must be a power of 2, and there must be 64 slots, one for
+ * each bit of the mask of slots in use.
+ */
+#define UMQTT_TIMER_SLOTS 64
+#define UMQTT_TIMER_RESOLUTION 32
+#define UMQTT_TIMER_SPAN (UMQTT_TIMER_SLOTS * UMQTT_TIMER_RESOLUTION)
+
+/*
+ * Number of trailing zero bits of a 64-bit value that is not 0, used to
+ * find the next timer wheel slot in use.
+ */
+#if defined(__GNUC__)
+#define UMQTT_CTZ64(x) ((uint32_t)__builtin_ctzll(x))
+#else
+#define UMQTT_CTZ64(x) ctz64(x)
+#endif
+
+/*
+ * Packet buffer pool size classes.  Class n holds buffers of
+ * UMQTT_POOL_MIN_BLOCK << n bytes, including the internal packet header.
+ * Larger packets always use the application allocator.
+ */
+#define UMQTT_POOL_CLASSES 5
+#define UMQTT_POOL_MIN_BLOCK 128
+#define UMQTT_POOL_NONE 0xFF
+#define UMQTT_POOL_RING 0xFE
+
+/*
+ * Size classes for memory taken from the region of a static instance, see
+ * umqtt_NewStatic().  Class n holds blocks of UMQTT_STATIC_MIN_BLOCK << n
+ * bytes, including the block header.  Everything taken from the region is
+ * aligned to UMQTT_STATIC_ALIGN bytes.
+ */
+#define UMQTT_STATIC_CLASSES 16
+#define UMQTT_STATIC_MIN_BLOCK 32
+#define UMQTT_STATIC_ALIGN 8
+
+/*
+ * Number of packets that can wait for an ack on a static instance, if
+ * the _maxInflight_ option is not set.
+ */
+#define UMQTT_STATIC_INFLIGHT 16
+
+/*
+ * Size in bytes of the bitmap that holds one bit for each packet ID of
+ * received QoS 2 publish packets that have not been released yet.
+ */
+#define UMQTT_QOS2_BITMAP_SIZE (65536 / 8)
+
+/*
+ * Most buffers passed to one network write by umqtt_PublishBatch().  A
+ * bigger batch is written with several calls.
+ */
+#define UMQTT_BATCH_SEGMENTS 16
+
+/*
+ * Packet decode rules for a remaining length of at least _n_ bytes, and
+ * of exactly _n_ bytes.
+ */
+#define UMQTT_RULE_MIN(n) { (n), UMQTT_MAX_REMAINING_LENGTH - (n) + 1 }
+#define UMQTT_RULE_EXACT(n) { (n), 1 }
+
+/*
+ * Memory barrier used to publish the statistics snapshot to other
+ * threads.  Define this before building if your compiler is not gcc
+ * compatible and umqtt_GetStats() is called from another thread.
+ */
+#ifndef UMQTT_MEMORY_BARRIER
+#if defined(__GNUC__)
+#define UMQTT_MEMORY_BARRIER() __sync_synchronize()
+#else
+#define UMQTT_MEMORY_BARRIER() do{}while(0)
+#endif
+#endif
+
+/*
+ * Vector code for topic validation.  On x86 with gcc or clang, SSE2 is
+ * used if the build targets it, and AVX2 is used if the processor has it.
+ * Define UMQTT_NO_SIMD before building to use only the portable code.
+ */
+#if !defined(UMQTT_NO_SIMD) && defined(__GNUC__) \
+ && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define UMQTT_SIMD_AVX2 1
+#if defined(__SSE2__)
+#define UMQTT_SIMD_SSE2 1
+#endif
+#endif
+
 // error handling convenience
 #define RETURN_IF_ERR(c,e) do{if(c){return (e);}}while(0)
 
+// largest value that can be encoded in the remaining length field
+#define UMQTT_MAX_REMAINING_LENGTH 268435455
+
 /*
  * Provide names for all error codes for debug convenience.
  */
@@ -147,6 +287,7 @@ static const char *errCodeStrings[] =
     "UMQTT_ERR_CONNECTED",
     "UMQTT_ERR_DISCONNECTED",
     "UMQTT_ERR_TIMEOUT",
+    "UMQTT_ERR_WOULDBLOCK",
 };
 
 /*
@@ -158,11 +299,129 @@ static const char *errCodeStrings[] =
 typedef struct PktBuf
 {
     struct PktBuf *next;    // next packet in a list
+    struct PktBuf *prev;    // previous packet in a list
     uint16_t packetId;      // packet ID of this packet
     uint32_t ticks;         // ticks when this packet was last sent
+    uint32_t sentTicks;     // ticks when this packet was first sent
+    uint32_t deadline;      // ticks when this packet times out
     unsigned int ttl;       // time-to-live, remaining retries
+    uint8_t poolClass;      // pool size class, UMQTT_POOL_RING or UMQTT_POOL_NONE
+    uint32_t windowBytes;   // bytes counted in the in-flight window, or 0
+    uint8_t timerWheel;     // timer wheel holding this packet, 0 or 1
+    uint8_t timerSlot;      // slot of the timer wheel holding this packet
+    struct PktBuf *timerNext;   // next packet in the same timer slot
+    struct PktBuf **timerPrev;  // link pointing at this packet in timer slot
 } PktBuf_t;
 
+/*
+ * Header in front of each block of memory that is allocated from the region
+ * of a static instance.  It holds the size class while the block is in use,
+ * and links the block into the free list of its class while it is free.
+ */
+typedef union MemHdr
+{
+    uint32_t sizeClass;     // size class of a block in use
+    union MemHdr *next;     // next free block of the same class
+    uint64_t align;         // keeps the memory after the header aligned
+} MemHdr_t;
+
+/*
+ * Header in front of each entry in the packet ring.  Entries are a
+ * multiple of 8 bytes long so the packet header after this one stays
+ * aligned.
+ */
+typedef struct
+{
+    uint32_t size;          // bytes in the entry, including this header
+    uint32_t isFree;        // entry was released, or pads the end of the ring
+} RingEntry_t;
+
+/*
+ * Handler registered for a topic filter in the subscription trie.
+ */
+typedef struct HandlerEntry
+{
+    struct HandlerEntry *next;  // next handler for the same filter
+    TopicHandler_t pfnHandler;  // handler function, NULL if being removed
+    void *pUser;                // user data for the handler
+    bool isNew;                 // added by a subscribe that is not done yet
+} HandlerEntry_t;
+
+/*
+ * Node of the subscription trie.  Each node is one level of the topic
+ * filters.  Plain child levels are kept in a hash table, and the wildcard
+ * child levels have their own links.
+ */
+typedef struct TopicNode
+{
+    struct TopicNode *next;         // next node in the same hash chain
+    struct TopicNode *parent;       // parent level, NULL for the root
+    struct TopicNode **children;    // hash table of plain child levels
+    uint32_t childSlots;            // size of the hash table (power of 2)
+    uint32_t childCount;            // number of plain child levels
+    struct TopicNode *plus;         // '+' child level
+    struct TopicNode *hash;         // '#' child level
+    HandlerEntry_t *handlers;       // handlers for filters ending here
+    uint32_t levelHash;             // hash of the level name
+    uint16_t levelLen;              // length of the level name
+    char level[];                   // level name, not null terminated
+} TopicNode_t;
+
+/*
+ * A registered publish topic.  The topic is kept encoded the same way as
+ * in a publish packet, with the length first.
+ */
+typedef struct RegTopic
+{
+    struct RegTopic *next;  // next registered topic of the instance
+    uint16_t topicLen;      // number of bytes in the topic name
+    uint8_t field[];        // topic length and name, as encoded in a packet
+} RegTopic_t;
+
+/*
+ * A publish template.  Everything in the packet in front of the payload
+ * is built ahead of time, leaving room for the packet ID.
+ */
+typedef struct PubTemplate
+{
+    struct PubTemplate *next;   // next template of the instance
+    uint32_t payloadLen;        // payload length of every publish
+    uint32_t pktLen;            // total length of each packet
+    uint32_t prefixLen;         // number of bytes in front of the payload
+    uint8_t qos;                // QoS of the packets
+    uint8_t prefix[];           // fixed header, topic and packet ID space
+} PubTemplate_t;
+
+/*
+ * Function that finds the length of the plain ASCII run at the start of
+ * a topic, see topicSpanScalar().
+ */
+typedef size_t (*TopicSpan_t)(const uint8_t *pTopic, size_t len, bool isName);
+
+/*
+ * Decode rule for one value of the first byte of an incoming packet.
+ */
+typedef struct
+{
+    uint32_t minLen;        // shortest remaining length
+    uint32_t lenSpan;       // number of remaining lengths from minLen up,
+                            // 0 if the packet can not be received
+} PacketRule_t;
+
+/*
+ * A received publish message, as passed to the topic handlers.
+ */
+typedef struct
+{
+    bool dup;
+    bool retain;
+    uint8_t qos;
+    const char *pTopic;
+    uint16_t topicLen;
+    const uint8_t *pPayload;
+    uint32_t payloadLen;
+} TopicMsg_t;
+
 /*
  * umqtt instance data structure.  This is allocated and populated when
  * the client calls "New"
@@ -174,689 +433,3862 @@ typedef struct
     uint16_t packetId;      // last used packet ID on this instance
     void *pUser;            // caller supplied data pointer
     struct PktBuf pktList;  // pending packet list
+    PktBuf_t **pktIndex;    // pending packets indexed by packet ID
+    uint32_t pktIndexSize;  // number of slots in the index (power of 2)
+    uint32_t pktIndexCount; // number of packets in the index
+    uint32_t pktIndexProbe; // longest distance of a packet from its home slot
+    PktBuf_t *timerSlots[2][UMQTT_TIMER_SLOTS]; // retry timer wheels
+    uint64_t timerMask[2];  // slots of each timer wheel that hold packets
+    uint32_t timerMin[UMQTT_TIMER_SLOTS];   // earliest expiry in each slot
+                                            // of the second wheel
+    uint32_t timerNext;     // start ticks of the next timer slot to expire
+    uint32_t timerCount;    // number of packets on the timer wheel
     uint32_t ticks;         // ticks when run was last called
+    bool hasRun;            // run has been called at least once
     uint32_t pingTicks;     // ticks when last ping request was sent
+    uint32_t pingSentTicks; // precise ticks of the ping, for latency
+    bool pingIsPending;     // ping request sent but waiting for response
     bool isConnected;       // this client instance is protocol-connected
     bool connectIsPending;  // connect req was send but waiting for ack
     uint16_t keepAlive;     // keep alive interval in seconds
     umqtt_TransportConfig_t *pNet;  // network instance
     umqtt_Callbacks_t *pCb; // pointer to callbacks
+    bool usePool;           // packet buffers come from the pool
+    PktBuf_t *poolFree[UMQTT_POOL_CLASSES]; // pool free lists
+    umqtt_PoolStats_t poolStats;    // pool counters
+    bool isStatic;          // memory comes from a caller supplied region
+    uint8_t *pRegion;       // start of the unused part of the region
+    size_t regionLeft;      // bytes in the unused part of the region
+    MemHdr_t *memFree[UMQTT_STATIC_CLASSES];    // region free lists
+    uint8_t *pRing;         // packet ring, or NULL if not used
+    uint32_t ringSize;      // bytes in the packet ring
+    uint32_t ringHead;      // offset of the oldest entry in the ring
+    uint32_t ringTail;      // offset where the next entry goes
+    uint32_t ringUsed;      // bytes from head to tail, including released entries
+    bool streamInput;       // network reads return a byte stream
+    uint32_t maxPacketLen;  // largest packet accepted from the stream
+    uint8_t frameHdr[5];    // fixed header of next packet from the stream
+    uint8_t frameHdrCount;  // number of bytes in frameHdr
+    uint8_t *pFrame;        // packet being assembled from the stream
+    uint32_t frameLen;      // total length of the packet being assembled
+    uint32_t frameCount;    // number of bytes assembled so far
+    uint32_t decodeCount;   // number of packets passed to the decoder
+    getTicks_t pfnGetTicks; // application tick count function
+    uint32_t maxInflight;   // limit of publish packets in flight
+    uint32_t maxInflightBytes;  // limit of publish bytes in flight
+    uint32_t inflight;      // publish packets in flight
+    uint32_t inflightBytes; // publish bytes in flight
+    uint32_t minRto;        // shortest retransmit timeout
+    uint32_t maxRto;        // longest retransmit timeout
+    uint32_t initialRto;    // retransmit timeout before any round trip
+    uint16_t maxRetries;    // retransmits before a packet times out
+    uint32_t srtt;          // smoothed round trip time, scaled by 8
+    uint32_t rttvar;        // round trip time variation, scaled by 4
+    uint32_t rto;           // current retransmit timeout
+    uint32_t jitterSeed;    // random state for retransmit jitter
+    TopicNode_t *pTopicRoot;    // subscription trie
+    uint8_t topicDispatching;   // publish is being passed to handlers
+    bool topicSweepPending;     // handlers were removed during dispatch
+    RegTopic_t *pRegTopics;     // topics registered for publishing
+    PubTemplate_t *pTemplates;  // publish templates
+    uint8_t *pQos2Ids;      // bitmap of received QoS 2 packet IDs not released
+    uint8_t *pAckBuf;       // acknowledgments collected for one write
+    uint32_t ackBufLen;     // size of the ack buffer, or 0 if not used
+    uint32_t ackLen;        // number of bytes in the ack buffer
+    uint32_t ackTicks;      // ticks when the oldest collected ack was added
+    uint32_t ackDelay;      // longest time an ack is collected, or 0
+    TopicSpan_t pfnTopicSpan;   // topic scanner, NULL if topics are not checked
+    umqtt_Stats_t stats;    // performance counters
+    umqtt_Stats_t statsSnapshot;    // counters as last published
+    volatile uint32_t statsSeq;     // odd while the snapshot is updated
+    bool statsDirty;        // counters changed since they were published
 } umqtt_Instance_t;
 
 
 /*
  * @internal
  *
- * Allocate a new packet
+ * Take memory from the unused part of the region of a static instance
  *
  * @param this umqtt instance
- * @param remainingLength the packet length not including header and
- * remaining length fields
+ * @param size number of bytes needed
  *
- * This function will allocate a new packet and return a pointer to a buffer
- * to use for assembling a MQTT packet.  It will add additional length
- * to account for the required header byte and up to 4 bytes for remaining
- * length.  It also adds the internal packet tracking structure to the
- * front of the MQTT packet but this is hidden from the returned pointer.
+ * Memory taken this way is never given back, so it is only used for
+ * buffers that are kept for the life of the instance.
  *
- * @return pointer to uint8_t buffer of sufficient length for MQTT packet,
- * or NULL
+ * @return pointer to the memory, or NULL if the region is used up
  */
-static uint8_t *
-newPacket(const umqtt_Instance_t *this, size_t remainingLength)
+static void *
+carveRegion(umqtt_Instance_t *this, size_t size)
 {
-    if (!this)
-    {
-        return NULL;
-    }
-    remainingLength += 1 + 4; // 1 hdr byte plus up to 4 len bytes
-    uint8_t *buf = this->pNet->pfnmalloc(remainingLength + sizeof(PktBuf_t));
-    if (buf)
-    {
-        buf += sizeof(PktBuf_t);
-        return buf;
-    }
-    else
+    size = (size + UMQTT_STATIC_ALIGN - 1) & ~(size_t)(UMQTT_STATIC_ALIGN - 1);
+    if (size > this->regionLeft)
     {
         return NULL;
     }
+    void *pMem = this->pRegion;
+    this->pRegion += size;
+    this->regionLeft -= size;
+    return pMem;
 }
 
 /*
  * @internal
  *
- * Free a packet
+ * Allocate memory for the instance
  *
  * @param this umqtt instance
- * @param pbuf the MQTT packet that was allocated with newPacket()
+ * @param size number of bytes needed
  *
- * Frees a previously allocated MQTT packet.  Assumes this packet is
- * not in the pending list.  If it is, then things will go bad.
+ * Memory normally comes from the application allocator.  A static instance
+ * instead uses a block of the smallest size class that fits, from the free
+ * list of that class or else from the unused part of its region.  If the
+ * region is used up, a free block of a larger class is used.
+ *
+ * @return pointer to the memory, or NULL if there is none
  */
-static void
-deletePacket(const umqtt_Instance_t *this, uint8_t *pbuf)
+static void *
+allocMem(umqtt_Instance_t *this, size_t size)
 {
-    if (pbuf && this)
+    if (!this->isStatic)
     {
-        pbuf -= sizeof(PktBuf_t);
-        PktBuf_t *pkt = (PktBuf_t *)pbuf;
-        pkt->next = NULL;
-        this->pNet->pfnfree(pbuf);
+        return this->pNet->pfnmalloc(size);
+    }
+
+    // find the smallest class that holds the block
+    uint32_t cls = 0;
+    size_t blockSize = UMQTT_STATIC_MIN_BLOCK;
+    while ((size + sizeof(MemHdr_t)) > blockSize)
+    {
+        if (++cls == UMQTT_STATIC_CLASSES)
+        {
+            return NULL;
+        }
+        blockSize <<= 1;
+    }
+
+    MemHdr_t *pBlock = this->memFree[cls];
+    if (pBlock)
+    {
+        this->memFree[cls] = pBlock->next;
+    }
+    else
+    {
+        pBlock = carveRegion(this, blockSize);
+        for (uint32_t larger = cls + 1; !pBlock && (larger < UMQTT_STATIC_CLASSES); larger++)
+        {
+            pBlock = this->memFree[larger];
+            if (pBlock)
+            {
+                this->memFree[larger] = pBlock->next;
+                cls = larger;
+            }
+        }
+        if (pBlock == NULL)
+        {
+            return NULL;
+        }
     }
+    pBlock->sizeClass = cls;
+    return pBlock + 1;
 }
 
 /*
  * @internal
  *
- * Add a packet to the pending packet list.
+ * Free memory that was allocated with allocMem()
  *
  * @param this umqtt instance
- * @param pbuf MQTT packet buffer to add to the queue
- * @param packetId packet ID of this packet
- * @param ticks tick count when this packet is enqueued
+ * @param ptr the memory to free
  *
- * This function will add the MQTT packet to the list of pending packets.
- * The caller supplies the packet ID and the current tick count for the
- * packet.  These are saved with the packet to facilitate lookup later.
+ * A static instance puts the block on the free list of its size class.
  */
 static void
-enqueuePacket(umqtt_Instance_t *this, uint8_t *pbuf, uint16_t packetId, uint32_t ticks)
+freeMem(umqtt_Instance_t *this, void *ptr)
 {
-    if (pbuf && this)
+    if (!this->isStatic)
     {
-        pbuf -= sizeof(PktBuf_t);
-        PktBuf_t *pkt = (PktBuf_t *)pbuf;
-        pkt->next = this->pktList.next;
-        this->pktList.next = pkt;
-        pkt->ticks = ticks;
-        pkt->packetId = packetId;
-        pkt->ttl = UMQTT_RETRIES;
+        this->pNet->pfnfree(ptr);
+        return;
+    }
+    if (ptr)
+    {
+        MemHdr_t *pBlock = (MemHdr_t *)ptr - 1;
+        uint32_t cls = pBlock->sizeClass;
+        pBlock->next = this->memFree[cls];
+        this->memFree[cls] = pBlock;
     }
 }
 
 /*
  * @internal
  *
- * Remove a packet from the pending packet list, using the packet ID
+ * Allocate a buffer that is kept for the life of the instance
  *
  * @param this umqtt instance
- * @param packetId the packet ID of the packet to remove
+ * @param size number of bytes needed
  *
- * Searches the pending packet list/queue for a packet with matching
- * packet ID.  If found, the packet is delinked from the list and returned
- * to the caller.
+ * A static instance takes the buffer straight from its region, so it does
+ * not use up a larger size class block.
  *
- * @return Pointer to the dequeued packet or NULL.
+ * @return pointer to the buffer, or NULL if there is no memory
  */
-static uint8_t *
-dequeuePacketById(umqtt_Instance_t *this, uint16_t packetId)
+static void *
+allocFixed(umqtt_Instance_t *this, size_t size)
 {
-    if (!this)
-    {
-        return NULL;
-    }
-    PktBuf_t *pPrev = &this->pktList;
-    PktBuf_t *pPkt = pPrev->next;
-    while (pPkt)
-    {
-        if (packetId == pPkt->packetId)
-        {
-            pPrev->next = pPkt->next;
-            pPkt->next = NULL;
-            uint8_t *buf = (uint8_t *)pPkt;
-            buf += sizeof(PktBuf_t);
-            return buf;
-        }
-        pPrev = pPkt;
-        pPkt = pPkt->next;
-    }
-    return NULL;
+    return this->isStatic ? carveRegion(this, size) : this->pNet->pfnmalloc(size);
 }
 
 /*
  * @internal
  *
- * Remove a packet from the pending packet list, using the MQTT packet type
+ * Append an entry to the packet ring
  *
  * @param this umqtt instance
- * @param type the MQTT packet type to remove
+ * @param len number of bytes needed
  *
- * Searches the pending packet list/queue for a packet with matching
- * packet type.  If found, the packet is delinked from the list and returned
- * to the caller.  If there is more than one packet with the same type, it
- * will only dequeue and return the first one that matches.
+ * The entry goes after the newest entry.  If it does not fit before the
+ * end of the ring, the rest of the ring is padded and the entry goes at
+ * the start, if there is room before the oldest entry.
  *
- * @return Pointer to the dequeued packet or NULL.
+ * @return pointer to the memory for the entry, or NULL if the ring is full
  */
-static uint8_t *
-dequeuePacketByType(umqtt_Instance_t *this, uint8_t type)
+static void *
+ringAlloc(umqtt_Instance_t *this, size_t len)
 {
-    if (!this)
+    if (len > this->ringSize)
     {
         return NULL;
     }
-    PktBuf_t *pPrev = &this->pktList;
-    PktBuf_t *pPkt = pPrev->next;
-    while (pPkt)
+    uint32_t size = (sizeof(RingEntry_t) + len + 7) & ~7U;
+    uint32_t start;
+    if ((this->ringUsed == 0) || (this->ringTail > this->ringHead))
     {
-        uint8_t *buf = (uint8_t *)pPkt;
-        buf += sizeof(PktBuf_t);
-        if ((type << 4) == buf[0])
+        // the used part does not wrap, so the entry can go after it, or
+        // else at the start of the ring
+        if (size <= (this->ringSize - this->ringTail))
         {
-            pPrev->next = pPkt->next;
-            pPkt->next = NULL;
-            return buf;
+            start = this->ringTail;
+        }
+        else if (size <= this->ringHead)
+        {
+            RingEntry_t *pPad = (RingEntry_t *)&this->pRing[this->ringTail];
+            pPad->size = this->ringSize - this->ringTail;
+            pPad->isFree = 1;
+            this->ringUsed += pPad->size;
+            start = 0;
+        }
+        else
+        {
+            return NULL;
         }
-        pPrev = pPkt;
-        pPkt = pPkt->next;
     }
-    return NULL;
+    else if (size <= (this->ringHead - this->ringTail))
+    {
+        // the used part wraps, so the free space is between tail and head
+        start = this->ringTail;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    RingEntry_t *pEntry = (RingEntry_t *)&this->pRing[start];
+    pEntry->size = size;
+    pEntry->isFree = 0;
+    this->ringUsed += size;
+    this->ringTail = start + size;
+    if (this->ringTail == this->ringSize)
+    {
+        this->ringTail = 0;
+    }
+    return pEntry + 1;
 }
 
 /*
  * @internal
  *
- * Removes and frees all packets from the pending packet list.
+ * Release an entry of the packet ring
  *
  * @param this umqtt instance
+ * @param ptr the memory returned by ringAlloc()
+ *
+ * Acks mostly arrive in the order the packets were sent, so the entry is
+ * usually the oldest one and its space is reclaimed straight away.  An
+ * entry released out of order is marked free, and reclaimed once all of
+ * the entries before it have been released.  The newest entry, such as
+ * a QoS 0 packet that has just been written, is taken back from the tail.
  */
 static void
-freeAllQueuedPackets(umqtt_Instance_t *this)
+ringFree(umqtt_Instance_t *this, void *ptr)
 {
-    if (this)
+    RingEntry_t *pEntry = (RingEntry_t *)ptr - 1;
+    uint32_t start = (uint8_t *)pEntry - this->pRing;
+    uint32_t end = start + pEntry->size;
+    pEntry->isFree = 1;
+    if ((end == this->ringTail) || ((end == this->ringSize) && (this->ringTail == 0)))
     {
-        PktBuf_t *pNext = this->pktList.next;
-        while (pNext)
+        this->ringTail = start;
+        this->ringUsed -= pEntry->size;
+    }
+
+    // reclaim released entries from the head
+    while (this->ringUsed)
+    {
+        RingEntry_t *pHead = (RingEntry_t *)&this->pRing[this->ringHead];
+        if (!pHead->isFree)
         {
-            PktBuf_t *pPkt = pNext;
-            pNext = pPkt->next;
-            pPkt->next = NULL;
-            this->pNet->pfnfree(pPkt);
+            break;
+        }
+        this->ringUsed -= pHead->size;
+        this->ringHead += pHead->size;
+        if (this->ringHead == this->ringSize)
+        {
+            this->ringHead = 0;
         }
     }
+    if (this->ringUsed == 0)
+    {
+        this->ringHead = 0;
+        this->ringTail = 0;
+    }
 }
 
-/**
- * Get string representing an error code.
- *
- * @param err is the error code to decode
+/*
+ * @internal
  *
- * This function is useful for debugging.  It can be used to print
- * a meaningful string for an error code.
-
- * @return a human readable string representation of the error code
- */
-const char *
-umqtt_GetErrorString(umqtt_Error_t err)
-{
-    return errCodeStrings[err];
-}
-
-/* @internal
+ * Allocate a new packet
  *
- * Encode length into MQTT remaining length format
+ * @param this umqtt instance
+ * @param remainingLength the packet length not including header and
+ * remaining length fields
  *
- * @param length length to encode
- * @param pEncodeBuf buffer to store encoded length
+ * This function will allocate a new packet and return a pointer to a buffer
+ * to use for assembling a MQTT packet.  It will add additional length
+ * to account for the required header byte and up to 4 bytes for remaining
+ * length.  It also adds the internal packet tracking structure to the
+ * front of the MQTT packet but this is hidden from the returned pointer.
  *
- * Does not validate parameters.  Assumes length is valid
- * and buffer is large enough to hold encoded length.
+ * If the instance uses the packet buffer pool then the buffer is taken
+ * from the free list of the smallest size class that fits, and only
+ * allocated from the application if that free list is empty.  If the
+ * instance has a packet ring then the buffer is always taken from the
+ * ring, and there is no buffer if the ring is full.
  *
- * @return the count of bytes that hold the length
+ * @return pointer to uint8_t buffer of sufficient length for MQTT packet,
+ * or NULL
  */
-static uint32_t
-umqtt_EncodeLength(uint32_t length, uint8_t *pEncodeBuf)
+static uint8_t *
+newPacket(umqtt_Instance_t *this, size_t remainingLength)
 {
-    uint8_t encByte;
-    uint32_t idx = 0;
-    do
+    if (!this)
     {
-        encByte = length % 128;
-        length /= 128;
-        if (length > 0)
+        return NULL;
+    }
+    remainingLength += 1 + 4; // 1 hdr byte plus up to 4 len bytes
+    size_t allocLength = remainingLength + sizeof(PktBuf_t);
+    uint8_t poolClass = UMQTT_POOL_NONE;
+    PktBuf_t *pkt = NULL;
+
+    if (this->pRing)
+    {
+        pkt = ringAlloc(this, allocLength);
+        if (pkt == NULL)
         {
-            encByte |= 0x80;
+            this->statsDirty = true;
+            ++this->stats.allocFails;
+            return NULL;
         }
-        pEncodeBuf[idx] = encByte;
-        ++idx;;
-    } while (length > 0);
-    return idx; // return count of bytes
+        poolClass = UMQTT_POOL_RING;
+    }
+    else if (this->usePool)
+    {
+        // find the smallest class that holds the packet
+        size_t blockSize = UMQTT_POOL_MIN_BLOCK;
+        for (uint8_t cls = 0; cls < UMQTT_POOL_CLASSES; cls++)
+        {
+            if (allocLength <= blockSize)
+            {
+                poolClass = cls;
+                allocLength = blockSize;
+                pkt = this->poolFree[cls];
+                break;
+            }
+            blockSize <<= 1;
+        }
+        if (pkt)
+        {
+            this->poolFree[poolClass] = pkt->next;
+            ++this->poolStats.hits;
+        }
+        else
+        {
+            ++this->poolStats.misses;
+        }
+    }
+
+    if (pkt == NULL)
+    {
+        pkt = allocMem(this, allocLength);
+        if (pkt == NULL)
+        {
+            this->statsDirty = true;
+            ++this->stats.allocFails;
+            return NULL;
+        }
+    }
+    this->statsDirty = true;
+    ++this->stats.allocs;
+
+    if (poolClass < UMQTT_POOL_CLASSES)
+    {
+        ++this->poolStats.inUse;
+        if (this->poolStats.inUse > this->poolStats.highWater)
+        {
+            this->poolStats.highWater = this->poolStats.inUse;
+        }
+    }
+    pkt->next = NULL;
+    pkt->poolClass = poolClass;
+    uint8_t *buf = (uint8_t *)pkt;
+    buf += sizeof(PktBuf_t);
+    return buf;
 }
 
-/* @internal
+/*
+ * @internal
  *
- * Decode remaining length field from MQTT packet.
+ * Release the memory of a packet
  *
- * @param pLength storage to location of decoded length
- * @param pEncodedLength buffer holding the encoded length field
+ * @param this umqtt instance
+ * @param pPkt the packet header of a packet allocated with newPacket()
  *
- * The caller supplies storage for the decoded length through the
- * _pLength_ parameter.  The number of bytes used to hold the encoded
- * length in the packet is returned to the caller.  No parameter
- * validation is performed.
+ * Pool buffers go back on the free list for their size class, ring
+ * entries go back to the ring, and anything else is returned to the
+ * application allocator.
+ */
+static void
+releasePacket(umqtt_Instance_t *this, PktBuf_t *pPkt)
+{
+    this->statsDirty = true;
+    ++this->stats.frees;
+    if (pPkt->poolClass < UMQTT_POOL_CLASSES)
+    {
+        pPkt->next = this->poolFree[pPkt->poolClass];
+        this->poolFree[pPkt->poolClass] = pPkt;
+        --this->poolStats.inUse;
+    }
+    else if (pPkt->poolClass == UMQTT_POOL_RING)
+    {
+        ringFree(this, pPkt);
+    }
+    else
+    {
+        pPkt->next = NULL;
+        freeMem(this, pPkt);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Free a packet
+ *
+ * @param this umqtt instance
+ * @param pbuf the MQTT packet that was allocated with newPacket()
+ *
+ * Frees a previously allocated MQTT packet.  Assumes this packet is
+ * not in the pending list.  If it is, then things will go bad.
+ */
+static void
+deletePacket(umqtt_Instance_t *this, uint8_t *pbuf)
+{
+    if (pbuf && this)
+    {
+        pbuf -= sizeof(PktBuf_t);
+        releasePacket(this, (PktBuf_t *)pbuf);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Free all the buffers held on the pool free lists
+ *
+ * @param this umqtt instance
+ */
+static void
+freePool(umqtt_Instance_t *this)
+{
+    for (uint8_t cls = 0; cls < UMQTT_POOL_CLASSES; cls++)
+    {
+        PktBuf_t *pNext = this->poolFree[cls];
+        while (pNext)
+        {
+            PktBuf_t *pPkt = pNext;
+            pNext = pPkt->next;
+            freeMem(this, pPkt);
+        }
+        this->poolFree[cls] = NULL;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Assign the next packet ID
+ *
+ * @param this umqtt instance
+ *
+ * @return the next packet ID to use, never 0
+ */
+static uint16_t
+nextPacketId(umqtt_Instance_t *this)
+{
+    ++this->packetId;
+    if (this->packetId == 0)
+    {
+        this->packetId = 1;
+    }
+    return this->packetId;
+}
+
+/*
+ * @internal
+ *
+ * Get the current tick count
+ *
+ * @param this umqtt instance
  *
- * @return count of bytes of the encoded length
+ * @return the application tick count if there is a tick function,
+ * otherwise the tick count of the last Run
  */
 static uint32_t
-umqtt_DecodeLength(uint32_t *pLength, const uint8_t *pEncodedLength)
+nowTicks(umqtt_Instance_t *this)
+{
+    return this->pfnGetTicks ? this->pfnGetTicks() : this->ticks;
+}
+
+/*
+ * @internal
+ *
+ * Update the retransmit timeout with a new round trip time
+ *
+ * @param this umqtt instance
+ * @param rtt measured round trip time of a packet that was not
+ * retransmitted
+ *
+ * Follows the TCP retransmit timer calculation (RFC 6298).  The smoothed
+ * round trip time and its variation are kept in fixed point, scaled by 8
+ * and 4, and the timeout is the smoothed time plus 4 times the variation.
+ */
+static void
+updateRtt(umqtt_Instance_t *this, uint32_t rtt)
+{
+    if (this->srtt == 0)
+    {
+        // first measurement, the low bit keeps srtt non-zero so that
+        // it is not taken for no measurement even if the rtt is 0
+        this->srtt = (rtt << 3) | 1;
+        this->rttvar = rtt << 1;
+    }
+    else
+    {
+        int32_t delta = (int32_t)rtt - (int32_t)(this->srtt >> 3);
+        this->srtt += delta;
+        if (delta < 0)
+        {
+            delta = -delta;
+        }
+        this->rttvar += delta - (int32_t)(this->rttvar >> 2);
+    }
+    uint32_t var = (this->rttvar > UMQTT_TIMER_RESOLUTION) ? this->rttvar : UMQTT_TIMER_RESOLUTION;
+    uint32_t rto = (this->srtt >> 3) + var;
+    rto = (rto < this->minRto) ? this->minRto : rto;
+    this->rto = (rto > this->maxRto) ? this->maxRto : rto;
+}
+
+/*
+ * @internal
+ *
+ * Compute the timeout for a transmission of a pending packet
+ *
+ * @param this umqtt instance
+ * @param attempt 0 for the first transmission, 1 for the first
+ * retransmit and so on
+ *
+ * The timeout doubles with each attempt, and up to a quarter is added
+ * at random so that packets that were sent together are not all sent
+ * again at the same time.
+ *
+ * @return timeout in milliseconds
+ */
+static uint32_t
+retryTimeout(umqtt_Instance_t *this, unsigned int attempt)
+{
+    uint32_t timeout = this->rto;
+    while (attempt-- && (timeout < this->maxRto))
+    {
+        timeout = (timeout > (this->maxRto / 2)) ? this->maxRto : (timeout * 2);
+    }
+
+    // xorshift random number for the jitter
+    this->jitterSeed ^= this->jitterSeed << 13;
+    this->jitterSeed ^= this->jitterSeed >> 17;
+    this->jitterSeed ^= this->jitterSeed << 5;
+    timeout += this->jitterSeed % ((timeout / 4) + 1);
+    return (timeout < this->maxRto) ? timeout : this->maxRto;
+}
+
+/*
+ * @internal
+ *
+ * Locate the index slot holding a pending packet.
+ *
+ * @param this umqtt instance
+ * @param packetId the packet ID to search for
+ * @param pPkt specific packet to find, or NULL to match any packet with
+ * the packet ID
+ *
+ * The index is an open addressing hash table using linear probing.  Packet
+ * IDs are assigned sequentially, so the low bits of the packet ID are
+ * used directly as the hash and the IDs that are in flight at the same
+ * time spread out over the table without colliding.  That makes one long
+ * run of occupied slots, so the search stops after the longest distance
+ * any packet has from its home slot rather than at an empty slot.
+ *
+ * @return index slot number holding the packet, or -1 if not found
+ */
+static int32_t
+findPacketSlot(const umqtt_Instance_t *this, uint16_t packetId, const PktBuf_t *pPkt)
+{
+    if (this->pktIndexCount == 0)
+    {
+        return -1;
+    }
+    uint32_t mask = this->pktIndexSize - 1;
+    uint32_t slot = packetId & mask;
+    for (uint32_t dist = 0; this->pktIndex[slot] && (dist <= this->pktIndexProbe); dist++)
+    {
+        PktBuf_t *pSlotPkt = this->pktIndex[slot];
+        if ((pSlotPkt->packetId == packetId) && (!pPkt || (pSlotPkt == pPkt)))
+        {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/*
+ * @internal
+ *
+ * Insert a packet into the pending packet index.
+ *
+ * @param this umqtt instance
+ * @param pPkt packet to add to the index
+ *
+ * Assumes that there is a free slot in the index, see reservePacketSlots().
+ */
+static void
+indexPacket(umqtt_Instance_t *this, PktBuf_t *pPkt)
+{
+    uint32_t mask = this->pktIndexSize - 1;
+    uint32_t slot = pPkt->packetId & mask;
+    uint32_t dist = 0;
+    while (this->pktIndex[slot])
+    {
+        slot = (slot + 1) & mask;
+        ++dist;
+    }
+    this->pktIndex[slot] = pPkt;
+    ++this->pktIndexCount;
+    if (dist > this->pktIndexProbe)
+    {
+        this->pktIndexProbe = dist;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Remove a packet from the pending packet index.
+ *
+ * @param this umqtt instance
+ * @param pPkt packet to remove from the index
+ *
+ * Entries that follow the removed one in the same probe run are shifted
+ * back to fill the gap, so the index never needs deleted-slot markers.
+ * Only entries within the longest probe distance of the gap can belong
+ * before it, so the rest of the run is not looked at.
+ */
+static void
+unindexPacket(umqtt_Instance_t *this, const PktBuf_t *pPkt)
+{
+    int32_t found = findPacketSlot(this, pPkt->packetId, pPkt);
+    if (found < 0)
+    {
+        return;
+    }
+    uint32_t mask = this->pktIndexSize - 1;
+    uint32_t hole = found;
+    uint32_t slot = found;
+    for (;;)
+    {
+        slot = (slot + 1) & mask;
+        PktBuf_t *pNext = this->pktIndex[slot];
+        if ((pNext == NULL) || (((slot - hole) & mask) > this->pktIndexProbe))
+        {
+            break;
+        }
+        // move the entry back into the hole unless its home slot lies
+        // between the hole and where it is now
+        uint32_t home = pNext->packetId & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            this->pktIndex[hole] = pNext;
+            hole = slot;
+        }
+    }
+    this->pktIndex[hole] = NULL;
+    --this->pktIndexCount;
+    if (this->pktIndexCount == 0)
+    {
+        this->pktIndexProbe = 0;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Make sure the pending packet index has room for more packets.
+ *
+ * @param this umqtt instance
+ * @param count number of packets that will be added
+ *
+ * This should be called before a packet with a packet ID is sent, so
+ * that the packet can be added to the pending list after it has been
+ * sent.  The index is grown when it would become more than half full.
+ * If it can not be grown but still has enough free slots, then the
+ * packets can still be added, they will just be a little slower to find.
+ *
+ * @return true if there is room for the packets in the index
+ */
+static bool
+reservePacketSlots(umqtt_Instance_t *this, uint32_t count)
+{
+    if (((this->pktIndexCount + count) * 2) <= this->pktIndexSize)
+    {
+        return true;
+    }
+    // the index of a static instance has a fixed size
+    if (this->isStatic)
+    {
+        return false;
+    }
+    uint32_t newSize = this->pktIndexSize ? this->pktIndexSize * 2 : UMQTT_PKT_INDEX_MIN;
+    while ((newSize / 2) < (this->pktIndexCount + count))
+    {
+        newSize *= 2;
+    }
+    PktBuf_t **pNewIndex = allocMem(this, newSize * sizeof(PktBuf_t *));
+    if (pNewIndex == NULL)
+    {
+        return (this->pktIndexCount + count) < this->pktIndexSize;
+    }
+    memset(pNewIndex, 0, newSize * sizeof(PktBuf_t *));
+
+    // rehash all the existing entries into the new index
+    PktBuf_t **pOldIndex = this->pktIndex;
+    uint32_t oldSize = this->pktIndexSize;
+    this->pktIndex = pNewIndex;
+    this->pktIndexSize = newSize;
+    this->pktIndexCount = 0;
+    this->pktIndexProbe = 0;
+    for (uint32_t i = 0; i < oldSize; i++)
+    {
+        if (pOldIndex[i])
+        {
+            indexPacket(this, pOldIndex[i]);
+        }
+    }
+    if (pOldIndex)
+    {
+        freeMem(this, pOldIndex);
+    }
+    return true;
+}
+
+#if !defined(__GNUC__)
+/*
+ * @internal
+ *
+ * Count the trailing zero bits of a value that is not 0
+ *
+ * @param x the value
+ *
+ * @return number of zero bits below the lowest bit that is set
+ */
+static uint32_t
+ctz64(uint64_t x)
 {
-    uint8_t encByte;
     uint32_t count = 0;
-    uint32_t length = 0;
-    uint32_t mult = 1;
-    do
+    while ((x & 1) == 0)
     {
-        encByte = pEncodedLength[count];
-        length += (encByte & 0x7F) * mult;
+        x >>= 1;
         ++count;
-        mult *= 128;
-    } while (encByte & 0x80);
-
-    *pLength = length;
+    }
     return count;
 }
+#endif
 
-/* @internal
+/*
+ * @internal
  *
- * Encode a data block into an MQTT packet
+ * Find the next slot of a timer wheel that holds packets
  *
- * @param pInBuf pointer to buffer containing data to encode
- * @param inBufLen count of bytes in input buffer
- * @param pOutBuf pointer to a buffer where the data block will be encoded
+ * @param mask slots of the wheel that hold packets, not 0
+ * @param slot slot to start looking from
+ *
+ * @return number of slots from _slot_ to the first slot that holds
+ * packets, counting around the wheel
+ */
+static uint32_t
+timerScan(uint64_t mask, uint32_t slot)
+{
+    uint64_t rotated = (mask >> slot)
+                     | (mask << ((UMQTT_TIMER_SLOTS - slot) & (UMQTT_TIMER_SLOTS - 1)));
+    return UMQTT_CTZ64(rotated);
+}
+
+/*
+ * @internal
+ *
+ * Place a pending packet on the timer wheel.
+ *
+ * @param this umqtt instance
+ * @param pPkt the pending packet, with its deadline set
+ *
+ * A packet that times out on the current turn of the first wheel goes
+ * into the slot of the first wheel that covers the deadline, and one
+ * that is already in the past goes into the next slot to be expired.  A
+ * later packet goes into the slot of the second wheel for the turn of
+ * its deadline, or into the last slot if the deadline is further away
+ * than the second wheel reaches, to be placed again from there.  Each
+ * slot of the second wheel keeps the earliest time one of its packets
+ * would be expired, for umqtt_GetNextDeadline().
+ */
+static void
+timerFile(umqtt_Instance_t *this, PktBuf_t *pPkt)
+{
+    uint32_t slotTicks = pPkt->deadline;
+    if ((int32_t)(slotTicks - this->timerNext) < 0)
+    {
+        slotTicks = this->timerNext;
+    }
+    uint32_t wheel = 0;
+    uint32_t slot;
+    if ((slotTicks - this->timerNext) < UMQTT_TIMER_SPAN)
+    {
+        slot = (slotTicks / UMQTT_TIMER_RESOLUTION) & (UMQTT_TIMER_SLOTS - 1);
+    }
+    else
+    {
+        wheel = 1;
+        if ((slotTicks - this->timerNext) >= (UMQTT_TIMER_SPAN * UMQTT_TIMER_SLOTS))
+        {
+            slotTicks = this->timerNext + (UMQTT_TIMER_SPAN * (UMQTT_TIMER_SLOTS - 1));
+        }
+        slot = (slotTicks / UMQTT_TIMER_SPAN) & (UMQTT_TIMER_SLOTS - 1);
+
+        // a packet that is placed again when its turn starts counts as
+        // expiring then
+        uint32_t turn = slotTicks & ~(UMQTT_TIMER_SPAN - 1);
+        uint32_t due = ((pPkt->deadline - turn) < UMQTT_TIMER_SPAN) ? pPkt->deadline : turn;
+        uint32_t expiry = (due & ~(UMQTT_TIMER_RESOLUTION - 1)) + UMQTT_TIMER_RESOLUTION;
+        if (!(this->timerMask[1] & ((uint64_t)1 << slot))
+         || ((int32_t)(expiry - this->timerMin[slot]) < 0))
+        {
+            this->timerMin[slot] = expiry;
+        }
+    }
+    PktBuf_t **ppSlot = &this->timerSlots[wheel][slot];
+    pPkt->timerWheel = (uint8_t)wheel;
+    pPkt->timerSlot = (uint8_t)slot;
+    pPkt->timerNext = *ppSlot;
+    pPkt->timerPrev = ppSlot;
+    if (pPkt->timerNext)
+    {
+        pPkt->timerNext->timerPrev = &pPkt->timerNext;
+    }
+    *ppSlot = pPkt;
+    this->timerMask[wheel] |= (uint64_t)1 << slot;
+}
+
+/*
+ * @internal
+ *
+ * Take all of the packets out of a timer wheel slot.
+ *
+ * @param this umqtt instance
+ * @param wheel timer wheel, 0 or 1
+ * @param slot slot of the wheel
+ *
+ * @return the first packet of the slot, linked to the others through
+ * _timerNext_, or NULL if the slot is empty.  The packets are still
+ * counted in _timerCount_.
+ */
+static PktBuf_t *
+timerTake(umqtt_Instance_t *this, uint32_t wheel, uint32_t slot)
+{
+    PktBuf_t *pPkt = this->timerSlots[wheel][slot];
+    this->timerSlots[wheel][slot] = NULL;
+    this->timerMask[wheel] &= ~((uint64_t)1 << slot);
+    return pPkt;
+}
+
+/*
+ * @internal
+ *
+ * Start the timeout for a pending packet.
+ *
+ * @param this umqtt instance
+ * @param pPkt the pending packet
+ * @param deadline tick count when the packet times out
+ */
+static void
+timerStart(umqtt_Instance_t *this, PktBuf_t *pPkt, uint32_t deadline)
+{
+    if (this->timerCount == 0)
+    {
+        this->timerNext = this->ticks & ~(UMQTT_TIMER_RESOLUTION - 1);
+    }
+    pPkt->deadline = deadline;
+    timerFile(this, pPkt);
+    ++this->timerCount;
+}
+
+/*
+ * @internal
+ *
+ * Stop the timeout for a pending packet.
+ *
+ * @param this umqtt instance
+ * @param pPkt the pending packet
+ *
+ * Removes the packet from the timer wheel.  It is safe to call this for
+ * a packet that is not on the timer wheel.
+ */
+static void
+timerStop(umqtt_Instance_t *this, PktBuf_t *pPkt)
+{
+    if (pPkt->timerPrev)
+    {
+        *pPkt->timerPrev = pPkt->timerNext;
+        if (pPkt->timerNext)
+        {
+            pPkt->timerNext->timerPrev = pPkt->timerPrev;
+        }
+        else if (this->timerSlots[pPkt->timerWheel][pPkt->timerSlot] == NULL)
+        {
+            this->timerMask[pPkt->timerWheel] &= ~((uint64_t)1 << pPkt->timerSlot);
+        }
+        pPkt->timerNext = NULL;
+        pPkt->timerPrev = NULL;
+        --this->timerCount;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Move the packets of the next turn of the first timer wheel to it.
+ *
+ * @param this umqtt instance
+ *
+ * Called when the next slot to expire is the first slot of a turn.  The
+ * packets in the slot of the second wheel for that turn are placed again,
+ * which puts them on the first wheel except for any that are further
+ * away than the second wheel reaches.
+ */
+static void
+timerCascade(umqtt_Instance_t *this)
+{
+    PktBuf_t *pPkt = timerTake(this, 1, (this->timerNext / UMQTT_TIMER_SPAN)
+                                        & (UMQTT_TIMER_SLOTS - 1));
+    while (pPkt)
+    {
+        PktBuf_t *pNext = pPkt->timerNext;
+        timerFile(this, pPkt);
+        pPkt = pNext;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Skip over timer wheel slots that hold no packets.
+ *
+ * @param this umqtt instance
+ * @param msTicks the current tick count
+ *
+ * Moves the next slot to expire ahead to the first slot that holds
+ * packets, but not past the start of the next turn of the first wheel,
+ * which has to be taken from the second wheel first, and not past the
+ * slot of the current tick count.
+ */
+static void
+timerSkip(umqtt_Instance_t *this, uint32_t msTicks)
+{
+    uint32_t target = (this->timerNext + UMQTT_TIMER_SPAN - 1) & ~(UMQTT_TIMER_SPAN - 1);
+    if (this->timerMask[0])
+    {
+        uint32_t slotTicks = this->timerNext
+            + (timerScan(this->timerMask[0], (this->timerNext / UMQTT_TIMER_RESOLUTION)
+                                             & (UMQTT_TIMER_SLOTS - 1))
+               * UMQTT_TIMER_RESOLUTION);
+        if ((int32_t)(slotTicks - target) < 0)
+        {
+            target = slotTicks;
+        }
+    }
+    else if (this->timerMask[1])
+    {
+        // with the first wheel empty, go straight to the next turn that
+        // has packets on the second wheel
+        target += timerScan(this->timerMask[1], (target / UMQTT_TIMER_SPAN)
+                                                & (UMQTT_TIMER_SLOTS - 1))
+                  * UMQTT_TIMER_SPAN;
+    }
+    uint32_t present = msTicks & ~(UMQTT_TIMER_RESOLUTION - 1);
+    if ((int32_t)(target - present) > 0)
+    {
+        target = present;
+    }
+    if ((int32_t)(target - this->timerNext) > 0)
+    {
+        this->timerNext = target;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Place every packet on the timer wheel again from a new start.
+ *
+ * @param this umqtt instance
+ * @param start start ticks of the next slot to expire, slot aligned
+ * @param shift ticks to add to the send time and deadline of each packet
+ * @param isDue true if every packet is to time out in the first slot
+ * instead
+ *
+ * This is only needed when the tick count does not follow on from the
+ * one the packets were timed with, see umqtt_RunBudget().
+ */
+static void
+timerRebase(umqtt_Instance_t *this, uint32_t start, uint32_t shift, bool isDue)
+{
+    PktBuf_t *pList = NULL;
+    for (uint32_t wheel = 0; wheel < 2; wheel++)
+    {
+        while (this->timerMask[wheel])
+        {
+            PktBuf_t *pPkt = timerTake(this, wheel, UMQTT_CTZ64(this->timerMask[wheel]));
+            while (pPkt)
+            {
+                PktBuf_t *pNext = pPkt->timerNext;
+                pPkt->timerNext = pList;
+                pList = pPkt;
+                pPkt = pNext;
+            }
+        }
+    }
+    this->timerNext = start;
+    while (pList)
+    {
+        PktBuf_t *pNext = pList->timerNext;
+        pList->ticks += shift;
+        if (this->pfnGetTicks == NULL)
+        {
+            pList->sentTicks += shift;
+        }
+        pList->deadline = isDue ? start : (pList->deadline + shift);
+        timerFile(this, pList);
+        pList = pNext;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Check if the in-flight window has room for more publish packets
+ *
+ * @param this umqtt instance
+ * @param count number of QoS > 0 publish packets to be sent
+ * @param bytes total length of the packets
+ *
+ * @return true if the packets can be sent without going over the
+ * configured in-flight limits
+ */
+static bool
+windowHasRoom(const umqtt_Instance_t *this, uint32_t count, uint32_t bytes)
+{
+    if (this->maxInflight && ((this->inflight + count) > this->maxInflight))
+    {
+        return false;
+    }
+    if (this->maxInflightBytes && (bytes > (this->maxInflightBytes - this->inflightBytes)))
+    {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Count a pending packet in the in-flight window
+ *
+ * @param this umqtt instance
+ * @param pbuf MQTT packet buffer that is in the pending list
+ * @param len length of the packet
+ *
+ * The packet is removed from the window again when it is removed from
+ * the pending list.
+ */
+static void
+windowAdd(umqtt_Instance_t *this, uint8_t *pbuf, uint32_t len)
+{
+    PktBuf_t *pPkt = (PktBuf_t *)(pbuf - sizeof(PktBuf_t));
+    pPkt->windowBytes = len;
+    ++this->inflight;
+    this->inflightBytes += len;
+}
+
+/*
+ * @internal
+ *
+ * Add a packet to the pending packet list.
+ *
+ * @param this umqtt instance
+ * @param pbuf MQTT packet buffer to add to the queue
+ * @param packetId packet ID of this packet
+ * @param ticks tick count when this packet is enqueued
+ *
+ * This function will add the MQTT packet to the list of pending packets.
+ * The caller supplies the packet ID and the current tick count for the
+ * packet.  These are saved with the packet to facilitate lookup later.
+ * Packets with a non-zero packet ID are also added to the packet index,
+ * and the caller must have reserved a slot with reservePacketSlots().
+ */
+static void
+enqueuePacket(umqtt_Instance_t *this, uint8_t *pbuf, uint16_t packetId, uint32_t ticks)
+{
+    if (pbuf && this)
+    {
+        pbuf -= sizeof(PktBuf_t);
+        PktBuf_t *pkt = (PktBuf_t *)pbuf;
+        pkt->next = this->pktList.next;
+        pkt->prev = &this->pktList;
+        if (pkt->next)
+        {
+            pkt->next->prev = pkt;
+        }
+        this->pktList.next = pkt;
+        pkt->ticks = ticks;
+        pkt->sentTicks = this->pfnGetTicks ? this->pfnGetTicks() : ticks;
+        pkt->packetId = packetId;
+        pkt->ttl = this->maxRetries;
+        pkt->windowBytes = 0;
+        pkt->timerPrev = NULL;
+        // CONNECT is never retried, and must allow for the broker to
+        // set up the session, so it does not use the adaptive timeout
+        if ((pbuf[sizeof(PktBuf_t)] >> 4) == UMQTT_TYPE_CONNECT)
+        {
+            timerStart(this, pkt, ticks + this->initialRto);
+        }
+        else
+        {
+            timerStart(this, pkt, ticks + retryTimeout(this, 0));
+        }
+        if (packetId != 0)
+        {
+            indexPacket(this, pkt);
+        }
+        this->statsDirty = true;
+        ++this->stats.inflight;
+        if (this->stats.inflight > this->stats.inflightPeak)
+        {
+            this->stats.inflightPeak = this->stats.inflight;
+        }
+    }
+}
+
+/*
+ * @internal
+ *
+ * Delink a packet from the pending packet list.
+ *
+ * @param this umqtt instance
+ * @param pPkt the packet to remove from the list
+ *
+ * Removes the packet from the pending list, the packet index, the timer
+ * wheel and the in-flight window.  The packet is not freed.
+ */
+static void
+unlinkPacket(umqtt_Instance_t *this, PktBuf_t *pPkt)
+{
+    timerStop(this, pPkt);
+    if (pPkt->windowBytes)
+    {
+        --this->inflight;
+        this->inflightBytes -= pPkt->windowBytes;
+        pPkt->windowBytes = 0;
+    }
+    pPkt->prev->next = pPkt->next;
+    if (pPkt->next)
+    {
+        pPkt->next->prev = pPkt->prev;
+    }
+    pPkt->next = NULL;
+    pPkt->prev = NULL;
+    if (pPkt->packetId != 0)
+    {
+        unindexPacket(this, pPkt);
+    }
+    this->statsDirty = true;
+    --this->stats.inflight;
+}
+
+/*
+ * @internal
+ *
+ * Remove a packet from the pending packet list, using the packet ID
+ *
+ * @param this umqtt instance
+ * @param packetId the packet ID of the packet to remove
+ *
+ * Looks up the packet with matching packet ID in the packet index.
+ * If found, the packet is delinked from the list and returned to the
+ * caller.  Packet ID 0 is never valid in an ack so it is not indexed.
+ *
+ * @return Pointer to the dequeued packet or NULL.
+ */
+static uint8_t *
+dequeuePacketById(umqtt_Instance_t *this, uint16_t packetId)
+{
+    if (!this || (packetId == 0))
+    {
+        return NULL;
+    }
+    int32_t slot = findPacketSlot(this, packetId, NULL);
+    if (slot < 0)
+    {
+        return NULL;
+    }
+    PktBuf_t *pPkt = this->pktIndex[slot];
+    unlinkPacket(this, pPkt);
+    uint8_t *buf = (uint8_t *)pPkt;
+    buf += sizeof(PktBuf_t);
+    return buf;
+}
+
+/*
+ * @internal
+ *
+ * Remove a packet from the pending packet list, using the MQTT packet type
+ *
+ * @param this umqtt instance
+ * @param type the MQTT packet type to remove
+ *
+ * Searches the pending packet list/queue for a packet with matching
+ * packet type.  If found, the packet is delinked from the list and returned
+ * to the caller.  If there is more than one packet with the same type, it
+ * will only dequeue and return the first one that matches.
+ *
+ * @return Pointer to the dequeued packet or NULL.
+ */
+static uint8_t *
+dequeuePacketByType(umqtt_Instance_t *this, uint8_t type)
+{
+    if (!this)
+    {
+        return NULL;
+    }
+    PktBuf_t *pPkt = this->pktList.next;
+    while (pPkt)
+    {
+        uint8_t *buf = (uint8_t *)pPkt;
+        buf += sizeof(PktBuf_t);
+        if ((type << 4) == buf[0])
+        {
+            unlinkPacket(this, pPkt);
+            return buf;
+        }
+        pPkt = pPkt->next;
+    }
+    return NULL;
+}
+
+/*
+ * @internal
+ *
+ * Removes and frees all packets from the pending packet list.
+ *
+ * @param this umqtt instance
+ *
+ * The packet index and timer wheel are emptied.  The index remains
+ * allocated for reuse.
+ */
+static void
+freeAllQueuedPackets(umqtt_Instance_t *this)
+{
+    if (this)
+    {
+        PktBuf_t *pNext = this->pktList.next;
+        while (pNext)
+        {
+            PktBuf_t *pPkt = pNext;
+            pNext = pPkt->next;
+            releasePacket(this, pPkt);
+        }
+        this->pktList.next = NULL;
+        if (this->pktIndex)
+        {
+            memset(this->pktIndex, 0, this->pktIndexSize * sizeof(PktBuf_t *));
+        }
+        this->pktIndexCount = 0;
+        this->pktIndexProbe = 0;
+        memset(this->timerSlots, 0, sizeof(this->timerSlots));
+        memset(this->timerMask, 0, sizeof(this->timerMask));
+        this->timerCount = 0;
+        this->inflight = 0;
+        this->inflightBytes = 0;
+        this->statsDirty = true;
+        this->stats.inflight = 0;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Discard any partially received packet from the byte stream
+ *
+ * @param this umqtt instance
+ */
+static void
+resetFrame(umqtt_Instance_t *this)
+{
+    if (this->pFrame)
+    {
+        freeMem(this, this->pFrame);
+        this->pFrame = NULL;
+    }
+    this->frameHdrCount = 0;
+    this->frameLen = 0;
+    this->frameCount = 0;
+}
+
+/*
+ * @internal
+ *
+ * Write bytes to the network without counting them as a packet
+ *
+ * @param this umqtt instance
+ * @param pBuf the bytes to write, one or more whole packets
+ * @param len number of bytes
+ * @param isMore true if more bytes will be written right away
+ *
+ * The caller adds the packets to the instance statistics.
+ *
+ * @return true if all of the bytes were written
+ */
+static bool
+writeBytes(umqtt_Instance_t *this, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    int written = this->pNet->pfnNetWritePacket(this->pNet->hNet, pBuf, len, isMore);
+    if ((written < 0) || ((uint32_t)written != len))
+    {
+        this->statsDirty = true;
+        ++this->stats.networkErrors;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Write bytes to the network from several buffers without counting
+ * them as a packet
+ *
+ * @param this umqtt instance
+ * @param pSegs the buffers holding the bytes, in order
+ * @param segCount number of buffers
+ * @param len total number of bytes
+ * @param isMore true if more bytes will be written right away
+ *
+ * @return true if all of the bytes were written
+ */
+static bool
+writevBytes(umqtt_Instance_t *this, const umqtt_Segment_t *pSegs,
+            uint32_t segCount, uint32_t len, bool isMore)
+{
+    int written = this->pNet->pfnNetWritevPacket(this->pNet->hNet, pSegs, segCount, isMore);
+    if ((written < 0) || ((uint32_t)written != len))
+    {
+        this->statsDirty = true;
+        ++this->stats.networkErrors;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Write a packet to the network
+ *
+ * @param this umqtt instance
+ * @param pBuf the encoded MQTT packet
+ * @param len length of the packet
+ * @param isMore true if more packets will be written right away
+ *
+ * All single packets are sent through here so that they are counted in
+ * the instance statistics.
+ *
+ * @return true if the whole packet was written
+ */
+static bool
+writePacket(umqtt_Instance_t *this, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    if (!writeBytes(this, pBuf, len, isMore))
+    {
+        return false;
+    }
+    this->statsDirty = true;
+    ++this->stats.pktsSent[pBuf[0] >> 4];
+    this->stats.bytesSent += len;
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Write a packet to the network from several buffers
+ *
+ * @param this umqtt instance
+ * @param pSegs the buffers holding the packet, the first one starts
+ * with the fixed header
+ * @param segCount number of buffers
+ * @param len total length of the packet
+ *
+ * @return true if the whole packet was written
+ */
+static bool
+writevPacket(umqtt_Instance_t *this, const umqtt_Segment_t *pSegs,
+             uint32_t segCount, uint32_t len)
+{
+    if (!writevBytes(this, pSegs, segCount, len, false))
+    {
+        return false;
+    }
+    this->statsDirty = true;
+    ++this->stats.pktsSent[pSegs[0].pData[0] >> 4];
+    this->stats.bytesSent += len;
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Add a round trip time to a latency histogram
+ *
+ * @param this umqtt instance
+ * @param type the kind of round trip
+ * @param ms the round trip time
+ * @param retried true if the request was retransmitted
+ */
+static void
+recordLatency(umqtt_Instance_t *this, umqtt_LatencyType_t type,
+              uint32_t ms, bool retried)
+{
+    umqtt_Latency_t *pLatency = &this->stats.latency[type];
+    this->statsDirty = true;
+    if ((pLatency->count == 0) || (ms < pLatency->min))
+    {
+        pLatency->min = ms;
+    }
+    if (ms > pLatency->max)
+    {
+        pLatency->max = ms;
+    }
+    ++pLatency->count;
+    pLatency->sum += ms;
+    if (retried)
+    {
+        ++pLatency->retried;
+    }
+
+    // bucket number is the number of significant bits
+    uint32_t bucket = 0;
+    while (ms && (bucket < (UMQTT_LATENCY_BUCKETS - 1)))
+    {
+        ms >>= 1;
+        ++bucket;
+    }
+    ++pLatency->buckets[bucket];
+}
+
+/*
+ * @internal
+ *
+ * Time the round trip of a pending packet that has been acked
+ *
+ * @param this umqtt instance
+ * @param type the kind of round trip
+ * @param pbuf the dequeued MQTT packet
+ *
+ * The round trip also updates the retransmit timeout, unless the packet
+ * was retransmitted, because then it is not known which transmission
+ * the ack is for.
+ */
+static void
+recordPacketLatency(umqtt_Instance_t *this, umqtt_LatencyType_t type, uint8_t *pbuf)
+{
+    PktBuf_t *pPkt = (PktBuf_t *)(pbuf - sizeof(PktBuf_t));
+    uint32_t now = nowTicks(this);
+    bool retried = pPkt->ttl != this->maxRetries;
+    recordLatency(this, type, now - pPkt->sentTicks, retried);
+    if (!retried)
+    {
+        updateRtt(this, now - pPkt->sentTicks);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Publish the statistics snapshot
+ *
+ * @param this umqtt instance
+ *
+ * Copies the working counters to the snapshot that is read by
+ * umqtt_GetStats().  The sequence number is odd while the copy is
+ * being made, so that a reader in another thread can tell when it
+ * needs to read the snapshot again.  Nothing is copied if no counter
+ * has changed since the last time, so an idle umqtt_Run() is cheap.
+ */
+static void
+publishStats(umqtt_Instance_t *this)
+{
+    if (!this->statsDirty
+     && (this->stats.rttSmoothed == (this->srtt >> 3))
+     && (this->stats.retryTimeout == this->rto))
+    {
+        return;
+    }
+    this->statsDirty = false;
+    this->stats.rttSmoothed = this->srtt >> 3;
+    this->stats.retryTimeout = this->rto;
+    ++this->statsSeq;
+    UMQTT_MEMORY_BARRIER();
+    this->statsSnapshot = this->stats;
+    UMQTT_MEMORY_BARRIER();
+    ++this->statsSeq;
+}
+
+/*
+ * @internal
+ *
+ * Hash a topic level name
+ *
+ * @param pLevel the level name
+ * @param len length of the level name
+ *
+ * @return FNV-1a hash of the name
+ */
+static uint32_t
+topicLevelHash(const char *pLevel, uint32_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)pLevel[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * @internal
+ *
+ * Find a plain child level of a subscription trie node
+ *
+ * @param pNode the parent node
+ * @param pLevel name of the child level
+ * @param len length of the name
+ * @param hash hash of the name from topicLevelHash()
+ *
+ * @return the child node or NULL
+ */
+static TopicNode_t *
+findTopicChild(const TopicNode_t *pNode, const char *pLevel, uint32_t len, uint32_t hash)
+{
+    if (pNode->childCount == 0)
+    {
+        return NULL;
+    }
+    TopicNode_t *pChild = pNode->children[hash & (pNode->childSlots - 1)];
+    while (pChild)
+    {
+        if ((pChild->levelHash == hash) && (pChild->levelLen == len)
+         && (memcmp(pChild->level, pLevel, len) == 0))
+        {
+            return pChild;
+        }
+        pChild = pChild->next;
+    }
+    return NULL;
+}
+
+/*
+ * @internal
+ *
+ * Find or add a child level of a subscription trie node
+ *
+ * @param this umqtt instance
+ * @param pNode the parent node
+ * @param pLevel name of the child level, which can be a wildcard
+ * @param len length of the name
+ *
+ * The hash table of plain children is doubled in size when it has as
+ * many children as slots.
+ *
+ * @return the child node, or NULL if memory could not be allocated
+ */
+static TopicNode_t *
+addTopicChild(umqtt_Instance_t *this, TopicNode_t *pNode, const char *pLevel, uint32_t len)
+{
+    TopicNode_t **ppWild = NULL;
+    uint32_t hash = 0;
+    if ((len == 1) && (pLevel[0] == '+'))
+    {
+        ppWild = &pNode->plus;
+    }
+    else if ((len == 1) && (pLevel[0] == '#'))
+    {
+        ppWild = &pNode->hash;
+    }
+    else
+    {
+        hash = topicLevelHash(pLevel, len);
+        TopicNode_t *pChild = findTopicChild(pNode, pLevel, len, hash);
+        if (pChild)
+        {
+            return pChild;
+        }
+    }
+    if (ppWild && *ppWild)
+    {
+        return *ppWild;
+    }
+
+    // grow the hash table before adding another plain child
+    if (!ppWild && (pNode->childCount >= pNode->childSlots))
+    {
+        uint32_t newSlots = pNode->childSlots ? (pNode->childSlots * 2) : 4;
+        TopicNode_t **pNewChildren = allocMem(this, newSlots * sizeof(TopicNode_t *));
+        if (pNewChildren == NULL)
+        {
+            return NULL;
+        }
+        memset(pNewChildren, 0, newSlots * sizeof(TopicNode_t *));
+        for (uint32_t i = 0; i < pNode->childSlots; i++)
+        {
+            TopicNode_t *pNext = pNode->children[i];
+            while (pNext)
+            {
+                TopicNode_t *pChild = pNext;
+                pNext = pChild->next;
+                TopicNode_t **ppSlot = &pNewChildren[pChild->levelHash & (newSlots - 1)];
+                pChild->next = *ppSlot;
+                *ppSlot = pChild;
+            }
+        }
+        if (pNode->children)
+        {
+            freeMem(this, pNode->children);
+        }
+        pNode->children = pNewChildren;
+        pNode->childSlots = newSlots;
+    }
+
+    TopicNode_t *pChild = allocMem(this, sizeof(TopicNode_t) + len);
+    if (pChild == NULL)
+    {
+        return NULL;
+    }
+    memset(pChild, 0, sizeof(TopicNode_t));
+    memcpy(pChild->level, pLevel, len);
+    pChild->levelLen = len;
+    pChild->levelHash = hash;
+    pChild->parent = pNode;
+    if (ppWild)
+    {
+        *ppWild = pChild;
+    }
+    else
+    {
+        TopicNode_t **ppSlot = &pNode->children[hash & (pNode->childSlots - 1)];
+        pChild->next = *ppSlot;
+        *ppSlot = pChild;
+        ++pNode->childCount;
+    }
+    return pChild;
+}
+
+/*
+ * @internal
+ *
+ * Free a subscription trie node if it is no longer needed
+ *
+ * @param this umqtt instance
+ * @param pNode the node
+ *
+ * A node that has no handlers and no children is removed from its
+ * parent and freed.  The root node is never freed.
+ *
+ * @return the parent of the node if it was freed, otherwise NULL
+ */
+static TopicNode_t *
+freeEmptyTopicNode(umqtt_Instance_t *this, TopicNode_t *pNode)
+{
+    TopicNode_t *pParent = pNode->parent;
+    if (pParent && !pNode->handlers && !pNode->childCount
+     && !pNode->plus && !pNode->hash)
+    {
+        if (pParent->plus == pNode)
+        {
+            pParent->plus = NULL;
+        }
+        else if (pParent->hash == pNode)
+        {
+            pParent->hash = NULL;
+        }
+        else
+        {
+            TopicNode_t **ppLink = &pParent->children[pNode->levelHash
+                                                     & (pParent->childSlots - 1)];
+            while (*ppLink != pNode)
+            {
+                ppLink = &(*ppLink)->next;
+            }
+            *ppLink = pNode->next;
+            --pParent->childCount;
+        }
+        if (pNode->children)
+        {
+            freeMem(this, pNode->children);
+        }
+        freeMem(this, pNode);
+        return pParent;
+    }
+    return NULL;
+}
+
+/*
+ * @internal
+ *
+ * Free subscription trie nodes that are no longer needed
+ *
+ * @param this umqtt instance
+ * @param pNode node to start from
+ *
+ * Starting at the node and moving up toward the root, each node that has
+ * no handlers and no children is freed.
+ */
+static void
+pruneTopicNode(umqtt_Instance_t *this, TopicNode_t *pNode)
+{
+    while (pNode)
+    {
+        pNode = freeEmptyTopicNode(this, pNode);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Remove handlers that were marked for removal during dispatch
+ *
+ * @param this umqtt instance
+ * @param pNode subtree to clean up
+ *
+ * Handlers can not be freed while a publish is being dispatched, in case
+ * a handler removes itself, so they are only marked and then removed
+ * here once the dispatch is finished.
+ */
+static void
+sweepTopicNode(umqtt_Instance_t *this, TopicNode_t *pNode)
+{
+    HandlerEntry_t **ppEntry = &pNode->handlers;
+    while (*ppEntry)
+    {
+        HandlerEntry_t *pEntry = *ppEntry;
+        if (pEntry->pfnHandler == NULL)
+        {
+            *ppEntry = pEntry->next;
+            freeMem(this, pEntry);
+        }
+        else
+        {
+            ppEntry = &pEntry->next;
+        }
+    }
+
+    // a pruned child can only take itself out of its hash chain, so
+    // remember the next one before visiting it
+    for (uint32_t i = 0; i < pNode->childSlots; i++)
+    {
+        TopicNode_t *pNext = pNode->children[i];
+        while (pNext)
+        {
+            TopicNode_t *pChild = pNext;
+            pNext = pChild->next;
+            sweepTopicNode(this, pChild);
+        }
+    }
+    if (pNode->plus)
+    {
+        sweepTopicNode(this, pNode->plus);
+    }
+    if (pNode->hash)
+    {
+        sweepTopicNode(this, pNode->hash);
+    }
+    freeEmptyTopicNode(this, pNode);
+}
+
+/*
+ * @internal
+ *
+ * Free the whole subscription trie
+ *
+ * @param this umqtt instance
+ * @param pNode subtree to free
+ */
+static void
+freeTopicNode(umqtt_Instance_t *this, TopicNode_t *pNode)
+{
+    while (pNode->handlers)
+    {
+        HandlerEntry_t *pEntry = pNode->handlers;
+        pNode->handlers = pEntry->next;
+        freeMem(this, pEntry);
+    }
+    for (uint32_t i = 0; i < pNode->childSlots; i++)
+    {
+        while (pNode->children[i])
+        {
+            TopicNode_t *pChild = pNode->children[i];
+            pNode->children[i] = pChild->next;
+            freeTopicNode(this, pChild);
+        }
+    }
+    if (pNode->plus)
+    {
+        freeTopicNode(this, pNode->plus);
+    }
+    if (pNode->hash)
+    {
+        freeTopicNode(this, pNode->hash);
+    }
+    if (pNode->children)
+    {
+        freeMem(this, pNode->children);
+    }
+    freeMem(this, pNode);
+}
+
+/*
+ * @internal
+ *
+ * Find the plain ASCII run at the start of a topic
+ *
+ * @param pTopic the topic bytes
+ * @param len number of bytes in the topic
+ * @param isName true for a topic name, false for a topic filter
+ *
+ * The run ends at the first byte that is not ASCII, is null, or for a
+ * topic name is a wildcard.  Those bytes need a closer look by
+ * validTopic().  This is the portable version, the vector versions below
+ * do the same thing many bytes at a time.
+ *
+ * @return number of bytes in the run
+ */
+static size_t
+topicSpanScalar(const uint8_t *pTopic, size_t len, bool isName)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        uint8_t c = pTopic[i];
+        if ((c == 0) || (c >= 0x80) || (isName && ((c == '+') || (c == '#'))))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+#if defined(UMQTT_SIMD_SSE2)
+/*
+ * @internal
+ *
+ * Find the plain ASCII run at the start of a topic, 16 bytes at a time
+ *
+ * See topicSpanScalar().
+ */
+static size_t
+topicSpanSse2(const uint8_t *pTopic, size_t len, bool isName)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i hash = _mm_set1_epi8('#');
+    size_t i = 0;
+    while ((i + 16) <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&pTopic[i]);
+        // non-ASCII bytes already have the top bit set
+        __m128i stop = _mm_or_si128(v, _mm_cmpeq_epi8(v, zero));
+        if (isName)
+        {
+            stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, plus));
+            stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, hash));
+        }
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(stop);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + topicSpanScalar(&pTopic[i], len - i, isName);
+}
+#endif
+
+#if defined(UMQTT_SIMD_AVX2)
+/*
+ * @internal
+ *
+ * Find the plain ASCII run at the start of a topic, 32 bytes at a time
+ *
+ * See topicSpanScalar().  Only called if the processor supports AVX2.
+ */
+__attribute__((target("avx2")))
+static size_t
+topicSpanAvx2(const uint8_t *pTopic, size_t len, bool isName)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i plus = _mm256_set1_epi8('+');
+    const __m256i hash = _mm256_set1_epi8('#');
+    size_t i = 0;
+    while ((i + 32) <= len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&pTopic[i]);
+        // non-ASCII bytes already have the top bit set
+        __m256i stop = _mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero));
+        if (isName)
+        {
+            stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, plus));
+            stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, hash));
+        }
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(stop);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    return i + topicSpanScalar(&pTopic[i], len - i, isName);
+}
+#endif
+
+/*
+ * @internal
+ *
+ * Choose the fastest topic scanner for this processor
+ *
+ * @return the topic scanner function
+ */
+static TopicSpan_t
+selectTopicSpan(void)
+{
+#if defined(UMQTT_SIMD_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return topicSpanAvx2;
+    }
+#endif
+#if defined(UMQTT_SIMD_SSE2)
+    return topicSpanSse2;
+#else
+    return topicSpanScalar;
+#endif
+}
+
+/*
+ * @internal
+ *
+ * Check that a topic is well formed UTF-8
+ *
+ * @param pfnSpan topic scanner from selectTopicSpan()
+ * @param pTopic the topic bytes
+ * @param len number of bytes in the topic
+ * @param isName true for a topic name, false for a topic filter
+ *
+ * MQTT topics must be UTF-8 without overlong encodings, surrogates or
+ * the null character.  A topic name must not be empty and must not
+ * contain wildcards.  Runs of plain ASCII are skipped by the scanner, so
+ * only the multibyte characters are decoded one at a time.
+ *
+ * @return true if the topic is valid
+ */
+static bool
+validTopic(TopicSpan_t pfnSpan, const char *pTopic, size_t len, bool isName)
+{
+    static const uint32_t minCodePoint[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    const uint8_t *p = (const uint8_t *)pTopic;
+    if (isName && (len == 0))
+    {
+        return false;
+    }
+    size_t i = 0;
+    while (i < len)
+    {
+        i += pfnSpan(&p[i], len - i, isName);
+        if (i == len)
+        {
+            break;
+        }
+
+        // the run ended on a null or a wildcard
+        uint8_t c = p[i];
+        if (c < 0x80)
+        {
+            return false;
+        }
+
+        // decode one multibyte character
+        uint32_t count;
+        uint32_t codePoint;
+        if ((c & 0xE0) == 0xC0)
+        {
+            count = 2;
+            codePoint = c & 0x1F;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            count = 3;
+            codePoint = c & 0x0F;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            count = 4;
+            codePoint = c & 0x07;
+        }
+        else
+        {
+            return false;
+        }
+        if (count > (len - i))
+        {
+            return false;
+        }
+        for (uint32_t k = 1; k < count; k++)
+        {
+            if ((p[i + k] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+            codePoint = (codePoint << 6) | (p[i + k] & 0x3F);
+        }
+        if ((codePoint < minCodePoint[count]) || (codePoint > 0x10FFFF)
+         || ((codePoint >= 0xD800) && (codePoint <= 0xDFFF)))
+        {
+            return false;
+        }
+        i += count;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Check a topic name if the instance validates topics
+ *
+ * @param this umqtt instance
+ * @param pTopic the topic name
+ * @param len number of bytes in the topic name
+ *
+ * @return true if the topic name can be used, or is not checked
+ */
+static bool
+checkTopicName(umqtt_Instance_t *this, const char *pTopic, size_t len)
+{
+    return !this->pfnTopicSpan || validTopic(this->pfnTopicSpan, pTopic, len, true);
+}
+
+/*
+ * @internal
+ *
+ * Check that a topic filter is valid
+ *
+ * @param pFilter the topic filter
+ *
+ * A wildcard must be a whole topic level, and '#' can only be the last
+ * level.
+ *
+ * @return true if the topic filter can be subscribed
+ */
+static bool
+validTopicFilter(const char *pFilter)
+{
+    size_t len = strlen(pFilter);
+    if ((len == 0) || (len > 0xFFFF))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((pFilter[i] == '+') || (pFilter[i] == '#'))
+        {
+            if (((i > 0) && (pFilter[i - 1] != '/'))
+             || (((i + 1) < len) && (pFilter[i + 1] != '/'))
+             || ((pFilter[i] == '#') && ((i + 1) != len)))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Check a topic filter if the instance validates topics
+ *
+ * @param this umqtt instance
+ * @param pFilter the topic filter
+ *
+ * @return true if the topic filter can be subscribed, or is not checked
+ */
+static bool
+checkTopicFilter(umqtt_Instance_t *this, const char *pFilter)
+{
+    return !this->pfnTopicSpan
+        || (validTopicFilter(pFilter)
+            && validTopic(this->pfnTopicSpan, pFilter, strlen(pFilter), false));
+}
+
+/*
+ * @internal
+ *
+ * Find the subscription trie node for a topic filter
+ *
+ * @param this umqtt instance
+ * @param pFilter the topic filter
+ * @param create true to add any missing levels
+ *
+ * @return the node for the last level of the filter, or NULL if it does
+ * not exist, or could not be added
+ */
+static TopicNode_t *
+findTopicNode(umqtt_Instance_t *this, const char *pFilter, bool create)
+{
+    if (this->pTopicRoot == NULL)
+    {
+        if (!create)
+        {
+            return NULL;
+        }
+        this->pTopicRoot = allocMem(this, sizeof(TopicNode_t));
+        if (this->pTopicRoot == NULL)
+        {
+            return NULL;
+        }
+        memset(this->pTopicRoot, 0, sizeof(TopicNode_t));
+    }
+
+    TopicNode_t *pNode = this->pTopicRoot;
+    for (;;)
+    {
+        const char *pEnd = strchr(pFilter, '/');
+        uint32_t len = pEnd ? (uint32_t)(pEnd - pFilter) : (uint32_t)strlen(pFilter);
+        if (create)
+        {
+            TopicNode_t *pChild = addTopicChild(this, pNode, pFilter, len);
+            if (pChild == NULL)
+            {
+                pruneTopicNode(this, pNode);
+                return NULL;
+            }
+            pNode = pChild;
+        }
+        else if ((len == 1) && (pFilter[0] == '+'))
+        {
+            pNode = pNode->plus;
+        }
+        else if ((len == 1) && (pFilter[0] == '#'))
+        {
+            pNode = pNode->hash;
+        }
+        else
+        {
+            pNode = findTopicChild(pNode, pFilter, len, topicLevelHash(pFilter, len));
+        }
+        if ((pNode == NULL) || (pEnd == NULL))
+        {
+            return pNode;
+        }
+        pFilter = pEnd + 1;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Register a handler for a topic filter
+ *
+ * @param this umqtt instance
+ * @param pFilter the topic filter
+ * @param pfnHandler the handler function
+ * @param pUser user data pointer for the handler
+ *
+ * Registering the same handler and user pointer again for the same filter
+ * has no effect.  A new registration is marked with _isNew_, so that
+ * settleTopicHandlers() can tell it apart from one that was already
+ * there.
+ *
+ * @return UMQTT_ERR_OK, or UMQTT_ERR_BUFSIZE if memory could not be
+ * allocated
+ */
+static umqtt_Error_t
+addTopicHandler(umqtt_Instance_t *this, const char *pFilter,
+                TopicHandler_t pfnHandler, void *pUser)
+{
+    TopicNode_t *pNode = findTopicNode(this, pFilter, true);
+    RETURN_IF_ERR(pNode == NULL, UMQTT_ERR_BUFSIZE);
+
+    // add at the end of the list so handlers are called in order
+    HandlerEntry_t **ppEntry = &pNode->handlers;
+    while (*ppEntry)
+    {
+        if (((*ppEntry)->pfnHandler == pfnHandler) && ((*ppEntry)->pUser == pUser))
+        {
+            return UMQTT_ERR_OK;
+        }
+        ppEntry = &(*ppEntry)->next;
+    }
+    HandlerEntry_t *pEntry = allocMem(this, sizeof(HandlerEntry_t));
+    if (pEntry == NULL)
+    {
+        pruneTopicNode(this, pNode);
+        return UMQTT_ERR_BUFSIZE;
+    }
+    pEntry->next = NULL;
+    pEntry->pfnHandler = pfnHandler;
+    pEntry->pUser = pUser;
+    pEntry->isNew = true;
+    *ppEntry = pEntry;
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Remove handlers for a topic filter
+ *
+ * @param this umqtt instance
+ * @param pFilter the topic filter
+ * @param pfnHandler the handler function to remove, or NULL to remove
+ * all handlers for the filter
+ * @param pUser user data pointer of the handler to remove
+ */
+static void
+removeTopicHandler(umqtt_Instance_t *this, const char *pFilter,
+                   TopicHandler_t pfnHandler, void *pUser)
+{
+    TopicNode_t *pNode = findTopicNode(this, pFilter, false);
+    if (pNode == NULL)
+    {
+        return;
+    }
+    HandlerEntry_t **ppEntry = &pNode->handlers;
+    while (*ppEntry)
+    {
+        HandlerEntry_t *pEntry = *ppEntry;
+        if (!pfnHandler || ((pEntry->pfnHandler == pfnHandler) && (pEntry->pUser == pUser)))
+        {
+            // while dispatching, only mark the handler to be removed later
+            if (this->topicDispatching)
+            {
+                pEntry->pfnHandler = NULL;
+                this->topicSweepPending = true;
+                ppEntry = &pEntry->next;
+            }
+            else
+            {
+                *ppEntry = pEntry->next;
+                freeMem(this, pEntry);
+            }
+        }
+        else
+        {
+            ppEntry = &pEntry->next;
+        }
+    }
+    if (!this->topicDispatching)
+    {
+        pruneTopicNode(this, pNode);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Keep or take out the handlers just added for a list of topic filters
+ *
+ * @param this umqtt instance
+ * @param count number of topic filters
+ * @param topics the topic filters
+ * @param pfnHandler the handler function that was added
+ * @param pUser user data pointer of the handler
+ * @param keep true to keep the new registrations, false to remove them
+ *
+ * Only registrations that were made new by addTopicHandler() are
+ * touched, so a handler that was already registered for one of the
+ * filters stays registered if the subscribe fails.
+ */
+static void
+settleTopicHandlers(umqtt_Instance_t *this, uint32_t count, char *topics[],
+                    TopicHandler_t pfnHandler, void *pUser, bool keep)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        TopicNode_t *pNode = findTopicNode(this, topics[i], false);
+        HandlerEntry_t *pEntry = pNode ? pNode->handlers : NULL;
+        while (pEntry)
+        {
+            if (pEntry->isNew && (pEntry->pfnHandler == pfnHandler) && (pEntry->pUser == pUser))
+            {
+                pEntry->isNew = false;
+                if (!keep)
+                {
+                    removeTopicHandler(this, topics[i], pfnHandler, pUser);
+                }
+                break;
+            }
+            pEntry = pEntry->next;
+        }
+    }
+}
+
+/*
+ * @internal
+ *
+ * Call the handlers registered at a subscription trie node
+ *
+ * @param this umqtt instance
+ * @param pNode the node that matched the topic
+ * @param pMsg the received publish message
+ *
+ * @return number of handlers called
+ */
+static uint32_t
+callTopicHandlers(umqtt_Instance_t *this, const TopicNode_t *pNode, const TopicMsg_t *pMsg)
+{
+    uint32_t count = 0;
+    for (HandlerEntry_t *pEntry = pNode->handlers; pEntry; pEntry = pEntry->next)
+    {
+        if (pEntry->pfnHandler)
+        {
+            pEntry->pfnHandler(this, pEntry->pUser, pMsg->dup, pMsg->retain, pMsg->qos,
+                               pMsg->pTopic, pMsg->topicLen, pMsg->pPayload, pMsg->payloadLen);
+            ++count;
+        }
+    }
+    return count;
+}
+
+/*
+ * @internal
+ *
+ * Match topic levels against a subscription trie node
+ *
+ * @param this umqtt instance
+ * @param pNode the node to match the levels below
+ * @param pLevel the next topic level to match
+ * @param len length of the rest of the topic, starting at pLevel
+ * @param pMsg the received publish message
+ *
+ * Each level of the topic is looked up in the hash table of the node, and
+ * also matched to the '+' child if there is one.  A '#' child matches
+ * all of the remaining levels.  The cost depends on the number of topic
+ * levels and not on the number of subscribed filters.  Wildcards at the
+ * first level do not match topics that start with '$'.
+ *
+ * @return number of handlers called
+ */
+static uint32_t
+matchTopicNode(umqtt_Instance_t *this, const TopicNode_t *pNode,
+               const char *pLevel, uint32_t len, const TopicMsg_t *pMsg)
+{
+    uint32_t count = 0;
+    bool wildOk = (pNode != this->pTopicRoot) || (len == 0) || (pLevel[0] != '$');
+
+    if (pNode->hash && wildOk)
+    {
+        count += callTopicHandlers(this, pNode->hash, pMsg);
+    }
+
+    const char *pEnd = memchr(pLevel, '/', len);
+    uint32_t levelLen = pEnd ? (uint32_t)(pEnd - pLevel) : len;
+    const TopicNode_t *pMatches[2];
+    pMatches[0] = findTopicChild(pNode, pLevel, levelLen, topicLevelHash(pLevel, levelLen));
+    pMatches[1] = wildOk ? pNode->plus : NULL;
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        const TopicNode_t *pChild = pMatches[i];
+        if (pChild == NULL)
+        {
+            continue;
+        }
+        if (pEnd)
+        {
+            count += matchTopicNode(this, pChild, pEnd + 1, len - levelLen - 1, pMsg);
+        }
+        else
+        {
+            // last level, and a '#' below also matches the parent level
+            count += callTopicHandlers(this, pChild, pMsg);
+            if (pChild->hash)
+            {
+                count += callTopicHandlers(this, pChild->hash, pMsg);
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * @internal
+ *
+ * Pass a received publish message to the handlers for matching filters
+ *
+ * @param this umqtt instance
+ * @param pMsg the received publish message
+ *
+ * @return number of handlers called
+ */
+static uint32_t
+dispatchTopic(umqtt_Instance_t *this, const TopicMsg_t *pMsg)
+{
+    if (this->pTopicRoot == NULL)
+    {
+        return 0;
+    }
+    ++this->topicDispatching;
+    uint32_t count = matchTopicNode(this, this->pTopicRoot, pMsg->pTopic,
+                                    pMsg->topicLen, pMsg);
+    --this->topicDispatching;
+    if (this->topicSweepPending && !this->topicDispatching)
+    {
+        this->topicSweepPending = false;
+        sweepTopicNode(this, this->pTopicRoot);
+    }
+    return count;
+}
+
+/**
+ * Get string representing an error code.
+ *
+ * @param err is the error code to decode
+ *
+ * This function is useful for debugging.  It can be used to print
+ * a meaningful string for an error code.
+
+ * @return a human readable string representation of the error code
+ */
+const char *
+umqtt_GetErrorString(umqtt_Error_t err)
+{
+    return errCodeStrings[err];
+}
+
+/* @internal
+ *
+ * Encode length into MQTT remaining length format
+ *
+ * @param length length to encode
+ * @param pEncodeBuf buffer to store encoded length
+ *
+ * Does not validate parameters.  Assumes length is valid
+ * and buffer is large enough to hold encoded length.
+ *
+ * @return the count of bytes that hold the length
+ */
+static uint32_t
+umqtt_EncodeLength(uint32_t length, uint8_t *pEncodeBuf)
+{
+    uint8_t encByte;
+    uint32_t idx = 0;
+    do
+    {
+        encByte = length % 128;
+        length /= 128;
+        if (length > 0)
+        {
+            encByte |= 0x80;
+        }
+        pEncodeBuf[idx] = encByte;
+        ++idx;;
+    } while (length > 0);
+    return idx; // return count of bytes
+}
+
+/* @internal
+ *
+ * Decode remaining length field from MQTT packet.
+ *
+ * @param pLength storage to location of decoded length
+ * @param pEncodedLength buffer holding the encoded length field
+ * @param encodedLen number of bytes available at _pEncodedLength_
+ *
+ * The caller supplies storage for the decoded length through the
+ * _pLength_ parameter.  The number of bytes used to hold the encoded
+ * length in the packet is returned to the caller.  At most 4 bytes, and
+ * never more than _encodedLen_ bytes, are read.  Lengths of 1 and 2 bytes
+ * are the most common so they are decoded without a loop.
+ *
+ * @return count of bytes of the encoded length, or 0 if the field is
+ * longer than 4 bytes or runs past the end of the buffer
+ */
+static uint32_t
+umqtt_DecodeLength(uint32_t *pLength, const uint8_t *pEncodedLength, uint32_t encodedLen)
+{
+    if ((encodedLen >= 1) && !(pEncodedLength[0] & 0x80))
+    {
+        *pLength = pEncodedLength[0];
+        return 1;
+    }
+    if ((encodedLen >= 2) && !(pEncodedLength[1] & 0x80))
+    {
+        *pLength = (pEncodedLength[0] & 0x7F) | ((uint32_t)pEncodedLength[1] << 7);
+        return 2;
+    }
+
+    uint32_t length = 0;
+    uint32_t limit = (encodedLen < 4) ? encodedLen : 4;
+    for (uint32_t count = 0; count < limit; count++)
+    {
+        uint8_t encByte = pEncodedLength[count];
+        length |= (uint32_t)(encByte & 0x7F) << (7 * count);
+        if (!(encByte & 0x80))
+        {
+            *pLength = length;
+            return count + 1;
+        }
+    }
+    return 0;
+}
+
+/* @internal
+ *
+ * Encode a data block into an MQTT packet
+ *
+ * @param pInBuf pointer to buffer containing data to encode
+ * @param inBufLen count of bytes in input buffer
+ * @param pOutBuf pointer to a buffer where the data block will be encoded
+ *
+ * This function assumes that the buffer pointed at by _pOutBuf_ is large
+ * enough to hold the encoded data block.  This function will take the data
+ * and length provided and encode it into a buffer as an MQTT data block.
+ *
+ * @return count of bytes that were encoded
+ */
+static uint32_t
+umqtt_EncodeData(const uint8_t *pInBuf, uint32_t inBufLen, uint8_t *pOutBuf)
+{
+    *pOutBuf++ = inBufLen >> 8;
+    *pOutBuf++ = inBufLen & 0xFF;
+    memcpy(pOutBuf, pInBuf, inBufLen);
+    return inBufLen + 2;
+}
+
+/* @internal
+ *
+ * Compute the size of a publish packet
+ *
+ * @param topicLen number of bytes in the topic name
+ * @param payloadLen number of bytes in the payload
+ * @param qos QoS level of the packet
+ * @param pRemainingLength storage for the packet remaining length
+ *
+ * @return the total number of bytes in the packet including the header
+ */
+static uint32_t
+umqtt_PublishLength(uint32_t topicLen, uint32_t payloadLen, uint32_t qos,
+                    uint32_t *pRemainingLength)
+{
+    uint32_t remainingLength = (qos ? 2 : 0) + 2 + topicLen + payloadLen;
+    uint32_t lenSize = 1;
+    for (uint32_t len = remainingLength; len > 127; len /= 128)
+    {
+        ++lenSize;
+    }
+    *pRemainingLength = remainingLength;
+    return 1 + lenSize + remainingLength;
+}
+
+/* @internal
+ *
+ * Encode a complete publish packet
+ *
+ * @param pOutBuf buffer where the packet will be encoded
+ * @param pField the topic length and name already encoded, or NULL to
+ * encode them from _topic_
+ * @param topic topic name to publish
+ * @param topicLen number of bytes in the topic name
+ * @param payload payload for the topic, can be NULL if _payloadLen_ is 0
+ * @param payloadLen number of bytes in the payload
+ * @param qos QoS level for the packet
+ * @param shouldRetain true if the broker should retain the topic
+ * @param packetId packet ID, only used if the QoS is non-zero
+ *
+ * This function assumes that the parameters are valid and that the
+ * buffer is large enough to hold the packet, see umqtt_PublishLength().
+ *
+ * @return count of bytes that were encoded
+ */
+static uint32_t
+umqtt_EncodePublish(uint8_t *pOutBuf, const uint8_t *pField,
+                    const char *topic, uint32_t topicLen,
+                    const uint8_t *payload, uint32_t payloadLen,
+                    uint32_t qos, bool shouldRetain, uint16_t packetId)
+{
+    uint32_t remainingLength;
+    uint32_t pktLen = umqtt_PublishLength(topicLen, payloadLen, qos, &remainingLength);
+
+    // header flags, the dup flag is set when the packet is retransmitted
+    uint8_t flags = 0;
+    flags |= shouldRetain ? UMQTT_FLAG_RETAIN : 0;
+    flags |= (qos << UMQTT_FLAG_QOS_SHIFT) & UMQTT_FLAG_QOS;
+    pOutBuf[0] = (UMQTT_TYPE_PUBLISH << 4) | flags;
+    uint32_t idx = 1 + umqtt_EncodeLength(remainingLength, &pOutBuf[1]);
+
+    // topic name
+    if (pField)
+    {
+        memcpy(&pOutBuf[idx], pField, topicLen + 2);
+        idx += topicLen + 2;
+    }
+    else
+    {
+        idx += umqtt_EncodeData((const uint8_t *)topic, topicLen, &pOutBuf[idx]);
+    }
+
+    // if QOS then also need packet ID
+    if (qos != 0)
+    {
+        pOutBuf[idx++] = packetId >> 8;
+        pOutBuf[idx++] = packetId & 0xFF;
+    }
+
+    // payload message
+    if (payloadLen)
+    {
+        memcpy(&pOutBuf[idx], payload, payloadLen);
+    }
+    return pktLen;
+}
+
+/*
+ * @internal
+ *
+ * Encode a publish acknowledgment packet
+ *
+ * @param pOutBuf buffer of at least 4 bytes to hold the packet
+ * @param type PUBACK, PUBREC, PUBREL or PUBCOMP packet type
+ * @param packetId packet ID of the publish that is acknowledged
+ *
+ * These packets are identical except for the type, and PUBREL which
+ * needs fixed header flags of 0x02.
+ *
+ * @return count of bytes that were encoded
+ */
+static uint32_t
+umqtt_EncodeAck(uint8_t *pOutBuf, uint8_t type, uint16_t packetId)
+{
+    pOutBuf[0] = (type << 4) | ((type == UMQTT_TYPE_PUBREL) ? 0x02 : 0);
+    pOutBuf[1] = 2;
+    pOutBuf[2] = packetId >> 8;
+    pOutBuf[3] = packetId & 0xFF;
+    return 4;
+}
+
+/*
+ * @internal
+ *
+ * Write the collected acknowledgments to the network
+ *
+ * @param this umqtt instance
+ *
+ * The acknowledgments are written together but counted in the statistics
+ * one packet at a time.  If the write fails they are dropped, and the
+ * server will send the publish packets again.
+ *
+ * @return UMQTT_ERR_OK or UMQTT_ERR_NETWORK
+ */
+static umqtt_Error_t
+flushAcks(umqtt_Instance_t *this)
+{
+    uint32_t len = this->ackLen;
+    if (len == 0)
+    {
+        return UMQTT_ERR_OK;
+    }
+    this->ackLen = 0;
+    RETURN_IF_ERR(!writeBytes(this, this->pAckBuf, len, false), UMQTT_ERR_NETWORK);
+    this->statsDirty = true;
+    for (uint32_t idx = 0; idx < len; idx += 4)
+    {
+        ++this->stats.pktsSent[this->pAckBuf[idx] >> 4];
+    }
+    this->stats.bytesSent += len;
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Initiate MQTT protocol Connect
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param cleanSession true to establish new session, false to resume old session
+ * @param willRetain true if published will message should be retained
+ * @param willQos the QoS level to be used for the will message (if used)
+ * @param keepAlive the keep alive interval in seconds
+ * @param clientId the name of the MQTT client to use for the session
+ * @param willTopic optional topic name for will, or NULL
+ * @param willPayload optional will payload, or NULL
+ * @param willPayloadLen length of the will payload message
+ * @param username optional authentication user name, or NULL
+ * @param password optional authentication password, or NULL
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * This function will create a MQTT Connect packet and attempt to send it
+ * to the MQTT broker.  The network connection to the MQTT server port should
+ * already be established.  When the function returns, the Connect packet
+ * has been sent or there was an error.  Upon return, the MQTT connection
+ * is pending, it is not yet established.  The connection is not established
+ * until the MQTT broker sends a Connack packet, which can be detected by
+ * either using the Connack callback function, or when umqtt_GetConnectedStatus()
+ * returns UMQTT_ERR_CONNECTED.
+ *
+ * Possible return codes:
+ *
+ * Code                      | Reason
+ * --------------------------|-------
+ * UMQTT_ERR_OK              | Connect packet was transmitted
+ * UMQTT_ERR_PARM            | detected an error in a function parameter
+ * UMQTT_ERR_BUFSIZE         | memory allocation failed
+ * UMQTT_ERR_NETWORK         | error writing packet to network
+ * UMQTT_ERR_CONNECTED       | MQTT connection is already established
+ * UMQTT_ERR_CONNECT_PENDING | MQTT connection is already in progress
+ *
+ * __Example__
+ *
+ * ~~~~~~~~.c
+ * umqtt_Handle_t h; // previously acquired instance handle
+ * char clientName[] = "myMqttClient";
+ * char willTopic[] = "myWillTopic";
+ * uint8_t willPayload[] = (uint8_t *)"myWillMessage";
+ *
+ * umqtt_Error_t err;
+ * err = umqtt_Connect(h, true, false, 0, 30, // clean session, 30 secs keep alive
+ *                     clientName, willTopic,
+ *                     willPayload, strlen(willPayload),
+ *                     NULL, NULL); // no username or password
+ * if (err != UMQTT_ERR_OK)
+ * {
+ *     // handle error
+ * }
+ * else
+ * {
+ *     // connect is in progress
+ * }
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_Connect(umqtt_Handle_t h,
+              bool cleanSession, bool willRetain, uint8_t willQos,
+              uint16_t keepAlive, const char *clientId,
+              const char *willTopic, const uint8_t *willPayload, uint32_t willPayloadLen,
+              const char *username, const char *password)
+{
+    uint8_t connectFlags = 0;
+    uint32_t idx = 0;
+    umqtt_Instance_t *this = h;
+
+    // initial parameter check
+    RETURN_IF_ERR((this == NULL) || (clientId == NULL), UMQTT_ERR_PARM);
+    size_t clientIdLen = strlen(clientId);
+    size_t willTopicLen = willTopic ? strlen(willTopic) : 0;
+    size_t usernameLen = username ? strlen(username) : 0;
+    size_t passwordLen = password ? strlen(password) : 0;
+
+    // already connected
+    RETURN_IF_ERR(this->isConnected, UMQTT_ERR_CONNECTED);
+    RETURN_IF_ERR(this->connectIsPending, UMQTT_ERR_CONNECT_PENDING);
+
+    // calculate the "remaining length" for the packet based on
+    // the various input fields.
+    RETURN_IF_ERR(clientIdLen == 0, UMQTT_ERR_PARM);
+    uint16_t remainingLength = 10 + 2 + clientIdLen;
+    if (willTopicLen)
+    {
+        connectFlags |= UMQTT_CONNECT_FLAG_WILL;
+        RETURN_IF_ERR(!checkTopicName(this, willTopic, willTopicLen), UMQTT_ERR_PARM);
+        remainingLength += 2 + willTopicLen;
+        // if there is a will topic there should be a will message
+        RETURN_IF_ERR(willPayload == NULL, UMQTT_ERR_PARM);
+        remainingLength += 2 + willPayloadLen;
+    }
+    if (usernameLen)
+    {
+        connectFlags |= UMQTT_CONNECT_FLAG_USER;
+        remainingLength += 2 + usernameLen;
+    }
+    if (passwordLen)
+    {
+        connectFlags |= UMQTT_CONNECT_FLAG_PASS;
+        remainingLength += 2 + passwordLen;
+    }
+
+    // allocate buffer needed for encode
+    uint8_t *buf = newPacket(this, remainingLength);
+    RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
+
+    // allocate second buffer just to hold packet timeout
+    uint8_t *tmoBuf = newPacket(this, 0);
+    if (tmoBuf == NULL)
+    {
+        deletePacket(this, buf);
+        return UMQTT_ERR_BUFSIZE;
+    }
+
+    // encode the remaining length into the appropriate position in the buffer
+    uint32_t lenSize = umqtt_EncodeLength(remainingLength, &buf[1]);
+
+    // compute final length of packet with all data and headers
+    remainingLength += 1 + lenSize;
+
+    // encode the packet type and adjust index ahead to
+    // point at variable header
+    buf[0] = UMQTT_TYPE_CONNECT << 4;
+    idx = 1 + lenSize;
+    tmoBuf[0] = buf[0];
+
+    // encode protocol name
+    const uint8_t *protocolName = (const uint8_t *)"MQTT";
+    idx += umqtt_EncodeData(protocolName, 4, &buf[idx]);
+
+    // protocol level, connect flags and keepalive
+    connectFlags |= willRetain ? UMQTT_CONNECT_FLAG_WILL_RETAIN : 0;
+    connectFlags |= cleanSession ? UMQTT_CONNECT_FLAG_CLEAN : 0;
+    connectFlags |= (willQos << UMQTT_CONNECT_FLAG_QOS_SHIFT) & UMQTT_CONNECT_FLAG_WILL_QOS;
+    buf[idx++] = 4;
+    buf[idx++] = connectFlags;
+    buf[idx++] = keepAlive >> 8;
+    buf[idx++] = keepAlive & 0xFF;
+    this->keepAlive = keepAlive;
+
+    // client id
+    idx += umqtt_EncodeData((const uint8_t *)clientId, clientIdLen, &buf[idx]);
+
+    // will topic and message
+    if (willTopicLen)
+    {
+        // check data pointers
+        idx += umqtt_EncodeData((const uint8_t *)willTopic, willTopicLen, &buf[idx]);
+        idx += umqtt_EncodeData(willPayload, willPayloadLen, &buf[idx]);
+    }
+
+    // username
+    if (usernameLen)
+    {
+        idx += umqtt_EncodeData((const uint8_t *)username, usernameLen, &buf[idx]);
+    }
+
+    // password
+    if (passwordLen)
+    {
+        idx += umqtt_EncodeData((const uint8_t *)password, passwordLen, &buf[idx]);
+    }
+
+    // attempt to send the packet on the network
+    bool sent = writePacket(this, buf, remainingLength, false);
+    // no matter what, we dont need this packet any more so free it
+    deletePacket(this, buf);
+
+    // check for error sending on the network
+    if (!sent)
+    {
+        // also need to delete the timeout packet since we dont need it now
+        deletePacket(this, tmoBuf);
+        return UMQTT_ERR_NETWORK; // network error
+    }
+
+    // if we make it here then we are attempting a connection and dont know
+    // yet if there is a connection.  Enqueue the timeout packet for the
+    // purpose of tracking the timeout until we get a CONNACK.
+    // This packet doesnt have a packet ID so just use 0
+    enqueuePacket(this, tmoBuf, 0, this->ticks);
+    this->connectIsPending = true;
+
+    // acknowledgments collected on the old connection are not sent
+    this->ackLen = 0;
+
+    // a new session forgets the QoS 2 messages received in the old one
+    if (cleanSession && this->pQos2Ids)
+    {
+        memset(this->pQos2Ids, 0, UMQTT_QOS2_BITMAP_SIZE);
+    }
+
+    // return success - connect attempt is in flight
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Disconnect MQTT protocol
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ *
+ * @return UMQTT_ERR_OK or an error code
+ *
+ * This function attempts to send a MQTT protocol disconnect packet, frees
+ * up all pending packets and marks the instance as disconnected.
+ */
+umqtt_Error_t
+umqtt_Disconnect(umqtt_Handle_t h)
+{
+    umqtt_Instance_t *this = h;
+    static const uint8_t disconnectPacket[2] = { UMQTT_TYPE_DISCONNECT << 4, 0 };
+
+    // initial parameter check
+    RETURN_IF_ERR(h == NULL, UMQTT_ERR_PARM);
+
+    // clean out packet queue and any partly received packet, and send
+    // the acknowledgments that are still collected
+    freeAllQueuedPackets(this);
+    resetFrame(this);
+    flushAcks(this);
+
+    // attempt to send disconnect packet
+    bool sent = writePacket(this, disconnectPacket, 2, false);
+
+    // clear connection status no matter what
+    this->isConnected = false;
+    this->connectIsPending = false;
+    this->pingIsPending = false;
+
+    if (!sent)
+    {
+        return UMQTT_ERR_NETWORK; // network error
+    }
+
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Send a publish acknowledgment packet that is not tracked
+ *
+ * @param this umqtt instance
+ * @param type PUBACK, PUBREC, PUBREL or PUBCOMP packet type
+ * @param packetId packet ID of the publish that is acknowledged
+ *
+ * If the instance collects acknowledgments (the _coalesceAcks_ option),
+ * the packet is added to the ack buffer, which is written when it is full
+ * or the oldest packet in it has waited for the ack delay.  Otherwise the
+ * packet is written right away.
+ *
+ * @return UMQTT_ERR_OK or UMQTT_ERR_NETWORK
+ */
+static umqtt_Error_t
+sendAck(umqtt_Instance_t *this, uint8_t type, uint16_t packetId)
+{
+    if (this->pAckBuf)
+    {
+        if (this->ackLen == 0)
+        {
+            this->ackTicks = nowTicks(this);
+        }
+        this->ackLen += umqtt_EncodeAck(&this->pAckBuf[this->ackLen], type, packetId);
+        if ((this->ackLen == this->ackBufLen)
+         || (this->ackDelay && ((nowTicks(this) - this->ackTicks) >= this->ackDelay)))
+        {
+            return flushAcks(this);
+        }
+        return UMQTT_ERR_OK;
+    }
+
+    uint8_t ackdat[4];
+    uint32_t len = umqtt_EncodeAck(ackdat, type, packetId);
+    RETURN_IF_ERR(!writePacket(this, ackdat, len, false), UMQTT_ERR_NETWORK);
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Replace a pending QoS 2 publish with a PUBREL
+ *
+ * @param this umqtt instance
+ * @param packetId packet ID from the PUBREC
+ *
+ * Once the server has sent PUBREC, the publish is not sent again and the
+ * PUBREL is retried instead until PUBCOMP arrives.  The PUBREL takes over
+ * the place of the publish in the in-flight window.  If there is no buffer
+ * for the PUBREL then the publish is kept, and its retransmit will draw
+ * another PUBREC.  A PUBREC for an unknown packet ID, or a repeated PUBREC,
+ * is answered with a PUBREL that is not tracked.
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_BUFSIZE or UMQTT_ERR_NETWORK
+ */
+static umqtt_Error_t
+releasePublish(umqtt_Instance_t *this, uint16_t packetId)
+{
+    int32_t slot = (packetId != 0) ? findPacketSlot(this, packetId, NULL) : -1;
+    PktBuf_t *pPkt = (slot >= 0) ? this->pktIndex[slot] : NULL;
+    uint8_t *buf = pPkt ? ((uint8_t *)pPkt + sizeof(PktBuf_t)) : NULL;
+    if ((buf == NULL) || ((buf[0] >> 4) != UMQTT_TYPE_PUBLISH))
+    {
+        return sendAck(this, UMQTT_TYPE_PUBREL, packetId);
+    }
+
+    uint8_t *relBuf = newPacket(this, 2);
+    RETURN_IF_ERR(relBuf == NULL, UMQTT_ERR_BUFSIZE);
+    uint32_t len = umqtt_EncodeAck(relBuf, UMQTT_TYPE_PUBREL, packetId);
+
+    // the index slot of the publish is reused by the PUBREL
+    uint32_t windowBytes = pPkt->windowBytes;
+    recordPacketLatency(this, UMQTT_LATENCY_PUBREC, buf);
+    unlinkPacket(this, pPkt);
+    deletePacket(this, buf);
+    enqueuePacket(this, relBuf, packetId, this->ticks);
+    if (windowBytes)
+    {
+        windowAdd(this, relBuf, windowBytes);
+    }
+
+    // if the write fails the PUBREL stays pending and is retried
+    RETURN_IF_ERR(!writePacket(this, relBuf, len, false), UMQTT_ERR_NETWORK);
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Send an encoded publish packet and track it until it is acked
+ *
+ * @param this umqtt instance
+ * @param buf publish packet that was allocated with newPacket()
+ * @param pktLen length of the packet
+ * @param packetId packet ID of the packet, 0 for QoS 0
+ *
+ * A QoS 0 packet is freed after it is sent.  Otherwise it is put in the
+ * pending list and the in-flight window.  The caller must have checked
+ * the window and reserved an index slot for a packet with a packet ID.
+ *
+ * @return UMQTT_ERR_OK or UMQTT_ERR_NETWORK
+ */
+static umqtt_Error_t
+sendPublishPacket(umqtt_Instance_t *this, uint8_t *buf, uint32_t pktLen, uint16_t packetId)
+{
+    if (writePacket(this, buf, pktLen, false))
+    {
+        // if qos is non-zero then we need to hang on to the packet until
+        // it is acked, so save the packetId and put it in the wait list
+        if (packetId != 0)
+        {
+            enqueuePacket(this, buf, packetId, this->ticks);
+            windowAdd(this, buf, pktLen);
+        }
+        else
+        {
+            deletePacket(this, buf);
+        }
+    }
+    else
+    {
+        deletePacket(this, buf);
+        return UMQTT_ERR_NETWORK; // network error
+    }
+
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Send a publish packet
+ *
+ * @param this umqtt instance
+ * @param pField the topic length and name as encoded in the packet, or
+ * NULL to encode it from _topic_
+ * @param topic topic name to publish
+ * @param topicLen number of bytes in the topic name
+ * @param payload payload for the topic, can be NULL if _payloadLen_ is 0
+ * @param payloadLen number of bytes in the payload
+ * @param qos QoS level for the packet
+ * @param shouldRetain true if the broker should retain the topic
+ * @param pId pointer to storage for assigned packet ID (optional)
  *
- * This function assumes that the buffer pointed at by _pOutBuf_ is large
- * enough to hold the encoded data block.  This function will take the data
- * and length provided and encode it into a buffer as an MQTT data block.
+ * This does the work for umqtt_Publish() and umqtt_PublishTopic(), after
+ * the parameters have been checked.
  *
- * @return count of bytes that were encoded
+ * @return UMQTT_ERR_OK if successful, or an error code
  */
-static uint32_t
-umqtt_EncodeData(const uint8_t *pInBuf, uint32_t inBufLen, uint8_t *pOutBuf)
+static umqtt_Error_t
+sendPublish(umqtt_Instance_t *this, const uint8_t *pField,
+            const char *topic, uint32_t topicLen,
+            const uint8_t *payload, uint32_t payloadLen,
+            uint32_t qos, bool shouldRetain, uint16_t *pId)
 {
-    *pOutBuf++ = inBufLen >> 8;
-    *pOutBuf++ = inBufLen & 0xFF;
-    memcpy(pOutBuf, pInBuf, inBufLen);
-    return inBufLen + 2;
+    // calculate the "remaining length" for the packet based on
+    // the various input fields.
+    uint32_t remainingLength = (qos ? 2 : 0) + 2 + topicLen;
+    remainingLength += payload ? payloadLen: 0;
+
+    // QoS 0 packets are not kept, so if the transport can write
+    // from several buffers then send the topic and payload in place
+    if ((qos == 0) && this->pNet->pfnNetWritevPacket)
+    {
+        uint8_t hdr[1 + 4 + 2];
+        hdr[0] = (UMQTT_TYPE_PUBLISH << 4) | (shouldRetain ? UMQTT_FLAG_RETAIN : 0);
+        uint32_t idx = 1 + umqtt_EncodeLength(remainingLength, &hdr[1]);
+        umqtt_Segment_t segs[3] =
+        {
+            { hdr, idx },
+            { pField, topicLen + 2 },
+            { payload, payloadLen }
+        };
+        remainingLength += idx;
+        if (pField == NULL)
+        {
+            hdr[idx++] = topicLen >> 8;
+            hdr[idx++] = topicLen & 0xFF;
+            segs[0].len = idx;
+            segs[1].pData = (const uint8_t *)topic;
+            segs[1].len = topicLen;
+        }
+        uint32_t segCount = payloadLen ? 3 : 2;
+        if (pId)
+        {
+            *pId = 0;
+        }
+        RETURN_IF_ERR(!writevPacket(this, segs, segCount, remainingLength), UMQTT_ERR_NETWORK);
+        return UMQTT_ERR_OK;
+    }
+
+    // make sure the packet fits in the in-flight window and
+    // can be tracked until it is acked
+    if (qos != 0)
+    {
+        uint32_t pktLen = umqtt_PublishLength(topicLen, payloadLen, qos, &remainingLength);
+        RETURN_IF_ERR(!windowHasRoom(this, 1, pktLen), UMQTT_ERR_WOULDBLOCK);
+        RETURN_IF_ERR(!reservePacketSlots(this, 1), UMQTT_ERR_BUFSIZE);
+    }
+
+    // allocate buffer needed to encode packet
+    uint8_t *buf = newPacket(this, remainingLength);
+    RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
+
+    // if QOS then also need packet ID
+    uint16_t packetId = (qos != 0) ? nextPacketId(this) : 0;
+    if (pId)
+    {
+        *pId = packetId;
+    }
+
+    // encode the whole packet and compute its final length
+    remainingLength = umqtt_EncodePublish(buf, pField, topic, topicLen, payload, payloadLen,
+                                          qos, shouldRetain, packetId);
+
+    return sendPublishPacket(this, buf, remainingLength, packetId);
 }
 
 /**
- * Initiate MQTT protocol Connect
+ * Send MQTT protocol Publish packet
  *
  * @param h umqtt instance handle from umqtt_New()
- * @param cleanSession true to establish new session, false to resume old session
- * @param willRetain true if published will message should be retained
- * @param willQos the QoS level to be used for the will message (if used)
- * @param keepAlive the keep alive interval in seconds
- * @param clientId the name of the MQTT client to use for the session
- * @param willTopic optional topic name for will, or NULL
- * @param willPayload optional will payload, or NULL
- * @param willPayloadLen length of the will payload message
- * @param username optional authentication user name, or NULL
- * @param password optional authentication password, or NULL
+ * @param topic topic name to publish
+ * @param payload payload or message for the topic (can be NULL)
+ * @param payloadLen number of bytes in the payload
+ * @param qos QoS (quality of service) level for this topic
+ * @param shouldRetain true if MQTT broker should retain this topic
+ * @param pId pointer to storage for assigned packet ID (optional)
  *
  * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
  *
- * This function will create a MQTT Connect packet and attempt to send it
- * to the MQTT broker.  The network connection to the MQTT server port should
- * already be established.  When the function returns, the Connect packet
- * has been sent or there was an error.  Upon return, the MQTT connection
- * is pending, it is not yet established.  The connection is not established
- * until the MQTT broker sends a Connack packet, which can be detected by
- * either using the Connack callback function, or when umqtt_GetConnectedStatus()
- * returns UMQTT_ERR_CONNECTED.
+ * This function is used to publish a topic with an optional payload.
+ * A publish packet will be assembled and sent to the connected UMQTT
+ * broker.  If the QoS > 0 then the packet will be held and resent as
+ * needed until an acknowledgment is received.  If this happens, then the
+ * Publish packet will have a packet ID.  The _pId_ parameter can be used
+ * to get the packet ID if needed.  Otherwise, this parameter can be set
+ * to NULL.  If the QoS is 0, then there is no packet ID.
  *
- * Possible return codes:
+ * If a callback function was provided for Puback, then the Puback callback
+ * will be called when the publish packet is acknowledged.
  *
- * Code                      | Reason
- * --------------------------|-------
- * UMQTT_ERR_OK              | Connect packet was transmitted
- * UMQTT_ERR_PARM            | detected an error in a function parameter
- * UMQTT_ERR_BUFSIZE         | memory allocation failed
- * UMQTT_ERR_NETWORK         | error writing packet to network
- * UMQTT_ERR_CONNECTED       | MQTT connection is already established
- * UMQTT_ERR_CONNECT_PENDING | MQTT connection is already in progress
+ * A payload is not required.  MQTT can publish only a topic name with
+ * no payload.  If a payload is not used then the parameter can be set
+ * to NULL.  The payload can be binary data and not necessarily a string.
+ *
+ * If the transport provides netWritevPacket_t() and the QoS is 0, then the
+ * packet is written straight from the topic and payload buffers without
+ * allocating or copying.  For QoS > 0 the packet has to be kept for
+ * retransmission so it is always assembled in a packet buffer.
+ *
+ * If the instance was created with an in-flight limit (see
+ * @ref umqtt_Options_t) and sending a QoS > 0 packet would go over the
+ * limit, then nothing is sent and UMQTT_ERR_WOULDBLOCK is returned.  The
+ * application should try again after some of the pending publish packets
+ * have been acknowledged, which can be detected with the Puback callback.
+ *
+ * For QoS 2 the Puback callback is called when the Pubcomp packet is
+ * received, after the umqtt library has completed the Pubrec and Pubrel
+ * exchange with the server.
  *
  * __Example__
  *
  * ~~~~~~~~.c
  * umqtt_Handle_t h; // previously acquired instance handle
- * char clientName[] = "myMqttClient";
- * char willTopic[] = "myWillTopic";
- * uint8_t willPayload[] = (uint8_t *)"myWillMessage";
+ * char topicName[] = "myTopic";
+ * uint8_t payload[] = (uint8_t *)"myPayloadMessage";
+ * uint16_t msgId;
  *
  * umqtt_Error_t err;
- * err = umqtt_Connect(h, true, false, 0, 30, // clean session, 30 secs keep alive
- *                     clientName, willTopic,
- *                     willPayload, strlen(willPayload),
- *                     NULL, NULL); // no username or password
- * if (err != UMQTT_ERR_OK)
+ * err = umqtt_Publish(h, topicName, payload, strlen(payload),
+ *                     1, true, *msgId);
+ * if (err == UMQTT_ERR_OK)
  * {
- *     // handle error
+ *     // Publish packet has been sent with QoS 1
+ *     // Packet is pending acknowledgment
+ *     // msgId now contains the packet ID that was used
  * }
- * else
+ * else // error occurred
  * {
- *     // connect is in progress
+ *     // handle publish error
  * }
  * ~~~~~~~~
  */
 umqtt_Error_t
-umqtt_Connect(umqtt_Handle_t h,
-              bool cleanSession, bool willRetain, uint8_t willQos,
-              uint16_t keepAlive, const char *clientId,
-              const char *willTopic, const uint8_t *willPayload, uint32_t willPayloadLen,
-              const char *username, const char *password)
+umqtt_Publish(umqtt_Handle_t h,
+              const char *topic, const uint8_t *payload, uint32_t payloadLen,
+              uint32_t qos, bool shouldRetain, uint16_t *pId)
 {
-    uint8_t connectFlags = 0;
-    uint32_t idx = 0;
     umqtt_Instance_t *this = h;
 
     // initial parameter check
-    RETURN_IF_ERR((this == NULL) || (clientId == NULL), UMQTT_ERR_PARM);
-    size_t clientIdLen = strlen(clientId);
-    size_t willTopicLen = willTopic ? strlen(willTopic) : 0;
-    size_t usernameLen = username ? strlen(username) : 0;
-    size_t passwordLen = password ? strlen(password) : 0;
+    RETURN_IF_ERR((this == NULL) || (topic == NULL), UMQTT_ERR_PARM);
+    size_t topicLen = strlen(topic);
+    RETURN_IF_ERR(topicLen > 0xFFFF, UMQTT_ERR_PARM);
+    RETURN_IF_ERR((payloadLen != 0) && (payload == NULL), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(payloadLen > (UMQTT_MAX_REMAINING_LENGTH - 4 - topicLen), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(qos > 2, UMQTT_ERR_PARM);
+    RETURN_IF_ERR(!checkTopicName(this, topic, topicLen), UMQTT_ERR_PARM);
 
-    // already connected
-    RETURN_IF_ERR(this->isConnected, UMQTT_ERR_CONNECTED);
-    RETURN_IF_ERR(this->connectIsPending, UMQTT_ERR_CONNECT_PENDING);
+    RETURN_IF_ERR(!this->isConnected, UMQTT_ERR_DISCONNECTED);
 
-    // calculate the "remaining length" for the packet based on
-    // the various input fields.
-    RETURN_IF_ERR(clientIdLen == 0, UMQTT_ERR_PARM);
-    uint16_t remainingLength = 10 + 2 + clientIdLen;
-    if (willTopicLen)
-    {
-        connectFlags |= UMQTT_CONNECT_FLAG_WILL;
-        remainingLength += 2 + willTopicLen;
-        // if there is a will topic there should be a will message
-        RETURN_IF_ERR(willPayload == NULL, UMQTT_ERR_PARM);
-        remainingLength += 2 + willPayloadLen;
-    }
-    if (usernameLen)
-    {
-        connectFlags |= UMQTT_CONNECT_FLAG_USER;
-        remainingLength += 2 + usernameLen;
-    }
-    if (passwordLen)
-    {
-        connectFlags |= UMQTT_CONNECT_FLAG_PASS;
-        remainingLength += 2 + passwordLen;
-    }
+    return sendPublish(this, NULL, topic, topicLen, payload, payloadLen,
+                       qos, shouldRetain, pId);
+}
 
-    // allocate buffer needed for encode
-    uint8_t *buf = newPacket(this, remainingLength);
-    RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
+/**
+ * Register a topic for repeated publishing
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param topic topic name to publish
+ * @param phTopic storage for the registered topic handle
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * An application that publishes to the same topics over and over can
+ * register them once, and then publish with umqtt_PublishTopic().  The
+ * topic is measured and encoded into publish packet form when it is
+ * registered, so that it only needs to be copied for each publish.
+ *
+ * The topic name must not contain wildcards.  The registered topic uses
+ * memory until it is freed with umqtt_UnregisterTopic() or the instance
+ * is deleted.  It stays valid across disconnect and connect.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_Topic_t hTemp;
+ * err = umqtt_RegisterTopic(h, "sensors/1/temperature", &hTemp);
+ * ...
+ * err = umqtt_PublishTopic(h, hTemp, payload, payloadLen, 0, false, NULL);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_RegisterTopic(umqtt_Handle_t h, const char *topic, umqtt_Topic_t *phTopic)
+{
+    umqtt_Instance_t *this = h;
 
-    // allocate second buffer just to hold packet timeout
-    uint8_t *tmoBuf = newPacket(this, 0);
-    if (tmoBuf == NULL)
-    {
-        deletePacket(this, buf);
-        return UMQTT_ERR_BUFSIZE;
-    }
+    // initial parameter check
+    RETURN_IF_ERR((this == NULL) || (topic == NULL) || (phTopic == NULL), UMQTT_ERR_PARM);
+    size_t topicLen = strlen(topic);
+    RETURN_IF_ERR((topicLen == 0) || (topicLen > 0xFFFF), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(strpbrk(topic, "+#") != NULL, UMQTT_ERR_PARM);
+    RETURN_IF_ERR(!checkTopicName(this, topic, topicLen), UMQTT_ERR_PARM);
+
+    RegTopic_t *pTopic = allocMem(this, sizeof(RegTopic_t) + 2 + topicLen);
+    RETURN_IF_ERR(pTopic == NULL, UMQTT_ERR_BUFSIZE);
+    pTopic->topicLen = topicLen;
+    umqtt_EncodeData((const uint8_t *)topic, topicLen, pTopic->field);
+    pTopic->next = this->pRegTopics;
+    this->pRegTopics = pTopic;
+    *phTopic = pTopic;
+    return UMQTT_ERR_OK;
+}
 
-    // encode the remaining length into the appropriate position in the buffer
-    uint32_t lenSize = umqtt_EncodeLength(remainingLength, &buf[1]);
+/**
+ * Free a registered topic
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param hTopic registered topic handle from umqtt_RegisterTopic()
+ *
+ * @return UMQTT_ERR_OK, or UMQTT_ERR_PARM if the topic is not registered
+ * on this instance
+ */
+umqtt_Error_t
+umqtt_UnregisterTopic(umqtt_Handle_t h, umqtt_Topic_t hTopic)
+{
+    umqtt_Instance_t *this = h;
+    RETURN_IF_ERR((this == NULL) || (hTopic == NULL), UMQTT_ERR_PARM);
 
-    // compute final length of packet with all data and headers
-    remainingLength += 1 + lenSize;
+    RegTopic_t **ppTopic = &this->pRegTopics;
+    while (*ppTopic && (*ppTopic != hTopic))
+    {
+        ppTopic = &(*ppTopic)->next;
+    }
+    RETURN_IF_ERR(*ppTopic == NULL, UMQTT_ERR_PARM);
+    *ppTopic = (*ppTopic)->next;
+    freeMem(this, hTopic);
+    return UMQTT_ERR_OK;
+}
 
-    // encode the packet type and adjust index ahead to
-    // point at variable header
-    buf[0] = UMQTT_TYPE_CONNECT << 4;
-    idx = 1 + lenSize;
-    tmoBuf[0] = buf[0];
+/**
+ * Send MQTT protocol Publish packet for a registered topic
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param hTopic registered topic handle from umqtt_RegisterTopic()
+ * @param payload payload or message for the topic (can be NULL)
+ * @param payloadLen number of bytes in the payload
+ * @param qos QoS (quality of service) level for this topic
+ * @param shouldRetain true if MQTT broker should retain this topic
+ * @param pId pointer to storage for assigned packet ID (optional)
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * This is the same as umqtt_Publish() except that the topic was prepared
+ * ahead of time with umqtt_RegisterTopic(), so it does not need to be
+ * measured and encoded again.
+ */
+umqtt_Error_t
+umqtt_PublishTopic(umqtt_Handle_t h, umqtt_Topic_t hTopic,
+                   const uint8_t *payload, uint32_t payloadLen,
+                   uint32_t qos, bool shouldRetain, uint16_t *pId)
+{
+    umqtt_Instance_t *this = h;
+    const RegTopic_t *pTopic = hTopic;
 
-    // encode protocol name
-    const uint8_t *protocolName = (const uint8_t *)"MQTT";
-    idx += umqtt_EncodeData(protocolName, 4, &buf[idx]);
+    // initial parameter check
+    RETURN_IF_ERR((this == NULL) || (pTopic == NULL), UMQTT_ERR_PARM);
+    RETURN_IF_ERR((payloadLen != 0) && (payload == NULL), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(payloadLen > (UMQTT_MAX_REMAINING_LENGTH - 4U - pTopic->topicLen),
+                  UMQTT_ERR_PARM);
+    RETURN_IF_ERR(qos > 2, UMQTT_ERR_PARM);
 
-    // protocol level, connect flags and keepalive
-    connectFlags |= willRetain ? UMQTT_CONNECT_FLAG_WILL_RETAIN : 0;
-    connectFlags |= cleanSession ? UMQTT_CONNECT_FLAG_CLEAN : 0;
-    connectFlags |= (willQos << UMQTT_CONNECT_FLAG_QOS_SHIFT) & UMQTT_CONNECT_FLAG_WILL_QOS;
-    buf[idx++] = 4;
-    buf[idx++] = connectFlags;
-    buf[idx++] = keepAlive >> 8;
-    buf[idx++] = keepAlive & 0xFF;
-    this->keepAlive = keepAlive;
+    RETURN_IF_ERR(!this->isConnected, UMQTT_ERR_DISCONNECTED);
 
-    // client id
-    idx += umqtt_EncodeData((const uint8_t *)clientId, clientIdLen, &buf[idx]);
+    return sendPublish(this, pTopic->field, (const char *)&pTopic->field[2],
+                       pTopic->topicLen, payload, payloadLen, qos, shouldRetain, pId);
+}
 
-    // will topic and message
-    if (willTopicLen)
-    {
-        // check data pointers
-        idx += umqtt_EncodeData((const uint8_t *)willTopic, willTopicLen, &buf[idx]);
-        idx += umqtt_EncodeData(willPayload, willPayloadLen, &buf[idx]);
-    }
+/**
+ * Create a publish template
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param topic topic name to publish
+ * @param payloadLen number of bytes in the payload of every publish
+ * @param qos QoS (quality of service) level for the packets
+ * @param shouldRetain true if MQTT broker should retain this topic
+ * @param phTemplate storage for the template handle
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * A template is useful for messages that are published over and over
+ * with the same topic, QoS and retain setting and the same payload size,
+ * such as periodic sensor readings.  The fixed header, remaining length
+ * and topic are encoded once when the template is created.  Publishing
+ * from the template with umqtt_PublishTemplate() only needs to fill in
+ * the packet ID and the payload, so every publish takes the same time.
+ *
+ * The template uses memory until it is freed with umqtt_DeleteTemplate()
+ * or the instance is deleted.  It stays valid across disconnect and
+ * connect.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_Template_t hTemp;
+ * float reading;
+ * err = umqtt_NewTemplate(h, "sensors/1/temperature", sizeof(reading),
+ *                         1, false, &hTemp);
+ * ...
+ * err = umqtt_PublishTemplate(h, hTemp, (const uint8_t *)&reading, NULL);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_NewTemplate(umqtt_Handle_t h, const char *topic, uint32_t payloadLen,
+                  uint32_t qos, bool shouldRetain, umqtt_Template_t *phTemplate)
+{
+    umqtt_Instance_t *this = h;
 
-    // username
-    if (usernameLen)
+    // initial parameter check
+    RETURN_IF_ERR((this == NULL) || (topic == NULL) || (phTemplate == NULL), UMQTT_ERR_PARM);
+    size_t topicLen = strlen(topic);
+    RETURN_IF_ERR((topicLen == 0) || (topicLen > 0xFFFF), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(strpbrk(topic, "+#") != NULL, UMQTT_ERR_PARM);
+    RETURN_IF_ERR(!checkTopicName(this, topic, topicLen), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(payloadLen > (UMQTT_MAX_REMAINING_LENGTH - 4 - topicLen), UMQTT_ERR_PARM);
+    RETURN_IF_ERR(qos > 2, UMQTT_ERR_PARM);
+
+    uint32_t remainingLength;
+    uint32_t pktLen = umqtt_PublishLength(topicLen, payloadLen, qos, &remainingLength);
+    uint32_t prefixLen = pktLen - payloadLen;
+    PubTemplate_t *pTemplate = allocMem(this, sizeof(PubTemplate_t) + prefixLen);
+    RETURN_IF_ERR(pTemplate == NULL, UMQTT_ERR_BUFSIZE);
+
+    // encode everything except the payload, the packet ID is filled
+    // in for each publish
+    uint8_t *pPrefix = pTemplate->prefix;
+    pPrefix[0] = (UMQTT_TYPE_PUBLISH << 4) | (shouldRetain ? UMQTT_FLAG_RETAIN : 0)
+               | ((qos << UMQTT_FLAG_QOS_SHIFT) & UMQTT_FLAG_QOS);
+    uint32_t idx = 1 + umqtt_EncodeLength(remainingLength, &pPrefix[1]);
+    idx += umqtt_EncodeData((const uint8_t *)topic, topicLen, &pPrefix[idx]);
+    if (qos != 0)
     {
-        idx += umqtt_EncodeData((const uint8_t *)username, usernameLen, &buf[idx]);
+        pPrefix[idx++] = 0;
+        pPrefix[idx++] = 0;
     }
 
-    // password
-    if (passwordLen)
-    {
-        idx += umqtt_EncodeData((const uint8_t *)password, passwordLen, &buf[idx]);
-    }
+    pTemplate->payloadLen = payloadLen;
+    pTemplate->pktLen = pktLen;
+    pTemplate->prefixLen = prefixLen;
+    pTemplate->qos = qos;
+    pTemplate->next = this->pTemplates;
+    this->pTemplates = pTemplate;
+    *phTemplate = pTemplate;
+    return UMQTT_ERR_OK;
+}
 
-    // attempt to send the packet on the network
-    int len = this->pNet->pfnNetWritePacket(this->pNet->hNet, buf, remainingLength, false);
-    // no matter what, we dont need this packet any more so free it
-    deletePacket(this, buf);
+/**
+ * Free a publish template
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param hTemplate template handle from umqtt_NewTemplate()
+ *
+ * @return UMQTT_ERR_OK, or UMQTT_ERR_PARM if the template does not
+ * belong to this instance
+ */
+umqtt_Error_t
+umqtt_DeleteTemplate(umqtt_Handle_t h, umqtt_Template_t hTemplate)
+{
+    umqtt_Instance_t *this = h;
+    RETURN_IF_ERR((this == NULL) || (hTemplate == NULL), UMQTT_ERR_PARM);
 
-    // check for error sending on the network
-    if (len != remainingLength)
+    PubTemplate_t **ppTemplate = &this->pTemplates;
+    while (*ppTemplate && (*ppTemplate != hTemplate))
     {
-        // also need to delete the timeout packet since we dont need it now
-        deletePacket(this, tmoBuf);
-        return UMQTT_ERR_NETWORK; // network error
+        ppTemplate = &(*ppTemplate)->next;
     }
-
-    // if we make it here then we are attempting a connection and dont know
-    // yet if there is a connection.  Enqueue the timeout packet for the
-    // purpose of tracking the timeout until we get a CONNACK.
-    // This packet doesnt have a packet ID so just use 0
-    enqueuePacket(this, tmoBuf, 0, this->ticks);
-    this->connectIsPending = true;
-
-    // return success - connect attempt is in flight
+    RETURN_IF_ERR(*ppTemplate == NULL, UMQTT_ERR_PARM);
+    *ppTemplate = (*ppTemplate)->next;
+    freeMem(this, hTemplate);
     return UMQTT_ERR_OK;
 }
 
 /**
- * Disconnect MQTT protocol
+ * Send MQTT protocol Publish packet from a template
  *
  * @param h umqtt instance handle from umqtt_New()
+ * @param hTemplate template handle from umqtt_NewTemplate()
+ * @param payload the payload, which must have the length given when the
+ * template was created (can be NULL if the length is 0)
+ * @param pId pointer to storage for assigned packet ID (optional)
  *
- * @return UMQTT_ERR_OK or an error code
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
  *
- * This function attempts to send a MQTT protocol disconnect packet, frees
- * up all pending packets and marks the instance as disconnected.
+ * This is the same as umqtt_Publish() with the topic, QoS and retain
+ * setting of the template.  For QoS 0 with a transport that provides
+ * netWritevPacket_t(), the prebuilt header and the payload are written
+ * in place.  Otherwise the header is copied into a packet buffer and only
+ * the packet ID and payload are added.
  */
 umqtt_Error_t
-umqtt_Disconnect(umqtt_Handle_t h)
+umqtt_PublishTemplate(umqtt_Handle_t h, umqtt_Template_t hTemplate,
+                      const uint8_t *payload, uint16_t *pId)
 {
     umqtt_Instance_t *this = h;
-    static const uint8_t disconnectPacket[2] = { UMQTT_TYPE_DISCONNECT << 4, 0 };
+    const PubTemplate_t *pTemplate = hTemplate;
 
     // initial parameter check
-    RETURN_IF_ERR(h == NULL, UMQTT_ERR_PARM);
+    RETURN_IF_ERR((this == NULL) || (pTemplate == NULL), UMQTT_ERR_PARM);
+    RETURN_IF_ERR((pTemplate->payloadLen != 0) && (payload == NULL), UMQTT_ERR_PARM);
 
-    // clean out packet queue
-    freeAllQueuedPackets(this);
+    RETURN_IF_ERR(!this->isConnected, UMQTT_ERR_DISCONNECTED);
 
-    // attempt to send disconnect packet
-    int len = this->pNet->pfnNetWritePacket(this->pNet->hNet, disconnectPacket,
-                                            2, false);
+    if (pTemplate->qos == 0)
+    {
+        if (pId)
+        {
+            *pId = 0;
+        }
+        if (this->pNet->pfnNetWritevPacket)
+        {
+            umqtt_Segment_t segs[2] =
+            {
+                { pTemplate->prefix, pTemplate->prefixLen },
+                { payload, pTemplate->payloadLen }
+            };
+            uint32_t segCount = pTemplate->payloadLen ? 2 : 1;
+            RETURN_IF_ERR(!writevPacket(this, segs, segCount, pTemplate->pktLen),
+                          UMQTT_ERR_NETWORK);
+            return UMQTT_ERR_OK;
+        }
+    }
+    else
+    {
+        // make sure the packet fits in the in-flight window and
+        // can be tracked until it is acked
+        RETURN_IF_ERR(!windowHasRoom(this, 1, pTemplate->pktLen), UMQTT_ERR_WOULDBLOCK);
+        RETURN_IF_ERR(!reservePacketSlots(this, 1), UMQTT_ERR_BUFSIZE);
+    }
 
-    // clear connection status no matter what
-    this->isConnected = false;
-    this->connectIsPending = false;
+    // newPacket() adds room for the largest fixed header, but the
+    // template length already includes the fixed header
+    uint8_t *buf = newPacket(this, pTemplate->pktLen - 5);
+    RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
+    memcpy(buf, pTemplate->prefix, pTemplate->prefixLen);
+    if (pTemplate->payloadLen)
+    {
+        memcpy(&buf[pTemplate->prefixLen], payload, pTemplate->payloadLen);
+    }
 
-    if (len != 2)
+    // patch in the packet ID
+    uint16_t packetId = 0;
+    if (pTemplate->qos != 0)
     {
-        return UMQTT_ERR_NETWORK; // network error
+        packetId = nextPacketId(this);
+        buf[pTemplate->prefixLen - 2] = packetId >> 8;
+        buf[pTemplate->prefixLen - 1] = packetId & 0xFF;
+        if (pId)
+        {
+            *pId = packetId;
+        }
     }
 
-    return UMQTT_ERR_OK;
+    return sendPublishPacket(this, buf, pTemplate->pktLen, packetId);
+}
+
+/*
+ * @internal
+ *
+ * Write the buffers of a batch of packets to the network
+ *
+ * @param this umqtt instance
+ * @param pSegs the buffers holding the packets, in order
+ * @param segCount number of buffers
+ * @param len total number of bytes in the buffers
+ * @param isMore true if more of the batch follows
+ *
+ * The buffers are written with one call if the transport can write from
+ * several buffers, otherwise each buffer is written in turn with _isMore_
+ * set on all but the last.
+ *
+ * @return true if all of the bytes were written
+ */
+static bool
+writeBatch(umqtt_Instance_t *this, const umqtt_Segment_t *pSegs,
+           uint32_t segCount, uint32_t len, bool isMore)
+{
+    if (this->pNet->pfnNetWritevPacket)
+    {
+        return writevBytes(this, pSegs, segCount, len, isMore);
+    }
+    for (uint32_t i = 0; i < segCount; i++)
+    {
+        bool isLast = (i + 1) == segCount;
+        RETURN_IF_ERR(!writeBytes(this, pSegs[i].pData, pSegs[i].len, isMore || !isLast),
+                      false);
+    }
+    return true;
 }
 
 /**
- * Send MQTT protocol Publish packet
+ * Send many MQTT protocol Publish packets with one network write
  *
  * @param h umqtt instance handle from umqtt_New()
- * @param topic topic name to publish
- * @param payload payload or message for the topic (can be NULL)
- * @param payloadLen number of bytes in the payload
- * @param qos QoS (quality of service) level for this topic
- * @param shouldRetain true if MQTT broker should retain this topic
- * @param pId pointer to storage for assigned packet ID (optional)
+ * @param pMsgs array of messages to publish
+ * @param count number of messages in the array
  *
  * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
  *
- * This function is used to publish a topic with an optional payload.
- * A publish packet will be assembled and sent to the connected UMQTT
- * broker.  If the QoS > 0 then the packet will be held and resent as
- * needed until an acknowledgment is received.  If this happens, then the
- * Publish packet will have a packet ID.  The _pId_ parameter can be used
- * to get the packet ID if needed.  Otherwise, this parameter can be set
- * to NULL.  If the QoS is 0, then there is no packet ID.
- *
- * If a callback function was provided for Puback, then the Puback callback
- * will be called when the publish packet is acknowledged.
+ * This function publishes a group of messages in the same way as calling
+ * umqtt_Publish() for each one, except that all of the publish packets are
+ * passed to the network together.  If the transport has a
+ * netWritevPacket_t() function then the batch is written in one call, or a
+ * few calls for a big batch, otherwise the packets are written
+ * one after another with _isMore_ set on all but the last.  The QoS 0
+ * messages are encoded back to back into one buffer, and each message
+ * with QoS > 0 is encoded only once, into the packet that is held until
+ * it is acknowledged.  This saves a network write (and usually a system
+ * call) per message when an application has many small messages to send
+ * at once.
  *
- * A payload is not required.  MQTT can publish only a topic name with
- * no payload.  If a payload is not used then the parameter can be set
- * to NULL.  The payload can be binary data and not necessarily a string.
+ * Each message with QoS > 0 gets its own packet ID, which is stored in
+ * the _packetId_ field of the message, and is held and retried until it
+ * is acknowledged the same as if it was sent by umqtt_Publish().  The
+ * _packetId_ field is set to 0 for QoS 0 messages.  The packet IDs are
+ * only meaningful if the function returns UMQTT_ERR_OK.
  *
- * @note At this time, the umqtt library does not support QoS level 2
+ * The batch is sent as a whole or not at all.  If any message has a bad
+ * parameter, or memory can not be allocated, then none of the messages
+ * are sent or held.  If the QoS > 0 messages do not all fit in the
+ * in-flight window then UMQTT_ERR_WOULDBLOCK is returned and nothing is
+ * sent.  If a network write fails then none of the messages are held and
+ * no packet IDs are used up, but part of the batch may already have been
+ * written, so the connection should be closed.
  *
  * __Example__
  *
  * ~~~~~~~~.c
  * umqtt_Handle_t h; // previously acquired instance handle
- * char topicName[] = "myTopic";
- * uint8_t payload[] = (uint8_t *)"myPayloadMessage";
- * uint16_t msgId;
+ * umqtt_PublishMsg_t msgs[2] =
+ * {
+ *     { "sensor/temp", tempData, tempLen, 0, false, 0 },
+ *     { "sensor/humidity", humData, humLen, 1, false, 0 },
+ * };
  *
  * umqtt_Error_t err;
- * err = umqtt_Publish(h, topicName, payload, strlen(payload),
- *                     1, true, *msgId);
+ * err = umqtt_PublishBatch(h, msgs, 2);
  * if (err == UMQTT_ERR_OK)
  * {
- *     // Publish packet has been sent with QoS 1
- *     // Packet is pending acknowledgment
- *     // msgId now contains the packet ID that was used
- * }
- * else // error occurred
- * {
- *     // handle publish error
+ *     // both publish packets have been sent
+ *     // msgs[1].packetId has the packet ID of the QoS 1 message
  * }
  * ~~~~~~~~
  */
 umqtt_Error_t
-umqtt_Publish(umqtt_Handle_t h,
-              const char *topic, const uint8_t *payload, uint32_t payloadLen,
-              uint32_t qos, bool shouldRetain, uint16_t *pId)
+umqtt_PublishBatch(umqtt_Handle_t h, umqtt_PublishMsg_t *pMsgs, uint32_t count)
 {
-    uint8_t flags = 0;
-    uint32_t idx = 0;
     umqtt_Instance_t *this = h;
 
     // initial parameter check
-    RETURN_IF_ERR((this == NULL) || (topic == NULL), UMQTT_ERR_PARM);
-    size_t topicLen = strlen(topic);
-    RETURN_IF_ERR((payloadLen != 0) && (payload == NULL), UMQTT_ERR_PARM);
-
+    RETURN_IF_ERR((this == NULL) || (pMsgs == NULL) || (count == 0), UMQTT_ERR_PARM);
     RETURN_IF_ERR(!this->isConnected, UMQTT_ERR_DISCONNECTED);
 
-    // calculate the "remaining length" for the packet based on
-    // the various input fields.
-    uint16_t remainingLength = (qos ? 2 : 0) + 2 + topicLen;
-    remainingLength += payload ? payloadLen: 0;
-
-    // allocate buffer needed to encode packet
-    uint8_t *buf = newPacket(this, remainingLength);
-    RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
-
-    // encode the remaining length into the appropriate position in the buffer
-    uint32_t lenSize = umqtt_EncodeLength(remainingLength, &buf[1]);
-
-    // compute final length of packet with all data and headers
-    remainingLength += 1 + lenSize;
-
-    // encode the packet type and adjust index ahead to
-    // point at variable header
-    buf[0] = UMQTT_TYPE_PUBLISH << 4;
-    idx = 1 + lenSize;
-
-    // header flags
-    // @todo dup flag needs to be set by retransmit
-//    flags |= isDup ? UMQTT_FLAG_DUP : 0;
-    flags |= shouldRetain ? UMQTT_FLAG_RETAIN : 0;
-    flags |= (qos << UMQTT_FLAG_QOS_SHIFT) & UMQTT_FLAG_QOS;
-    buf[0] |= flags;
-
-    // topic name
-    idx += umqtt_EncodeData((const uint8_t *)topic, topicLen, &buf[idx]);
-
-    // if QOS then also need packet ID
-    if (qos != 0)
+    // check each message and add up the size of the whole batch
+    uint32_t batchLen = 0;
+    uint32_t qosCount = 0;
+    uint32_t qosLen = 0;
+    uint32_t qos0Len = 0;
+    for (uint32_t i = 0; i < count; i++)
     {
-        ++this->packetId;
-        if (this->packetId == 0)
+        umqtt_PublishMsg_t *pMsg = &pMsgs[i];
+        RETURN_IF_ERR(pMsg->topic == NULL, UMQTT_ERR_PARM);
+        RETURN_IF_ERR(pMsg->qos > 2, UMQTT_ERR_PARM);
+        size_t topicLen = strlen(pMsg->topic);
+        RETURN_IF_ERR(topicLen > 0xFFFF, UMQTT_ERR_PARM);
+        RETURN_IF_ERR(!checkTopicName(this, pMsg->topic, topicLen), UMQTT_ERR_PARM);
+        RETURN_IF_ERR((pMsg->payloadLen != 0) && (pMsg->payload == NULL), UMQTT_ERR_PARM);
+        RETURN_IF_ERR(pMsg->payloadLen > (UMQTT_MAX_REMAINING_LENGTH - 4 - topicLen),
+                      UMQTT_ERR_PARM);
+        uint32_t remainingLength;
+        uint32_t pktLen = umqtt_PublishLength(topicLen, pMsg->payloadLen, pMsg->qos,
+                                              &remainingLength);
+        RETURN_IF_ERR(pktLen > (UINT32_MAX - batchLen), UMQTT_ERR_PARM);
+        batchLen += pktLen;
+        if (pMsg->qos)
         {
-            this->packetId = 1;
+            ++qosCount;
+            qosLen += pktLen;
         }
-        buf[idx++] = this->packetId >> 8;
-        buf[idx++] = this->packetId & 0xFF;
-        if (pId)
+        else
         {
-            *pId = this->packetId;
+            qos0Len += pktLen;
         }
     }
-    else
+
+    // make sure all the QoS > 0 packets fit in the in-flight window
+    // and can be tracked until acked
+    RETURN_IF_ERR(!windowHasRoom(this, qosCount, qosLen), UMQTT_ERR_WOULDBLOCK);
+    RETURN_IF_ERR(qosCount && !reservePacketSlots(this, qosCount), UMQTT_ERR_BUFSIZE);
+
+    // encode each QoS > 0 message straight into its own packet, which
+    // is held until acked.  The packets are linked through their headers
+    // in message order until sent.
+    uint16_t firstPacketId = this->packetId;
+    PktBuf_t *pHeld = NULL;
+    PktBuf_t **ppLast = &pHeld;
+    bool isEncoded = true;
+    for (uint32_t i = 0; (i < count) && isEncoded; i++)
     {
-        if (pId)
+        umqtt_PublishMsg_t *pMsg = &pMsgs[i];
+        pMsg->packetId = 0;
+        if (pMsg->qos)
         {
-            *pId = 0;
+            size_t topicLen = strlen(pMsg->topic);
+            uint32_t remainingLength;
+            uint32_t pktLen = umqtt_PublishLength(topicLen, pMsg->payloadLen, pMsg->qos,
+                                                  &remainingLength);
+            uint8_t *buf = newPacket(this, remainingLength);
+            isEncoded = buf != NULL;
+            if (isEncoded)
+            {
+                pMsg->packetId = nextPacketId(this);
+                umqtt_EncodePublish(buf, NULL, pMsg->topic, topicLen,
+                                    pMsg->payload, pMsg->payloadLen,
+                                    pMsg->qos, pMsg->shouldRetain, pMsg->packetId);
+                PktBuf_t *pPkt = (PktBuf_t *)(buf - sizeof(PktBuf_t));
+                pPkt->packetId = pMsg->packetId;
+                pPkt->windowBytes = pktLen;
+                pPkt->next = NULL;
+                *ppLast = pPkt;
+                ppLast = &pPkt->next;
+            }
         }
     }
 
-    // payload message
-    if (payloadLen)
+    // the QoS 0 messages are only needed until they are written, so they
+    // are encoded back to back into one buffer.  It is allocated last so
+    // that a packet ring gets the space back as soon as it is freed.
+    uint8_t *qos0Buf = NULL;
+    if (isEncoded && qos0Len)
     {
-        memcpy(&buf[idx], payload, payloadLen);
-        idx += payloadLen;
+        qos0Buf = newPacket(this, qos0Len);
+        isEncoded = qos0Buf != NULL;
     }
 
-    int len = this->pNet->pfnNetWritePacket(this->pNet->hNet, buf, remainingLength, false);
-    if (len == remainingLength)
+    // write the packets in message order, with each run of QoS 0 messages
+    // in one buffer
+    umqtt_Error_t err = UMQTT_ERR_BUFSIZE;
+    if (isEncoded)
     {
-        // if qos is non-zero then we need to hang on to the packet until
-        // it is acked, so save the packetId and put it in the wait list
-        if (qos != 0)
+        umqtt_Segment_t segs[UMQTT_BATCH_SEGMENTS];
+        uint32_t segCount = 0;
+        uint32_t segLen = 0;
+        bool isQos0Run = false;
+        PktBuf_t *pPkt = pHeld;
+        uint32_t idx = 0;
+        err = UMQTT_ERR_OK;
+        for (uint32_t i = 0; (i < count) && (err == UMQTT_ERR_OK); i++)
         {
-            enqueuePacket(this, buf, this->packetId, this->ticks);
+            umqtt_PublishMsg_t *pMsg = &pMsgs[i];
+            const uint8_t *pData;
+            uint32_t pktLen;
+            if (pMsg->qos)
+            {
+                pData = (uint8_t *)pPkt + sizeof(PktBuf_t);
+                pktLen = pPkt->windowBytes;
+                pPkt = pPkt->next;
+            }
+            else
+            {
+                pData = &qos0Buf[idx];
+                pktLen = umqtt_EncodePublish(&qos0Buf[idx], NULL, pMsg->topic,
+                                             strlen(pMsg->topic),
+                                             pMsg->payload, pMsg->payloadLen,
+                                             0, pMsg->shouldRetain, 0);
+                idx += pktLen;
+                if (isQos0Run)
+                {
+                    segs[segCount - 1].len += pktLen;
+                    segLen += pktLen;
+                    continue;
+                }
+            }
+            isQos0Run = pMsg->qos == 0;
+            if (segCount == UMQTT_BATCH_SEGMENTS)
+            {
+                if (!writeBatch(this, segs, segCount, segLen, true))
+                {
+                    err = UMQTT_ERR_NETWORK;
+                }
+                segCount = 0;
+                segLen = 0;
+            }
+            segs[segCount].pData = pData;
+            segs[segCount].len = pktLen;
+            ++segCount;
+            segLen += pktLen;
         }
-        else
+        if ((err == UMQTT_ERR_OK) && !writeBatch(this, segs, segCount, segLen, false))
         {
-            deletePacket(this, buf);
+            err = UMQTT_ERR_NETWORK;
         }
     }
+    deletePacket(this, qos0Buf);
+
+    if (err == UMQTT_ERR_OK)
+    {
+        this->statsDirty = true;
+        this->stats.pktsSent[UMQTT_TYPE_PUBLISH] += count;
+        this->stats.bytesSent += batchLen;
+    }
     else
     {
-        deletePacket(this, buf);
-        return UMQTT_ERR_NETWORK; // network error
+        // the packet IDs were not used
+        this->packetId = firstPacketId;
     }
 
-    return UMQTT_ERR_OK;
+    // put the held packets in the wait list if the batch was sent,
+    // otherwise they are not needed
+    while (pHeld)
+    {
+        PktBuf_t *pPkt = pHeld;
+        pHeld = pPkt->next;
+        uint8_t *buf = (uint8_t *)pPkt + sizeof(PktBuf_t);
+        if (err == UMQTT_ERR_OK)
+        {
+            uint32_t pktLen = pPkt->windowBytes;
+            enqueuePacket(this, buf, pPkt->packetId, this->ticks);
+            windowAdd(this, buf, pktLen);
+        }
+        else
+        {
+            deletePacket(this, buf);
+        }
+    }
+    return err;
 }
 
 /**
@@ -927,10 +4359,14 @@ umqtt_Subscribe(umqtt_Handle_t h,
     {
         RETURN_IF_ERR(topics[i] == NULL, UMQTT_ERR_PARM);
         RETURN_IF_ERR(qoss[i] > 2, UMQTT_ERR_PARM);
+        RETURN_IF_ERR(!checkTopicFilter(this, topics[i]), UMQTT_ERR_PARM);
         remainingLength += 2 + 1; // topic length field plus qos
         remainingLength += strlen(topics[i]);
     }
 
+    // make sure the packet can be tracked until it is acked
+    RETURN_IF_ERR(!reservePacketSlots(this, 1), UMQTT_ERR_BUFSIZE);
+
     // allocate buffer needed to encode packet
     uint8_t *buf = newPacket(this, remainingLength);
     RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
@@ -947,11 +4383,7 @@ umqtt_Subscribe(umqtt_Handle_t h,
     idx = 1 + lenSize;
 
     // packet id
-    ++this->packetId;
-    if (this->packetId == 0)
-    {
-        this->packetId = 1;
-    }
+    nextPacketId(this);
     buf[idx++] = this->packetId >> 8;
     buf[idx++] = this->packetId & 0xFF;
     if (pId)
@@ -959,26 +4391,109 @@ umqtt_Subscribe(umqtt_Handle_t h,
         *pId = this->packetId;
     }
 
-    // encode each topic in topic array provided by caller
+    // encode each topic in topic array provided by caller
+    for (uint32_t i = 0; i < count; i++)
+    {
+        idx += umqtt_EncodeData((const uint8_t *)topics[i], strlen(topics[i]), &buf[idx]);
+        buf[idx++] = qoss[i];
+    }
+
+    if (writePacket(this, buf, remainingLength, false))
+    {
+        // need to save the packet to wait for ack
+        enqueuePacket(this, buf, this->packetId, this->ticks);
+    }
+    else
+    {
+        deletePacket(this, buf);
+        return UMQTT_ERR_NETWORK; // network error
+    }
+
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Subscribe to topics and register a handler for their messages.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param count number of topics in the list of topics to subscribe
+ * @param topics array of topic filters to subscribe
+ * @param qoss array of QoS values to use for subscribed topics
+ * @param pfnHandler function to call for messages matching the topics
+ * @param pUser user data pointer passed to the handler
+ * @param pId pointer to storage for assigned packet ID (optional)
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * This works like umqtt_Subscribe(), but also registers a handler for
+ * each of the topic filters.  When a publish packet is received, its
+ * topic is looked up in a tree of the registered filters, one topic level
+ * at a time, and each handler with a matching filter is called.  Filters
+ * can use the '+' and '#' wildcards.  Looking up a topic takes about the
+ * same time no matter how many filters are registered.  If no handler
+ * matches the topic, then the publish callback is called instead, if
+ * there is one.
+ *
+ * More than one handler can be registered for the same filter, and the
+ * same handler can be registered for many filters.  The handlers stay
+ * registered until the topic is unsubscribed with umqtt_Unsubscribe(),
+ * or the instance is deleted.  A handler can subscribe or unsubscribe
+ * topics itself.
+ *
+ * If a topic filter is not valid then UMQTT_ERR_PARM is returned.  If
+ * there is a problem sending the subscribe packet then the handler is
+ * not registered for any of the topics, other than the ones it was
+ * already registered for.
+ *
+ * __Example__
+ *
+ * ~~~~~~~~.c
+ * void tempHandler(umqtt_Handle_t h, void *pUser, bool dup, bool retain,
+ *                  uint8_t qos, const char *pTopic, uint16_t topicLen,
+ *                  const uint8_t *pMsg, uint32_t msgLen)
+ * {
+ *     // handle a temperature message
+ * }
+ *
+ * char *topics[] = { "sensors/+/temperature" };
+ * uint8_t qoss[] = { 1 };
+ *
+ * umqtt_Error_t err;
+ * err = umqtt_SubscribeHandler(h, 1, topics, qoss, tempHandler, NULL, NULL);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_SubscribeHandler(umqtt_Handle_t h, uint32_t count, char *topics[], uint8_t qoss[],
+                       TopicHandler_t pfnHandler, void *pUser, uint16_t *pId)
+{
+    umqtt_Instance_t *this = h;
+
+    // initial parameter check
+    RETURN_IF_ERR((this == NULL) || (pfnHandler == NULL), UMQTT_ERR_PARM);
+    RETURN_IF_ERR((count == 0) || (topics == NULL), UMQTT_ERR_PARM);
     for (uint32_t i = 0; i < count; i++)
     {
-        idx += umqtt_EncodeData((const uint8_t *)topics[i], strlen(topics[i]), &buf[idx]);
-        buf[idx++] = qoss[i];
+        RETURN_IF_ERR((topics[i] == NULL) || !validTopicFilter(topics[i]), UMQTT_ERR_PARM);
+        RETURN_IF_ERR(!checkTopicFilter(this, topics[i]), UMQTT_ERR_PARM);
     }
 
-    int len = this->pNet->pfnNetWritePacket(this->pNet->hNet, buf, remainingLength, false);
-    if (len == remainingLength)
+    // register the handlers first, so that memory for them is known
+    // to be available before the subscription is made
+    umqtt_Error_t err = UMQTT_ERR_OK;
+    uint32_t added;
+    for (added = 0; (added < count) && (err == UMQTT_ERR_OK); added++)
     {
-        // need to save the packet to wait for ack
-        enqueuePacket(this, buf, this->packetId, this->ticks);
+        err = addTopicHandler(this, topics[added], pfnHandler, pUser);
     }
-    else
+    if (err == UMQTT_ERR_OK)
     {
-        deletePacket(this, buf);
-        return UMQTT_ERR_NETWORK; // network error
+        err = umqtt_Subscribe(h, count, topics, qoss, pId);
     }
 
-    return UMQTT_ERR_OK;
+    // keep the new handlers, or if anything failed then take them
+    // out again, leaving any that were registered before
+    settleTopicHandlers(this, added, topics, pfnHandler, pUser, err == UMQTT_ERR_OK);
+    return err;
 }
 
 /**
@@ -1002,6 +4517,9 @@ umqtt_Subscribe(umqtt_Handle_t h,
  * If the caller provided a Unsuback callback function, then it will be
  * notified when the unsubscribe request is acknowledged.
  *
+ * Any handlers registered for the topics with umqtt_SubscribeHandler()
+ * are removed once the unsubscribe packet is sent.
+ *
  * __Example__
  *
  * ~~~~~~~~.c
@@ -1042,10 +4560,14 @@ umqtt_Unsubscribe(umqtt_Handle_t h,
     for (uint32_t i = 0; i < count; i++)
     {
         RETURN_IF_ERR(topics[i] == NULL, UMQTT_ERR_PARM);
+        RETURN_IF_ERR(!checkTopicFilter(this, topics[i]), UMQTT_ERR_PARM);
         remainingLength += 2; // topic length field
         remainingLength += strlen(topics[i]);
     }
 
+    // make sure the packet can be tracked until it is acked
+    RETURN_IF_ERR(!reservePacketSlots(this, 1), UMQTT_ERR_BUFSIZE);
+
     // allocate buffer needed to encode packet
     uint8_t *buf = newPacket(this, remainingLength);
     RETURN_IF_ERR(buf == NULL, UMQTT_ERR_BUFSIZE);
@@ -1062,11 +4584,7 @@ umqtt_Unsubscribe(umqtt_Handle_t h,
     idx = 1 + lenSize;
 
     // packet id
-    ++this->packetId;
-    if (this->packetId == 0)
-    {
-        this->packetId = 1;
-    }
+    nextPacketId(this);
     buf[idx++] = this->packetId >> 8;
     buf[idx++] = this->packetId & 0xFF;
     if (pId)
@@ -1080,8 +4598,7 @@ umqtt_Unsubscribe(umqtt_Handle_t h,
         idx += umqtt_EncodeData((const uint8_t *)topics[i], strlen(topics[i]), &buf[idx]);
     }
 
-    int len = this->pNet->pfnNetWritePacket(this->pNet->hNet, buf, remainingLength, false);
-    if (len == remainingLength)
+    if (writePacket(this, buf, remainingLength, false))
     {
         // need to save the packet to wait for ack
         enqueuePacket(this, buf, this->packetId, this->ticks);
@@ -1092,6 +4609,12 @@ umqtt_Unsubscribe(umqtt_Handle_t h,
         return UMQTT_ERR_NETWORK; // network error
     }
 
+    // the topics are no longer passed to any handlers
+    for (uint32_t i = 0; i < count; i++)
+    {
+        removeTopicHandler(this, topics[i], NULL, NULL);
+    }
+
     return UMQTT_ERR_OK;
 }
 
@@ -1118,16 +4641,469 @@ umqtt_PingReq(umqtt_Handle_t h)
     RETURN_IF_ERR(h == NULL, UMQTT_ERR_PARM);
 
     // attempt to send pingreq packet
-    int len = this->pNet->pfnNetWritePacket(this->pNet->hNet, pingreqPacket,
-                                            2, false);
-    if (len != 2)
+    if (!writePacket(this, pingreqPacket, 2, false))
     {
         return UMQTT_ERR_NETWORK; // network error
     }
+    this->pingSentTicks = nowTicks(this);
+    this->pingIsPending = true;
+
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Decode a CONNACK packet, update the connection state and notify client
+ *
+ * @param this umqtt instance
+ * @param pData variable header and payload of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * The packet type, flags and length have been checked by decodePacket()
+ * against the packet rules, as for the other decode functions below.
+ *
+ * @return UMQTT_ERR_OK
+ */
+static umqtt_Error_t
+decodeConnack(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)remainingLen;
+
+    // extract parameters from connack packet
+    bool sessionPresent = pData[0] & 1 ? true : false;
+    uint8_t returnCode = pData[1];
+
+    // remove any pending connects from the wait queue
+    uint8_t *buf;
+    do
+    {
+        buf = dequeuePacketByType(this, UMQTT_TYPE_CONNECT);
+        if (buf)
+        {
+            deletePacket(this, buf);
+        }
+    } while (buf);
+
+    // update the connection state
+    // if return code is 0 then client is connected
+    this->connectIsPending = false;
+    this->isConnected = (returnCode == 0);
+    this->pingTicks = this->ticks;
+
+    // notify client of connack
+    if (this->pCb->connackCb)
+    {
+        this->pCb->connackCb(this, this->pUser, sessionPresent, returnCode);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Decode a PUBLISH packet, deliver the message and acknowledge it
+ *
+ * @param this umqtt instance
+ * @param flags fixed header flags
+ * @param pData variable header and payload of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code
+ */
+static umqtt_Error_t
+decodePublish(umqtt_Instance_t *this, uint8_t flags, const uint8_t *pData,
+              uint32_t remainingLen)
+{
+    TopicMsg_t msg;
+    uint16_t pktId = 0;
+
+    // extract publish options
+    msg.dup = flags & UMQTT_FLAG_DUP ? true : false;
+    msg.retain = flags & UMQTT_FLAG_RETAIN ? true : false;
+    msg.qos = (flags & UMQTT_FLAG_QOS) >> UMQTT_FLAG_QOS_SHIFT;
+
+    // find the topic length and value, the packet rules make sure
+    // there is room for the topic length and packet id
+    uint32_t idx = 0;
+    msg.topicLen = (pData[idx] << 8) + pData[idx + 1];
+    idx += 2;
+    remainingLen -= 2;
+    RETURN_IF_ERR(msg.topicLen > remainingLen, UMQTT_ERR_PACKET_ERROR);
+
+    // extract the topic length and buf pointer
+    msg.pTopic = (const char *)&pData[idx];
+    RETURN_IF_ERR(!checkTopicName(this, msg.pTopic, msg.topicLen),
+                  UMQTT_ERR_PACKET_ERROR);
+    remainingLen -= msg.topicLen;
+    idx += msg.topicLen;
+
+    // for non-0 QoS, extract the packet id
+    if (msg.qos != 0)
+    {
+        RETURN_IF_ERR(remainingLen < 2, UMQTT_ERR_PACKET_ERROR);
+        pktId = (pData[idx] << 8) + pData[idx + 1];
+        idx += 2;
+        remainingLen -= 2;
+    }
+
+    // remainder of packet is the payload message
+    msg.pPayload = (remainingLen != 0) ? &pData[idx] : NULL;
+    msg.payloadLen = remainingLen;
+
+    // for QoS 2, the packet ID is marked as received until the
+    // server releases it.  If it is already marked then this is
+    // a retransmit of a message that was delivered, and it is
+    // only acknowledged again.
+    bool isDuplicate = false;
+    if (msg.qos == 2)
+    {
+        if (this->pQos2Ids == NULL)
+        {
+            this->pQos2Ids = allocFixed(this, UMQTT_QOS2_BITMAP_SIZE);
+            RETURN_IF_ERR(this->pQos2Ids == NULL, UMQTT_ERR_BUFSIZE);
+            memset(this->pQos2Ids, 0, UMQTT_QOS2_BITMAP_SIZE);
+        }
+        uint8_t bit = 1U << (pktId & 7);
+        isDuplicate = (this->pQos2Ids[pktId >> 3] & bit) != 0;
+        this->pQos2Ids[pktId >> 3] |= bit;
+    }
+
+    // pass the message to the handlers of all matching topic
+    // filters, or to the callback if there were none
+    if (!isDuplicate && (dispatchTopic(this, &msg) == 0) && this->pCb->publishCb)
+    {
+        this->pCb->publishCb(this, this->pUser, msg.dup, msg.retain, msg.qos,
+                             msg.pTopic, msg.topicLen, msg.pPayload,
+                             msg.payloadLen);
+    }
+
+    // if QoS is non-0, send the reply packet, even if
+    // nobody was notified of the message
+    if (msg.qos != 0)
+    {
+        return sendAck(this, (msg.qos == 1) ? UMQTT_TYPE_PUBACK : UMQTT_TYPE_PUBREC,
+                       pktId);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Decode a PUBACK packet, free the pending publish and notify client
+ *
+ * @param this umqtt instance
+ * @param pData variable header of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK
+ */
+static umqtt_Error_t
+decodePuback(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)remainingLen;
+    uint16_t pktId = (pData[0] << 8) + pData[1];
+
+    // remove pending publish packet with this packet ID
+    uint8_t *buf;
+    do
+    {
+        buf = dequeuePacketById(this, pktId);
+        if (buf)
+        {
+            recordPacketLatency(this, UMQTT_LATENCY_PUBACK, buf);
+            deletePacket(this, buf);
+        }
+    } while (buf); // should not ever repeat
+
+    if (this->pCb->pubackCb)
+    {
+        this->pCb->pubackCb(this, this->pUser, pktId);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Decode a PUBREC packet and release the client QoS 2 publish
+ *
+ * @param this umqtt instance
+ * @param pData variable header of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code
+ */
+static umqtt_Error_t
+decodePubrec(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)remainingLen;
+    uint16_t pktId = (pData[0] << 8) + pData[1];
+    return releasePublish(this, pktId);
+}
+
+/*
+ * @internal
+ *
+ * Decode a PUBREL packet, forget the packet ID and complete the handshake
+ *
+ * @param this umqtt instance
+ * @param pData variable header of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code
+ */
+static umqtt_Error_t
+decodePubrel(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)remainingLen;
+    uint16_t pktId = (pData[0] << 8) + pData[1];
+    if (this->pQos2Ids)
+    {
+        this->pQos2Ids[pktId >> 3] &= ~(1U << (pktId & 7));
+    }
+    return sendAck(this, UMQTT_TYPE_PUBCOMP, pktId);
+}
+
+/*
+ * @internal
+ *
+ * Decode a PUBCOMP packet, free the pending pubrel and notify client
+ *
+ * @param this umqtt instance
+ * @param pData variable header of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK
+ */
+static umqtt_Error_t
+decodePubcomp(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)remainingLen;
+    uint16_t pktId = (pData[0] << 8) + pData[1];
+
+    // remove pending pubrel packet with this packet ID
+    uint8_t *buf;
+    do
+    {
+        buf = dequeuePacketById(this, pktId);
+        if (buf)
+        {
+            recordPacketLatency(this, UMQTT_LATENCY_PUBCOMP, buf);
+            deletePacket(this, buf);
+        }
+    } while (buf); // should not ever repeat
+
+    if (this->pCb->pubackCb)
+    {
+        this->pCb->pubackCb(this, this->pUser, pktId);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Decode a SUBACK packet, free the pending subscribe and notify client
+ *
+ * @param this umqtt instance
+ * @param pData variable header and payload of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK
+ */
+static umqtt_Error_t
+decodeSuback(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    uint16_t pktId = (pData[0] << 8) + pData[1];
+
+    // remove pending subscribe packet with this packet ID
+    uint8_t *buf;
+    do
+    {
+        buf = dequeuePacketById(this, pktId);
+        if (buf)
+        {
+            recordPacketLatency(this, UMQTT_LATENCY_SUBACK, buf);
+            deletePacket(this, buf);
+        }
+    } while (buf); // should not ever repeat
+
+    if (this->pCb->subackCb)
+    {
+        uint16_t topicCount = remainingLen - 2;
+        const uint8_t *topicList = &pData[2];
+        this->pCb->subackCb(this, this->pUser, topicList, topicCount, pktId);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/*
+ * @internal
+ *
+ * Decode an UNSUBACK packet, free the pending unsubscribe and notify client
+ *
+ * @param this umqtt instance
+ * @param pData variable header of the packet
+ * @param remainingLen number of bytes at _pData_
+ *
+ * @return UMQTT_ERR_OK
+ */
+static umqtt_Error_t
+decodeUnsuback(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)remainingLen;
+    uint16_t pktId = (pData[0] << 8) + pData[1];
+
+    // remove pending unsub packet with this packet ID
+    uint8_t *buf;
+    do
+    {
+        buf = dequeuePacketById(this, pktId);
+        if (buf)
+        {
+            recordPacketLatency(this, UMQTT_LATENCY_UNSUBACK, buf);
+            deletePacket(this, buf);
+        }
+    } while (buf); // should not ever repeat
+
+    if (this->pCb->unsubackCb)
+    {
+        this->pCb->unsubackCb(this, this->pUser, pktId);
+    }
+    return UMQTT_ERR_OK;
+}
 
+/*
+ * @internal
+ *
+ * Decode a PINGRESP packet, measure the round trip and notify client
+ *
+ * @param this umqtt instance
+ * @param pData end of the packet, PINGRESP has no variable header
+ * @param remainingLen always 0
+ *
+ * @return UMQTT_ERR_OK
+ */
+static umqtt_Error_t
+decodePingresp(umqtt_Instance_t *this, const uint8_t *pData, uint32_t remainingLen)
+{
+    (void)pData;
+    (void)remainingLen;
+    if (this->pingIsPending)
+    {
+        this->pingIsPending = false;
+        uint32_t rtt = nowTicks(this) - this->pingSentTicks;
+        recordLatency(this, UMQTT_LATENCY_PINGRESP, rtt, false);
+        updateRtt(this, rtt);
+    }
+    if (this->pCb->pingrespCb)
+    {
+        this->pCb->pingrespCb(this, this->pUser);
+    }
     return UMQTT_ERR_OK;
 }
 
+/*
+ * Decode rules for every value of the first byte of a packet, which holds
+ * the packet type and flags.  Only the packets a server can send to a
+ * client, with the flags allowed for them, have a rule.  A QoS 0 publish
+ * must not have the DUP flag, and QoS 3 does not exist.
+ */
+static const PacketRule_t packetRules[256] =
+{
+    [0x20] = UMQTT_RULE_EXACT(2),
+    [0x30] = UMQTT_RULE_MIN(2),
+    [0x31] = UMQTT_RULE_MIN(2),
+    [0x32] = UMQTT_RULE_MIN(4),
+    [0x33] = UMQTT_RULE_MIN(4),
+    [0x34] = UMQTT_RULE_MIN(4),
+    [0x35] = UMQTT_RULE_MIN(4),
+    [0x3A] = UMQTT_RULE_MIN(4),
+    [0x3B] = UMQTT_RULE_MIN(4),
+    [0x3C] = UMQTT_RULE_MIN(4),
+    [0x3D] = UMQTT_RULE_MIN(4),
+    [0x40] = UMQTT_RULE_EXACT(2),
+    [0x50] = UMQTT_RULE_EXACT(2),
+    [0x62] = UMQTT_RULE_EXACT(2),
+    [0x70] = UMQTT_RULE_EXACT(2),
+    [0x90] = UMQTT_RULE_MIN(3),
+    [0xB0] = UMQTT_RULE_EXACT(2),
+    [0xD0] = UMQTT_RULE_EXACT(0),
+};
+
+/*
+ * @internal
+ *
+ * Decode incoming MQTT packet and perform its action
+ *
+ * @param this umqtt instance
+ * @param pIncoming buffer holding incoming MQTT packet
+ * @param incomingLen number of bytes in the incoming buffer, at least 1
+ *
+ * This does the work for umqtt_DecodePacket(), after the parameters
+ * have been checked.  One lookup of the first byte in the packet rules
+ * checks the packet type and flags, and gives the length limits.  The
+ * packet is then passed to the decode function for its type.  Nothing is
+ * read past _incomingLen_ bytes.
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code
+ */
+static umqtt_Error_t
+decodePacket(umqtt_Instance_t *this, const uint8_t *pIncoming, uint32_t incomingLen)
+{
+    const PacketRule_t *pRule = &packetRules[pIncoming[0]];
+
+    // most packets from the server are short, so decode a one byte
+    // remaining length here.  Make sure MQTT packet length is consistent
+    // with the supplied network packet.
+    uint32_t remainingLen;
+    uint32_t lenCount;
+    if ((incomingLen >= 2) && !(pIncoming[1] & 0x80))
+    {
+        remainingLen = pIncoming[1];
+        lenCount = 1;
+    }
+    else
+    {
+        lenCount = umqtt_DecodeLength(&remainingLen, &pIncoming[1], incomingLen - 1);
+    }
+    RETURN_IF_ERR((lenCount == 0) || ((remainingLen + 1 + lenCount) != incomingLen),
+                  UMQTT_ERR_PACKET_ERROR);
+
+    // only packets a server sends to a client are accepted, and the
+    // remaining length must be allowed for the type.  The unsigned
+    // difference checks both ends of the range, and a packet that is not
+    // valid has no allowed lengths.
+    RETURN_IF_ERR((remainingLen - pRule->minLen) >= pRule->lenSpan, UMQTT_ERR_PACKET_ERROR);
+
+    // process the packet type
+    // only client related - not implementing server
+    const uint8_t *pData = &pIncoming[1 + lenCount];
+    switch (pIncoming[0] >> 4)
+    {
+        case UMQTT_TYPE_CONNACK:
+            return decodeConnack(this, pData, remainingLen);
+        case UMQTT_TYPE_PUBLISH:
+            return decodePublish(this, pIncoming[0] & 0x0F, pData, remainingLen);
+        case UMQTT_TYPE_PUBACK:
+            return decodePuback(this, pData, remainingLen);
+        case UMQTT_TYPE_PUBREC:
+            return decodePubrec(this, pData, remainingLen);
+        case UMQTT_TYPE_PUBREL:
+            return decodePubrel(this, pData, remainingLen);
+        case UMQTT_TYPE_PUBCOMP:
+            return decodePubcomp(this, pData, remainingLen);
+        case UMQTT_TYPE_SUBACK:
+            return decodeSuback(this, pData, remainingLen);
+        case UMQTT_TYPE_UNSUBACK:
+            return decodeUnsuback(this, pData, remainingLen);
+        default:
+            return decodePingresp(this, pData, remainingLen);
+    }
+}
+
 /**
  * Decode incoming MQTT packet.
  *
@@ -1148,258 +5124,219 @@ umqtt_PingReq(umqtt_Handle_t h)
  * Type     | Action
  * ---------|-------
  * CONNACK  | Free pending connect, notify client if callback is provided
- * PUBLISH  | Extract publish topic, notify client through callback
+ * PUBLISH  | Extract publish topic, notify matching topic handlers or callback
  * PUBACK   | Free pending Publish, notify client if callback is provided
+ * PUBREC   | Replace pending QoS 2 Publish with a Pubrel and send it
+ * PUBREL   | Forget the QoS 2 packet ID and reply with Pubcomp
+ * PUBCOMP  | Free pending Pubrel, notify client if Puback callback is provided
  * SUBACK   | Free pending Subscribe, notify client if callback is provided
  * UNSUBACK | Free pending Unsubscribe, notify client if callback is provided
  * PINGRESP | No action except notify client if a callback is provided
+ *
+ * Any other packet type, fixed header flags that are not allowed for the
+ * type, or a length that does not match the type or the buffer, is
+ * rejected with UMQTT_ERR_PACKET_ERROR.  The decoder never reads past
+ * _incomingLen_ bytes, even for malformed input.
+ */
+umqtt_Error_t
+umqtt_DecodePacket(umqtt_Handle_t h, const uint8_t *pIncoming, uint32_t incomingLen)
+{
+    // basic parameter check
+    if ((h == NULL) || (pIncoming == NULL) || (incomingLen == 0))
+    {
+        return UMQTT_ERR_PARM;
+    }
+
+    // get instance data from handle
+    umqtt_Instance_t *this = h;
+    ++this->decodeCount;
+    this->statsDirty = true;
+    ++this->stats.pktsRecv[pIncoming[0] >> 4];
+    this->stats.bytesRecv += incomingLen;
+
+    umqtt_Error_t err = decodePacket(this, pIncoming, incomingLen);
+    if (err == UMQTT_ERR_PACKET_ERROR)
+    {
+        this->statsDirty = true;
+        ++this->stats.decodeErrors;
+    }
+    return err;
+}
+
+/* @internal
+ *
+ * Check for a complete fixed header at the start of a byte stream
+ *
+ * @param pBuf bytes from the stream
+ * @param bufLen number of bytes available in the buffer
+ * @param pRemainingLen storage for the decoded remaining length
+ *
+ * The remaining length is only decoded once all of its bytes are present
+ * in the buffer.
+ *
+ * @return the number of bytes in the fixed header, 0 if more bytes are
+ * needed, or -1 if the remaining length field is longer than 4 bytes
+ */
+static int32_t
+frameHeader(const uint8_t *pBuf, uint32_t bufLen, uint32_t *pRemainingLen)
+{
+    uint32_t lenCount = umqtt_DecodeLength(pRemainingLen, &pBuf[1], bufLen - 1);
+    if (lenCount)
+    {
+        return lenCount + 1;
+    }
+    return (bufLen > 4) ? -1 : 0;
+}
+
+/**
+ * Decode MQTT packets from a byte stream.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param pData bytes received from the network
+ * @param len number of bytes in the buffer
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * This function is used when the network delivers a byte stream rather
+ * than whole packets, such as the data from a TCP socket.  The data can
+ * hold any number of packets, and can start or end in the middle of a
+ * packet.  Each complete packet is passed to umqtt_DecodePacket().
+ * Packets that are wholly contained in _pData_ are decoded in place.
+ * A packet that is split across calls is collected in a buffer from the
+ * application allocator until the rest of it arrives.  The caller keeps
+ * ownership of _pData_.
+ *
+ * If the instance was created with the _streamInput_ option then
+ * umqtt_Run() calls this function with the data from the network read
+ * function, and the application does not need to call it.
+ *
+ * If a packet can not be decoded, the error is remembered and the
+ * remaining packets are still processed.  If the packet framing itself
+ * is broken (bad remaining length, or a packet larger than the
+ * _maxPacketLen_ option), then the rest of the data is discarded and
+ * UMQTT_ERR_PACKET_ERROR is returned.  The stream can not be resynced
+ * after this and the connection should be closed.
  */
 umqtt_Error_t
-umqtt_DecodePacket(umqtt_Handle_t h, const uint8_t *pIncoming, uint32_t incomingLen)
+umqtt_Feed(umqtt_Handle_t h, const uint8_t *pData, uint32_t len)
 {
     umqtt_Error_t err = UMQTT_ERR_OK;
-
-    // basic parameter check
-    if ((h == NULL) || (pIncoming == NULL) || (incomingLen == 0))
-    {
-        return UMQTT_ERR_PARM;
-    }
-
-    // get instance data from handle
+    umqtt_Error_t decodeErr;
     umqtt_Instance_t *this = h;
+    RETURN_IF_ERR((this == NULL) || ((pData == NULL) && len), UMQTT_ERR_PARM);
 
-    // start processing the packet if it contains data
-    if (incomingLen)
+    while (len)
     {
-        // extract the packet type, flags and length
-        uint8_t type = pIncoming[0] >> 4;
-        uint8_t flags = pIncoming[0] & 0x0F;
         uint32_t remainingLen;
-        uint32_t lenCount = umqtt_DecodeLength(&remainingLen, &pIncoming[1]);
-        // make sure MQTT packet length is consistent with
-        // the supplied network packet
-        if ((remainingLen + 1 + lenCount) != incomingLen)
-        {
-            return UMQTT_ERR_PACKET_ERROR;
-        }
+        int32_t hdrLen;
 
-        // process the packet type
-        // only client related - not implementing server
-        switch (type)
+        // collecting the rest of a packet that was split
+        if (this->pFrame)
         {
-            // CONNACK - pass ack info to callback
-            case UMQTT_TYPE_CONNACK:
-            {
-                // sanity check
-                RETURN_IF_ERR(remainingLen != 2, UMQTT_ERR_PACKET_ERROR);
-                // extract parameters from connack packet
-                bool sessionPresent = pIncoming[2] & 1 ? true : false;
-                uint8_t returnCode = pIncoming[3];
-
-                // remove any pending connects from the wait queue
-                uint8_t *buf;
-                do
-                {
-                    buf = dequeuePacketByType(this, UMQTT_TYPE_CONNECT);
-                    if (buf)
-                    {
-                        deletePacket(this, buf);
-                    }
-                } while (buf);
-
-                // update the connection state
-                // if return code is 0 then client is connected
-                this->connectIsPending = false;
-                this->isConnected = (returnCode == 0);
-                this->pingTicks = this->ticks;
-
-                // notify client of connack
-                if (this->pCb->connackCb)
-                {
-                    this->pCb->connackCb(h, this->pUser, sessionPresent, returnCode);
-                }
-                break;
-            }
-
-            // PUBLISH - extract published topic, payload and options
-            case UMQTT_TYPE_PUBLISH:
-            {
-                const char *pTopic;
-                const uint8_t *pMsg = NULL;
-                uint8_t pktId[2] = {0, 0};
-
-                // make sure there is a callback function
-                // @todo do we need to process packet even if no callback?
-                // what if qos != 0 we still need to reply to sender
-                if (this->pCb->publishCb)
-                {
-                    // extract publish options
-                    bool dup = flags & UMQTT_FLAG_DUP ? true : false;
-                    bool retain = flags & UMQTT_FLAG_RETAIN ? true : false;
-                    uint8_t qos = (flags & UMQTT_FLAG_QOS) >> UMQTT_FLAG_QOS_SHIFT;
-                    RETURN_IF_ERR(qos > 2, UMQTT_ERR_PACKET_ERROR);
-
-                    // find the topic length and value
-                    // make sure remaining packet length is long enough
-                    uint32_t idx = 1 + lenCount;
-                    uint16_t topicLen = (pIncoming[idx] << 8) + pIncoming[idx + 1];
-                    idx += 2;
-                    RETURN_IF_ERR((topicLen + 2U) > remainingLen, UMQTT_ERR_PACKET_ERROR);
-
-                    // extract the topic length and buf pointer
-                    pTopic = (const char *)&pIncoming[idx];
-                    remainingLen -= topicLen + 2;
-                    idx += topicLen;
-
-                    // for non-0 QoS, extract the packet id
-                    // @todo check for qos 2 and signal error?
-                    if (qos != 0)
-                    {
-                        if (remainingLen >= 2)
-                        {
-                            pktId[0] = pIncoming[idx++];
-                            pktId[1] = pIncoming[idx++];
-                            remainingLen -= 2;
-                        }
-                        else
-                        {
-                            return UMQTT_ERR_PACKET_ERROR;
-                        }
-                    }
-
-                    // continue extracting if there is a topic payload
-                    if (remainingLen != 0)
-                    {
-                        // remainder of packet is the payload message
-                        pMsg = &pIncoming[idx];
-                    }
-
-                    // callback to provide the publish info to the app
-                    this->pCb->publishCb(h, this->pUser, dup, retain, qos, pTopic, topicLen, pMsg, remainingLen);
-
-                    // if QoS is non-0, prepare a reply packet and
-                    // notify through the callback
-                    // (note this only works for QoS 1 right now)
-                    if (qos != 0)
-                    {
-                        uint8_t pubackdat[4];
-                        pubackdat[0] = UMQTT_TYPE_PUBACK << 4;
-                        pubackdat[1] = 2;
-                        pubackdat[2] = pktId[0];
-                        pubackdat[3] = pktId[1];
-                        int msgLen = this->pNet->pfnNetWritePacket(this->pNet->hNet, pubackdat, 4, false);
-                        RETURN_IF_ERR(msgLen != 4, UMQTT_ERR_NETWORK);
-                    }
-                }
-
-                break;
-            }
-
-            // PUBACK - server is acking the client publish, notify client
-            case UMQTT_TYPE_PUBACK:
+            uint32_t count = this->frameLen - this->frameCount;
+            count = (count < len) ? count : len;
+            memcpy(&this->pFrame[this->frameCount], pData, count);
+            this->frameCount += count;
+            pData += count;
+            len -= count;
+            if (this->frameCount == this->frameLen)
             {
-                // sanity check
-                RETURN_IF_ERR(remainingLen != 2, UMQTT_ERR_PACKET_ERROR);
-                uint16_t pktId = (pIncoming[2] << 8) + pIncoming[3];
-
-                // remove pending publish packet with this packet ID
-                uint8_t *buf;
-                do
-                {
-                    buf = dequeuePacketById(this, pktId);
-                    if (buf)
-                    {
-                        deletePacket(this, buf);
-                    }
-                } while (buf); // should not ever repeat
-
-                if (this->pCb->pubackCb)
-                {
-                    this->pCb->pubackCb(this, this->pUser, pktId);
-                }
-                break;
+                uint8_t *pFrame = this->pFrame;
+                this->pFrame = NULL;
+                decodeErr = umqtt_DecodePacket(h, pFrame, this->frameLen);
+                freeMem(this, pFrame);
+                err = (decodeErr != UMQTT_ERR_OK) ? decodeErr : err;
             }
+            continue;
+        }
 
-            // SUBACK - server is acking the client subscribe,
-            // notify client
-            case UMQTT_TYPE_SUBACK:
+        // at a packet boundary, decode whole packets in place
+        if (this->frameHdrCount == 0)
+        {
+            hdrLen = frameHeader(pData, len, &remainingLen);
+            if ((hdrLen > 0) && (remainingLen <= (len - hdrLen))
+             && (!this->maxPacketLen || ((remainingLen + hdrLen) <= this->maxPacketLen)))
             {
-                // sanity check
-                RETURN_IF_ERR(remainingLen < 3, UMQTT_ERR_PACKET_ERROR);
-                uint16_t pktId = (pIncoming[2] << 8) + pIncoming[3];
-
-                // remove pending subscribe packet with this packet ID
-                uint8_t *buf;
-                do
-                {
-                    buf = dequeuePacketById(this, pktId);
-                    if (buf)
-                    {
-                        deletePacket(this, buf);
-                    }
-                } while (buf); // should not ever repeat
-
-                if (this->pCb->subackCb)
-                {
-                    uint16_t topicCount = remainingLen - 2;
-                    const uint8_t *topicList = &pIncoming[4];
-                    this->pCb->subackCb(this, this->pUser, topicList, topicCount, pktId);
-                }
-                break;
+                decodeErr = umqtt_DecodePacket(h, pData, remainingLen + hdrLen);
+                err = (decodeErr != UMQTT_ERR_OK) ? decodeErr : err;
+                pData += remainingLen + hdrLen;
+                len -= remainingLen + hdrLen;
+                continue;
             }
+        }
 
-            // UNSUBACK - notify client
-            case UMQTT_TYPE_UNSUBACK:
-            {
-                // sanity check
-                RETURN_IF_ERR(remainingLen != 2, UMQTT_ERR_PACKET_ERROR);
-                uint16_t pktId = (pIncoming[2] << 8) + pIncoming[3];
-
-                // remove pending unsub packet with this packet ID
-                uint8_t *buf;
-                do
-                {
-                    buf = dequeuePacketById(this, pktId);
-                    if (buf)
-                    {
-                        deletePacket(this, buf);
-                    }
-                } while (buf); // should not ever repeat
-
-                if (this->pCb->unsubackCb)
-                {
-                    this->pCb->unsubackCb(this, this->pUser, pktId);
-                }
-                break;
-            }
+        // otherwise collect the fixed header one byte at a time
+        this->frameHdr[this->frameHdrCount++] = *pData++;
+        --len;
+        hdrLen = frameHeader(this->frameHdr, this->frameHdrCount, &remainingLen);
+        if (hdrLen == 0)
+        {
+            continue;
+        }
+        if ((hdrLen < 0) || (this->maxPacketLen
+                         && ((remainingLen + hdrLen) > this->maxPacketLen)))
+        {
+            this->statsDirty = true;
+            ++this->stats.decodeErrors;
+            resetFrame(this);
+            return UMQTT_ERR_PACKET_ERROR;
+        }
 
-            // PINGRESP - notify client
-            case UMQTT_TYPE_PINGRESP:
-            {
-                // sanity check
-                RETURN_IF_ERR(remainingLen != 0, UMQTT_ERR_PACKET_ERROR);
-                if (this->pCb->pingrespCb)
-                {
-                    this->pCb->pingrespCb(this, this->pUser);
-                }
-                break;
-            }
+        // packets with no body are complete with the header
+        this->frameHdrCount = 0;
+        if (remainingLen == 0)
+        {
+            decodeErr = umqtt_DecodePacket(h, this->frameHdr, hdrLen);
+            err = (decodeErr != UMQTT_ERR_OK) ? decodeErr : err;
+            continue;
+        }
 
-            // unexpected packet type is an error
-            default:
-            {
-                err = UMQTT_ERR_PACKET_ERROR;
-                break;
-            }
+        // start collecting the packet body
+        this->pFrame = allocMem(this, remainingLen + hdrLen);
+        if (this->pFrame == NULL)
+        {
+            this->statsDirty = true;
+            ++this->stats.allocFails;
+            resetFrame(this);
+            return UMQTT_ERR_BUFSIZE;
         }
-        return err;
+        memcpy(this->pFrame, this->frameHdr, hdrLen);
+        this->frameLen = remainingLen + hdrLen;
+        this->frameCount = hdrLen;
     }
+    return err;
+}
 
-    // packet length 0 is an error
-    else
-    {
-        return UMQTT_ERR_PACKET_ERROR;
-    }
+/**
+ * Write collected acknowledgments to the network.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ *
+ * @return UMQTT_ERR_OK if successful, or an error code if an error occurred
+ *
+ * If the instance was created with the _coalesceAcks_ option, the
+ * acknowledgments for received publish packets are collected and written
+ * to the network together.  umqtt_Run() writes them at the end of each
+ * pass, so an application that uses umqtt_Run() does not need to call
+ * this function.  An application that passes packets to
+ * umqtt_DecodePacket() or umqtt_Feed() itself should call it after each
+ * batch of packets.  If acknowledgments are not collected, this function
+ * does nothing.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * // decode everything that was received, then acknowledge it all
+ * // with one network write
+ * umqtt_Feed(h, rxData, rxLen);
+ * umqtt_FlushAcks(h);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_FlushAcks(umqtt_Handle_t h)
+{
+    umqtt_Instance_t *this = h;
+    RETURN_IF_ERR(this == NULL, UMQTT_ERR_PARM);
+    return flushAcks(this);
 }
 
 /**
@@ -1430,6 +5367,169 @@ umqtt_GetConnectedStatus(umqtt_Handle_t h)
     else                                { return UMQTT_ERR_DISCONNECTED; }
 }
 
+/**
+ * Get the number of bytes the transport holds back for sending.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ *
+ * @return the number of bytes written by the instance that the network
+ * has not taken yet, or 0 if the transport does not report it
+ *
+ * The bytes are sent by the transport on a later read or write, which
+ * umqtt_Run() does.  If this is not 0, an application that waits for
+ * network events should also wait for the network to become writable,
+ * and run the instance when it does.  umqtt_LoopRun() does this itself.
+ */
+uint32_t
+umqtt_GetNetBacklog(umqtt_Handle_t h)
+{
+    umqtt_Instance_t *this = h;
+    if ((this == NULL) || (this->pNet->pfnNetGetBacklog == NULL))
+    {
+        return 0;
+    }
+    return this->pNet->pfnNetGetBacklog(this->pNet->hNet);
+}
+
+/*
+ * @internal
+ *
+ * Initialize the instance data
+ *
+ * @param this umqtt instance, with the memory fields already set
+ * @param pTransport structure defining the MQTT transport interface
+ * @param pCallbacks structure holding the callback functions
+ * @param pUser optional caller defined data pointer
+ * @param pOptions instance settings
+ *
+ * @return true if the instance is ready, or false if the buffers it
+ * needs could not be allocated
+ */
+static bool
+initInstance(umqtt_Instance_t *this, umqtt_TransportConfig_t *pTransport,
+             umqtt_Callbacks_t *pCallbacks, void *pUser,
+             const umqtt_Options_t *pOptions)
+{
+    this->pNet = pTransport;
+    this->pCb = pCallbacks;
+    this->pUser = pUser;
+    this->packetId = 0;
+    this->pktList.next = NULL;
+    this->pktList.prev = NULL;
+    this->pktList.packetId = 0;
+    this->pktList.ticks = 0;
+    this->pktIndex = NULL;
+    this->pktIndexSize = 0;
+    this->pktIndexCount = 0;
+    this->pktIndexProbe = 0;
+    memset(this->timerSlots, 0, sizeof(this->timerSlots));
+    memset(this->timerMask, 0, sizeof(this->timerMask));
+    this->timerNext = 0;
+    this->timerCount = 0;
+    this->ticks = 0;
+    this->hasRun = false;
+    this->pingTicks = 0;
+    this->pingSentTicks = 0;
+    this->pingIsPending = false;
+    this->isConnected = false;
+    this->connectIsPending = false;
+    this->keepAlive = 0;
+    this->usePool = pOptions->usePool;
+    memset(this->poolFree, 0, sizeof(this->poolFree));
+    memset(&this->poolStats, 0, sizeof(this->poolStats));
+    memset(this->memFree, 0, sizeof(this->memFree));
+    this->streamInput = pOptions->streamInput;
+    this->maxPacketLen = pOptions->maxPacketLen;
+    this->frameHdrCount = 0;
+    this->pFrame = NULL;
+    this->frameLen = 0;
+    this->frameCount = 0;
+    this->decodeCount = 0;
+    this->pfnGetTicks = pOptions->pfnGetTicks;
+    this->maxInflight = pOptions->maxInflight;
+    this->maxInflightBytes = pOptions->maxInflightBytes;
+    this->inflight = 0;
+    this->inflightBytes = 0;
+    memset(&this->stats, 0, sizeof(this->stats));
+    memset(&this->statsSnapshot, 0, sizeof(this->statsSnapshot));
+    this->statsSeq = 0;
+    this->statsDirty = true;
+    this->minRto = pOptions->minRetryTimeout ? pOptions->minRetryTimeout
+                                             : UMQTT_RETRY_TIMEOUT_MIN;
+    this->maxRto = pOptions->maxRetryTimeout ? pOptions->maxRetryTimeout
+                                             : UMQTT_RETRY_TIMEOUT_MAX;
+    this->maxRto = (this->maxRto < this->minRto) ? this->minRto : this->maxRto;
+    this->initialRto = pOptions->initialRetryTimeout ? pOptions->initialRetryTimeout
+                                                     : UMQTT_RETRY_TIMEOUT;
+    this->maxRetries = pOptions->maxRetries ? pOptions->maxRetries : UMQTT_RETRIES;
+    this->srtt = 0;
+    this->rttvar = 0;
+    this->rto = this->initialRto;
+    this->rto = (this->rto < this->minRto) ? this->minRto : this->rto;
+    this->rto = (this->rto > this->maxRto) ? this->maxRto : this->rto;
+    this->jitterSeed = 0x9E3779B9U ^ (uint32_t)(size_t)this;
+    this->jitterSeed = this->jitterSeed ? this->jitterSeed : 1;
+    this->pTopicRoot = NULL;
+    this->topicDispatching = 0;
+    this->topicSweepPending = false;
+    this->pRegTopics = NULL;
+    this->pTemplates = NULL;
+    this->pQos2Ids = NULL;
+    this->pAckBuf = NULL;
+    this->ackBufLen = 0;
+    this->ackLen = 0;
+    this->ackTicks = 0;
+    this->ackDelay = pOptions->ackDelay;
+    this->pfnTopicSpan = pOptions->validateTopics ? selectTopicSpan() : NULL;
+    this->pRing = NULL;
+    this->ringSize = pOptions->ringSize & ~7U;
+    this->ringHead = 0;
+    this->ringTail = 0;
+    this->ringUsed = 0;
+
+    // fill the pool free lists with any requested starting buffers
+    if (this->usePool)
+    {
+        size_t blockSize = UMQTT_POOL_MIN_BLOCK;
+        for (uint8_t cls = 0; cls < UMQTT_POOL_CLASSES; cls++)
+        {
+            for (uint16_t i = 0; i < pOptions->poolPrealloc; i++)
+            {
+                PktBuf_t *pPkt = allocMem(this, blockSize);
+                if (pPkt == NULL)
+                {
+                    return false;
+                }
+                pPkt->next = this->poolFree[cls];
+                this->poolFree[cls] = pPkt;
+            }
+            blockSize <<= 1;
+        }
+    }
+
+    // the ack buffer holds 4 bytes for each acknowledgment
+    if (pOptions->coalesceAcks)
+    {
+        this->pAckBuf = allocFixed(this, pOptions->coalesceAcks * 4U);
+        if (this->pAckBuf == NULL)
+        {
+            return false;
+        }
+        this->ackBufLen = pOptions->coalesceAcks * 4U;
+    }
+
+    // the packet ring holds every packet the instance sends
+    if (this->ringSize)
+    {
+        this->pRing = allocFixed(this, this->ringSize);
+        if (this->pRing == NULL)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
  * Create and initialize a umqtt client instance.
  *
@@ -1437,37 +5537,158 @@ umqtt_GetConnectedStatus(umqtt_Handle_t h)
  * @param pCallbacks structure holding the callback functions
  * @param pUser optional caller defined data pointer that will be passed in callbacks
  *
- * @return _umqtt_ instance handle that should be used for all other
- * function calls, or NULL if there is an error.
+ * @return _umqtt_ instance handle that should be used for all other
+ * function calls, or NULL if there is an error.
+ *
+ * This function will allocate a _umqtt_ instance and initialize it.  No
+ * actual MQTT operations are performed.  The caller must provide the
+ * network access functions through the pTransport parameter.  Callback
+ * functions are used for notification and are optional.  If used, callback
+ * functions are provided by the pCallbacks parameter.  The entire parameter
+ * can be NULL if no callbacks are used, or individual callbacks can be
+ * NULL within the structure.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * void PublishCb(umqtt_Handle_t h, void *pUser, bool dup, bool retain,
+ *                const char *topic, uint16_t topicLen,
+ *                const uint8_t *msg, uint16_t msgLen)
+ * {
+ *     // publish handler
+ * }
+ *
+ * umqtt_TransportConfig_t transport =
+ * {
+ *     myNetworkHandle, // optional, if network has a handle or instance
+ *     malloc, free,
+ *     myNetReadFunction, myNetWriteFunction
+ * };
+ * umqtt_Callbacks_t callbacks = // only publish callback is defined
+ *     { NULL, PublishCb, NULL, NULL, NULL, NULL };
+ *
+ * umqtt_Handle_t h;
+ * h = umqtt_New(&transport, &callbacks, NULL);
+ * if (h == NULL)
+ * {
+ *     // handle error
+ * }
+ * ~~~~~~~~
+ */
+umqtt_Handle_t
+umqtt_New(umqtt_TransportConfig_t *pTransport, umqtt_Callbacks_t *pCallbacks, void *pUser)
+{
+    return umqtt_NewWithOptions(pTransport, pCallbacks, pUser, NULL);
+}
+
+/**
+ * Create and initialize a umqtt client instance with optional settings.
+ *
+ * @param pTransport structure defining the MQTT transport interface
+ * @param pCallbacks structure holding the callback functions
+ * @param pUser optional caller defined data pointer that will be passed in callbacks
+ * @param pOptions optional instance settings, or NULL for defaults
+ *
+ * @return _umqtt_ instance handle that should be used for all other
+ * function calls, or NULL if there is an error.
+ *
+ * This function is the same as umqtt_New() except that the caller can
+ * change instance settings using the @ref umqtt_Options_t structure.  The
+ * settings are copied so the structure does not need to be kept after
+ * this function returns.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_Options_t options = { 0 };
+ * options.usePool = true;     // reuse packet buffers
+ * options.poolPrealloc = 4;   // start with 4 buffers of each size
+ *
+ * umqtt_Handle_t h;
+ * h = umqtt_NewWithOptions(&transport, &callbacks, NULL, &options);
+ * if (h == NULL)
+ * {
+ *     // handle error
+ * }
+ * ~~~~~~~~
+ */
+umqtt_Handle_t
+umqtt_NewWithOptions(umqtt_TransportConfig_t *pTransport, umqtt_Callbacks_t *pCallbacks,
+                     void *pUser, const umqtt_Options_t *pOptions)
+{
+    static const umqtt_Options_t defaultOptions = { 0 };
+    if (!pOptions)
+    {
+        pOptions = &defaultOptions;
+    }
+    if (!pTransport)
+    {
+        return NULL;
+    }
+    if (!pTransport->pfnmalloc || !pTransport->pfnfree
+     || !pTransport->pfnNetReadPacket || !pTransport->pfnNetWritePacket
+     || !pTransport->hNet)
+    {
+        return NULL;
+    }
+    umqtt_Instance_t *this = pTransport->pfnmalloc(sizeof(umqtt_Instance_t));
+    if (!this)
+    {
+        return NULL;
+    }
+    this->isStatic = false;
+    this->pRegion = NULL;
+    this->regionLeft = 0;
+    if (!initInstance(this, pTransport, pCallbacks, pUser, pOptions))
+    {
+        umqtt_Delete(this);
+        return NULL;
+    }
+    return this;
+}
+
+/**
+ * Create and initialize a umqtt client instance in caller supplied memory.
+ *
+ * @param pTransport structure defining the MQTT transport interface
+ * @param pCallbacks structure holding the callback functions
+ * @param pUser optional caller defined data pointer that will be passed in callbacks
+ * @param pOptions optional instance settings, or NULL for defaults
+ * @param pRegion memory to hold the instance and all of its buffers
+ * @param regionSize number of bytes in _pRegion_
+ *
+ * @return _umqtt_ instance handle that should be used for all other
+ * function calls, or NULL if there is an error or the region is too
+ * small.
+ *
+ * This function is the same as umqtt_NewWithOptions() except that the
+ * instance never uses the _pfnmalloc_ and _pfnfree_ transport functions
+ * to allocate memory.  The instance data, the index of packets waiting
+ * for an ack, and every packet and other buffer the instance needs are
+ * carved out of the memory region.  When the region is used up, functions
+ * that need more memory, such as umqtt_Publish() and umqtt_Subscribe(),
+ * return UMQTT_ERR_BUFSIZE.
+ *
+ * Buffers are taken from the region in power of 2 sized blocks, and a
+ * freed block is kept to be used again for the next buffer of the same
+ * size.  The number of packets that can wait for an ack at one time is
+ * fixed when the instance is created.  It is the _maxInflight_ option,
+ * or 16 if that is not set.
  *
- * This function will allocate a _umqtt_ instance and initialize it.  No
- * actual MQTT operations are performed.  The caller must provide the
- * network access functions through the pTransport parameter.  Callback
- * functions are used for notification and are optional.  If used, callback
- * functions are provided by the pCallbacks parameter.  The entire parameter
- * can be NULL if no callbacks are used, or individual callbacks can be
- * NULL within the structure.
+ * The transport _pfnmalloc_ function is not needed and can be NULL.  If
+ * _pfnfree_ is NULL then umqtt_Run() does not free the buffer returned by
+ * the network read function, so the transport can use a buffer of its
+ * own, which only needs to stay valid until the next read.
+ *
+ * The region belongs to the instance until umqtt_Delete() is called.
  *
  * __Example__
  * ~~~~~~~~.c
- * void PublishCb(umqtt_Handle_t h, void *pUser, bool dup, bool retain,
- *                const char *topic, uint16_t topicLen,
- *                const uint8_t *msg, uint16_t msgLen)
- * {
- *     // publish handler
- * }
- *
- * umqtt_TransportConfig_t transport =
- * {
- *     myNetworkHandle, // optional, if network has a handle or instance
- *     malloc, free,
- *     myNetReadFunction, myNetWriteFunction
- * };
- * umqtt_Callbacks_t callbacks = // only publish callback is defined
- *     { NULL, PublishCb, NULL, NULL, NULL, NULL };
+ * static uint64_t region[4096 / sizeof(uint64_t)];
+ * umqtt_Options_t options = { 0 };
+ * options.maxInflight = 8;    // at most 8 publish packets waiting for ack
  *
  * umqtt_Handle_t h;
- * h = umqtt_New(&transport, &callbacks, NULL);
+ * h = umqtt_NewStatic(&transport, &callbacks, NULL, &options,
+ *                     region, sizeof(region));
  * if (h == NULL)
  * {
  *     // handle error
@@ -1475,35 +5696,58 @@ umqtt_GetConnectedStatus(umqtt_Handle_t h)
  * ~~~~~~~~
  */
 umqtt_Handle_t
-umqtt_New(umqtt_TransportConfig_t *pTransport, umqtt_Callbacks_t *pCallbacks, void *pUser)
+umqtt_NewStatic(umqtt_TransportConfig_t *pTransport, umqtt_Callbacks_t *pCallbacks,
+                void *pUser, const umqtt_Options_t *pOptions,
+                void *pRegion, size_t regionSize)
 {
-    if (!pTransport)
+    static const umqtt_Options_t defaultOptions = { 0 };
+    if (!pOptions)
+    {
+        pOptions = &defaultOptions;
+    }
+    if (!pTransport || !pRegion)
     {
         return NULL;
     }
-    if (!pTransport->pfnmalloc || !pTransport->pfnfree
-     || !pTransport->pfnNetReadPacket || !pTransport->pfnNetWritePacket
+    if (!pTransport->pfnNetReadPacket || !pTransport->pfnNetWritePacket
      || !pTransport->hNet)
     {
         return NULL;
     }
-    umqtt_Instance_t *this = pTransport->pfnmalloc(sizeof(umqtt_Instance_t));
-    if (!this)
+
+    // the instance data goes at the aligned start of the region
+    size_t skip = (UMQTT_STATIC_ALIGN - ((size_t)pRegion & (UMQTT_STATIC_ALIGN - 1)))
+                & (UMQTT_STATIC_ALIGN - 1);
+    size_t instanceSize = (sizeof(umqtt_Instance_t) + UMQTT_STATIC_ALIGN - 1)
+                        & ~(size_t)(UMQTT_STATIC_ALIGN - 1);
+    if (regionSize < (skip + instanceSize))
     {
         return NULL;
     }
-    this->pNet = pTransport;
-    this->pCb = pCallbacks;
-    this->pUser = pUser;
-    this->packetId = 0;
-    this->pktList.next = NULL;
-    this->pktList.packetId = 0;
-    this->pktList.ticks = 0;
-    this->ticks = 0;
-    this->pingTicks = 0;
-    this->isConnected = false;
-    this->connectIsPending = false;
-    this->keepAlive = 0;
+    umqtt_Instance_t *this = (umqtt_Instance_t *)((uint8_t *)pRegion + skip);
+    this->isStatic = true;
+    this->pRegion = (uint8_t *)this + instanceSize;
+    this->regionLeft = regionSize - skip - instanceSize;
+    if (!initInstance(this, pTransport, pCallbacks, pUser, pOptions))
+    {
+        return NULL;
+    }
+
+    // the pending packet index never grows, so make it big enough for
+    // the in-flight limit while staying no more than half full
+    uint32_t capacity = pOptions->maxInflight ? pOptions->maxInflight : UMQTT_STATIC_INFLIGHT;
+    uint32_t indexSize = UMQTT_PKT_INDEX_MIN;
+    while (((indexSize / 2) < capacity) && (indexSize < (2 * 65536)))
+    {
+        indexSize *= 2;
+    }
+    this->pktIndex = carveRegion(this, indexSize * sizeof(PktBuf_t *));
+    if (this->pktIndex == NULL)
+    {
+        return NULL;
+    }
+    memset(this->pktIndex, 0, indexSize * sizeof(PktBuf_t *));
+    this->pktIndexSize = indexSize;
     return this;
 }
 
@@ -1513,7 +5757,9 @@ umqtt_New(umqtt_TransportConfig_t *pTransport, umqtt_Callbacks_t *pCallbacks, vo
  * @param h umqtt instance handle from umqtt_New()
  *
  * This function is used to free all allocated memory by the umqtt
- * instance.  It should be called as part of an orderly shutdown.
+ * instance.  It should be called as part of an orderly shutdown.  For an
+ * instance made with umqtt_NewStatic(), nothing is freed and the memory
+ * region can be used again after this returns.
  */
 void
 umqtt_Delete(umqtt_Handle_t h)
@@ -1521,13 +5767,208 @@ umqtt_Delete(umqtt_Handle_t h)
     if (h)
     {
         umqtt_Instance_t *this = h;
+
+        // everything a static instance uses is in the caller's region
+        if (this->isStatic)
+        {
+            memset(h, 0, sizeof(umqtt_Instance_t));
+            return;
+        }
         freeAllQueuedPackets(this);
+        freePool(this);
+        resetFrame(this);
+        if (this->pTopicRoot)
+        {
+            freeTopicNode(this, this->pTopicRoot);
+        }
+        while (this->pRegTopics)
+        {
+            RegTopic_t *pTopic = this->pRegTopics;
+            this->pRegTopics = pTopic->next;
+            freeMem(this, pTopic);
+        }
+        while (this->pTemplates)
+        {
+            PubTemplate_t *pTemplate = this->pTemplates;
+            this->pTemplates = pTemplate->next;
+            freeMem(this, pTemplate);
+        }
         void (*pfnfree)(void *ptr) = this->pNet->pfnfree;
+        if (this->pQos2Ids)
+        {
+            pfnfree(this->pQos2Ids);
+        }
+        if (this->pAckBuf)
+        {
+            pfnfree(this->pAckBuf);
+        }
+        if (this->pktIndex)
+        {
+            pfnfree(this->pktIndex);
+        }
+        if (this->pRing)
+        {
+            pfnfree(this->pRing);
+        }
         memset(h, 0, sizeof(umqtt_Instance_t));
         pfnfree(h);
     }
 }
 
+/**
+ * Get the packet buffer pool counters.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param pStats storage for the counters
+ *
+ * @return UMQTT_ERR_OK or UMQTT_ERR_PARM
+ *
+ * The counters show how well the packet buffer pool is working.  After
+ * the free lists have grown to the working set of the application, the
+ * _misses_ count should stop increasing, meaning that packets are no
+ * longer being allocated from the application allocator.  The counters
+ * are all zero if the instance does not use the pool.
+ */
+umqtt_Error_t
+umqtt_GetPoolStats(umqtt_Handle_t h, umqtt_PoolStats_t *pStats)
+{
+    umqtt_Instance_t *this = h;
+    RETURN_IF_ERR((this == NULL) || (pStats == NULL), UMQTT_ERR_PARM);
+    *pStats = this->poolStats;
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Get the instance performance counters.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param pStats storage for the counters
+ *
+ * @return UMQTT_ERR_OK or UMQTT_ERR_PARM
+ *
+ * The counters include a round trip latency histogram for each kind of
+ * ack, see umqtt_LatencyPercentile().
+ *
+ * The counters are collected as the instance runs, and a copy of them is
+ * published each time umqtt_Run() or umqtt_RunBudget() finishes.  This
+ * function returns the most recently published copy, so it does not
+ * include activity since the last Run.
+ *
+ * Unlike the other functions, this one can be called from a different
+ * thread than the one that runs the client, for example by a monitoring
+ * task.  It does not lock anything.  If the copy is being published at the
+ * same moment, it reads the copy again, so the counters it returns are
+ * always from a single point in time.  The instance must not be deleted
+ * while another thread may be calling this function.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_Stats_t stats;
+ * umqtt_GetStats(h, &stats);
+ * printf("retransmits: %u, in flight: %u (peak %u)\n",
+ *        stats.retransmits, stats.inflight, stats.inflightPeak);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_GetStats(umqtt_Handle_t h, umqtt_Stats_t *pStats)
+{
+    umqtt_Instance_t *this = h;
+    RETURN_IF_ERR((this == NULL) || (pStats == NULL), UMQTT_ERR_PARM);
+
+    // retry if the snapshot was being published while it was copied
+    uint32_t seq;
+    do
+    {
+        seq = this->statsSeq;
+        UMQTT_MEMORY_BARRIER();
+        *pStats = this->statsSnapshot;
+        UMQTT_MEMORY_BARRIER();
+    } while ((seq & 1) || (seq != this->statsSeq));
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Clear the instance performance counters.
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ *
+ * @return UMQTT_ERR_OK or UMQTT_ERR_PARM
+ *
+ * All counters are set to zero, except the current in-flight count which
+ * is kept, and becomes the new peak.  The cleared counters are published
+ * right away.  This must be called from the thread that runs the client.
+ */
+umqtt_Error_t
+umqtt_ResetStats(umqtt_Handle_t h)
+{
+    umqtt_Instance_t *this = h;
+    RETURN_IF_ERR(this == NULL, UMQTT_ERR_PARM);
+    uint32_t inflight = this->stats.inflight;
+    memset(&this->stats, 0, sizeof(this->stats));
+    this->stats.inflight = inflight;
+    this->stats.inflightPeak = inflight;
+    this->statsDirty = true;
+    publishStats(this);
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Get a percentile of a latency histogram.
+ *
+ * @param pLatency a latency histogram from umqtt_GetStats()
+ * @param percent the percentile to find, 0-100
+ *
+ * Finds the histogram bucket that holds the requested percentile and
+ * returns the upper bound of that bucket, but no more than the longest
+ * round trip that was measured.  Since the buckets double in size the
+ * result is an estimate that is never low, and at most twice the real
+ * value.  This works on a copy of the counters, so it can be called
+ * from any thread.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_Stats_t stats;
+ * umqtt_GetStats(h, &stats);
+ * uint32_t p99 = umqtt_LatencyPercentile(&stats.latency[UMQTT_LATENCY_PUBACK], 99);
+ * ~~~~~~~~
+ *
+ * @return round trip time in milliseconds, or 0 if nothing was measured
+ */
+uint32_t
+umqtt_LatencyPercentile(const umqtt_Latency_t *pLatency, uint32_t percent)
+{
+    if ((pLatency == NULL) || (pLatency->count == 0))
+    {
+        return 0;
+    }
+    if (percent > 100)
+    {
+        percent = 100;
+    }
+
+    // number of samples at or below the percentile, rounded up
+    uint64_t rank = ((uint64_t)pLatency->count * percent + 99) / 100;
+    if (rank == 0)
+    {
+        return pLatency->min;
+    }
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < (UMQTT_LATENCY_BUCKETS - 1); bucket++)
+    {
+        seen += pLatency->buckets[bucket];
+        if (seen >= rank)
+        {
+            uint32_t upper = (1U << bucket) - 1;
+            if (upper < pLatency->min)
+            {
+                upper = pLatency->min;
+            }
+            return (upper < pLatency->max) ? upper : pLatency->max;
+        }
+    }
+    return pLatency->max;
+}
+
 /**
  * Main loop processing for the umqtt client instance
  *
@@ -1543,9 +5984,17 @@ umqtt_Delete(umqtt_Handle_t h)
  * of internal timeouts.  The Run function performs the following actions:
  *
  * - check for any incoming packets, decode and process
+ * - write acknowledgments that were collected (see @ref umqtt_Options_t)
  * - check for ping timeout and send ping packet if needed
  * - check for timed out pending packets and resend or expire
  *
+ * Pending packet timeouts are kept on a timer wheel, so the cost of
+ * checking them depends only on how many packets have actually timed out
+ * and not on how many packets are pending.  A timeout is noticed at most
+ * a few tens of milliseconds after it is due.  Packets that were sent
+ * before the first call, such as the CONNECT, are timed from the tick
+ * count of the first call.
+ *
  * The Run function can encounter several kinds of errors while peforming
  * its process.  If nothing goes wrong it will return UMQTT_ERR_OK.  If
  * something goes wrong, it will return the most recent error code, even
@@ -1573,40 +6022,141 @@ umqtt_Delete(umqtt_Handle_t h)
  */
 umqtt_Error_t
 umqtt_Run(umqtt_Handle_t h, uint32_t msTicks)
+{
+    return umqtt_RunBudget(h, msTicks, 1, 0, NULL);
+}
+
+/**
+ * Main loop processing that drains incoming packets up to a budget
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param msTicks milliseconds tick count
+ * @param maxPackets most incoming packets to process, or 0 for no limit
+ * @param maxMs most milliseconds to spend reading packets, or 0 for no
+ * limit
+ * @param pCount storage for the number of packets processed (optional)
+ *
+ * @return UMQTT_ERR_OK if everything is normal, or an error code if
+ * something goes wrong
+ *
+ * This function does the same processing as umqtt_Run() except that it
+ * keeps reading from the network until the network read function returns
+ * no data, or until the budget is used up.  umqtt_Run() only reads from
+ * the network once per call, which limits the incoming packet rate to the
+ * rate umqtt_Run() is called.
+ *
+ * The packet budget counts each packet passed to the decoder.  If the
+ * instance takes a byte stream (see @ref umqtt_Options_t), the budget is
+ * checked after each network read, so all of the packets in the last
+ * read are processed even if that goes over the budget.  The time budget
+ * is only used if the instance was given a tick function in the
+ * _pfnGetTicks_ option.
+ *
+ * When many instances are served from one loop, the budget can be used
+ * to share processing time fairly between them.  The number of packets
+ * processed is returned through _pCount_.  If it reached the packet
+ * budget then there is probably more data waiting.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * uint32_t count;
+ * // process up to 64 incoming packets
+ * err = umqtt_RunBudget(h, msTicks, 64, 0, &count);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_RunBudget(umqtt_Handle_t h, uint32_t msTicks,
+                uint32_t maxPackets, uint32_t maxMs, uint32_t *pCount)
 {
     umqtt_Error_t err = UMQTT_ERR_OK;
     umqtt_Instance_t *this = h;
     RETURN_IF_ERR(this == NULL, UMQTT_ERR_PARM);
 
+    // packets sent before the first run, such as the CONNECT, were timed
+    // from tick 0, so time them from now instead
+    if (!this->hasRun)
+    {
+        this->hasRun = true;
+        if (this->timerCount)
+        {
+            timerRebase(this, msTicks & ~(UMQTT_TIMER_RESOLUTION - 1),
+                        msTicks - this->ticks, false);
+        }
+    }
     this->ticks = msTicks;
+    uint32_t startCount = this->decodeCount;
+    uint32_t startTicks = 0;
+    if (maxMs && this->pfnGetTicks)
+    {
+        startTicks = this->pfnGetTicks();
+    }
 
     // if connected or connect is pending, then need to process incoming
     if (this->connectIsPending || this->isConnected)
     {
-        // attempt to read from the network
-        // assumes always a whole packet is given
-        // cannot handle partial packets
-        uint8_t *pBuf;
-        int len;
-        len = this->pNet->pfnNetReadPacket(this->pNet->hNet, &pBuf);
-
-        // check for network error.  if so then remember error
-        // but keep going because there is more processing to do
-        if (len < 0)
+        // read from the network until there is no more data or
+        // the budget is used up
+        while (this->connectIsPending || this->isConnected)
         {
-            err = UMQTT_ERR_NETWORK;
-        }
+            // attempt to read from the network
+            // assumes always a whole packet is given unless the
+            // instance takes a byte stream
+            uint8_t *pBuf;
+            int len;
+            len = this->pNet->pfnNetReadPacket(this->pNet->hNet, &pBuf);
+
+            // check for network error.  if so then remember error
+            // but keep going because there is more processing to do
+            if (len < 0)
+            {
+                this->statsDirty = true;
+                ++this->stats.networkErrors;
+                err = UMQTT_ERR_NETWORK;
+                break;
+            }
 
-        // non-zero means something was received, so decode the packet
-        // free it when we are finished
-        else if (len)
-        {
-            err = umqtt_DecodePacket(h, pBuf, len);
-            this->pNet->pfnfree(pBuf);
+            // nothing received so there is no more to read
+            if (len == 0)
+            {
+                break;
+            }
+
+            // something was received, so decode the packet
+            // free it when we are finished
+            umqtt_Error_t decodeErr;
+            if (this->streamInput)
+            {
+                decodeErr = umqtt_Feed(h, pBuf, len);
+            }
+            else
+            {
+                decodeErr = umqtt_DecodePacket(h, pBuf, len);
+            }
+            if (this->pNet->pfnfree && !this->pNet->ownsReadBuf)
+            {
+                this->pNet->pfnfree(pBuf);
+            }
+            err = (decodeErr != UMQTT_ERR_OK) ? decodeErr : err;
+
+            // stop reading if the budget is used up
+            if (maxPackets && ((this->decodeCount - startCount) >= maxPackets))
+            {
+                break;
+            }
+            if (maxMs && this->pfnGetTicks
+             && ((this->pfnGetTicks() - startTicks) >= maxMs))
+            {
+                break;
+            }
         }
 
-        // if connected, then need to check for ping timeout
-        if (this->isConnected)
+        // acknowledge everything that was received in this pass
+        umqtt_Error_t ackErr = flushAcks(this);
+        err = (ackErr != UMQTT_ERR_OK) ? ackErr : err;
+
+        // if connected, then need to check for ping timeout.  A keep
+        // alive of 0 turns off the keep alive mechanism
+        if (this->isConnected && this->keepAlive)
         {
             // use half of keepalive for ping timeout
             // keepAlive * 1000 / 2 ==> keepAlive * 500
@@ -1618,16 +6168,50 @@ umqtt_Run(umqtt_Handle_t h, uint32_t msTicks)
         }
     }
 
-    // iterate through list of queued messages
-    PktBuf_t *pPrev = &this->pktList;
-    PktBuf_t *pPkt = this->pktList.next;
-    while (pPkt)
+    // the next timer slot to expire is never after the current tick
+    // count, unless the tick count has jumped by more than half of its
+    // range.  Then the deadlines mean nothing, so everything times out
+    if (this->timerCount && ((int32_t)(msTicks - this->timerNext) < 0))
+    {
+        timerRebase(this, (msTicks & ~(UMQTT_TIMER_RESOLUTION - 1))
+                          - UMQTT_TIMER_RESOLUTION, 0, true);
+    }
+
+    // check the timer wheel for timed out pending packets.  Each slot
+    // is processed once all of the time it covers has passed, so there
+    // is nothing to do until the next slot boundary, and slots without
+    // packets are skipped.  A retransmitted packet is held back until
+    // the next one is known, so that all but the last packet of a burst
+    // are written with the isMore hint
+    const uint8_t *pHeld = NULL;
+    uint32_t heldLen = 0;
+    while (this->timerCount
+        && ((int32_t)(msTicks - this->timerNext) >= UMQTT_TIMER_RESOLUTION))
     {
-        bool unlinkAndFree;
-        unlinkAndFree = false;
-        // check if the packet is past the retry timeout
-        if ((msTicks - pPkt->ticks) >= UMQTT_RETRY_TIMEOUT)
+        // a turn of the first wheel starts with the packets of that
+        // turn from the second wheel
+        if ((this->timerNext & (UMQTT_TIMER_SPAN - 1)) == 0)
+        {
+            timerCascade(this);
+        }
+
+        // detach the packets in this slot, and advance to the next slot
+        // so that restarted timers are placed in later slots.  All of
+        // them have timed out
+        PktBuf_t *pPkt = timerTake(this, 0, (this->timerNext / UMQTT_TIMER_RESOLUTION)
+                                            & (UMQTT_TIMER_SLOTS - 1));
+        this->timerNext += UMQTT_TIMER_RESOLUTION;
+
+        while (pPkt)
         {
+            PktBuf_t *pNext = pPkt->timerNext;
+            pPkt->timerNext = NULL;
+            pPkt->timerPrev = NULL;
+            --this->timerCount;
+
+            bool unlinkAndFree;
+            unlinkAndFree = false;
+
             // get the payload part of the packet buffer
             uint8_t *buf = (uint8_t *)pPkt;
             buf += sizeof(PktBuf_t);
@@ -1640,6 +6224,8 @@ umqtt_Run(umqtt_Handle_t h, uint32_t msTicks)
                 // mark packet to be unlinked and freed
                 unlinkAndFree = true;
                 err = UMQTT_ERR_TIMEOUT;
+                this->statsDirty = true;
+                ++this->stats.timeouts;
                 this->connectIsPending = false;
             }
 
@@ -1649,22 +6235,34 @@ umqtt_Run(umqtt_Handle_t h, uint32_t msTicks)
                 // if the packet has more life, then retry it
                 if (pPkt->ttl)
                 {
-                    // reduce retry count and reset the timeout ticks
+                    // reduce retry count and restart the timeout,
+                    // backing off further with each retry
                     --pPkt->ttl;
                     pPkt->ticks = this->ticks;
+                    timerStart(this, pPkt, this->ticks
+                               + retryTimeout(this, this->maxRetries - pPkt->ttl));
                     // get the packet length, adjust for header
-                    uint32_t remLen;
-                    uint32_t lenBytes = umqtt_DecodeLength(&remLen, &buf[1]);
+                    uint32_t remLen = 0;
+                    uint32_t lenBytes = umqtt_DecodeLength(&remLen, &buf[1], 4);
                     remLen += 1 + lenBytes;
-                    // attempt to re-send the packet
-                    uint32_t writeLen = this->pNet->pfnNetWritePacket(this->pNet->hNet,
-                                                                 buf, remLen, false);
+                    // a publish that is sent again is marked as a duplicate
+                    if (type == UMQTT_TYPE_PUBLISH)
+                    {
+                        buf[0] |= UMQTT_FLAG_DUP;
+                    }
+                    // attempt to re-send the held packet, and hold this
+                    // one.  It stays pending with a later deadline, so
+                    // it cannot be freed before it is written
+                    this->statsDirty = true;
+                    ++this->stats.retransmits;
                     // if there is an error then return error,
                     // but packet is not deleted so it will be tried again
-                    if (writeLen != remLen)
+                    if (pHeld && !writePacket(this, pHeld, heldLen, true))
                     {
                         err = UMQTT_ERR_NETWORK;
                     }
+                    pHeld = buf;
+                    heldLen = remLen;
                 }
 
                 // life expired for this packet dont retry again
@@ -1673,27 +6271,144 @@ umqtt_Run(umqtt_Handle_t h, uint32_t msTicks)
                     // unlink it from the list and free packet memory
                     unlinkAndFree = true;
                     err = UMQTT_ERR_TIMEOUT;
+                    this->statsDirty = true;
+                    ++this->stats.timeouts;
                 }
             }
+
+            // if marked for deletion, update pointers and free packet
+            if (unlinkAndFree)
+            {
+                unlinkPacket(this, pPkt);
+                releasePacket(this, pPkt);
+            }
+            pPkt = pNext;
         }
+        if (this->timerCount)
+        {
+            timerSkip(this, msTicks);
+        }
+    }
+    if (pHeld && !writePacket(this, pHeld, heldLen, false))
+    {
+        err = UMQTT_ERR_NETWORK;
+    }
+    if (pCount)
+    {
+        *pCount = this->decodeCount - startCount;
+    }
+
+    // make the counters visible to umqtt_GetStats()
+    publishStats(this);
+    return err;
+}
+
+/**
+ * Get the tick count when umqtt_Run() next has timed work to do
+ *
+ * @param h umqtt instance handle from umqtt_New()
+ * @param pDeadline storage for the deadline tick count
+ *
+ * @return true if there is a deadline, or false if the instance has no
+ * timed work, in which case umqtt_Run() only needs to be called when
+ * there is data to read from the network
+ *
+ * The deadline is the earliest of the next keep alive ping, the time
+ * collected acknowledgments are due to be written (see the _ackDelay_
+ * option), and the time the timer wheel processes the first pending
+ * packet to time out.  It is kept up to date as packets are sent and
+ * acknowledged, so reading it takes the same short time no matter how
+ * many packets are pending.  After an acknowledgment it can be earlier
+ * than needed, which only costs a umqtt_Run() call with nothing to do.
+ * It uses the same ticks as umqtt_Run(), and can already be in the past.
+ * An application that serves many instances can use this to call
+ * umqtt_Run() only for the instances that have network data or a
+ * deadline that has passed, instead of calling it for every instance on
+ * every tick.
+ *
+ * The deadline changes whenever a packet is sent or acknowledged, so it
+ * should be read again after umqtt_Run() and after any function that
+ * sends a packet, such as umqtt_Connect() or umqtt_Publish().
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * uint32_t deadline;
+ * if (umqtt_GetNextDeadline(h, &deadline))
+ * {
+ *     // sleep no longer than deadline - msTicks
+ * }
+ * ~~~~~~~~
+ */
+bool
+umqtt_GetNextDeadline(umqtt_Handle_t h, uint32_t *pDeadline)
+{
+    umqtt_Instance_t *this = h;
+    if ((this == NULL) || (pDeadline == NULL))
+    {
+        return false;
+    }
 
-        // if marked for deletion, update pointers and free packet
-        if (unlinkAndFree)
+    bool hasDeadline = false;
+    uint32_t deadline = 0;
+
+    // a keep alive ping is sent once more than half of the keep alive
+    // interval has passed since the last one
+    if (this->isConnected && this->keepAlive)
+    {
+        deadline = this->pingTicks + (this->keepAlive * 500) + 1;
+        hasDeadline = true;
+    }
+
+    // collected acknowledgments are written by the next umqtt_Run() once
+    // the oldest has waited for the ack delay
+    if (this->ackLen)
+    {
+        uint32_t ackDeadline = this->ackTicks + this->ackDelay;
+        if (!hasDeadline || ((int32_t)(ackDeadline - deadline) < 0))
         {
-            pPrev->next = pPkt->next;
-            pPkt->next = NULL;
-            this->pNet->pfnfree(pPkt);
-            pPkt = pPrev->next;
+            deadline = ackDeadline;
         }
+        hasDeadline = true;
+    }
 
-        // packet not to be deleted, advance to the next in the list
-        else
+    // umqtt_Run() processes a timer wheel slot once all of the time it
+    // covers has passed.  The first slot of the first wheel that holds
+    // packets is the earliest on this turn.  The packets of the first
+    // turn with packets on the second wheel can be due even earlier, so
+    // the earliest expiry kept for that slot is checked too
+    if (this->timerCount)
+    {
+        uint32_t timerDeadline = 0;
+        bool hasTimer = false;
+        if (this->timerMask[0])
         {
-            pPrev = pPkt;
-            pPkt = pPkt->next;
+            timerDeadline = this->timerNext + UMQTT_TIMER_RESOLUTION
+                + (timerScan(this->timerMask[0], (this->timerNext / UMQTT_TIMER_RESOLUTION)
+                                                 & (UMQTT_TIMER_SLOTS - 1))
+                   * UMQTT_TIMER_RESOLUTION);
+            hasTimer = true;
         }
+        if (this->timerMask[1])
+        {
+            uint32_t turn = (this->timerNext + UMQTT_TIMER_SPAN - 1) & ~(UMQTT_TIMER_SPAN - 1);
+            turn += timerScan(this->timerMask[1], (turn / UMQTT_TIMER_SPAN)
+                                                  & (UMQTT_TIMER_SLOTS - 1))
+                    * UMQTT_TIMER_SPAN;
+            uint32_t due = this->timerMin[(turn / UMQTT_TIMER_SPAN) & (UMQTT_TIMER_SLOTS - 1)];
+            if (!hasTimer || ((int32_t)(due - timerDeadline) < 0))
+            {
+                timerDeadline = due;
+            }
+        }
+        if (!hasDeadline || ((int32_t)(timerDeadline - deadline) < 0))
+        {
+            deadline = timerDeadline;
+        }
+        hasDeadline = true;
     }
-    return err;
+
+    *pDeadline = deadline;
+    return hasDeadline;
 }
 
 /**
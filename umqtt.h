@@ -33,6 +33,7 @@ typedef enum
     UMQTT_ERR_CONNECTED,    ///< umqtt client is connected to MQTT broker
     UMQTT_ERR_DISCONNECTED, ///< umqtt client is not connected to MQTT broker
     UMQTT_ERR_TIMEOUT,      ///< a timeout occurred waiting on some reply
+    UMQTT_ERR_WOULDBLOCK,   ///< in-flight window is full, try again later
 } umqtt_Error_t;
 
 /**
@@ -41,6 +42,18 @@ typedef enum
  */
 typedef void * umqtt_Handle_t;
 
+/**
+ * Registered topic handle, for publishing many times to the same topic.
+ * Obtained from umqtt_RegisterTopic().
+ */
+typedef void * umqtt_Topic_t;
+
+/**
+ * Publish template handle, for publishing fixed size messages many times.
+ * Obtained from umqtt_NewTemplate().
+ */
+typedef void * umqtt_Template_t;
+
 /**
  * Callback function for CONNACK connection acknowledgment.
  *
@@ -80,6 +93,28 @@ typedef void (*PublishCb_t)(umqtt_Handle_t h, void *pUser, bool dup, bool retain
                             uint8_t qos, const char *pTopic, uint16_t topicLen,
                             const uint8_t *pMsg, uint16_t msgLen);
 
+/**
+ * Handler function for Publish packets that match a topic filter.
+ *
+ * @param h umqtt instance handle
+ * @param pUser user data pointer given when the handler was registered
+ * @param dup MQTT dup header flag was set in the packet
+ * @param retain MQTT retain flag was set in the packet
+ * @param qos QoS level for the packet
+ * @param pTopic pointer to topic string
+ * @param topicLen number of bytes in the topic string
+ * @param pMsg pointer to topic message
+ * @param msgLen number of bytes in the topic message
+ *
+ * This function is called when the umqtt client receives a publish
+ * packet with a topic that matches a filter the handler was registered
+ * for with umqtt_SubscribeHandler().  As with PublishCb_t(), the pointers
+ * are only valid until the function returns.
+ */
+typedef void (*TopicHandler_t)(umqtt_Handle_t h, void *pUser, bool dup, bool retain,
+                               uint8_t qos, const char *pTopic, uint16_t topicLen,
+                               const uint8_t *pMsg, uint32_t msgLen);
+
 /**
  * Callback function for Puback packets.
  *
@@ -88,7 +123,9 @@ typedef void (*PublishCb_t)(umqtt_Handle_t h, void *pUser, bool dup, bool retain
  * @param pktId packet ID of the received packet
  *
  * This function is called when the umqtt client receives a Puback
- * packet in response to umqtt_Publish().  It is not necessary for the
+ * packet in response to umqtt_Publish().  For a QoS 2 publish it is
+ * called when the Pubcomp packet is received, which completes the
+ * exactly-once handshake.  It is not necessary for the
  * application to use this callback unless it needs to track completion
  * of publish messages.  The _pktId_ parameter should match the message ID
  * that was returned when using umqtt_Publish().  This method could be used
@@ -156,9 +193,10 @@ typedef struct
 {
     /// Called when a CONNACK is received.
     ConnackCb_t connackCb;
-    /// Called when PUBLISH packet is received.
+    /// Called when PUBLISH packet is received that does not match the
+    /// topic filter of any handler.
     PublishCb_t publishCb;
-    /// Called when PUBACK is received.
+    /// Called when PUBACK, or PUBCOMP for QoS 2, is received.
     PubackCb_t pubackCb;
     /// Called when SUBACK is received.
     SubackCb_t subackCb;
@@ -195,6 +233,17 @@ typedef void *(*malloc_t)(size_t size);
  */
 typedef void (*free_t)(void *ptr);
 
+/**
+ * Millisecond tick count function provided by application.
+ *
+ * @return the current millisecond tick count
+ *
+ * This function is optional.  It is used by umqtt_RunBudget() to measure
+ * how much time has been spent processing incoming packets.  It should
+ * return ticks from the same source as the ticks passed to umqtt_Run().
+ */
+typedef uint32_t (*getTicks_t)(void);
+
 /**
  * Read a packet from the network
  *
@@ -210,10 +259,19 @@ typedef void (*free_t)(void *ptr);
  * need to make any additional copy of the data.  This function must allocate
  * the memory used to hold the packet in a method compatible with the
  * malloc_t() / free_t() functions.  The umqtt_Run() function will use the
- * free_t() function to free this packet after it has been decoded.
+ * free_t() function to free this packet after it has been decoded.  If
+ * the instance was made with umqtt_NewStatic() and the transport has no
+ * free_t() function, or if the transport sets _ownsReadBuf_, then the
+ * buffer is not freed, and only needs to stay valid until the next read.
+ * This lets a transport hand over packets straight from its own receive
+ * buffer.
  *
  * The incoming packet must be a complete packet.  The `umqtt` library does
- * not handle partial packets or misaligned packets.
+ * not handle partial packets or misaligned packets, unless the instance
+ * was created with the _streamInput_ option (see @ref umqtt_Options_t).
+ * In that case this function can return any number of bytes read from
+ * the network, such as whatever one _recv()_ call produced, and umqtt
+ * will split the bytes into packets itself.
  */
 typedef int (*netReadPacket_t)(void *hNet, uint8_t **ppBuf);
 
@@ -238,6 +296,55 @@ typedef int (*netReadPacket_t)(void *hNet, uint8_t **ppBuf);
  */
 typedef int (*netWritePacket_t)(void *hNet, const uint8_t *pBuf, uint32_t len, bool isMore);
 
+/**
+ * One piece of a packet that is written with netWritevPacket_t().
+ */
+typedef struct
+{
+    const uint8_t *pData;   ///< pointer to the bytes of this segment
+    uint32_t len;           ///< number of bytes in this segment
+} umqtt_Segment_t;
+
+/**
+ * Write a packet that is held in several buffers to the network
+ *
+ * @param hNet is the network instance handle (not umqtt instance handle)
+ * @param pSegs array of segments that make up the packet, in order
+ * @param segCount number of segments in the array
+ * @param isMore flag to indicate that there is additional data to send
+ *
+ * @return number of bytes that were written to the network.  This will be
+ * 0 if no data was written or negative if there was an error.
+ *
+ * This function is optional.  If it is provided, the umqtt library uses it
+ * to send packets without first copying all the parts of the packet into
+ * one buffer.  For example, the payload of a QoS 0 publish is sent straight
+ * from the buffer passed to umqtt_Publish().  The segments must be sent
+ * in order, as if they were one packet buffer, and the same rules apply as
+ * for netWritePacket_t(): the packet must be all sent or none.  A typical
+ * implementation maps the segments onto a _writev()_ or scatter-gather
+ * call of the network stack.  The segment buffers are only valid until
+ * this function returns.
+ */
+typedef int (*netWritevPacket_t)(void *hNet, const umqtt_Segment_t *pSegs,
+                                 uint32_t segCount, bool isMore);
+
+/**
+ * Get the number of bytes a transport holds back for sending
+ *
+ * @param hNet is the network instance handle (not umqtt instance handle)
+ *
+ * @return the number of bytes that were accepted by the network write
+ * function but not yet taken by the network
+ *
+ * This function is optional.  A transport that keeps the rest of a packet
+ * when the network does not take all of it (such as the one in
+ * umqtt_posix.c) can provide it, so that an event loop knows to wait for
+ * the network to become writable and then run the instance, which sends
+ * the held bytes.  See umqtt_GetNetBacklog().
+ */
+typedef uint32_t (*netGetBacklog_t)(void *hNet);
+
 /**
  * Structure to define the network interface.
  */
@@ -247,16 +354,182 @@ typedef struct
     /// It can be a data structure that holds network sockets or something
     /// similar.
     void *hNet;
-    /// Application supplied function to allocate memory.
+    /// Application supplied function to allocate memory.  Not used by
+    /// an instance made with umqtt_NewStatic(), and can be NULL.
     malloc_t pfnmalloc;
-    /// Application supplied function to free memory.
+    /// Application supplied function to free memory.  Can be NULL for an
+    /// instance made with umqtt_NewStatic().
     free_t pfnfree;
     /// Application supplied function to read from the network.
     netReadPacket_t pfnNetReadPacket;
     /// Application supplied function to write to the network.
     netWritePacket_t pfnNetWritePacket;
+    /// Optional application supplied function to write a packet from
+    /// several buffers to the network, or NULL.
+    netWritevPacket_t pfnNetWritevPacket;
+    /// Set to true if the network read function returns a buffer that it
+    /// owns itself, which only needs to stay valid until the next read.
+    /// Then umqtt does not free the buffers returned by the read function.
+    bool ownsReadBuf;
+    /// Optional application supplied function to get the number of bytes
+    /// held back for sending, or NULL.
+    netGetBacklog_t pfnNetGetBacklog;
 } umqtt_TransportConfig_t;
 
+/**
+ * One message to be published by umqtt_PublishBatch().
+ */
+typedef struct
+{
+    const char *topic;      ///< topic name to publish
+    const uint8_t *payload; ///< payload for the topic (can be NULL)
+    uint32_t payloadLen;    ///< number of bytes in the payload
+    uint8_t qos;            ///< QoS level for this message
+    bool shouldRetain;      ///< true if MQTT broker should retain this topic
+    uint16_t packetId;      ///< packet ID assigned to the message (output)
+} umqtt_PublishMsg_t;
+
+/**
+ * Optional instance settings, passed to umqtt_NewWithOptions().
+ *
+ * A structure that is all zeroes selects the default for every setting,
+ * which gives the same behavior as umqtt_New().
+ */
+typedef struct
+{
+    /// Use the built-in packet buffer pool.  Packet buffers are kept on
+    /// per-instance free lists by size class when they are freed, and
+    /// reused for later packets instead of calling the application
+    /// allocator each time.
+    bool usePool;
+    /// Number of buffers of each size class to allocate when the instance
+    /// is created, if the packet buffer pool is used.
+    uint16_t poolPrealloc;
+    /// Treat the data returned by the network read function as a byte
+    /// stream instead of one complete packet.  The data is passed to
+    /// umqtt_Feed() which finds the packet boundaries.
+    bool streamInput;
+    /// Largest incoming packet accepted by umqtt_Feed(), including the
+    /// fixed header, or 0 for no limit.
+    uint32_t maxPacketLen;
+    /// Optional function to read the millisecond tick count, needed to
+    /// use a time budget with umqtt_RunBudget().  If provided, it is also
+    /// used to time acks more precisely for the latency histograms.
+    getTicks_t pfnGetTicks;
+    /// Most QoS > 0 publish packets waiting for acknowledgment at one
+    /// time, or 0 for no limit.
+    uint32_t maxInflight;
+    /// Most bytes of QoS > 0 publish packets waiting for acknowledgment
+    /// at one time, or 0 for no limit.
+    uint32_t maxInflightBytes;
+    /// Shortest retransmit timeout in ms, or 0 for the default of 200 ms.
+    uint32_t minRetryTimeout;
+    /// Longest retransmit timeout in ms, or 0 for the default of 60000 ms.
+    uint32_t maxRetryTimeout;
+    /// Retransmit timeout in ms used until a round trip has been measured,
+    /// and the CONNACK timeout, or 0 for the default of 5000 ms.
+    uint32_t initialRetryTimeout;
+    /// Number of retransmits before a packet times out, or 0 for the
+    /// default of 10.
+    uint16_t maxRetries;
+    /// Number of acknowledgments for received publish packets to collect
+    /// and write to the network together, or 0 to write each one as soon
+    /// as the publish is decoded.  Collected acknowledgments are written
+    /// at the end of each umqtt_Run() pass, when the buffer is full, or
+    /// when the oldest one has been held for _ackDelay_.
+    uint16_t coalesceAcks;
+    /// Longest time in ms an acknowledgment is held when _coalesceAcks_
+    /// is used, or 0 to hold it until the end of the umqtt_Run() pass.
+    /// umqtt_GetNextDeadline() includes the time the held acknowledgments
+    /// are due, so that umqtt_Run() is called to write them.
+    uint32_t ackDelay;
+    /// Check that topic names and filters are well formed UTF-8, and that
+    /// topic names have no wildcards.  Topics passed to the publish,
+    /// subscribe and connect functions are rejected with UMQTT_ERR_PARM,
+    /// and a received publish with a bad topic is a packet error.
+    bool validateTopics;
+    /// Bytes of one contiguous ring buffer that holds every packet the
+    /// instance sends, or 0 to allocate each packet separately.  Packets
+    /// are appended to the ring and their space is reclaimed as acks
+    /// arrive, so no memory is allocated per packet and the instance
+    /// never uses more than this for packets.  When the ring is full,
+    /// functions that send a packet return UMQTT_ERR_BUFSIZE.
+    uint32_t ringSize;
+} umqtt_Options_t;
+
+/**
+ * Packet buffer pool counters, see umqtt_GetPoolStats().
+ */
+typedef struct
+{
+    uint32_t hits;      ///< buffers taken from a pool free list
+    uint32_t misses;    ///< buffers that needed the application allocator
+    uint32_t inUse;     ///< pool buffers currently in use
+    uint32_t highWater; ///< largest number of pool buffers in use at once
+} umqtt_PoolStats_t;
+
+/**
+ * Number of buckets in a latency histogram.  Bucket 0 counts round trips
+ * of 0 ms, and bucket n counts round trips from 2^(n-1) to 2^n - 1 ms.  The
+ * last bucket also counts anything longer.
+ */
+#define UMQTT_LATENCY_BUCKETS 18
+
+/**
+ * Kinds of round trip that are timed, used to index the latency
+ * histograms in @ref umqtt_Stats_t.
+ */
+typedef enum
+{
+    UMQTT_LATENCY_PUBACK,   ///< PUBLISH to PUBACK
+    UMQTT_LATENCY_SUBACK,   ///< SUBSCRIBE to SUBACK
+    UMQTT_LATENCY_UNSUBACK, ///< UNSUBSCRIBE to UNSUBACK
+    UMQTT_LATENCY_PINGRESP, ///< PINGREQ to PINGRESP
+    UMQTT_LATENCY_PUBREC,   ///< QoS 2 PUBLISH to PUBREC
+    UMQTT_LATENCY_PUBCOMP,  ///< PUBREL to PUBCOMP
+    UMQTT_LATENCY_TYPES     ///< number of latency types
+} umqtt_LatencyType_t;
+
+/**
+ * Round trip latency histogram for one kind of ack, in milliseconds.
+ * The time is measured from when the request was first sent, so for a
+ * request that had to be retransmitted it includes the retry time.
+ */
+typedef struct
+{
+    uint32_t count;     ///< number of round trips measured
+    uint32_t retried;   ///< how many of those were retransmitted
+    uint32_t min;       ///< shortest round trip
+    uint32_t max;       ///< longest round trip
+    uint64_t sum;       ///< total of all round trips, for the mean
+    uint32_t buckets[UMQTT_LATENCY_BUCKETS];    ///< log2 histogram
+} umqtt_Latency_t;
+
+/**
+ * Instance performance counters, see umqtt_GetStats().  The per-type
+ * arrays are indexed by the MQTT packet type number, for example
+ * `pktsSent[3]` counts PUBLISH packets.
+ */
+typedef struct
+{
+    uint32_t pktsSent[16];  ///< packets sent, by packet type
+    uint32_t pktsRecv[16];  ///< packets received, by packet type
+    uint64_t bytesSent;     ///< bytes written to the network
+    uint64_t bytesRecv;     ///< bytes of received packets
+    uint32_t retransmits;   ///< packets sent again after a timeout
+    uint32_t timeouts;      ///< pending packets that timed out for good
+    uint32_t inflight;      ///< packets currently waiting for an ack
+    uint32_t inflightPeak;  ///< largest number of packets waiting for an ack
+    uint32_t allocs;        ///< packet buffers allocated
+    uint32_t frees;         ///< packet buffers freed
+    uint32_t allocFails;    ///< packet buffer allocations that failed
+    uint32_t decodeErrors;  ///< received packets that were malformed
+    uint32_t networkErrors; ///< failed network reads and writes
+    uint32_t rttSmoothed;   ///< smoothed round trip time in ms
+    uint32_t retryTimeout;  ///< current retransmit timeout in ms
+    umqtt_Latency_t latency[UMQTT_LATENCY_TYPES];   ///< ack round trip times
+} umqtt_Stats_t;
+
 /**
  * @}
  */
@@ -273,19 +546,55 @@ extern umqtt_Error_t umqtt_Publish(umqtt_Handle_t h, const char *topic,
                                    const uint8_t *payload, uint32_t payloadLen,
                                    uint32_t qos, bool shouldRetain,
                                    uint16_t *pId);
+extern umqtt_Error_t umqtt_RegisterTopic(umqtt_Handle_t h, const char *topic,
+                                        umqtt_Topic_t *phTopic);
+extern umqtt_Error_t umqtt_UnregisterTopic(umqtt_Handle_t h, umqtt_Topic_t hTopic);
+extern umqtt_Error_t umqtt_PublishTopic(umqtt_Handle_t h, umqtt_Topic_t hTopic,
+                                       const uint8_t *payload, uint32_t payloadLen,
+                                       uint32_t qos, bool shouldRetain, uint16_t *pId);
+extern umqtt_Error_t umqtt_NewTemplate(umqtt_Handle_t h, const char *topic,
+                                      uint32_t payloadLen, uint32_t qos,
+                                      bool shouldRetain, umqtt_Template_t *phTemplate);
+extern umqtt_Error_t umqtt_DeleteTemplate(umqtt_Handle_t h, umqtt_Template_t hTemplate);
+extern umqtt_Error_t umqtt_PublishTemplate(umqtt_Handle_t h, umqtt_Template_t hTemplate,
+                                          const uint8_t *payload, uint16_t *pId);
+extern umqtt_Error_t umqtt_PublishBatch(umqtt_Handle_t h, umqtt_PublishMsg_t *pMsgs,
+                                        uint32_t count);
 extern umqtt_Error_t umqtt_Subscribe(umqtt_Handle_t h, uint32_t count,
                                      char *topics[], uint8_t qoss[],
                                      uint16_t *pId);
+extern umqtt_Error_t umqtt_SubscribeHandler(umqtt_Handle_t h, uint32_t count,
+                                           char *topics[], uint8_t qoss[],
+                                           TopicHandler_t pfnHandler, void *pUser,
+                                           uint16_t *pId);
 extern umqtt_Error_t umqtt_Unsubscribe(umqtt_Handle_t h, uint32_t count,
                                        const char *topics[], uint16_t *pId);
 extern umqtt_Error_t umqtt_DecodePacket(umqtt_Handle_t h,
                                         const uint8_t *pIncoming, uint32_t incomingLen);
+extern umqtt_Error_t umqtt_Feed(umqtt_Handle_t h, const uint8_t *pData, uint32_t len);
+extern umqtt_Error_t umqtt_FlushAcks(umqtt_Handle_t h);
 extern umqtt_Error_t umqtt_GetConnectedStatus(umqtt_Handle_t h);
+extern uint32_t umqtt_GetNetBacklog(umqtt_Handle_t h);
 extern umqtt_Error_t umqtt_Disconnect(umqtt_Handle_t h);
 extern umqtt_Error_t umqtt_PingReq(umqtt_Handle_t h);
 extern umqtt_Error_t umqtt_Run(umqtt_Handle_t h, uint32_t msTicks);
+extern umqtt_Error_t umqtt_RunBudget(umqtt_Handle_t h, uint32_t msTicks,
+                                     uint32_t maxPackets, uint32_t maxMs,
+                                     uint32_t *pCount);
+extern bool umqtt_GetNextDeadline(umqtt_Handle_t h, uint32_t *pDeadline);
 extern umqtt_Handle_t umqtt_New(umqtt_TransportConfig_t *pTransport,
                                          umqtt_Callbacks_t *pCallbacks, void *pUser);
+extern umqtt_Handle_t umqtt_NewWithOptions(umqtt_TransportConfig_t *pTransport,
+                                           umqtt_Callbacks_t *pCallbacks, void *pUser,
+                                           const umqtt_Options_t *pOptions);
+extern umqtt_Handle_t umqtt_NewStatic(umqtt_TransportConfig_t *pTransport,
+                                      umqtt_Callbacks_t *pCallbacks, void *pUser,
+                                      const umqtt_Options_t *pOptions,
+                                      void *pRegion, size_t regionSize);
+extern umqtt_Error_t umqtt_GetPoolStats(umqtt_Handle_t h, umqtt_PoolStats_t *pStats);
+extern umqtt_Error_t umqtt_GetStats(umqtt_Handle_t h, umqtt_Stats_t *pStats);
+extern umqtt_Error_t umqtt_ResetStats(umqtt_Handle_t h);
+extern uint32_t umqtt_LatencyPercentile(const umqtt_Latency_t *pLatency, uint32_t percent);
 extern void umqtt_Delete(umqtt_Handle_t h);
 extern const char *umqtt_GetErrorString(umqtt_Error_t err);
 
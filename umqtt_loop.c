@@ -0,0 +1,1020 @@
+/******************************************************************************
+ * umqtt_loop.c - Event loop to run many umqtt instances from one thread.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "umqtt_loop.h"
+
+/**
+ *
+ * @addtogroup umqtt_loop uMQTT Event Loop
+ * @{
+ *
+ * Running many instances from one thread
+ * --------------------------------------
+ *
+ * Function Name          | Description
+ * -----------------------|------------
+ * umqtt_LoopNew()        | create an event loop
+ * umqtt_LoopDelete()     | free an event loop
+ * umqtt_LoopAdd()        | add a umqtt instance and its socket to the loop
+ * umqtt_LoopRemove()     | remove a umqtt instance from the loop
+ * umqtt_LoopSetFd()      | change the socket of an instance, after reconnect
+ * umqtt_LoopUpdate()     | read the deadline of an instance again
+ * umqtt_LoopWake()       | run an instance on the next pass
+ * umqtt_LoopSetPoll()    | share the loop with another event source
+ * umqtt_LoopRun()        | wait for events and run the instances that need it
+ * umqtt_LoopGetTicks()   | get the tick count used by the loop
+ *
+ * When a host runs thousands of umqtt instances, calling umqtt_Run() for
+ * every instance on every tick costs time in proportion to the number of
+ * instances, even when nearly all of them are idle.  The event loop
+ * instead watches the socket of each instance with Linux epoll, and keeps
+ * the deadline from umqtt_GetNextDeadline() of each instance in one heap
+ * that is shared by all of the instances.  umqtt_LoopRun() only runs the
+ * instances that have data to read or a deadline that has passed, so the
+ * cost follows the amount of activity and not the number of instances.
+ *
+ * While the transport of an instance holds bytes that the socket did not
+ * take (see umqtt_GetNetBacklog()), the socket is also watched for being
+ * writable, and the instance is run when it is, so that the bytes are
+ * sent without waiting for other activity.
+ *
+ * The loop is not thread safe, and neither are the instances it runs.
+ * All of the instances in a loop must be used from the thread that calls
+ * umqtt_LoopRun().
+ */
+
+/*
+ * Default number of incoming packets processed for one instance each
+ * time it is run.
+ */
+#define UMQTT_LOOP_MAX_PACKETS 16
+
+/*
+ * Most epoll events collected by one call of umqtt_LoopRun().  More
+ * readable sockets are picked up on the next call.
+ */
+#define UMQTT_LOOP_EVENTS 256
+
+/*
+ * Initial number of slots in the instance index.  The index is doubled
+ * whenever it would become more than half full.  Must be a power of 2.
+ */
+#define UMQTT_LOOP_INDEX_MIN 64
+
+/*
+ * One umqtt instance in the loop.  The epoll event data points to this.
+ */
+typedef struct LoopEntry
+{
+    umqtt_Handle_t h;       // umqtt instance, or NULL once removed
+    void *pUser;            // caller supplied data pointer
+    int fd;                 // socket watched for reading, or -1 if none
+    bool isWatchingOut;     // socket is also watched for being writable
+    uint32_t deadline;      // ticks when the instance must next be run
+    uint32_t heapPos;       // position in the deadline heap, or 0 if none
+    struct LoopEntry *pNextDue;     // next entry due in this pass
+    struct LoopEntry *pNextRemoved; // next entry removed during this pass
+} LoopEntry_t;
+
+/*
+ * Event loop data structure.  This is allocated and populated by
+ * umqtt_LoopNew()
+ */
+typedef struct
+{
+    int epfd;               // epoll instance
+    getTicks_t pfnGetTicks; // application tick count function, or NULL
+    uint32_t maxPackets;    // packet budget for one instance per run
+    LoopErrorCb_t errorCb;  // error callback, or NULL
+    LoopEntry_t **index;    // entries indexed by instance handle
+    uint32_t indexSize;     // number of slots in the index (power of 2)
+    uint32_t indexCount;    // number of entries in the index
+    LoopEntry_t **heap;     // entries with a deadline, earliest at heap[1]
+    uint32_t heapSize;      // number of slots in the heap, including heap[0]
+    uint32_t heapCount;     // number of entries in the heap
+    bool isRunning;         // umqtt_LoopRun() is running instances
+    LoopEntry_t *pRemoved;  // entries removed while running, to be freed
+    int pollFd;             // descriptor watched for the poll callback, or -1
+    LoopPollCb_t pfnPoll;   // poll callback, or NULL
+    void *pPollArg;         // argument for the poll callback
+    struct epoll_event events[UMQTT_LOOP_EVENTS];
+} Loop_t;
+
+/*
+ * @internal
+ *
+ * Read the loop tick count
+ *
+ * @param this event loop
+ *
+ * @return the application tick count if a tick function was given, or
+ * else the system monotonic clock in milliseconds
+ */
+static uint32_t
+loopTicks(Loop_t *this)
+{
+    if (this->pfnGetTicks)
+    {
+        return this->pfnGetTicks();
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000) + (uint32_t)(ts.tv_nsec / 1000000);
+}
+
+/*
+ * @internal
+ *
+ * Compute the home slot of an instance handle in the index
+ *
+ * @param this event loop
+ * @param h umqtt instance handle
+ *
+ * @return the slot where the search for the handle starts
+ */
+static uint32_t
+indexHome(const Loop_t *this, umqtt_Handle_t h)
+{
+    // instances are allocated on aligned addresses, so mix the upper
+    // bits down into the slot number
+    uint64_t key = (uint64_t)(uintptr_t)h;
+    uint32_t hash = (uint32_t)(key >> 4) ^ (uint32_t)(key >> 32);
+    hash *= 0x9E3779B1U;
+    hash ^= hash >> 16;
+    return hash & (this->indexSize - 1);
+}
+
+/*
+ * @internal
+ *
+ * Find the index slot holding an instance
+ *
+ * @param this event loop
+ * @param h umqtt instance handle to search for
+ *
+ * @return slot number holding the instance, or -1 if it is not in the loop
+ */
+static int32_t
+findEntrySlot(const Loop_t *this, umqtt_Handle_t h)
+{
+    if (this->indexSize == 0)
+    {
+        return -1;
+    }
+    uint32_t mask = this->indexSize - 1;
+    uint32_t slot = indexHome(this, h);
+    while (this->index[slot])
+    {
+        if (this->index[slot]->h == h)
+        {
+            return (int32_t)slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/*
+ * @internal
+ *
+ * Add an entry to the index.  The caller must make sure there is room.
+ *
+ * @param this event loop
+ * @param pEntry the entry to add
+ */
+static void
+indexEntry(Loop_t *this, LoopEntry_t *pEntry)
+{
+    uint32_t mask = this->indexSize - 1;
+    uint32_t slot = indexHome(this, pEntry->h);
+    while (this->index[slot])
+    {
+        slot = (slot + 1) & mask;
+    }
+    this->index[slot] = pEntry;
+    ++this->indexCount;
+}
+
+/*
+ * @internal
+ *
+ * Remove the entry in an index slot
+ *
+ * @param this event loop
+ * @param slot the slot holding the entry
+ *
+ * Entries that follow in the same cluster are shifted back so that every
+ * entry can still be found from its home slot without tombstones.
+ */
+static void
+unindexEntry(Loop_t *this, uint32_t slot)
+{
+    uint32_t mask = this->indexSize - 1;
+    uint32_t hole = slot;
+    this->index[hole] = NULL;
+    --this->indexCount;
+    slot = (slot + 1) & mask;
+    while (this->index[slot])
+    {
+        // move the entry into the hole unless its home slot lies
+        // cyclically between the hole and where it is now
+        uint32_t home = indexHome(this, this->index[slot]->h);
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            this->index[hole] = this->index[slot];
+            this->index[slot] = NULL;
+            hole = slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Make sure the index and the heap have room for another entry
+ *
+ * @param this event loop
+ *
+ * @return true if there is room, false if memory could not be allocated
+ */
+static bool
+reserveEntry(Loop_t *this)
+{
+    if (((this->indexCount + 1) * 2) > this->indexSize)
+    {
+        uint32_t newSize = this->indexSize ? this->indexSize * 2 : UMQTT_LOOP_INDEX_MIN;
+        LoopEntry_t **pNewIndex = calloc(newSize, sizeof(LoopEntry_t *));
+        if (pNewIndex == NULL)
+        {
+            return false;
+        }
+
+        // rehash all the existing entries into the new index
+        LoopEntry_t **pOldIndex = this->index;
+        uint32_t oldSize = this->indexSize;
+        this->index = pNewIndex;
+        this->indexSize = newSize;
+        this->indexCount = 0;
+        for (uint32_t i = 0; i < oldSize; i++)
+        {
+            if (pOldIndex[i])
+            {
+                indexEntry(this, pOldIndex[i]);
+            }
+        }
+        free(pOldIndex);
+    }
+
+    // every entry can be in the heap, and heap[0] is not used
+    if ((this->indexCount + 2) > this->heapSize)
+    {
+        uint32_t newSize = this->indexSize + 1;
+        LoopEntry_t **pNewHeap = realloc(this->heap, newSize * sizeof(LoopEntry_t *));
+        if (pNewHeap == NULL)
+        {
+            return false;
+        }
+        this->heap = pNewHeap;
+        this->heapSize = newSize;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Place an entry at a heap position and record the position in the entry
+ *
+ * @param this event loop
+ * @param pos heap position
+ * @param pEntry the entry
+ */
+static void
+heapPlace(Loop_t *this, uint32_t pos, LoopEntry_t *pEntry)
+{
+    this->heap[pos] = pEntry;
+    pEntry->heapPos = pos;
+}
+
+/*
+ * @internal
+ *
+ * Restore the heap order around one entry whose deadline has changed
+ *
+ * @param this event loop
+ * @param pEntry the entry, which must be in the heap
+ *
+ * Deadlines are compared as the signed difference between tick counts,
+ * so the order stays correct when the tick count wraps around.
+ */
+static void
+heapFix(Loop_t *this, LoopEntry_t *pEntry)
+{
+    uint32_t pos = pEntry->heapPos;
+
+    // move towards the top while earlier than the parent
+    while ((pos > 1)
+        && ((int32_t)(pEntry->deadline - this->heap[pos / 2]->deadline) < 0))
+    {
+        heapPlace(this, pos, this->heap[pos / 2]);
+        pos /= 2;
+    }
+
+    // move towards the bottom while later than the earliest child
+    for (;;)
+    {
+        uint32_t child = pos * 2;
+        if (child > this->heapCount)
+        {
+            break;
+        }
+        if ((child < this->heapCount)
+         && ((int32_t)(this->heap[child + 1]->deadline - this->heap[child]->deadline) < 0))
+        {
+            ++child;
+        }
+        if ((int32_t)(this->heap[child]->deadline - pEntry->deadline) >= 0)
+        {
+            break;
+        }
+        heapPlace(this, pos, this->heap[child]);
+        pos = child;
+    }
+    heapPlace(this, pos, pEntry);
+}
+
+/*
+ * @internal
+ *
+ * Take an entry out of the heap.  It is safe to call this for an entry
+ * that is not in the heap.
+ *
+ * @param this event loop
+ * @param pEntry the entry
+ */
+static void
+heapRemove(Loop_t *this, LoopEntry_t *pEntry)
+{
+    uint32_t pos = pEntry->heapPos;
+    if (pos == 0)
+    {
+        return;
+    }
+    pEntry->heapPos = 0;
+
+    // fill the hole with the last entry and put that in order
+    LoopEntry_t *pLast = this->heap[this->heapCount--];
+    if (pLast != pEntry)
+    {
+        heapPlace(this, pos, pLast);
+        heapFix(this, pLast);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Read the deadline of an instance and update its place in the heap
+ *
+ * @param this event loop
+ * @param pEntry the entry of the instance
+ */
+static void
+scheduleEntry(Loop_t *this, LoopEntry_t *pEntry)
+{
+    uint32_t deadline;
+    if (!umqtt_GetNextDeadline(pEntry->h, &deadline))
+    {
+        heapRemove(this, pEntry);
+        return;
+    }
+    pEntry->deadline = deadline;
+    if (pEntry->heapPos == 0)
+    {
+        heapPlace(this, ++this->heapCount, pEntry);
+    }
+    heapFix(this, pEntry);
+}
+
+/*
+ * @internal
+ *
+ * Make the epoll events watched for an entry
+ *
+ * @param pEntry the entry
+ *
+ * @return EPOLLIN, plus EPOLLOUT while the transport holds bytes to send
+ */
+static uint32_t
+entryEvents(const LoopEntry_t *pEntry)
+{
+    return EPOLLIN | (pEntry->isWatchingOut ? EPOLLOUT : 0);
+}
+
+/*
+ * @internal
+ *
+ * Change the socket that is watched for an entry
+ *
+ * @param this event loop
+ * @param pEntry the entry
+ * @param fd the new socket, or -1 to not watch any socket
+ *
+ * @return true if the socket is watched, false if epoll reported an error
+ */
+static bool
+watchFd(Loop_t *this, LoopEntry_t *pEntry, int fd)
+{
+    // the old socket may already be closed, and then epoll has already
+    // dropped it, so an error here does not matter
+    if (pEntry->fd >= 0)
+    {
+        epoll_ctl(this->epfd, EPOLL_CTL_DEL, pEntry->fd, NULL);
+        pEntry->fd = -1;
+    }
+    if (fd >= 0)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = entryEvents(pEntry);
+        ev.data.ptr = pEntry;
+        if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            return false;
+        }
+        pEntry->fd = fd;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Watch the socket of an entry for being writable while its transport
+ * holds bytes to send
+ *
+ * @param this event loop
+ * @param pEntry the entry
+ */
+static void
+watchBacklog(Loop_t *this, LoopEntry_t *pEntry)
+{
+    bool hasBacklog = umqtt_GetNetBacklog(pEntry->h) != 0;
+    if (hasBacklog != pEntry->isWatchingOut)
+    {
+        pEntry->isWatchingOut = hasBacklog;
+        if (pEntry->fd >= 0)
+        {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = entryEvents(pEntry);
+            ev.data.ptr = pEntry;
+            epoll_ctl(this->epfd, EPOLL_CTL_MOD, pEntry->fd, &ev);
+        }
+    }
+}
+
+/*
+ * @internal
+ *
+ * Run one instance and schedule it again
+ *
+ * @param this event loop
+ * @param pEntry the entry of the instance
+ * @param msTicks the loop tick count
+ * @param hangup true if epoll reported that the socket is closed or has
+ * an error
+ *
+ * A closed socket stays readable forever, so once all of the data left
+ * in it has been processed it is no longer watched and the error callback
+ * is given UMQTT_ERR_NETWORK.
+ *
+ * If the packet budget was used up, the instance is due again on the
+ * next tick, so that the other instances get their turn in this pass
+ * first.  The rest of the data may already be in a buffer of the
+ * transport, where epoll cannot see it.
+ */
+static void
+runEntry(Loop_t *this, LoopEntry_t *pEntry, uint32_t msTicks, bool hangup)
+{
+    uint32_t count = 0;
+    umqtt_Error_t err = umqtt_RunBudget(pEntry->h, msTicks, this->maxPackets, 0, &count);
+    if (hangup && (count < this->maxPackets))
+    {
+        watchFd(this, pEntry, -1);
+        err = UMQTT_ERR_NETWORK;
+    }
+    if ((err != UMQTT_ERR_OK) && this->errorCb)
+    {
+        this->errorCb(this, pEntry->h, pEntry->pUser, err);
+    }
+
+    // the callback can remove the instance
+    if (pEntry->h)
+    {
+        watchBacklog(this, pEntry);
+        scheduleEntry(this, pEntry);
+        if (count >= this->maxPackets)
+        {
+            pEntry->deadline = msTicks + 1;
+            if (pEntry->heapPos == 0)
+            {
+                heapPlace(this, ++this->heapCount, pEntry);
+            }
+            heapFix(this, pEntry);
+        }
+
+        // otherwise an instance is run at most once for each deadline, so
+        // that a deadline that does not move cannot keep the loop busy
+        else if (pEntry->heapPos && ((int32_t)(pEntry->deadline - msTicks) <= 0))
+        {
+            pEntry->deadline = msTicks + 1;
+            heapFix(this, pEntry);
+        }
+    }
+}
+
+/**
+ * Create an event loop
+ *
+ * @param pOptions optional loop settings, or NULL for defaults
+ *
+ * @return event loop handle, or NULL if there is an error
+ *
+ * The loop memory and the epoll instance are allocated here and freed by
+ * umqtt_LoopDelete().  The settings are copied so the structure does not
+ * need to be kept after this function returns.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_LoopOptions_t options = { 0 };
+ * options.errorCb = onLoopError;
+ *
+ * umqtt_Loop_t hLoop = umqtt_LoopNew(&options);
+ * if (hLoop == NULL)
+ * {
+ *     // handle error
+ * }
+ * ~~~~~~~~
+ */
+umqtt_Loop_t
+umqtt_LoopNew(const umqtt_LoopOptions_t *pOptions)
+{
+    Loop_t *this = calloc(1, sizeof(Loop_t));
+    if (this == NULL)
+    {
+        return NULL;
+    }
+    this->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epfd < 0)
+    {
+        free(this);
+        return NULL;
+    }
+    this->maxPackets = UMQTT_LOOP_MAX_PACKETS;
+    this->pollFd = -1;
+    if (pOptions)
+    {
+        this->pfnGetTicks = pOptions->pfnGetTicks;
+        this->errorCb = pOptions->errorCb;
+        if (pOptions->maxPackets)
+        {
+            this->maxPackets = pOptions->maxPackets;
+        }
+    }
+    return this;
+}
+
+/**
+ * Free an event loop
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ *
+ * The instances that are still in the loop are not deleted and their
+ * sockets are not closed, the application still owns them.  This must
+ * not be called from the error callback.
+ */
+void
+umqtt_LoopDelete(umqtt_Loop_t hLoop)
+{
+    Loop_t *this = hLoop;
+    if (this)
+    {
+        for (uint32_t i = 0; i < this->indexSize; i++)
+        {
+            free(this->index[i]);
+        }
+        free(this->index);
+        free(this->heap);
+        close(this->epfd);
+        free(this);
+    }
+}
+
+/**
+ * Add a umqtt instance to an event loop
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param h umqtt instance handle
+ * @param fd the socket read by the instance network read function, or -1
+ * if the instance has no socket yet
+ * @param pUser optional caller defined data pointer that will be passed
+ * to the error callback
+ *
+ * @return UMQTT_ERR_OK if the instance was added, UMQTT_ERR_PARM if it is
+ * already in the loop, UMQTT_ERR_BUFSIZE if memory could not be allocated
+ * or UMQTT_ERR_NETWORK if epoll does not accept the socket
+ *
+ * The instance is run when the socket has data to read, and when the
+ * deadline from umqtt_GetNextDeadline() has passed.  The network read
+ * function should not block, and should return 0 once there is no more
+ * data.  The socket can be changed later with umqtt_LoopSetFd().
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * err = umqtt_LoopAdd(hLoop, h, sock, pDevice);
+ * err = umqtt_Connect(h, true, false, 0, 30, "device1", NULL, NULL, 0, NULL, NULL);
+ * // connect started a timer so the deadline changed
+ * err = umqtt_LoopUpdate(hLoop, h);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_LoopAdd(umqtt_Loop_t hLoop, umqtt_Handle_t h, int fd, void *pUser)
+{
+    Loop_t *this = hLoop;
+    if ((this == NULL) || (h == NULL) || (findEntrySlot(this, h) >= 0))
+    {
+        return UMQTT_ERR_PARM;
+    }
+    if (!reserveEntry(this))
+    {
+        return UMQTT_ERR_BUFSIZE;
+    }
+    LoopEntry_t *pEntry = calloc(1, sizeof(LoopEntry_t));
+    if (pEntry == NULL)
+    {
+        return UMQTT_ERR_BUFSIZE;
+    }
+    pEntry->h = h;
+    pEntry->pUser = pUser;
+    pEntry->fd = -1;
+    if (!watchFd(this, pEntry, fd))
+    {
+        free(pEntry);
+        return UMQTT_ERR_NETWORK;
+    }
+    indexEntry(this, pEntry);
+    scheduleEntry(this, pEntry);
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Remove a umqtt instance from an event loop
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param h umqtt instance handle
+ *
+ * @return UMQTT_ERR_OK, or UMQTT_ERR_PARM if the instance is not in the
+ * loop
+ *
+ * The instance is not deleted and its socket is not closed.  This can be
+ * called from the error callback, also for other instances than the one
+ * the callback is for.  An instance should be removed before it is
+ * deleted with umqtt_Delete().
+ */
+umqtt_Error_t
+umqtt_LoopRemove(umqtt_Loop_t hLoop, umqtt_Handle_t h)
+{
+    Loop_t *this = hLoop;
+    int32_t slot = this ? findEntrySlot(this, h) : -1;
+    if (slot < 0)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    LoopEntry_t *pEntry = this->index[slot];
+    unindexEntry(this, (uint32_t)slot);
+    heapRemove(this, pEntry);
+    watchFd(this, pEntry, -1);
+    pEntry->h = NULL;
+
+    // events already collected by umqtt_LoopRun() can still point at the
+    // entry, so it is freed when the pass is finished
+    if (this->isRunning)
+    {
+        pEntry->pNextRemoved = this->pRemoved;
+        this->pRemoved = pEntry;
+    }
+    else
+    {
+        free(pEntry);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Change the socket of a umqtt instance in an event loop
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param h umqtt instance handle
+ * @param fd the new socket, or -1 to not watch any socket
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_PARM if the instance is not in the loop,
+ * or UMQTT_ERR_NETWORK if epoll does not accept the socket
+ *
+ * Use this when the instance is connected again on a new socket.  The
+ * old socket is no longer watched.
+ */
+umqtt_Error_t
+umqtt_LoopSetFd(umqtt_Loop_t hLoop, umqtt_Handle_t h, int fd)
+{
+    Loop_t *this = hLoop;
+    int32_t slot = this ? findEntrySlot(this, h) : -1;
+    if (slot < 0)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    return watchFd(this, this->index[slot], fd) ? UMQTT_ERR_OK : UMQTT_ERR_NETWORK;
+}
+
+/**
+ * Read the deadline of a umqtt instance in an event loop again
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param h umqtt instance handle
+ *
+ * @return UMQTT_ERR_OK, or UMQTT_ERR_PARM if the instance is not in the
+ * loop
+ *
+ * The loop reads the deadline of an instance each time it runs it.  If
+ * the application calls a function that sends a packet, such as
+ * umqtt_Connect() or umqtt_Publish(), from outside the loop, it must
+ * call this afterwards so that the retry timer of the packet is seen,
+ * and so that the socket is watched for being writable if the transport
+ * could not send all of the packet.  It is not needed when the function
+ * is called from a umqtt callback while the loop is running the instance.
+ */
+umqtt_Error_t
+umqtt_LoopUpdate(umqtt_Loop_t hLoop, umqtt_Handle_t h)
+{
+    Loop_t *this = hLoop;
+    int32_t slot = this ? findEntrySlot(this, h) : -1;
+    if (slot < 0)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    watchBacklog(this, this->index[slot]);
+    scheduleEntry(this, this->index[slot]);
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Run a umqtt instance in an event loop on the next pass
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param h umqtt instance handle
+ *
+ * @return UMQTT_ERR_OK, or UMQTT_ERR_PARM if the instance is not in the
+ * loop
+ *
+ * This is for an instance whose network read function gets its data
+ * some other way than from a socket that epoll can watch, for example
+ * from a poll callback set with umqtt_LoopSetPoll().  The instance is run
+ * by the next umqtt_LoopRun(), without waiting.
+ */
+umqtt_Error_t
+umqtt_LoopWake(umqtt_Loop_t hLoop, umqtt_Handle_t h)
+{
+    Loop_t *this = hLoop;
+    int32_t slot = this ? findEntrySlot(this, h) : -1;
+    if (slot < 0)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    LoopEntry_t *pEntry = this->index[slot];
+    pEntry->deadline = loopTicks(this);
+    if (pEntry->heapPos == 0)
+    {
+        heapPlace(this, ++this->heapCount, pEntry);
+    }
+    heapFix(this, pEntry);
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Share an event loop with another event source
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param fd a descriptor that becomes readable when the source has
+ * work, or -1 if there is none
+ * @param pfnPoll poll callback, or NULL to stop calling one
+ * @param pArg argument passed to the poll callback
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_PARM if the loop handle is not valid,
+ * or UMQTT_ERR_NETWORK if epoll does not accept the descriptor
+ *
+ * The loop has room for one poll callback, which replaces any set
+ * before.  The descriptor ends the wait in umqtt_LoopRun() when it is
+ * readable, and the callback is called before and after each wait, see
+ * LoopPollCb_t().  The io_uring transport in `umqtt_uring.c` uses this
+ * to run its instances from the loop.
+ */
+umqtt_Error_t
+umqtt_LoopSetPoll(umqtt_Loop_t hLoop, int fd, LoopPollCb_t pfnPoll, void *pArg)
+{
+    Loop_t *this = hLoop;
+    if (this == NULL)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    if (this->pollFd >= 0)
+    {
+        epoll_ctl(this->epfd, EPOLL_CTL_DEL, this->pollFd, NULL);
+        this->pollFd = -1;
+    }
+    this->pfnPoll = pfnPoll;
+    this->pPollArg = pArg;
+    if (fd >= 0)
+    {
+        // the poll descriptor has no entry, so its event data is NULL
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            return UMQTT_ERR_NETWORK;
+        }
+        this->pollFd = fd;
+    }
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Wait for events and run the umqtt instances that need it
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param timeoutMs longest time in ms to wait for an event, 0 to not wait,
+ * or -1 to wait until there is an event
+ * @param pCount storage for the number of instances that were run
+ * (optional)
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_PARM if the loop handle is not valid, or
+ * UMQTT_ERR_NETWORK if epoll reported an error
+ *
+ * The wait ends early when the earliest instance deadline comes up.  Then
+ * umqtt_RunBudget() is called for each instance whose socket has data to
+ * read, and for each instance whose deadline has passed or that was woken
+ * with umqtt_LoopWake(), with the loop tick count.  Errors returned for an
+ * instance are passed to the error callback.  This function is called
+ * over and over from the thread that serves the instances.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * while (running)
+ * {
+ *     err = umqtt_LoopRun(hLoop, 1000, NULL);
+ * }
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_LoopRun(umqtt_Loop_t hLoop, int timeoutMs, uint32_t *pCount)
+{
+    Loop_t *this = hLoop;
+    if (this == NULL)
+    {
+        return UMQTT_ERR_PARM;
+    }
+
+    // the poll callback can wake instances, so it goes first
+    if (this->pfnPoll)
+    {
+        this->pfnPoll(this, this->pPollArg);
+    }
+
+    // do not sleep past the earliest deadline
+    uint32_t msTicks = loopTicks(this);
+    int waitMs = timeoutMs;
+    if (this->heapCount)
+    {
+        int32_t untilDeadline = (int32_t)(this->heap[1]->deadline - msTicks);
+        if (untilDeadline < 0)
+        {
+            untilDeadline = 0;
+        }
+        if ((waitMs < 0) || (untilDeadline < waitMs))
+        {
+            waitMs = untilDeadline;
+        }
+    }
+
+    int eventCount = epoll_wait(this->epfd, this->events, UMQTT_LOOP_EVENTS, waitMs);
+    if (eventCount < 0)
+    {
+        if (errno != EINTR)
+        {
+            return UMQTT_ERR_NETWORK;
+        }
+        eventCount = 0;
+    }
+    if (this->pfnPoll)
+    {
+        this->pfnPoll(this, this->pPollArg);
+    }
+
+    msTicks = loopTicks(this);
+    this->isRunning = true;
+    uint32_t runCount = 0;
+
+    // run the instances that have something to read
+    for (int i = 0; i < eventCount; i++)
+    {
+        LoopEntry_t *pEntry = this->events[i].data.ptr;
+        if (pEntry && pEntry->h)
+        {
+            runEntry(this, pEntry, msTicks,
+                     (this->events[i].events & (EPOLLHUP | EPOLLERR)) != 0);
+            ++runCount;
+        }
+    }
+
+    // take the instances whose deadline has passed out of the heap
+    // before running them, so that each one runs once in this pass even
+    // if it is due again right away
+    LoopEntry_t *pDue = NULL;
+    while (this->heapCount
+        && ((int32_t)(this->heap[1]->deadline - msTicks) <= 0))
+    {
+        LoopEntry_t *pEntry = this->heap[1];
+        heapRemove(this, pEntry);
+        pEntry->pNextDue = pDue;
+        pDue = pEntry;
+    }
+    while (pDue)
+    {
+        LoopEntry_t *pEntry = pDue;
+        pDue = pEntry->pNextDue;
+        if (pEntry->h)
+        {
+            runEntry(this, pEntry, msTicks, false);
+            ++runCount;
+        }
+    }
+
+    // free the entries that were removed during this pass
+    this->isRunning = false;
+    while (this->pRemoved)
+    {
+        LoopEntry_t *pEntry = this->pRemoved;
+        this->pRemoved = pEntry->pNextRemoved;
+        free(pEntry);
+    }
+
+    if (pCount)
+    {
+        *pCount = runCount;
+    }
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Get the tick count used by an event loop
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ *
+ * @return the millisecond tick count that the loop passes to umqtt_Run()
+ *
+ * This is the tick function from the loop options if one was given, or
+ * else the system monotonic clock.
+ */
+uint32_t
+umqtt_LoopGetTicks(umqtt_Loop_t hLoop)
+{
+    Loop_t *this = hLoop;
+    return this ? loopTicks(this) : 0;
+}
+
+/**
+ * @}
+ */
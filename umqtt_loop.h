@@ -0,0 +1,99 @@
+/******************************************************************************
+ * umqtt_loop.h - Event loop to run many umqtt instances from one thread.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#ifndef __UMQTT_LOOP_H__
+#define __UMQTT_LOOP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "umqtt.h"
+
+/**
+ * Event loop handle, obtained from umqtt_LoopNew().
+ */
+typedef void * umqtt_Loop_t;
+
+/**
+ * Callback function for errors returned by umqtt_Run().
+ *
+ * @param hLoop event loop handle
+ * @param h umqtt instance handle
+ * @param pUser application defined data pointer given to umqtt_LoopAdd()
+ * @param err the error code
+ *
+ * This is called when umqtt_Run() returns an error for an instance, and
+ * with UMQTT_ERR_NETWORK when the socket of an instance is closed or has
+ * an error.  In that case the socket is no longer watched.  The callback
+ * can start a recovery, for example by connecting a new socket and
+ * passing it to umqtt_LoopSetFd(), or it can remove the instance with
+ * umqtt_LoopRemove().
+ */
+typedef void (*LoopErrorCb_t)(umqtt_Loop_t hLoop, umqtt_Handle_t h,
+                              void *pUser, umqtt_Error_t err);
+
+/**
+ * Callback function for another event source that shares the loop.
+ *
+ * @param hLoop event loop handle
+ * @param pArg argument given to umqtt_LoopSetPoll()
+ *
+ * This is called by umqtt_LoopRun() just before it waits for events and
+ * again right after, before any instance is run.  It must not block.  It
+ * can hand over work that was queued while the instances ran, collect
+ * finished work, and use umqtt_LoopWake() for the instances that have
+ * new data.
+ */
+typedef void (*LoopPollCb_t)(umqtt_Loop_t hLoop, void *pArg);
+
+/**
+ * Optional event loop settings, passed to umqtt_LoopNew().
+ *
+ * A structure that is all zeroes selects the default for every setting.
+ */
+typedef struct
+{
+    /// Millisecond tick count function, used for the ticks passed to
+    /// umqtt_Run(), or NULL to use the system monotonic clock.
+    getTicks_t pfnGetTicks;
+    /// Most incoming packets to process for one instance each time it
+    /// is run, or 0 for the default of 16.  Data left over is processed
+    /// on the next pass, so one busy instance cannot hold up the others.
+    uint32_t maxPackets;
+    /// Called when umqtt_Run() returns an error (optional).
+    LoopErrorCb_t errorCb;
+} umqtt_LoopOptions_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern umqtt_Loop_t umqtt_LoopNew(const umqtt_LoopOptions_t *pOptions);
+extern void umqtt_LoopDelete(umqtt_Loop_t hLoop);
+extern umqtt_Error_t umqtt_LoopAdd(umqtt_Loop_t hLoop, umqtt_Handle_t h,
+                                   int fd, void *pUser);
+extern umqtt_Error_t umqtt_LoopRemove(umqtt_Loop_t hLoop, umqtt_Handle_t h);
+extern umqtt_Error_t umqtt_LoopSetFd(umqtt_Loop_t hLoop, umqtt_Handle_t h, int fd);
+extern umqtt_Error_t umqtt_LoopUpdate(umqtt_Loop_t hLoop, umqtt_Handle_t h);
+extern umqtt_Error_t umqtt_LoopWake(umqtt_Loop_t hLoop, umqtt_Handle_t h);
+extern umqtt_Error_t umqtt_LoopSetPoll(umqtt_Loop_t hLoop, int fd,
+                                       LoopPollCb_t pfnPoll, void *pArg);
+extern umqtt_Error_t umqtt_LoopRun(umqtt_Loop_t hLoop, int timeoutMs,
+                                   uint32_t *pCount);
+extern uint32_t umqtt_LoopGetTicks(umqtt_Loop_t hLoop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,815 @@
+/******************************************************************************
+ * umqtt_posix.c - Reference POSIX TCP transport for umqtt.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "umqtt_posix.h"
+
+/**
+ *
+ * @addtogroup umqtt_posix uMQTT POSIX Transport
+ * @{
+ *
+ * Ready made network functions for TCP sockets
+ * --------------------------------------------
+ *
+ * Function Name              | Description
+ * ---------------------------|------------
+ * umqtt_PosixNew()           | create a transport
+ * umqtt_PosixDelete()        | close the socket and free the transport
+ * umqtt_PosixGetTransport()  | fill in a transport structure for umqtt_New()
+ * umqtt_PosixConnect()       | start connecting to a broker
+ * umqtt_PosixCheckConnect()  | check if the connection has been made
+ * umqtt_PosixAttach()        | use a socket that is already connected
+ * umqtt_PosixFlush()         | send bytes held back when the socket was full
+ * umqtt_PosixGetBacklog()    | get the number of bytes held back
+ * umqtt_PosixGetFd()         | get the socket, for poll or umqtt_LoopAdd()
+ * umqtt_PosixClose()         | close the socket
+ *
+ * This module provides the network read and write functions of
+ * @ref umqtt_TransportConfig_t for a non-blocking TCP socket, so that an
+ * application on Linux or another POSIX system does not have to write
+ * them.
+ *
+ * The read function receives into a buffer owned by the transport and
+ * hands over each whole packet in place, without copying it.  Several
+ * packets that arrive in one _recv()_ are handed over one at a time, and
+ * only a packet that is split across reads is moved to the start of the
+ * buffer.  The instance must not use the _streamInput_ option.
+ *
+ * The socket uses TCP_NODELAY, so a small control packet such as an ack
+ * or a ping is sent right away.  When umqtt sets the _isMore_ hint, for
+ * example for all but the last packet of a burst of retransmits, the
+ * packet is sent with MSG_MORE, so the burst goes out in as few segments
+ * as possible.  Packets held in several buffers are sent with one
+ * scatter-gather _sendmsg()_.
+ *
+ * A packet that the socket does not take all of is kept in a send backlog
+ * and finished later, because umqtt needs each packet to be either all
+ * sent or not at all.  The backlog buffer grows to fit the packet, like
+ * the receive buffer.  The backlog is sent at the start of each read and
+ * write, and by umqtt_PosixFlush().  The transport reports the size of
+ * the backlog to umqtt, so that umqtt_LoopRun() can wait for the socket
+ * to become writable while bytes are held.
+ */
+
+/*
+ * Defaults for the transport settings.
+ */
+#define UMQTT_POSIX_RX_BUF_SIZE 4096
+#define UMQTT_POSIX_MAX_PACKET_LEN (1024 * 1024)
+#define UMQTT_POSIX_TX_BUF_SIZE 65536
+
+/*
+ * Most buffers in one packet written with the writev function.
+ */
+#define UMQTT_POSIX_MAX_SEGMENTS 8
+
+/*
+ * Transport data structure.  This is allocated and populated by
+ * umqtt_PosixNew()
+ */
+typedef struct
+{
+    int fd;                 // socket, or -1 if not connected
+    bool connectIsPending;  // non-blocking connect has not finished
+    uint8_t *pRx;           // receive buffer
+    uint32_t rxSize;        // bytes in the receive buffer
+    uint32_t rxStart;       // offset of the first byte not handed over
+    uint32_t rxEnd;         // offset after the last byte received
+    uint32_t maxPacketLen;  // largest packet accepted
+    uint8_t *pTx;           // send backlog, or NULL until first needed
+    uint32_t txSize;        // bytes in the send backlog buffer
+    uint32_t txMax;         // most bytes held in the send backlog
+    uint32_t txStart;       // offset of the first byte not yet sent
+    uint32_t txEnd;         // offset after the last byte held
+} PosixNet_t;
+
+/*
+ * @internal
+ *
+ * Find the length of the packet at the start of received data
+ *
+ * @param pBuf received data, starting with a fixed header
+ * @param avail number of bytes at _pBuf_
+ * @param pTotal storage for the total packet length, including the fixed
+ * header
+ *
+ * @return 1 if the length was found, 0 if more data is needed to find it,
+ * or -1 if the remaining length field is malformed
+ */
+static int
+frameLength(const uint8_t *pBuf, uint32_t avail, uint32_t *pTotal)
+{
+    uint32_t remainingLen = 0;
+    for (uint32_t idx = 1; idx <= 4; idx++)
+    {
+        if (idx >= avail)
+        {
+            return 0;
+        }
+        remainingLen |= (uint32_t)(pBuf[idx] & 0x7F) << (7 * (idx - 1));
+        if (!(pBuf[idx] & 0x80))
+        {
+            *pTotal = 1 + idx + remainingLen;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * @internal
+ *
+ * Prepare a socket for use by the transport
+ *
+ * @param fd the socket
+ *
+ * @return true if the socket could be made non-blocking
+ *
+ * Nagle's algorithm is turned off so that small packets are not held
+ * back.  That fails harmlessly for a socket that is not TCP.
+ */
+static bool
+setupSocket(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Send as much of the send backlog as the socket takes
+ *
+ * @param this transport
+ *
+ * @return true if there was no error, even if some bytes are still held
+ */
+static bool
+flushBacklog(PosixNet_t *this)
+{
+    while (this->txEnd != this->txStart)
+    {
+        ssize_t sent = send(this->fd, &this->pTx[this->txStart],
+                            this->txEnd - this->txStart, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+        }
+        this->txStart += sent;
+    }
+    this->txStart = 0;
+    this->txEnd = 0;
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Add the unsent part of a packet to the send backlog
+ *
+ * @param this transport
+ * @param pIov the buffers of the packet
+ * @param iovCount number of buffers
+ * @param skip number of bytes at the start of the packet already sent
+ *
+ * The backlog buffer is doubled until the bytes fit, up to the send
+ * backlog setting plus the largest packet length.
+ *
+ * @return true if the bytes were added, false if there is no room
+ */
+static bool
+holdBytes(PosixNet_t *this, const struct iovec *pIov, uint32_t iovCount, size_t skip)
+{
+    size_t len = 0;
+    for (uint32_t i = 0; i < iovCount; i++)
+    {
+        len += pIov[i].iov_len;
+    }
+    len -= skip;
+    size_t held = this->txEnd - this->txStart;
+    if (len > (this->txMax - held))
+    {
+        return false;
+    }
+
+    // move the held bytes to the start if they would run off the end
+    if (this->pTx && (len > (this->txSize - this->txEnd)))
+    {
+        memmove(this->pTx, &this->pTx[this->txStart], held);
+        this->txEnd = held;
+        this->txStart = 0;
+    }
+    if ((this->pTx == NULL) || ((held + len) > this->txSize))
+    {
+        size_t size = this->txSize;
+        while (size < (held + len))
+        {
+            size *= 2;
+        }
+        size = (size > this->txMax) ? this->txMax : size;
+        uint8_t *pNewTx = realloc(this->pTx, size);
+        if (pNewTx == NULL)
+        {
+            return false;
+        }
+        this->pTx = pNewTx;
+        this->txSize = size;
+    }
+    for (uint32_t i = 0; i < iovCount; i++)
+    {
+        const uint8_t *pData = pIov[i].iov_base;
+        size_t segLen = pIov[i].iov_len;
+        if (skip >= segLen)
+        {
+            skip -= segLen;
+            continue;
+        }
+        memcpy(&this->pTx[this->txEnd], &pData[skip], segLen - skip);
+        this->txEnd += segLen - skip;
+        skip = 0;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Send one packet held in one or more buffers
+ *
+ * @param this transport
+ * @param pIov the buffers of the packet
+ * @param iovCount number of buffers
+ * @param isMore true if more packets will be written right away
+ *
+ * @return the packet length if all of it was sent or held, 0 if none of
+ * it could be sent or held, or -1 if there is an error
+ */
+static int
+sendPacket(PosixNet_t *this, const struct iovec *pIov, uint32_t iovCount, bool isMore)
+{
+    if ((this->fd < 0) || this->connectIsPending)
+    {
+        return -1;
+    }
+    size_t len = 0;
+    for (uint32_t i = 0; i < iovCount; i++)
+    {
+        len += pIov[i].iov_len;
+    }
+
+    // bytes that are already held have to go out first
+    if (!flushBacklog(this))
+    {
+        return -1;
+    }
+    if (this->txEnd != this->txStart)
+    {
+        return holdBytes(this, pIov, iovCount, 0) ? (int)len : 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)pIov;
+    msg.msg_iovlen = iovCount;
+    ssize_t sent = sendmsg(this->fd, &msg, MSG_NOSIGNAL | (isMore ? MSG_MORE : 0));
+    if (sent < 0)
+    {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+            return -1;
+        }
+        sent = 0;
+    }
+    if ((size_t)sent == len)
+    {
+        return (int)len;
+    }
+
+    // the socket took only part of the packet, so the rest must be held
+    // or the stream is broken
+    if (!holdBytes(this, pIov, iovCount, sent))
+    {
+        return (sent == 0) ? 0 : -1;
+    }
+    return (int)len;
+}
+
+/*
+ * @internal
+ *
+ * Network read function, see netReadPacket_t()
+ *
+ * A packet that is already whole in the receive buffer is handed over
+ * without reading the socket.  Otherwise the socket is read once.  The
+ * packet handed over before is no longer used when this is called, so
+ * its space can be used again.
+ */
+static int
+posixRead(void *hNet, uint8_t **ppBuf)
+{
+    PosixNet_t *this = hNet;
+    if (this->fd < 0)
+    {
+        return -1;
+    }
+    if (this->connectIsPending)
+    {
+        return 0;
+    }
+    if (!flushBacklog(this))
+    {
+        return -1;
+    }
+
+    bool didRecv = false;
+    for (;;)
+    {
+        uint32_t avail = this->rxEnd - this->rxStart;
+        uint32_t total = 0;
+        int framed = frameLength(&this->pRx[this->rxStart], avail, &total);
+        if ((framed < 0) || ((framed > 0) && (total > this->maxPacketLen)))
+        {
+            return -1;
+        }
+        if ((framed > 0) && (total <= avail))
+        {
+            *ppBuf = &this->pRx[this->rxStart];
+            this->rxStart += total;
+            return (int)total;
+        }
+        if (didRecv)
+        {
+            return 0;
+        }
+
+        // make room for the rest of the packet.  Only the start of a
+        // packet that did not all arrive yet is ever moved
+        if (avail == 0)
+        {
+            this->rxStart = 0;
+            this->rxEnd = 0;
+        }
+        else if ((this->rxEnd == this->rxSize)
+              || ((framed > 0) && ((this->rxStart + total) > this->rxSize)))
+        {
+            memmove(this->pRx, &this->pRx[this->rxStart], avail);
+            this->rxStart = 0;
+            this->rxEnd = avail;
+        }
+        if ((framed > 0) && (total > this->rxSize))
+        {
+            uint8_t *pNewRx = realloc(this->pRx, total);
+            if (pNewRx == NULL)
+            {
+                return -1;
+            }
+            this->pRx = pNewRx;
+            this->rxSize = total;
+        }
+
+        ssize_t len = recv(this->fd, &this->pRx[this->rxEnd], this->rxSize - this->rxEnd, 0);
+        if (len < 0)
+        {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+        }
+
+        // the other end closed the connection
+        if (len == 0)
+        {
+            return -1;
+        }
+        this->rxEnd += len;
+        didRecv = true;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Network write function, see netWritePacket_t()
+ */
+static int
+posixWrite(void *hNet, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)pBuf;
+    iov.iov_len = len;
+    return sendPacket(hNet, &iov, 1, isMore);
+}
+
+/*
+ * @internal
+ *
+ * Network write function for a packet in several buffers, see
+ * netWritevPacket_t()
+ */
+static int
+posixWritev(void *hNet, const umqtt_Segment_t *pSegs, uint32_t segCount, bool isMore)
+{
+    struct iovec iov[UMQTT_POSIX_MAX_SEGMENTS];
+    if (segCount > UMQTT_POSIX_MAX_SEGMENTS)
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < segCount; i++)
+    {
+        iov[i].iov_base = (void *)pSegs[i].pData;
+        iov[i].iov_len = pSegs[i].len;
+    }
+    return sendPacket(hNet, iov, segCount, isMore);
+}
+
+/*
+ * @internal
+ *
+ * Backlog function, see netGetBacklog_t()
+ */
+static uint32_t
+posixGetBacklog(void *hNet)
+{
+    return umqtt_PosixGetBacklog(hNet);
+}
+
+/**
+ * Create a TCP transport
+ *
+ * @param pOptions optional transport settings, or NULL for defaults
+ *
+ * @return transport handle, or NULL if there is an error
+ *
+ * The transport starts without a socket.  Use umqtt_PosixConnect() or
+ * umqtt_PosixAttach() to give it one, and umqtt_PosixGetTransport() to
+ * get the network functions for umqtt_New().
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * umqtt_PosixNet_t hNet = umqtt_PosixNew(NULL);
+ * umqtt_TransportConfig_t transport;
+ * umqtt_PosixGetTransport(hNet, &transport);
+ * umqtt_Handle_t h = umqtt_New(&transport, &callbacks, NULL);
+ * ~~~~~~~~
+ */
+umqtt_PosixNet_t
+umqtt_PosixNew(const umqtt_PosixOptions_t *pOptions)
+{
+    PosixNet_t *this = calloc(1, sizeof(PosixNet_t));
+    if (this == NULL)
+    {
+        return NULL;
+    }
+    this->fd = -1;
+    this->rxSize = UMQTT_POSIX_RX_BUF_SIZE;
+    this->maxPacketLen = UMQTT_POSIX_MAX_PACKET_LEN;
+    this->txSize = UMQTT_POSIX_TX_BUF_SIZE;
+    if (pOptions)
+    {
+        this->rxSize = pOptions->rxBufSize ? pOptions->rxBufSize : this->rxSize;
+        this->maxPacketLen = pOptions->maxPacketLen ? pOptions->maxPacketLen : this->maxPacketLen;
+        this->txSize = pOptions->txBufSize ? pOptions->txBufSize : this->txSize;
+    }
+
+    // a fixed header and the longest remaining length always fit
+    if (this->rxSize < 5)
+    {
+        this->rxSize = 5;
+    }
+
+    // the backlog can hold a whole packet after the bytes already held
+    this->txSize = (this->txSize < 64) ? 64 : this->txSize;
+    uint64_t txMax = (uint64_t)this->txSize + this->maxPacketLen;
+    this->txMax = (txMax > INT32_MAX) ? INT32_MAX : (uint32_t)txMax;
+    this->pRx = malloc(this->rxSize);
+    if (this->pRx == NULL)
+    {
+        free(this);
+        return NULL;
+    }
+    return this;
+}
+
+/**
+ * Close the socket and free a transport
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ *
+ * The umqtt instance that uses the transport must be deleted first.
+ */
+void
+umqtt_PosixDelete(umqtt_PosixNet_t hNet)
+{
+    PosixNet_t *this = hNet;
+    if (this)
+    {
+        umqtt_PosixClose(this);
+        free(this->pRx);
+        free(this->pTx);
+        free(this);
+    }
+}
+
+/**
+ * Fill in a transport structure with the functions of a TCP transport
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ * @param pTransport transport structure to fill in
+ *
+ * The memory functions are the C library _malloc()_ and _free()_.  The
+ * structure is kept by the umqtt instance, so it must stay valid as long
+ * as the instance.
+ */
+void
+umqtt_PosixGetTransport(umqtt_PosixNet_t hNet, umqtt_TransportConfig_t *pTransport)
+{
+    if (pTransport)
+    {
+        memset(pTransport, 0, sizeof(umqtt_TransportConfig_t));
+        pTransport->hNet = hNet;
+        pTransport->pfnmalloc = malloc;
+        pTransport->pfnfree = free;
+        pTransport->pfnNetReadPacket = posixRead;
+        pTransport->pfnNetWritePacket = posixWrite;
+        pTransport->pfnNetWritevPacket = posixWritev;
+        pTransport->ownsReadBuf = true;
+        pTransport->pfnNetGetBacklog = posixGetBacklog;
+    }
+}
+
+/**
+ * Start connecting to a broker
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ * @param host host name or address of the broker
+ * @param port port number or service name, such as "1883"
+ *
+ * @return UMQTT_ERR_OK if the connection was made right away,
+ * UMQTT_ERR_CONNECT_PENDING if it is still being made, UMQTT_ERR_PARM for
+ * a bad parameter, or UMQTT_ERR_NETWORK if it failed
+ *
+ * Any earlier socket is closed.  The socket is not blocking, so the
+ * connection is usually still being made when this returns.  Use
+ * umqtt_PosixCheckConnect() to find out when it is done, before calling
+ * umqtt_Connect().  The host name lookup does block.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * err = umqtt_PosixConnect(hNet, "broker.example.com", "1883");
+ * while (err == UMQTT_ERR_CONNECT_PENDING)
+ * {
+ *     err = umqtt_PosixCheckConnect(hNet, 100);
+ * }
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_PosixConnect(umqtt_PosixNet_t hNet, const char *host, const char *port)
+{
+    PosixNet_t *this = hNet;
+    if ((this == NULL) || (host == NULL) || (port == NULL))
+    {
+        return UMQTT_ERR_PARM;
+    }
+    umqtt_PosixClose(this);
+
+    struct addrinfo hints;
+    struct addrinfo *pAddrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &pAddrs) != 0)
+    {
+        return UMQTT_ERR_NETWORK;
+    }
+
+    // use the first address that does not fail right away
+    umqtt_Error_t err = UMQTT_ERR_NETWORK;
+    for (struct addrinfo *pAddr = pAddrs; pAddr; pAddr = pAddr->ai_next)
+    {
+        int fd = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (setupSocket(fd))
+        {
+            if (connect(fd, pAddr->ai_addr, pAddr->ai_addrlen) == 0)
+            {
+                err = UMQTT_ERR_OK;
+            }
+            else if (errno == EINPROGRESS)
+            {
+                err = UMQTT_ERR_CONNECT_PENDING;
+            }
+        }
+        if (err != UMQTT_ERR_NETWORK)
+        {
+            this->fd = fd;
+            this->connectIsPending = (err == UMQTT_ERR_CONNECT_PENDING);
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(pAddrs);
+    return err;
+}
+
+/**
+ * Check if the connection to the broker has been made
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ * @param timeoutMs longest time in ms to wait, 0 to not wait, or -1 to
+ * wait until the connection is made or fails
+ *
+ * @return UMQTT_ERR_OK if connected, UMQTT_ERR_CONNECT_PENDING if the
+ * connection is still being made, or UMQTT_ERR_NETWORK if it failed, in
+ * which case the socket is closed
+ */
+umqtt_Error_t
+umqtt_PosixCheckConnect(umqtt_PosixNet_t hNet, int timeoutMs)
+{
+    PosixNet_t *this = hNet;
+    if ((this == NULL) || (this->fd < 0))
+    {
+        return UMQTT_ERR_NETWORK;
+    }
+    if (!this->connectIsPending)
+    {
+        return UMQTT_ERR_OK;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = this->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, timeoutMs);
+    if ((ready == 0) || ((ready < 0) && (errno == EINTR)))
+    {
+        return UMQTT_ERR_CONNECT_PENDING;
+    }
+
+    int sockErr = 0;
+    socklen_t errLen = sizeof(sockErr);
+    if ((ready < 0)
+     || (getsockopt(this->fd, SOL_SOCKET, SO_ERROR, &sockErr, &errLen) != 0)
+     || (sockErr != 0))
+    {
+        umqtt_PosixClose(this);
+        return UMQTT_ERR_NETWORK;
+    }
+    this->connectIsPending = false;
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Use a socket that is already connected
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ * @param fd the connected socket
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_PARM for a bad parameter, or
+ * UMQTT_ERR_NETWORK if the socket could not be made non-blocking
+ *
+ * Any earlier socket is closed.  The transport takes over the socket and
+ * closes it in umqtt_PosixClose().  This can be used with a socket that
+ * was connected by other means, such as through a proxy.
+ */
+umqtt_Error_t
+umqtt_PosixAttach(umqtt_PosixNet_t hNet, int fd)
+{
+    PosixNet_t *this = hNet;
+    if ((this == NULL) || (fd < 0))
+    {
+        return UMQTT_ERR_PARM;
+    }
+    umqtt_PosixClose(this);
+    if (!setupSocket(fd))
+    {
+        return UMQTT_ERR_NETWORK;
+    }
+    this->fd = fd;
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Send the bytes held back when the socket was full
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ *
+ * @return UMQTT_ERR_OK if there was no error, even if some bytes are
+ * still held, or UMQTT_ERR_NETWORK
+ *
+ * The backlog is also sent at the start of every read and write, so this
+ * is only needed when the application waits for the socket to become
+ * writable, see umqtt_PosixGetBacklog().
+ */
+umqtt_Error_t
+umqtt_PosixFlush(umqtt_PosixNet_t hNet)
+{
+    PosixNet_t *this = hNet;
+    if ((this == NULL) || (this->fd < 0))
+    {
+        return UMQTT_ERR_NETWORK;
+    }
+    if (this->connectIsPending)
+    {
+        return UMQTT_ERR_OK;
+    }
+    return flushBacklog(this) ? UMQTT_ERR_OK : UMQTT_ERR_NETWORK;
+}
+
+/**
+ * Get the number of bytes held back when the socket was full
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ *
+ * @return the number of bytes waiting to be sent
+ *
+ * If this is not 0, the application can wait for the socket to become
+ * writable and then call umqtt_PosixFlush().
+ */
+uint32_t
+umqtt_PosixGetBacklog(umqtt_PosixNet_t hNet)
+{
+    PosixNet_t *this = hNet;
+    return this ? (this->txEnd - this->txStart) : 0;
+}
+
+/**
+ * Get the socket of a transport
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ *
+ * @return the socket, or -1 if there is none
+ *
+ * The socket can be passed to umqtt_LoopAdd() or watched with _poll()_.
+ * It must not be read or written by the application.
+ */
+int
+umqtt_PosixGetFd(umqtt_PosixNet_t hNet)
+{
+    PosixNet_t *this = hNet;
+    return this ? this->fd : -1;
+}
+
+/**
+ * Close the socket of a transport
+ *
+ * @param hNet transport handle from umqtt_PosixNew()
+ *
+ * Received data and bytes held for sending are thrown away.  The
+ * transport can be connected again afterwards.
+ */
+void
+umqtt_PosixClose(umqtt_PosixNet_t hNet)
+{
+    PosixNet_t *this = hNet;
+    if (this == NULL)
+    {
+        return;
+    }
+    if (this->fd >= 0)
+    {
+        close(this->fd);
+    }
+    this->fd = -1;
+    this->connectIsPending = false;
+    this->rxStart = 0;
+    this->rxEnd = 0;
+    this->txStart = 0;
+    this->txEnd = 0;
+}
+
+/**
+ * @}
+ */
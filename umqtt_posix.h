@@ -0,0 +1,69 @@
+/******************************************************************************
+ * umqtt_posix.h - Reference POSIX TCP transport for umqtt.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#ifndef __UMQTT_POSIX_H__
+#define __UMQTT_POSIX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "umqtt.h"
+
+/**
+ * Transport handle, obtained from umqtt_PosixNew().
+ */
+typedef void * umqtt_PosixNet_t;
+
+/**
+ * Optional transport settings, passed to umqtt_PosixNew().
+ *
+ * A structure that is all zeroes selects the default for every setting.
+ */
+typedef struct
+{
+    /// Initial size in bytes of the receive buffer, or 0 for the default
+    /// of 4096.  The buffer grows when a larger packet arrives.
+    uint32_t rxBufSize;
+    /// Largest packet accepted, including the fixed header, or 0 for the
+    /// default of 1 MB.  A larger incoming packet is a network error.
+    uint32_t maxPacketLen;
+    /// Bytes held for sending when the socket does not take a whole
+    /// packet, or 0 for the default of 65536.  The backlog buffer is
+    /// allocated with this size when it is first needed, and grows so that
+    /// a packet of up to _maxPacketLen_ bytes can be held after up to this
+    /// many bytes already waiting.
+    uint32_t txBufSize;
+} umqtt_PosixOptions_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern umqtt_PosixNet_t umqtt_PosixNew(const umqtt_PosixOptions_t *pOptions);
+extern void umqtt_PosixDelete(umqtt_PosixNet_t hNet);
+extern void umqtt_PosixGetTransport(umqtt_PosixNet_t hNet,
+                                    umqtt_TransportConfig_t *pTransport);
+extern umqtt_Error_t umqtt_PosixConnect(umqtt_PosixNet_t hNet, const char *host,
+                                        const char *port);
+extern umqtt_Error_t umqtt_PosixCheckConnect(umqtt_PosixNet_t hNet, int timeoutMs);
+extern umqtt_Error_t umqtt_PosixAttach(umqtt_PosixNet_t hNet, int fd);
+extern umqtt_Error_t umqtt_PosixFlush(umqtt_PosixNet_t hNet);
+extern uint32_t umqtt_PosixGetBacklog(umqtt_PosixNet_t hNet);
+extern int umqtt_PosixGetFd(umqtt_PosixNet_t hNet);
+extern void umqtt_PosixClose(umqtt_PosixNet_t hNet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1432 @@
+/******************************************************************************
+ * umqtt_uring.c - Linux io_uring transport for many umqtt instances.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "umqtt_uring.h"
+
+/**
+ *
+ * @addtogroup umqtt_uring uMQTT io_uring Transport
+ * @{
+ *
+ * Network functions for many TCP sockets with Linux io_uring
+ * ----------------------------------------------------------
+ *
+ * Function Name              | Description
+ * ---------------------------|------------
+ * umqtt_UringNew()           | create an io_uring for an event loop
+ * umqtt_UringDelete()        | free an io_uring and its connections
+ * umqtt_UringAttach()        | start using a connected socket
+ * umqtt_UringGetTransport()  | fill in a transport structure for umqtt_New()
+ * umqtt_UringAdd()           | run the instance of a connection from the loop
+ * umqtt_UringClose()         | close a connection
+ * umqtt_UringSubmit()        | send the packets written so far right away
+ *
+ * With thousands of connections on one thread, the time spent in system
+ * calls for each read and write of each socket adds up.  This module is
+ * a transport, like the one in `umqtt_posix.c`, that instead uses one
+ * Linux io_uring for all of the connections of an event loop.
+ *
+ * Each connection has one multishot receive that stays armed.  It takes
+ * buffers from a pool that is registered with the kernel once and shared
+ * by all of the connections, so data is received with no system call at
+ * all.  The read function hands over each whole packet in place in its
+ * receive buffer, and only copies a packet that was split across
+ * buffers.  Packets written by the instances are queued for each
+ * connection, and all of the queued data of all connections is handed to
+ * the kernel with one system call on each pass of umqtt_LoopRun().
+ *
+ * The io_uring is driven by the event loop.  Instances are added to the
+ * loop with umqtt_UringAdd(), and the loop runs an instance when its
+ * connection has received data or when its deadline has passed.
+ *
+ * umqtt_UringNew() returns NULL if the kernel does not have io_uring, or
+ * if it is turned off, for example by a seccomp filter.  It also always
+ * returns NULL if this module was built with kernel headers that are too
+ * old for multishot receive, which came with Linux 6.0.  The application
+ * can then use the transport in `umqtt_posix.c` with the same loop:
+ *
+ * ~~~~~~~~.c
+ * umqtt_Uring_t hRing = umqtt_UringNew(hLoop, NULL);
+ * if (hRing)
+ * {
+ *     umqtt_UringConn_t hConn = umqtt_UringAttach(hRing, sock);
+ *     umqtt_UringGetTransport(hConn, &pDevice->transport);
+ *     h = umqtt_New(&pDevice->transport, &callbacks, pDevice);
+ *     err = umqtt_UringAdd(hConn, h, pDevice);
+ * }
+ * else
+ * {
+ *     umqtt_PosixNet_t hNet = umqtt_PosixNew(NULL);
+ *     err = umqtt_PosixAttach(hNet, sock);
+ *     umqtt_PosixGetTransport(hNet, &pDevice->transport);
+ *     h = umqtt_New(&pDevice->transport, &callbacks, pDevice);
+ *     err = umqtt_LoopAdd(hLoop, h, sock, pDevice);
+ * }
+ * ~~~~~~~~
+ *
+ * The io_uring and its connections are not thread safe.  They must be
+ * used from the thread that calls umqtt_LoopRun().
+ */
+
+#if defined(IORING_RECV_MULTISHOT)
+
+/*
+ * Defaults for the io_uring settings.
+ */
+#define UMQTT_URING_ENTRIES 256
+#define UMQTT_URING_BUF_COUNT 1024
+#define UMQTT_URING_BUF_SIZE 4096
+#define UMQTT_URING_MAX_PACKET_LEN (1024 * 1024)
+#define UMQTT_URING_TX_BUF_SIZE 65536
+
+/*
+ * Size in bytes of the send and queue buffers of a connection when they
+ * are first allocated.  They are doubled whenever more room is needed.
+ */
+#define UMQTT_URING_TX_MIN_SIZE 512
+
+/*
+ * Most receive buffers in the pool.  Buffer IDs are 16 bits and the pool
+ * ring can have at most this many entries.
+ */
+#define UMQTT_URING_MAX_BUFS 32768
+
+/*
+ * Buffer group ID of the receive buffer pool.
+ */
+#define UMQTT_URING_BGID 0
+
+/*
+ * The low bit of the user data of a request tells a send from a receive.
+ * The rest is the address of the connection.
+ */
+#define UMQTT_URING_OP_SEND 1
+
+struct Uring;
+
+/*
+ * One connection.  This is allocated by umqtt_UringAttach() and freed
+ * once it has been closed and the kernel has finished with it.
+ */
+typedef struct UringConn
+{
+    struct Uring *pRing;    // io_uring the connection belongs to
+    int fd;                 // socket, or -1 once closed
+    umqtt_Handle_t h;       // instance run from the loop, or NULL
+    bool isClosed;          // closed by umqtt_UringClose()
+    bool isBroken;          // the socket was closed by the peer or failed
+    bool recvIsArmed;       // a receive request is in the kernel
+    bool needsRecv;         // a receive request must be submitted
+    bool isStarved;         // the last receive found no free buffer
+    bool sendIsPending;     // a send request is in the kernel
+    bool isReady;           // connection is in the ready list
+    int32_t rxHead;         // first received buffer not yet used up, or -1
+    int32_t rxTail;         // last received buffer, or -1
+    uint32_t rxOffset;      // bytes of the first buffer already handed over
+    uint8_t *pAsm;          // packet put together from several buffers
+    uint32_t asmSize;       // bytes allocated for the packet buffer
+    uint32_t asmLen;        // bytes of the packet copied so far
+    uint32_t asmTotal;      // length of the packet, or 0 until known
+    uint8_t *pSend;         // data being sent by the kernel
+    uint32_t sendSize;      // bytes allocated for the send buffer
+    uint32_t sendLen;       // bytes in the send buffer
+    uint32_t sendOffset;    // bytes of the send buffer already sent
+    uint8_t *pQueue;        // data written since the last send
+    uint32_t queueSize;     // bytes allocated for the queue buffer
+    uint32_t queueLen;      // bytes in the queue buffer
+    struct UringConn *pNextReady;   // next connection with requests to submit
+    struct UringConn *pNext;        // next connection of the io_uring
+    struct UringConn *pPrev;        // previous connection of the io_uring
+} UringConn_t;
+
+/*
+ * io_uring data structure.  This is allocated and populated by
+ * umqtt_UringNew()
+ */
+typedef struct Uring
+{
+    int ringFd;             // io_uring instance
+    umqtt_Loop_t hLoop;     // event loop that drives the io_uring
+    void *pSqMap;           // mapped submission queue ring
+    size_t sqMapLen;
+    void *pCqMap;           // mapped completion queue ring, maybe the same
+    size_t cqMapLen;
+    struct io_uring_sqe *pSqes;     // mapped submission queue entries
+    size_t sqesMapLen;
+    uint32_t *pSqHead;      // submission queue, shared with the kernel
+    uint32_t *pSqTail;
+    uint32_t *pSqArray;
+    uint32_t *pSqFlags;
+    uint32_t sqMask;
+    uint32_t sqEntries;
+    uint32_t *pCqHead;      // completion queue, shared with the kernel
+    uint32_t *pCqTail;
+    struct io_uring_cqe *pCqes;
+    uint32_t cqMask;
+    struct io_uring_buf_ring *pBufRing; // receive buffer pool ring
+    size_t bufRingLen;
+    uint16_t bufRingTail;   // next free entry of the pool ring
+    uint8_t *pBufs;         // receive buffer memory
+    uint32_t bufCount;      // number of receive buffers
+    uint32_t bufSize;       // size of each receive buffer
+    uint32_t bufsInUse;     // buffers that are not back in the pool
+    int32_t *pBufNext;      // next buffer of the same connection, by ID
+    uint32_t *pBufLen;      // bytes received into each buffer, by ID
+    bool noMultishot;       // kernel does not have multishot receive
+    bool isPolling;         // the loop polls the io_uring
+    uint32_t maxPacketLen;  // largest packet accepted
+    uint32_t txBufSize;     // largest send buffer kept by a connection
+    uint32_t txMax;         // most bytes queued for one connection
+    UringConn_t *pReady;    // connections with requests to submit, in order
+    UringConn_t *pReadyTail;        // last connection in the ready list
+    UringConn_t *pConns;    // all connections of the io_uring
+} Uring_t;
+
+/*
+ * @internal
+ *
+ * io_uring system calls.  The C library does not wrap these.
+ */
+static int
+ringSetup(uint32_t entries, struct io_uring_params *pParams)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, pParams);
+}
+
+static int
+ringEnter(int fd, uint32_t toSubmit, uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, 0, flags, NULL, 0);
+}
+
+static int
+ringRegister(int fd, uint32_t opcode, void *pArg, uint32_t argCount)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, pArg, argCount);
+}
+
+/*
+ * @internal
+ *
+ * Find the length of the packet at the start of received data
+ *
+ * @param pBuf received data, starting with a fixed header
+ * @param avail number of bytes at _pBuf_
+ * @param pTotal storage for the total packet length, including the fixed
+ * header
+ *
+ * @return 1 if the length was found, 0 if more data is needed to find it,
+ * or -1 if the remaining length field is malformed
+ */
+static int
+frameLength(const uint8_t *pBuf, uint32_t avail, uint32_t *pTotal)
+{
+    uint32_t remainingLen = 0;
+    for (uint32_t idx = 1; idx <= 4; idx++)
+    {
+        if (idx >= avail)
+        {
+            return 0;
+        }
+        remainingLen |= (uint32_t)(pBuf[idx] & 0x7F) << (7 * (idx - 1));
+        if (!(pBuf[idx] & 0x80))
+        {
+            *pTotal = 1 + idx + remainingLen;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * @internal
+ *
+ * Hand the submission queue entries made so far to the kernel
+ *
+ * @param this io_uring
+ *
+ * @return true if there was no error.  Entries the kernel did not take
+ * yet stay queued for the next call.
+ */
+static bool
+submitEntries(Uring_t *this)
+{
+    uint32_t tail = *this->pSqTail;
+    uint32_t toSubmit = tail - __atomic_load_n(this->pSqHead, __ATOMIC_ACQUIRE);
+    while (toSubmit)
+    {
+        int taken = ringEnter(this->ringFd, toSubmit, 0);
+        if (taken < 0)
+        {
+            // busy means the completion queue must be emptied first
+            return (errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY);
+        }
+        if (taken == 0)
+        {
+            break;
+        }
+        toSubmit -= taken;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Get a free submission queue entry
+ *
+ * @param this io_uring
+ *
+ * @return a cleared entry, or NULL if the queue is full
+ *
+ * The entry is handed to the kernel by the next submitEntries().  The
+ * kernel only reads entries during that call, so the tail can be moved
+ * before the entry is filled in.
+ */
+static struct io_uring_sqe *
+getEntry(Uring_t *this)
+{
+    uint32_t tail = *this->pSqTail;
+    if ((tail - __atomic_load_n(this->pSqHead, __ATOMIC_ACQUIRE)) >= this->sqEntries)
+    {
+        submitEntries(this);
+        if ((tail - __atomic_load_n(this->pSqHead, __ATOMIC_ACQUIRE)) >= this->sqEntries)
+        {
+            return NULL;
+        }
+    }
+    uint32_t slot = tail & this->sqMask;
+    struct io_uring_sqe *pSqe = &this->pSqes[slot];
+    memset(pSqe, 0, sizeof(*pSqe));
+    this->pSqArray[slot] = slot;
+    __atomic_store_n(this->pSqTail, tail + 1, __ATOMIC_RELEASE);
+    return pSqe;
+}
+
+/*
+ * @internal
+ *
+ * Give a receive buffer back to the pool
+ *
+ * @param this io_uring
+ * @param bid buffer ID
+ */
+static void
+recycleBuf(Uring_t *this, uint32_t bid)
+{
+    struct io_uring_buf *pBuf = &this->pBufRing->bufs[this->bufRingTail & (this->bufCount - 1)];
+    pBuf->addr = (uintptr_t)&this->pBufs[(size_t)bid * this->bufSize];
+    pBuf->len = this->bufSize;
+    pBuf->bid = (uint16_t)bid;
+    ++this->bufRingTail;
+    __atomic_store_n(&this->pBufRing->tail, this->bufRingTail, __ATOMIC_RELEASE);
+    --this->bufsInUse;
+}
+
+/*
+ * @internal
+ *
+ * Give the first received buffer of a connection back to the pool
+ *
+ * @param this the connection
+ */
+static void
+popRxBuf(UringConn_t *this)
+{
+    int32_t bid = this->rxHead;
+    this->rxHead = this->pRing->pBufNext[bid];
+    if (this->rxHead < 0)
+    {
+        this->rxTail = -1;
+    }
+    this->rxOffset = 0;
+    recycleBuf(this->pRing, (uint32_t)bid);
+}
+
+/*
+ * @internal
+ *
+ * Put a connection at the end of the ready list, so that its requests
+ * are submitted
+ *
+ * @param this the connection
+ */
+static void
+markReady(UringConn_t *this)
+{
+    if (!this->isReady)
+    {
+        Uring_t *pRing = this->pRing;
+        this->isReady = true;
+        this->pNextReady = NULL;
+        if (pRing->pReadyTail)
+        {
+            pRing->pReadyTail->pNextReady = this;
+        }
+        else
+        {
+            pRing->pReady = this;
+        }
+        pRing->pReadyTail = this;
+    }
+}
+
+/*
+ * @internal
+ *
+ * Free a closed connection once nothing refers to it any more
+ *
+ * @param this the connection
+ *
+ * @return true if the connection was freed
+ */
+static bool
+releaseConn(UringConn_t *this)
+{
+    if (!this->isClosed || this->recvIsArmed || this->sendIsPending || this->isReady)
+    {
+        return false;
+    }
+    while (this->rxHead >= 0)
+    {
+        popRxBuf(this);
+    }
+    if (this->pPrev)
+    {
+        this->pPrev->pNext = this->pNext;
+    }
+    else
+    {
+        this->pRing->pConns = this->pNext;
+    }
+    if (this->pNext)
+    {
+        this->pNext->pPrev = this->pPrev;
+    }
+    free(this->pAsm);
+    free(this->pSend);
+    free(this->pQueue);
+    free(this);
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Mark a connection broken, and run its instance so that it sees it
+ *
+ * @param this the connection
+ */
+static void
+breakConn(UringConn_t *this)
+{
+    this->isBroken = true;
+    this->needsRecv = false;
+    if (this->h)
+    {
+        umqtt_LoopWake(this->pRing->hLoop, this->h);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Make the submission queue entries for one ready connection
+ *
+ * @param this io_uring
+ * @param pConn the connection
+ * @param canRecv false if a receive must not be started yet
+ *
+ * @return true if all of the requests of the connection were made, false
+ * if the submission queue is full
+ *
+ * Only one send is in the kernel at a time for each connection, so the
+ * data goes out in order.
+ */
+static bool
+prepareConn(Uring_t *this, UringConn_t *pConn, bool canRecv)
+{
+    if (pConn->needsRecv && canRecv)
+    {
+        struct io_uring_sqe *pSqe = getEntry(this);
+        if (pSqe == NULL)
+        {
+            return false;
+        }
+        pSqe->opcode = IORING_OP_RECV;
+        pSqe->fd = pConn->fd;
+        pSqe->flags = IOSQE_BUFFER_SELECT;
+        pSqe->buf_group = UMQTT_URING_BGID;
+        pSqe->ioprio = this->noMultishot ? 0 : IORING_RECV_MULTISHOT;
+        pSqe->user_data = (uintptr_t)pConn;
+        pConn->needsRecv = false;
+        pConn->recvIsArmed = true;
+    }
+    if (!pConn->sendIsPending && (pConn->sendOffset == pConn->sendLen) && pConn->queueLen)
+    {
+        // the queued data becomes the data being sent.  A buffer that
+        // grew past the usual size for a big packet is not kept
+        uint8_t *pSwap = pConn->pSend;
+        uint32_t swapSize = pConn->sendSize;
+        if (swapSize > this->txBufSize)
+        {
+            free(pSwap);
+            pSwap = NULL;
+            swapSize = 0;
+        }
+        pConn->pSend = pConn->pQueue;
+        pConn->sendSize = pConn->queueSize;
+        pConn->sendLen = pConn->queueLen;
+        pConn->sendOffset = 0;
+        pConn->pQueue = pSwap;
+        pConn->queueSize = swapSize;
+        pConn->queueLen = 0;
+    }
+    if (!pConn->sendIsPending && (pConn->sendOffset != pConn->sendLen))
+    {
+        struct io_uring_sqe *pSqe = getEntry(this);
+        if (pSqe == NULL)
+        {
+            return false;
+        }
+        pSqe->opcode = IORING_OP_SEND;
+        pSqe->fd = pConn->fd;
+        pSqe->addr = (uintptr_t)&pConn->pSend[pConn->sendOffset];
+        pSqe->len = pConn->sendLen - pConn->sendOffset;
+        pSqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        pSqe->user_data = (uintptr_t)pConn | UMQTT_URING_OP_SEND;
+        pConn->sendIsPending = true;
+    }
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Make the requests of all ready connections and submit them together
+ *
+ * @param this io_uring
+ *
+ * @return true if there was no error
+ *
+ * A connection whose last receive found no free buffer only receives
+ * again when a buffer has come back to the pool, and then only as many
+ * of them as there are free buffers, in the order they ran out.  The
+ * others stay in the ready list, so that a small pool is shared in turn
+ * instead of going to the same connections each time.
+ */
+static bool
+submitReady(Uring_t *this)
+{
+    UringConn_t *pConn = this->pReady;
+    uint32_t freeBufs = this->bufCount - this->bufsInUse;
+    this->pReady = NULL;
+    this->pReadyTail = NULL;
+    while (pConn)
+    {
+        UringConn_t *pNext = pConn->pNextReady;
+        pConn->isReady = false;
+        bool canRecv = !pConn->isStarved || (freeBufs != 0);
+        if (pConn->isClosed)
+        {
+            releaseConn(pConn);
+        }
+        else if (!prepareConn(this, pConn, canRecv) || pConn->needsRecv)
+        {
+            markReady(pConn);
+        }
+        else if (pConn->isStarved)
+        {
+            pConn->isStarved = false;
+            --freeBufs;
+        }
+        pConn = pNext;
+    }
+    return submitEntries(this);
+}
+
+/*
+ * @internal
+ *
+ * Handle the completion of a receive request
+ *
+ * @param this io_uring
+ * @param pConn the connection
+ * @param pCqe the completion
+ */
+static void
+receiveDone(Uring_t *this, UringConn_t *pConn, const struct io_uring_cqe *pCqe)
+{
+    if (!(pCqe->flags & IORING_CQE_F_MORE))
+    {
+        pConn->recvIsArmed = false;
+    }
+    if (pCqe->flags & IORING_CQE_F_BUFFER)
+    {
+        uint32_t bid = pCqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ++this->bufsInUse;
+        if (pConn->isClosed || (pCqe->res <= 0))
+        {
+            recycleBuf(this, bid);
+        }
+        else
+        {
+            this->pBufLen[bid] = (uint32_t)pCqe->res;
+            this->pBufNext[bid] = -1;
+            if (pConn->rxTail >= 0)
+            {
+                this->pBufNext[pConn->rxTail] = (int32_t)bid;
+            }
+            else
+            {
+                pConn->rxHead = (int32_t)bid;
+            }
+            pConn->rxTail = (int32_t)bid;
+        }
+    }
+    if (pConn->isClosed)
+    {
+        releaseConn(pConn);
+        return;
+    }
+
+    if (pCqe->res > 0)
+    {
+        if (pConn->h)
+        {
+            umqtt_LoopWake(this->hLoop, pConn->h);
+        }
+        if (!pConn->recvIsArmed)
+        {
+            pConn->needsRecv = true;
+            markReady(pConn);
+        }
+    }
+
+    // the pool ran out of buffers, so receive again when some come back
+    else if (pCqe->res == -ENOBUFS)
+    {
+        pConn->needsRecv = true;
+        pConn->isStarved = true;
+        markReady(pConn);
+    }
+
+    // an older kernel without multishot receive, so receive one at a time
+    else if ((pCqe->res == -EINVAL) && !this->noMultishot)
+    {
+        this->noMultishot = true;
+        pConn->needsRecv = true;
+        markReady(pConn);
+    }
+    else if (!pConn->recvIsArmed)
+    {
+        breakConn(pConn);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Handle the completion of a send request
+ *
+ * @param this io_uring
+ * @param pConn the connection
+ * @param pCqe the completion
+ */
+static void
+sendDone(Uring_t *this, UringConn_t *pConn, const struct io_uring_cqe *pCqe)
+{
+    (void)this;
+    pConn->sendIsPending = false;
+    if (pConn->isClosed)
+    {
+        releaseConn(pConn);
+        return;
+    }
+    if (pCqe->res <= 0)
+    {
+        breakConn(pConn);
+        return;
+    }
+    pConn->sendOffset += (uint32_t)pCqe->res;
+    if ((pConn->sendOffset != pConn->sendLen) || pConn->queueLen)
+    {
+        markReady(pConn);
+    }
+}
+
+/*
+ * @internal
+ *
+ * Handle all of the completions the kernel has posted
+ *
+ * @param this io_uring
+ *
+ * Completions that did not fit in the completion queue are kept by the
+ * kernel, and are moved to the queue by a system call once there is room.
+ */
+static void
+reapCompletions(Uring_t *this)
+{
+    if (__atomic_load_n(this->pSqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+    {
+        ringEnter(this->ringFd, 0, IORING_ENTER_GETEVENTS);
+    }
+    uint32_t head = *this->pCqHead;
+    uint32_t tail = __atomic_load_n(this->pCqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        const struct io_uring_cqe *pCqe = &this->pCqes[head & this->cqMask];
+        UringConn_t *pConn = (UringConn_t *)(uintptr_t)(pCqe->user_data & ~(uint64_t)UMQTT_URING_OP_SEND);
+        if (pCqe->user_data & UMQTT_URING_OP_SEND)
+        {
+            sendDone(this, pConn, pCqe);
+        }
+        else
+        {
+            receiveDone(this, pConn, pCqe);
+        }
+        ++head;
+        if (head == tail)
+        {
+            __atomic_store_n(this->pCqHead, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(this->pCqTail, __ATOMIC_ACQUIRE);
+        }
+    }
+    __atomic_store_n(this->pCqHead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * @internal
+ *
+ * Event loop poll callback, see LoopPollCb_t()
+ *
+ * Completions are handled first so that the connections they make ready
+ * are submitted in the same system call as everything written by the
+ * instances since the last pass.
+ */
+static void
+uringPoll(umqtt_Loop_t hLoop, void *pArg)
+{
+    (void)hLoop;
+    Uring_t *this = pArg;
+    reapCompletions(this);
+    submitReady(this);
+}
+
+/*
+ * @internal
+ *
+ * Network read function, see netReadPacket_t()
+ *
+ * A packet that is whole in one receive buffer is handed over in place.
+ * A packet that is split across buffers is copied together.  The packet
+ * handed over before is no longer used when this is called, so the
+ * buffers it used can go back to the pool.
+ */
+static int
+uringRead(void *hNet, uint8_t **ppBuf)
+{
+    UringConn_t *this = hNet;
+    Uring_t *pRing = this->pRing;
+    if (this->isClosed)
+    {
+        return -1;
+    }
+    if (this->asmTotal && (this->asmLen == this->asmTotal))
+    {
+        this->asmLen = 0;
+        this->asmTotal = 0;
+    }
+    if ((this->rxHead >= 0) && (this->rxOffset == pRing->pBufLen[this->rxHead]))
+    {
+        popRxBuf(this);
+    }
+
+    for (;;)
+    {
+        if (this->rxHead < 0)
+        {
+            return this->isBroken ? -1 : 0;
+        }
+        uint8_t *pData = &pRing->pBufs[(size_t)this->rxHead * pRing->bufSize + this->rxOffset];
+        uint32_t avail = pRing->pBufLen[this->rxHead] - this->rxOffset;
+        if (this->asmLen == 0)
+        {
+            uint32_t total = 0;
+            int framed = frameLength(pData, avail, &total);
+            if ((framed < 0) || ((framed > 0) && (total > pRing->maxPacketLen)))
+            {
+                return -1;
+            }
+            if ((framed > 0) && (total <= avail))
+            {
+                *ppBuf = pData;
+                this->rxOffset += total;
+                return (int)total;
+            }
+        }
+
+        // copy the header one byte at a time until the length is known,
+        // then as much of the rest as this buffer has
+        uint32_t take = 1;
+        if (this->asmTotal)
+        {
+            take = this->asmTotal - this->asmLen;
+            take = (take < avail) ? take : avail;
+        }
+        uint32_t need = this->asmTotal ? this->asmTotal : 5;
+        if (need > this->asmSize)
+        {
+            uint8_t *pNewAsm = realloc(this->pAsm, need);
+            if (pNewAsm == NULL)
+            {
+                return -1;
+            }
+            this->pAsm = pNewAsm;
+            this->asmSize = need;
+        }
+        memcpy(&this->pAsm[this->asmLen], pData, take);
+        this->asmLen += take;
+        this->rxOffset += take;
+        if (this->rxOffset == pRing->pBufLen[this->rxHead])
+        {
+            popRxBuf(this);
+        }
+
+        if (this->asmTotal == 0)
+        {
+            uint32_t total = 0;
+            int framed = frameLength(this->pAsm, this->asmLen, &total);
+            if ((framed < 0) || ((framed > 0) && (total > pRing->maxPacketLen)))
+            {
+                return -1;
+            }
+            this->asmTotal = (framed > 0) ? total : 0;
+        }
+        if (this->asmTotal && (this->asmLen == this->asmTotal))
+        {
+            *ppBuf = this->pAsm;
+            return (int)this->asmTotal;
+        }
+    }
+}
+
+/*
+ * @internal
+ *
+ * Queue the buffers of one packet for sending
+ *
+ * @param this the connection
+ * @param pSegs the buffers of the packet
+ * @param segCount number of buffers
+ *
+ * The queue buffer starts small and is doubled until the packet fits, so
+ * an idle connection uses little memory.
+ *
+ * @return the packet length if it was queued, 0 if there is no room, or
+ * -1 if the connection is closed
+ */
+static int
+queuePacket(UringConn_t *this, const umqtt_Segment_t *pSegs, uint32_t segCount)
+{
+    if (this->isClosed || this->isBroken)
+    {
+        return -1;
+    }
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < segCount; i++)
+    {
+        len += pSegs[i].len;
+    }
+    if (len > (this->pRing->txMax - this->queueLen))
+    {
+        return 0;
+    }
+    if ((this->queueLen + len) > this->queueSize)
+    {
+        uint32_t size = this->queueSize ? this->queueSize : UMQTT_URING_TX_MIN_SIZE;
+        while (size < (this->queueLen + len))
+        {
+            size *= 2;
+        }
+        size = (size > this->pRing->txMax) ? this->pRing->txMax : size;
+        uint8_t *pNewQueue = realloc(this->pQueue, size);
+        if (pNewQueue == NULL)
+        {
+            return 0;
+        }
+        this->pQueue = pNewQueue;
+        this->queueSize = size;
+    }
+    for (uint32_t i = 0; i < segCount; i++)
+    {
+        memcpy(&this->pQueue[this->queueLen], pSegs[i].pData, pSegs[i].len);
+        this->queueLen += pSegs[i].len;
+    }
+    markReady(this);
+    return (int)len;
+}
+
+/*
+ * @internal
+ *
+ * Network write function, see netWritePacket_t()
+ *
+ * Everything written during one pass of the loop is sent together, so
+ * the _isMore_ hint is not needed.
+ */
+static int
+uringWrite(void *hNet, const uint8_t *pBuf, uint32_t len, bool isMore)
+{
+    (void)isMore;
+    umqtt_Segment_t seg;
+    seg.pData = pBuf;
+    seg.len = len;
+    return queuePacket(hNet, &seg, 1);
+}
+
+/*
+ * @internal
+ *
+ * Network write function for a packet in several buffers, see
+ * netWritevPacket_t()
+ */
+static int
+uringWritev(void *hNet, const umqtt_Segment_t *pSegs, uint32_t segCount, bool isMore)
+{
+    (void)isMore;
+    return queuePacket(hNet, pSegs, segCount);
+}
+
+/*
+ * @internal
+ *
+ * Map the rings of a new io_uring
+ *
+ * @param this io_uring, with the ring descriptor set
+ * @param pParams parameters filled in by the kernel
+ *
+ * @return true if the rings were mapped
+ */
+static bool
+mapRings(Uring_t *this, const struct io_uring_params *pParams)
+{
+    this->sqMapLen = pParams->sq_off.array + (pParams->sq_entries * sizeof(uint32_t));
+    this->cqMapLen = pParams->cq_off.cqes + (pParams->cq_entries * sizeof(struct io_uring_cqe));
+    if (pParams->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (this->cqMapLen > this->sqMapLen)
+        {
+            this->sqMapLen = this->cqMapLen;
+        }
+        this->cqMapLen = 0;
+    }
+    this->pSqMap = mmap(NULL, this->sqMapLen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+    if (this->pSqMap == MAP_FAILED)
+    {
+        this->pSqMap = NULL;
+        return false;
+    }
+    this->pCqMap = this->pSqMap;
+    if (this->cqMapLen)
+    {
+        this->pCqMap = mmap(NULL, this->cqMapLen, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_CQ_RING);
+        if (this->pCqMap == MAP_FAILED)
+        {
+            this->pCqMap = NULL;
+            return false;
+        }
+    }
+    this->sqesMapLen = pParams->sq_entries * sizeof(struct io_uring_sqe);
+    this->pSqes = mmap(NULL, this->sqesMapLen, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+    if (this->pSqes == MAP_FAILED)
+    {
+        this->pSqes = NULL;
+        return false;
+    }
+
+    uint8_t *pSq = this->pSqMap;
+    uint8_t *pCq = this->pCqMap;
+    this->pSqHead = (uint32_t *)&pSq[pParams->sq_off.head];
+    this->pSqTail = (uint32_t *)&pSq[pParams->sq_off.tail];
+    this->pSqArray = (uint32_t *)&pSq[pParams->sq_off.array];
+    this->pSqFlags = (uint32_t *)&pSq[pParams->sq_off.flags];
+    this->sqMask = *(uint32_t *)&pSq[pParams->sq_off.ring_mask];
+    this->sqEntries = pParams->sq_entries;
+    this->pCqHead = (uint32_t *)&pCq[pParams->cq_off.head];
+    this->pCqTail = (uint32_t *)&pCq[pParams->cq_off.tail];
+    this->pCqes = (struct io_uring_cqe *)&pCq[pParams->cq_off.cqes];
+    this->cqMask = *(uint32_t *)&pCq[pParams->cq_off.ring_mask];
+    return true;
+}
+
+/*
+ * @internal
+ *
+ * Set up the receive buffer pool and register it with the kernel
+ *
+ * @param this io_uring, with the buffer count and size set
+ *
+ * @return true if the pool was registered
+ *
+ * The pool ring must be page aligned, so it is mapped rather than
+ * allocated.  The kernel must be at least 5.19 to take a pool ring.
+ */
+static bool
+setupBufPool(Uring_t *this)
+{
+    this->bufRingLen = this->bufCount * sizeof(struct io_uring_buf);
+    this->pBufRing = mmap(NULL, this->bufRingLen, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (this->pBufRing == MAP_FAILED)
+    {
+        this->pBufRing = NULL;
+        return false;
+    }
+    this->pBufs = malloc((size_t)this->bufCount * this->bufSize);
+    this->pBufNext = malloc(this->bufCount * sizeof(int32_t));
+    this->pBufLen = malloc(this->bufCount * sizeof(uint32_t));
+    if ((this->pBufs == NULL) || (this->pBufNext == NULL) || (this->pBufLen == NULL))
+    {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)this->pBufRing;
+    reg.ring_entries = this->bufCount;
+    reg.bgid = UMQTT_URING_BGID;
+    if (ringRegister(this->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        return false;
+    }
+    this->bufsInUse = this->bufCount;
+    for (uint32_t bid = 0; bid < this->bufCount; bid++)
+    {
+        recycleBuf(this, bid);
+    }
+    return true;
+}
+
+/**
+ * Create an io_uring for the connections of an event loop
+ *
+ * @param hLoop event loop handle from umqtt_LoopNew()
+ * @param pOptions optional io_uring settings, or NULL for defaults
+ *
+ * @return io_uring handle, or NULL if io_uring cannot be used or there is
+ * an error
+ *
+ * The io_uring is watched by the loop with umqtt_LoopSetPoll(), so a loop
+ * can have only one.  If this returns NULL, use the transport in
+ * `umqtt_posix.c` instead, see the example at the top of this module.
+ * The receive buffer pool is allocated here, _bufCount_ times _bufSize_
+ * bytes, and is shared by all of the connections.
+ */
+umqtt_Uring_t
+umqtt_UringNew(umqtt_Loop_t hLoop, const umqtt_UringOptions_t *pOptions)
+{
+    if (hLoop == NULL)
+    {
+        return NULL;
+    }
+    Uring_t *this = calloc(1, sizeof(Uring_t));
+    if (this == NULL)
+    {
+        return NULL;
+    }
+    this->hLoop = hLoop;
+    uint32_t entries = UMQTT_URING_ENTRIES;
+    uint32_t bufCount = UMQTT_URING_BUF_COUNT;
+    this->bufSize = UMQTT_URING_BUF_SIZE;
+    this->maxPacketLen = UMQTT_URING_MAX_PACKET_LEN;
+    this->txBufSize = UMQTT_URING_TX_BUF_SIZE;
+    if (pOptions)
+    {
+        entries = pOptions->ringEntries ? pOptions->ringEntries : entries;
+        bufCount = pOptions->bufCount ? pOptions->bufCount : bufCount;
+        this->bufSize = pOptions->bufSize ? pOptions->bufSize : this->bufSize;
+        this->maxPacketLen = pOptions->maxPacketLen ? pOptions->maxPacketLen : this->maxPacketLen;
+        this->txBufSize = pOptions->txBufSize ? pOptions->txBufSize : this->txBufSize;
+    }
+
+    // a whole packet can be queued after the usual amount of data
+    uint64_t txMax = (uint64_t)this->txBufSize + this->maxPacketLen;
+    this->txMax = (txMax > INT32_MAX) ? INT32_MAX : (uint32_t)txMax;
+
+    if (bufCount > UMQTT_URING_MAX_BUFS)
+    {
+        bufCount = UMQTT_URING_MAX_BUFS;
+    }
+    this->bufCount = 1;
+    while (this->bufCount < bufCount)
+    {
+        this->bufCount <<= 1;
+    }
+
+    // each receive buffer and each send gives one completion, so make
+    // room for all of them, to keep the completion queue from overflowing
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP | IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * this->bufCount;
+    if (params.cq_entries < (2 * entries))
+    {
+        params.cq_entries = 2 * entries;
+    }
+    this->ringFd = ringSetup(entries, &params);
+    if ((this->ringFd < 0)
+     || !mapRings(this, &params)
+     || !setupBufPool(this)
+     || (umqtt_LoopSetPoll(hLoop, this->ringFd, uringPoll, this) != UMQTT_ERR_OK))
+    {
+        umqtt_UringDelete(this);
+        return NULL;
+    }
+    this->isPolling = true;
+    return this;
+}
+
+/**
+ * Free an io_uring and all of its connections
+ *
+ * @param hRing io_uring handle from umqtt_UringNew()
+ *
+ * All connections are closed, and their instances are removed from the
+ * loop.  The instances themselves must be deleted by the application
+ * afterwards.  This must not be called from a umqtt callback.
+ */
+void
+umqtt_UringDelete(umqtt_Uring_t hRing)
+{
+    Uring_t *this = hRing;
+    if (this == NULL)
+    {
+        return;
+    }
+    if (this->isPolling)
+    {
+        umqtt_LoopSetPoll(this->hLoop, -1, NULL, NULL);
+    }
+
+    // the kernel cancels all requests when the io_uring is closed, so
+    // after that the connection buffers can be freed.  A connection with
+    // nothing outstanding is freed by umqtt_UringClose()
+    UringConn_t *pNext;
+    for (UringConn_t *pConn = this->pConns; pConn; pConn = pNext)
+    {
+        pNext = pConn->pNext;
+        umqtt_UringClose(pConn);
+    }
+    if (this->ringFd >= 0)
+    {
+        close(this->ringFd);
+        this->ringFd = -1;
+    }
+    while (this->pConns)
+    {
+        UringConn_t *pConn = this->pConns;
+        pConn->recvIsArmed = false;
+        pConn->sendIsPending = false;
+        pConn->isReady = false;
+        releaseConn(pConn);
+    }
+    if (this->pSqes)
+    {
+        munmap(this->pSqes, this->sqesMapLen);
+    }
+    if (this->pCqMap && (this->pCqMap != this->pSqMap))
+    {
+        munmap(this->pCqMap, this->cqMapLen);
+    }
+    if (this->pSqMap)
+    {
+        munmap(this->pSqMap, this->sqMapLen);
+    }
+    if (this->pBufRing)
+    {
+        munmap(this->pBufRing, this->bufRingLen);
+    }
+    free(this->pBufs);
+    free(this->pBufNext);
+    free(this->pBufLen);
+    free(this);
+}
+
+/**
+ * Start using a connected socket
+ *
+ * @param hRing io_uring handle from umqtt_UringNew()
+ * @param fd the connected socket
+ *
+ * @return connection handle, or NULL if there is an error
+ *
+ * The connection takes over the socket and closes it in
+ * umqtt_UringClose().  The socket is put in blocking mode, which io_uring
+ * needs so that requests wait in the kernel instead of failing, and does
+ * not block the thread.  Receiving starts on the next pass of the loop.
+ */
+umqtt_UringConn_t
+umqtt_UringAttach(umqtt_Uring_t hRing, int fd)
+{
+    Uring_t *this = hRing;
+    if ((this == NULL) || (fd < 0))
+    {
+        return NULL;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0))
+    {
+        return NULL;
+    }
+    UringConn_t *pConn = calloc(1, sizeof(UringConn_t));
+    if (pConn == NULL)
+    {
+        return NULL;
+    }
+
+    // Nagle's algorithm fails harmlessly for a socket that is not TCP
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pConn->pRing = this;
+    pConn->fd = fd;
+    pConn->rxHead = -1;
+    pConn->rxTail = -1;
+    pConn->pNext = this->pConns;
+    if (this->pConns)
+    {
+        this->pConns->pPrev = pConn;
+    }
+    this->pConns = pConn;
+    pConn->needsRecv = true;
+    markReady(pConn);
+    return pConn;
+}
+
+/**
+ * Fill in a transport structure with the functions of a connection
+ *
+ * @param hConn connection handle from umqtt_UringAttach()
+ * @param pTransport transport structure to fill in
+ *
+ * The memory functions are the C library _malloc()_ and _free()_.  The
+ * structure is kept by the umqtt instance, so it must stay valid as long
+ * as the instance.
+ */
+void
+umqtt_UringGetTransport(umqtt_UringConn_t hConn, umqtt_TransportConfig_t *pTransport)
+{
+    if (pTransport)
+    {
+        memset(pTransport, 0, sizeof(umqtt_TransportConfig_t));
+        pTransport->hNet = hConn;
+        pTransport->pfnmalloc = malloc;
+        pTransport->pfnfree = free;
+        pTransport->pfnNetReadPacket = uringRead;
+        pTransport->pfnNetWritePacket = uringWrite;
+        pTransport->pfnNetWritevPacket = uringWritev;
+        pTransport->ownsReadBuf = true;
+    }
+}
+
+/**
+ * Run the instance of a connection from the event loop
+ *
+ * @param hConn connection handle from umqtt_UringAttach()
+ * @param h umqtt instance that uses the connection as its transport
+ * @param pUser optional caller defined data pointer that will be passed
+ * to the loop error callback
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_PARM for a bad parameter, or an error
+ * from umqtt_LoopAdd()
+ *
+ * The instance is added to the loop without a socket, and the loop runs
+ * it whenever the connection receives data.  When the connection is
+ * closed by the broker or fails, the read function returns an error, so
+ * the loop error callback is called with UMQTT_ERR_NETWORK.
+ *
+ * __Example__
+ * ~~~~~~~~.c
+ * err = umqtt_UringAdd(hConn, h, pDevice);
+ * err = umqtt_Connect(h, true, false, 0, 30, "device1", NULL, NULL, 0, NULL, NULL);
+ * err = umqtt_LoopUpdate(hLoop, h);
+ * ~~~~~~~~
+ */
+umqtt_Error_t
+umqtt_UringAdd(umqtt_UringConn_t hConn, umqtt_Handle_t h, void *pUser)
+{
+    UringConn_t *this = hConn;
+    if ((this == NULL) || (h == NULL) || this->isClosed || this->h)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    umqtt_Error_t err = umqtt_LoopAdd(this->pRing->hLoop, h, -1, pUser);
+    if (err != UMQTT_ERR_OK)
+    {
+        return err;
+    }
+    this->h = h;
+    if ((this->rxHead >= 0) || this->isBroken)
+    {
+        umqtt_LoopWake(this->pRing->hLoop, h);
+    }
+    return UMQTT_ERR_OK;
+}
+
+/**
+ * Close a connection
+ *
+ * @param hConn connection handle from umqtt_UringAttach()
+ *
+ * The instance of the connection is removed from the loop but not
+ * deleted, and the socket is closed.  Received data and data that was
+ * not sent yet are thrown away.  The connection handle must not be used
+ * again, and the instance must not be run until it has a new transport.
+ * This can be called from the loop error callback.
+ */
+void
+umqtt_UringClose(umqtt_UringConn_t hConn)
+{
+    UringConn_t *this = hConn;
+    if ((this == NULL) || this->isClosed)
+    {
+        return;
+    }
+    if (this->h)
+    {
+        umqtt_LoopRemove(this->pRing->hLoop, this->h);
+        this->h = NULL;
+    }
+
+    // shutting the socket down ends the requests in the kernel, which
+    // still use the socket after it is closed here
+    shutdown(this->fd, SHUT_RDWR);
+    close(this->fd);
+    this->fd = -1;
+    this->isClosed = true;
+    this->needsRecv = false;
+    releaseConn(this);
+}
+
+/**
+ * Send the packets written so far right away
+ *
+ * @param hRing io_uring handle from umqtt_UringNew()
+ *
+ * @return UMQTT_ERR_OK, UMQTT_ERR_PARM if the handle is not valid, or
+ * UMQTT_ERR_NETWORK if the kernel returned an error
+ *
+ * Packets written by the instances are sent on the next pass of
+ * umqtt_LoopRun(), together with those of all the other connections.
+ * This is only needed to send them sooner, for example after publishing
+ * from outside the loop when the loop is not called again soon.
+ */
+umqtt_Error_t
+umqtt_UringSubmit(umqtt_Uring_t hRing)
+{
+    Uring_t *this = hRing;
+    if (this == NULL)
+    {
+        return UMQTT_ERR_PARM;
+    }
+    return submitReady(this) ? UMQTT_ERR_OK : UMQTT_ERR_NETWORK;
+}
+
+#else
+
+/*
+ * The kernel headers are too old, so there is never an io_uring and the
+ * application always uses its fallback transport.
+ */
+
+umqtt_Uring_t
+umqtt_UringNew(umqtt_Loop_t hLoop, const umqtt_UringOptions_t *pOptions)
+{
+    (void)hLoop;
+    (void)pOptions;
+    return NULL;
+}
+
+void
+umqtt_UringDelete(umqtt_Uring_t hRing)
+{
+    (void)hRing;
+}
+
+umqtt_UringConn_t
+umqtt_UringAttach(umqtt_Uring_t hRing, int fd)
+{
+    (void)hRing;
+    (void)fd;
+    return NULL;
+}
+
+void
+umqtt_UringGetTransport(umqtt_UringConn_t hConn, umqtt_TransportConfig_t *pTransport)
+{
+    (void)hConn;
+    (void)pTransport;
+}
+
+umqtt_Error_t
+umqtt_UringAdd(umqtt_UringConn_t hConn, umqtt_Handle_t h, void *pUser)
+{
+    (void)hConn;
+    (void)h;
+    (void)pUser;
+    return UMQTT_ERR_PARM;
+}
+
+void
+umqtt_UringClose(umqtt_UringConn_t hConn)
+{
+    (void)hConn;
+}
+
+umqtt_Error_t
+umqtt_UringSubmit(umqtt_Uring_t hRing)
+{
+    (void)hRing;
+    return UMQTT_ERR_PARM;
+}
+
+#endif
+
+/**
+ * @}
+ */
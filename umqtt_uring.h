@@ -0,0 +1,76 @@
+/******************************************************************************
+ * umqtt_uring.h - Linux io_uring transport for many umqtt instances.
+ *
+ * Copyright (c) 2016, Joseph Kroesche (tronics.kroesche.io)
+ * All rights reserved.
+ *
+ * This software is released under the FreeBSD license, found in the
+ * accompanying file LICENSE.txt and at the following URL:
+ *      http://www.freebsd.org/copyright/freebsd-license.html
+ *
+ * This software is provided as-is and without warranty.
+ */
+
+#ifndef __UMQTT_URING_H__
+#define __UMQTT_URING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "umqtt.h"
+#include "umqtt_loop.h"
+
+/**
+ * io_uring handle, obtained from umqtt_UringNew().
+ */
+typedef void * umqtt_Uring_t;
+
+/**
+ * Connection handle, obtained from umqtt_UringAttach().
+ */
+typedef void * umqtt_UringConn_t;
+
+/**
+ * Optional io_uring settings, passed to umqtt_UringNew().
+ *
+ * A structure that is all zeroes selects the default for every setting.
+ */
+typedef struct
+{
+    /// Number of submission queue entries, or 0 for the default of 256.
+    uint32_t ringEntries;
+    /// Number of receive buffers shared by all connections, or 0 for the
+    /// default of 1024.  Rounded up to a power of 2, at most 32768.
+    uint32_t bufCount;
+    /// Size in bytes of each receive buffer, or 0 for the default of 4096.
+    uint32_t bufSize;
+    /// Largest packet accepted, including the fixed header, or 0 for the
+    /// default of 1 MB.  A larger incoming packet is a network error.
+    uint32_t maxPacketLen;
+    /// Bytes queued for sending on one connection, or 0 for the default
+    /// of 65536.  The send buffers of a connection start small and grow as
+    /// needed, so that a packet of up to _maxPacketLen_ bytes can be
+    /// queued after up to this many bytes already waiting.  A buffer that
+    /// grew past this size is freed once its data is sent.
+    uint32_t txBufSize;
+} umqtt_UringOptions_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern umqtt_Uring_t umqtt_UringNew(umqtt_Loop_t hLoop, const umqtt_UringOptions_t *pOptions);
+extern void umqtt_UringDelete(umqtt_Uring_t hRing);
+extern umqtt_UringConn_t umqtt_UringAttach(umqtt_Uring_t hRing, int fd);
+extern void umqtt_UringGetTransport(umqtt_UringConn_t hConn,
+                                    umqtt_TransportConfig_t *pTransport);
+extern umqtt_Error_t umqtt_UringAdd(umqtt_UringConn_t hConn, umqtt_Handle_t h,
+                                    void *pUser);
+extern void umqtt_UringClose(umqtt_UringConn_t hConn);
+extern umqtt_Error_t umqtt_UringSubmit(umqtt_Uring_t hRing);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif